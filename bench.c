@@ -0,0 +1,541 @@
+/* MIT License
+ *
+ * Copyright (c) 2019 Robert Guetzkow
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+ /**
+  * @file bench.c
+  * @author Robert Guetzkow
+  * @date 2026-10-16
+  * @brief Benchmark of trashcan_soft_delete() on Linux and *BSD. Synthetic fixtures are
+  * created in a scratch directory, which is also used as $XDG_DATA_HOME. The latency
+  * percentiles and the throughput of each scenario are written as JSON.
+  *
+  * Usage: trashcan_bench [-n operations] [-d base directory] [-o output file]
+  */
+
+#define _GNU_SOURCE
+#include "src/trashcan.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mount.h>
+#endif
+
+#define BENCH_DEFAULT_OPS 200
+#define BENCH_FILE_SIZE 512
+#define BENCH_FILES_PER_DIR 4
+
+/* Parameters of the scenarios. */
+static const size_t trash_entries_params[] = { 0, 1000, 10000 };
+static const size_t depth_params[] = { 1, 16, 128 };
+static const size_t duplicate_percent_params[] = { 0, 50, 100 };
+static const size_t mount_params[] = { 0, 100, 1000 };
+
+struct bench_config
+{
+	char *scratch_dir;
+	char *trash_dir;
+	char *src_dir;
+	size_t ops;
+};
+
+struct bench_result
+{
+	const char *scenario;
+	size_t param;
+	int skipped;
+	size_t ops;
+	size_t failed;
+	double mean_us;
+	double p50_us;
+	double p90_us;
+	double p99_us;
+	double max_us;
+	double ops_per_sec;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int remove_entry(const char *path, const struct stat *entry_stat, int type, struct FTW *ftw)
+{
+	(void)entry_stat;
+	(void)type;
+	(void)ftw;
+	remove(path);
+	return 0;
+}
+
+static void remove_tree(const char *path)
+{
+	nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+static int write_file(const char *path)
+{
+	static const char content[BENCH_FILE_SIZE] = { 0 };
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) { return -1; }
+
+	ssize_t written = write(fd, content, sizeof(content));
+	close(fd);
+	return written == (ssize_t)sizeof(content) ? 0 : -1;
+}
+
+/* Creates a chain of depth nested directories, each containing a few files. */
+static int make_tree(const char *path, size_t depth)
+{
+	char *dir = strdup(path);
+	if (dir == NULL) { return -1; }
+
+	for (size_t level = 0; level < depth; level++)
+	{
+		if (mkdir(dir, 0755) != 0) { free(dir); return -1; }
+
+		for (size_t i = 0; i < BENCH_FILES_PER_DIR; i++)
+		{
+			char *file = NULL;
+			if (asprintf(&file, "%s/f%zu", dir, i) < 0) { free(dir); return -1; }
+			int ret = write_file(file);
+			free(file);
+			if (ret < 0) { free(dir); return -1; }
+		}
+
+		char *child = NULL;
+		if (asprintf(&child, "%s/d", dir) < 0) { free(dir); return -1; }
+		free(dir);
+		dir = child;
+	}
+
+	free(dir);
+	return 0;
+}
+
+/* Fills the trash with entries without going through the library, so that the fixture is cheap. */
+static int prefill_trash(const char *trash_dir, size_t entries)
+{
+	char *path = NULL;
+	if (asprintf(&path, "%s/files", trash_dir) < 0) { return -1; }
+	if (mkdir(trash_dir, 0700) != 0 || mkdir(path, 0700) != 0) { free(path); return -1; }
+	free(path);
+	if (asprintf(&path, "%s/info", trash_dir) < 0) { return -1; }
+	if (mkdir(path, 0700) != 0) { free(path); return -1; }
+	free(path);
+
+	for (size_t i = 0; i < entries; i++)
+	{
+		if (asprintf(&path, "%s/files/prefill%zu", trash_dir, i) < 0) { return -1; }
+		int ret = write_file(path);
+		free(path);
+		if (ret < 0) { return -1; }
+
+		if (asprintf(&path, "%s/info/prefill%zu.trashinfo", trash_dir, i) < 0) { return -1; }
+		FILE *fptr = fopen(path, "w");
+		free(path);
+		if (fptr == NULL) { return -1; }
+		fprintf(fptr, "[Trash Info]\nPath=/nonexistent/prefill%zu\nDeletionDate=2026-01-01T00:00:00\n", i);
+		if (fclose(fptr) != 0) { return -1; }
+	}
+
+	return 0;
+}
+
+/* Removes the trash and the sources of the previous scenario. */
+static int reset_scratch(const struct bench_config *config)
+{
+	remove_tree(config->trash_dir);
+	remove_tree(config->src_dir);
+	return mkdir(config->src_dir, 0755);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double lhs = *(const double *)a;
+	double rhs = *(const double *)b;
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+/* Nearest-rank percentile of sorted values. */
+static double percentile(const double *sorted, size_t num, double p)
+{
+	size_t rank = (size_t)(p / 100.0 * (double)num + 0.999999);
+	if (rank == 0) { rank = 1; }
+	if (rank > num) { rank = num; }
+	return sorted[rank - 1];
+}
+
+/* Trashes all paths and records the latency of each call. */
+static int run_deletes(char **paths, size_t num_paths, struct bench_result *result)
+{
+	double *latencies = malloc(num_paths * sizeof(*latencies));
+	if (latencies == NULL) { return -1; }
+
+	double sum = 0;
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < num_paths; i++)
+	{
+		uint64_t op_start = now_ns();
+		if (trashcan_soft_delete(paths[i]) != 0) { result->failed++; }
+		latencies[i] = (double)(now_ns() - op_start) / 1000.0;
+		sum += latencies[i];
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	qsort(latencies, num_paths, sizeof(*latencies), compare_doubles);
+	result->ops = num_paths;
+	result->mean_us = num_paths > 0 ? sum / (double)num_paths : 0;
+	result->p50_us = percentile(latencies, num_paths, 50);
+	result->p90_us = percentile(latencies, num_paths, 90);
+	result->p99_us = percentile(latencies, num_paths, 99);
+	result->max_us = num_paths > 0 ? latencies[num_paths - 1] : 0;
+	result->ops_per_sec = elapsed > 0 ? (double)num_paths * 1e9 / (double)elapsed : 0;
+
+	free(latencies);
+	return 0;
+}
+
+static void free_paths(char **paths, size_t num_paths)
+{
+	if (paths == NULL) { return; }
+	for (size_t i = 0; i < num_paths; i++) { free(paths[i]); }
+	free(paths);
+}
+
+/* Trashes files while the trash already contains a number of entries. */
+static int bench_trash_entries(const struct bench_config *config, size_t entries, struct bench_result *result)
+{
+	int ret = -1;
+	char **paths = calloc(config->ops, sizeof(*paths));
+	if (paths == NULL) { return -1; }
+	if (reset_scratch(config) < 0 || prefill_trash(config->trash_dir, entries) < 0) { goto cleanup; }
+
+	for (size_t i = 0; i < config->ops; i++)
+	{
+		if (asprintf(&paths[i], "%s/file%zu", config->src_dir, i) < 0) { paths[i] = NULL; goto cleanup; }
+		if (write_file(paths[i]) < 0) { goto cleanup; }
+	}
+
+	ret = run_deletes(paths, config->ops, result);
+
+cleanup:
+	free_paths(paths, config->ops);
+	return ret;
+}
+
+/* Trashes directory trees of a given depth, which have to be sized for directorysizes. */
+static int bench_depth(const struct bench_config *config, size_t depth, struct bench_result *result)
+{
+	int ret = -1;
+	char **paths = calloc(config->ops, sizeof(*paths));
+	if (paths == NULL) { return -1; }
+	if (reset_scratch(config) < 0) { goto cleanup; }
+
+	for (size_t i = 0; i < config->ops; i++)
+	{
+		if (asprintf(&paths[i], "%s/dir%zu", config->src_dir, i) < 0) { paths[i] = NULL; goto cleanup; }
+		if (make_tree(paths[i], depth) < 0) { goto cleanup; }
+	}
+
+	ret = run_deletes(paths, config->ops, result);
+
+cleanup:
+	free_paths(paths, config->ops);
+	return ret;
+}
+
+/* Trashes files of which a percentage shares the same basename, which causes name collisions in the trash. */
+static int bench_duplicates(const struct bench_config *config, size_t percent, struct bench_result *result)
+{
+	int ret = -1;
+	char **paths = calloc(config->ops, sizeof(*paths));
+	if (paths == NULL) { return -1; }
+	if (reset_scratch(config) < 0) { goto cleanup; }
+
+	for (size_t i = 0; i < config->ops; i++)
+	{
+		char *dir = NULL;
+		if (asprintf(&dir, "%s/%zu", config->src_dir, i) < 0) { goto cleanup; }
+		int mkdir_ret = mkdir(dir, 0755);
+		int asprintf_ret = i % 100 < percent ? asprintf(&paths[i], "%s/duplicate", dir) : asprintf(&paths[i], "%s/unique%zu", dir, i);
+		free(dir);
+		if (asprintf_ret < 0) { paths[i] = NULL; goto cleanup; }
+		if (mkdir_ret != 0 || write_file(paths[i]) < 0) { goto cleanup; }
+	}
+
+	ret = run_deletes(paths, config->ops, result);
+
+cleanup:
+	free_paths(paths, config->ops);
+	return ret;
+}
+
+#ifdef __linux__
+static int write_proc_file(const char *path, const char *content)
+{
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) { return -1; }
+
+	ssize_t len = (ssize_t)strlen(content);
+	ssize_t written = write(fd, content, (size_t)len);
+	close(fd);
+	return written == len ? 0 : -1;
+}
+
+/* Enters a private mount namespace, as an unprivileged user through a user namespace. */
+static int enter_mount_namespace(void)
+{
+	if (unshare(CLONE_NEWNS) != 0)
+	{
+		uid_t uid = getuid();
+		gid_t gid = getgid();
+		char map[64];
+
+		if (unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0) { return -1; }
+		if (write_proc_file("/proc/self/setgroups", "deny") != 0 && errno != ENOENT) { return -1; }
+		snprintf(map, sizeof(map), "%lu %lu 1", (unsigned long)uid, (unsigned long)uid);
+		if (write_proc_file("/proc/self/uid_map", map) != 0) { return -1; }
+		snprintf(map, sizeof(map), "%lu %lu 1", (unsigned long)gid, (unsigned long)gid);
+		if (write_proc_file("/proc/self/gid_map", map) != 0) { return -1; }
+	}
+
+	/* Mounts must not propagate to the parent namespace. */
+	return mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL);
+}
+
+/* Runs in the child process, which owns the mount namespace. */
+static int run_mount_table(const struct bench_config *config, size_t mounts, struct bench_result *result)
+{
+	int ret = -1;
+	char *target = NULL;
+	char **paths = calloc(config->ops, sizeof(*paths));
+	if (paths == NULL) { return -1; }
+	if (enter_mount_namespace() < 0) { goto cleanup; }
+
+	/* The extra mounts are only there to enlarge the mount table, the files are trashed from the last one. */
+	for (size_t i = 0; i <= mounts; i++)
+	{
+		free(target);
+		if (asprintf(&target, "%s/mnt%zu", config->src_dir, i) < 0) { target = NULL; goto cleanup; }
+		if (mkdir(target, 0755) != 0) { goto cleanup; }
+		if (mount("tmpfs", target, "tmpfs", 0, i < mounts ? "size=64k" : NULL) != 0) { goto cleanup; }
+	}
+
+	for (size_t i = 0; i < config->ops; i++)
+	{
+		if (asprintf(&paths[i], "%s/file%zu", target, i) < 0) { paths[i] = NULL; goto cleanup; }
+		if (write_file(paths[i]) < 0) { goto cleanup; }
+	}
+
+	ret = run_deletes(paths, config->ops, result);
+
+cleanup:
+	free(target);
+	free_paths(paths, config->ops);
+	return ret;
+}
+#endif
+
+/* Trashes files from a topdir trash while the mount table contains a number of additional mounts.
+ * The mounts are created in a private mount namespace of a child process. If that isn't
+ * permitted, the scenario is reported as skipped. */
+static int bench_mount_table(const struct bench_config *config, size_t mounts, struct bench_result *result)
+{
+	result->skipped = 1;
+	if (reset_scratch(config) < 0) { return -1; }
+
+#ifdef __linux__
+	int fds[2];
+	if (pipe(fds) != 0) { return -1; }
+
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (pid == 0)
+	{
+		close(fds[0]);
+		result->skipped = 0;
+		if (run_mount_table(config, mounts, result) == 0)
+		{
+			ssize_t written = write(fds[1], result, sizeof(*result));
+			(void)written;
+		}
+		_exit(0);
+	}
+
+	close(fds[1]);
+	struct bench_result child_result;
+	ssize_t num_read = read(fds[0], &child_result, sizeof(child_result));
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+
+	if (num_read == (ssize_t)sizeof(child_result))
+	{
+		child_result.scenario = result->scenario;
+		*result = child_result;
+	}
+#else
+	(void)mounts;
+#endif
+
+	return 0;
+}
+
+static void print_result(FILE *out, const struct bench_result *result, int first)
+{
+	fprintf(out, "%s\n    {\"scenario\": \"%s\", \"param\": %zu, ", first ? "" : ",", result->scenario, result->param);
+
+	if (result->skipped)
+	{
+		fprintf(out, "\"skipped\": true}");
+		return;
+	}
+
+	fprintf(out, "\"ops\": %zu, \"failed\": %zu, \"mean_us\": %.2f, \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, \"ops_per_sec\": %.1f}",
+			result->ops, result->failed, result->mean_us, result->p50_us, result->p90_us, result->p99_us, result->max_us, result->ops_per_sec);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_config config = { NULL, NULL, NULL, BENCH_DEFAULT_OPS };
+	const char *base_dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+	const char *output = NULL;
+	FILE *out = stdout;
+	char *data_home = NULL;
+	int ret = EXIT_FAILURE;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:d:o:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			config.ops = (size_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			base_dir = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n operations] [-d base directory] [-o output file]\n", argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (config.ops == 0)
+	{
+		fprintf(stderr, "Number of operations must be positive.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (asprintf(&config.scratch_dir, "%s/trashcan_bench.XXXXXX", base_dir) < 0) { return EXIT_FAILURE; }
+	if (mkdtemp(config.scratch_dir) == NULL)
+	{
+		fprintf(stderr, "Failed to create scratch directory in %s: %s\n", base_dir, strerror(errno));
+		free(config.scratch_dir);
+		return EXIT_FAILURE;
+	}
+
+	if (asprintf(&data_home, "%s/data", config.scratch_dir) < 0) { data_home = NULL; goto cleanup; }
+	if (asprintf(&config.trash_dir, "%s/Trash", data_home) < 0) { config.trash_dir = NULL; goto cleanup; }
+	if (asprintf(&config.src_dir, "%s/src", config.scratch_dir) < 0) { config.src_dir = NULL; goto cleanup; }
+	if (mkdir(data_home, 0700) != 0) { goto cleanup; }
+	if (setenv("XDG_DATA_HOME", data_home, 1) != 0) { goto cleanup; }
+	/* A running trashcand would serve the deletions, so only the in-process path is measured. */
+	if (setenv("TRASHCAND_SOCKET", "", 1) != 0) { goto cleanup; }
+
+	if (output != NULL && (out = fopen(output, "w")) == NULL)
+	{
+		fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+		out = stdout;
+		goto cleanup;
+	}
+
+	fprintf(out, "{\n  \"benchmark\": \"trashcan_soft_delete\",\n  \"ops_per_scenario\": %zu,\n  \"results\": [", config.ops);
+
+	int first = 1;
+	struct
+	{
+		const char *scenario;
+		const size_t *params;
+		size_t num_params;
+		int (*run)(const struct bench_config *, size_t, struct bench_result *);
+	} scenarios[] = {
+		{ "trash_entries", trash_entries_params, sizeof(trash_entries_params) / sizeof(trash_entries_params[0]), bench_trash_entries },
+		{ "dir_depth", depth_params, sizeof(depth_params) / sizeof(depth_params[0]), bench_depth },
+		{ "duplicate_percent", duplicate_percent_params, sizeof(duplicate_percent_params) / sizeof(duplicate_percent_params[0]), bench_duplicates },
+		{ "mount_table", mount_params, sizeof(mount_params) / sizeof(mount_params[0]), bench_mount_table },
+	};
+
+	for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+	{
+		for (size_t p = 0; p < scenarios[s].num_params; p++)
+		{
+			struct bench_result result;
+			memset(&result, 0, sizeof(result));
+			result.scenario = scenarios[s].scenario;
+			result.param = scenarios[s].params[p];
+
+			if (scenarios[s].run(&config, result.param, &result) < 0)
+			{
+				fprintf(stderr, "Failed to set up scenario %s with parameter %zu.\n", result.scenario, result.param);
+				goto cleanup;
+			}
+
+			print_result(out, &result, first);
+			first = 0;
+		}
+	}
+
+	fprintf(out, "\n  ]\n}\n");
+	ret = EXIT_SUCCESS;
+
+cleanup:
+	if (out != stdout) { fclose(out); }
+	remove_tree(config.scratch_dir);
+	free(config.src_dir);
+	free(config.trash_dir);
+	free(data_home);
+	free(config.scratch_dir);
+	return ret;
+}
@@ -0,0 +1,273 @@
+/* MIT License
+ *
+ * Copyright (c) 2019 Robert Guetzkow
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+ /**
+  * @file bench_escape.c
+  * @author Robert Guetzkow
+  * @date 2026-10-16
+  * @brief Microbenchmark of the percent-escaping and unescaping of the paths in .trashinfo files on
+  * Linux and *BSD. The library is compiled into this file to reach its static functions, so the
+  * scalar fallback can be compared with the vectorized implementations. The throughput of each
+  * implementation is written as JSON. Before timing, the output of every implementation is
+  * compared with the scalar one for the benchmarked paths and for random paths, a mismatch is
+  * reported and makes the program exit with a failure.
+  *
+  * Usage: trashcan_bench_escape [-n iterations] [-o output file]
+  */
+
+#include "src/trashcan.c"
+
+#define BENCH_DEFAULT_ITERATIONS 200000
+/* Number and maximum length of the random paths whose output is compared before timing. */
+#define BENCH_RANDOM_PATHS 20000
+#define BENCH_RANDOM_MAX_LEN 300
+
+/* Lengths of the generated paths. */
+static const size_t length_params[] = { 16, 64, 256, 4096 };
+
+struct escape_impl
+{
+	const char *name;
+	size_t (*run)(const char *, size_t, char *);
+	int supported;
+};
+
+/* Kinds of paths: plain ASCII, ASCII with a space every 16 bytes and UTF-8 where every byte is escaped. */
+enum path_kind { PATH_ASCII, PATH_SPACES, PATH_UTF8, NUM_PATH_KINDS };
+static const char *const path_kind_names[] = { "ascii", "spaces", "utf8" };
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static size_t escape_dispatch(const char *str, size_t len, char *out)
+{
+	(void)len;
+	return escape_into(str, out);
+}
+
+static size_t unescape_dispatch(const char *str, size_t len, char *out)
+{
+	(void)len;
+	return unescape_into(str, out);
+}
+
+static void make_path(char *path, size_t len, enum path_kind kind)
+{
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.";
+
+	for (size_t i = 0; i < len; i++)
+	{
+		if (i % 24 == 0) { path[i] = '/'; }
+		else if (kind == PATH_SPACES && i % 16 == 8) { path[i] = ' '; }
+		else if (kind == PATH_UTF8) { path[i] = (char)(i % 2 == 0 ? 0xC3 : 0xA4); } /* "ä" */
+		else { path[i] = alphabet[i % (sizeof(alphabet) - 1)]; }
+	}
+	path[len] = '\0';
+}
+
+/* Random path of non-zero bytes in which '/', ' ', '%' and hex digits are common, so that escape
+ * sequences, valid or not, occur at every position relative to the vector width. */
+static void make_random_path(char *path, size_t len, uint64_t *seed)
+{
+	static const char common[] = "/ %%%0123456789abcdefABCDEF";
+
+	for (size_t i = 0; i < len; i++)
+	{
+		*seed = *seed * 6364136223846793005u + 1442695040888963407u;
+		unsigned int r = (unsigned int)(*seed >> 33);
+		if (r % 2 == 0) { path[i] = common[(r >> 1) % (sizeof(common) - 1)]; }
+		else { path[i] = (char)(1 + (r >> 1) % 255); }
+	}
+	path[len] = '\0';
+}
+
+/* Compares the output of the implementations with the scalar one for one input. */
+static int check_impls(const char *operation, const struct escape_impl *impls, size_t num_impls, const char *input, size_t len, char *expected, char *buffer)
+{
+	size_t expected_len = impls[0].run(input, len, expected);
+	int status = 0;
+
+	for (size_t i = 1; i < num_impls; i++)
+	{
+		if (!impls[i].supported) { continue; }
+
+		size_t buffer_len = impls[i].run(input, len, buffer);
+		if (buffer_len != expected_len || memcmp(buffer, expected, expected_len + 1) != 0)
+		{
+			fprintf(stderr, "Mismatch of %s %s with scalar for input of length %zu: \"%s\"\n", impls[i].name, operation, len, input);
+			status = -1;
+		}
+	}
+
+	return status;
+}
+
+/* Sink of the results, so the calls can't be removed by the compiler. */
+static volatile size_t bench_sink;
+
+static double run_impl(const struct escape_impl *impl, const char *input, size_t len, char *out, size_t iterations)
+{
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < iterations; i++) { bench_sink += impl->run(input, len, out); }
+	uint64_t elapsed = now_ns() - start;
+
+	return (double)len * (double)iterations / ((double)elapsed / 1e9) / (1024.0 * 1024.0);
+}
+
+static void print_result(FILE *out, const char *operation, const char *impl, const char *kind, size_t len, double mb_per_sec, int first)
+{
+	fprintf(out, "%s\n    {\"operation\": \"%s\", \"impl\": \"%s\", \"path\": \"%s\", \"length\": %zu, \"mb_per_sec\": %.1f}",
+			first ? "" : ",", operation, impl, kind, len, mb_per_sec);
+}
+
+int main(int argc, char **argv)
+{
+	size_t iterations = BENCH_DEFAULT_ITERATIONS;
+	const char *output = NULL;
+	FILE *out = stdout;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:o:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			iterations = (size_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n iterations] [-o output file]\n", argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (iterations == 0)
+	{
+		fprintf(stderr, "Number of iterations must be positive.\n");
+		return EXIT_FAILURE;
+	}
+
+	const struct escape_impl escape_impls[] = {
+		{ "scalar", escape_scalar, 1 },
+#ifdef TRASHCAN_X86_SIMD
+		{ "sse2", escape_sse2, 1 },
+		{ "avx2", escape_avx2, __builtin_cpu_supports("avx2") },
+#endif
+		{ "dispatch", escape_dispatch, 1 },
+	};
+	const struct escape_impl unescape_impls[] = {
+		{ "scalar", unescape_scalar, 1 },
+#ifdef TRASHCAN_X86_SIMD
+		{ "sse2", unescape_sse2, 1 },
+		{ "avx2", unescape_avx2, __builtin_cpu_supports("avx2") },
+#endif
+		{ "dispatch", unescape_dispatch, 1 },
+	};
+	size_t num_escape_impls = sizeof(escape_impls) / sizeof(escape_impls[0]);
+	size_t num_unescape_impls = sizeof(unescape_impls) / sizeof(unescape_impls[0]);
+	size_t max_len = length_params[sizeof(length_params) / sizeof(length_params[0]) - 1];
+	char *path = malloc(max_len + 1);
+	char *escaped = malloc(3 * max_len + 1);
+	char *buffer = malloc(3 * max_len + 1);
+	char *expected = malloc(3 * max_len + 1);
+	uint64_t seed = 1;
+	int mismatch = 0;
+	int ret = EXIT_FAILURE;
+	int first = 1;
+
+	if (path == NULL || escaped == NULL || buffer == NULL || expected == NULL) { goto cleanup; }
+
+	/* The escaped random paths are unescaped as well, so that valid escape sequences are covered. */
+	for (size_t n = 0; n < BENCH_RANDOM_PATHS; n++)
+	{
+		size_t len = n % (BENCH_RANDOM_MAX_LEN + 1);
+		make_random_path(path, len, &seed);
+		if (check_impls("escape", escape_impls, num_escape_impls, path, len, expected, buffer) < 0) { mismatch = 1; }
+		if (check_impls("unescape", unescape_impls, num_unescape_impls, path, len, expected, buffer) < 0) { mismatch = 1; }
+
+		size_t escaped_len = escape_scalar(path, len, escaped);
+		if (check_impls("unescape", unescape_impls, num_unescape_impls, escaped, escaped_len, expected, buffer) < 0) { mismatch = 1; }
+	}
+
+	for (int kind = 0; kind < NUM_PATH_KINDS; kind++)
+	{
+		for (size_t p = 0; p < sizeof(length_params) / sizeof(length_params[0]); p++)
+		{
+			size_t len = length_params[p];
+			make_path(path, len, (enum path_kind)kind);
+			size_t escaped_len = escape_scalar(path, len, escaped);
+			if (check_impls("escape", escape_impls, num_escape_impls, path, len, expected, buffer) < 0) { mismatch = 1; }
+			if (check_impls("unescape", unescape_impls, num_unescape_impls, escaped, escaped_len, expected, buffer) < 0) { mismatch = 1; }
+		}
+	}
+
+	if (mismatch) { goto cleanup; }
+	if (output != NULL && (out = fopen(output, "w")) == NULL)
+	{
+		fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+		out = stdout;
+		goto cleanup;
+	}
+
+	fprintf(out, "{\n  \"benchmark\": \"trashinfo_escaping\",\n  \"iterations\": %zu,\n  \"results\": [", iterations);
+
+	for (int kind = 0; kind < NUM_PATH_KINDS; kind++)
+	{
+		for (size_t p = 0; p < sizeof(length_params) / sizeof(length_params[0]); p++)
+		{
+			size_t len = length_params[p];
+			make_path(path, len, (enum path_kind)kind);
+			size_t escaped_len = escape_scalar(path, len, escaped);
+
+			for (size_t i = 0; i < sizeof(escape_impls) / sizeof(escape_impls[0]); i++)
+			{
+				if (!escape_impls[i].supported) { continue; }
+				print_result(out, "escape", escape_impls[i].name, path_kind_names[kind], len, run_impl(&escape_impls[i], path, len, buffer, iterations), first);
+				first = 0;
+			}
+
+			for (size_t i = 0; i < sizeof(unescape_impls) / sizeof(unescape_impls[0]); i++)
+			{
+				if (!unescape_impls[i].supported) { continue; }
+				print_result(out, "unescape", unescape_impls[i].name, path_kind_names[kind], escaped_len, run_impl(&unescape_impls[i], escaped, escaped_len, buffer, iterations), first);
+			}
+		}
+	}
+
+	fprintf(out, "\n  ]\n}\n");
+	ret = EXIT_SUCCESS;
+
+cleanup:
+	if (out != stdout) { fclose(out); }
+	free(expected);
+	free(buffer);
+	free(escaped);
+	free(path);
+	return ret;
+}
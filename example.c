@@ -26,7 +26,11 @@
   * @author Robert Guetzkow
   * @date 2019-04-22
   * @brief Example implementation calling libtrashcan. First argument should be a file
-  * or a directory which is then moved to the trash.
+  * or a directory which is then moved to the trash. On Linux and *BSD further arguments
+  * are moved to the trash together with the first one in one batch. There the home trash
+  * can also be cleaned up with "--purge <original path>", "--empty" and
+  * "--expire <max age in seconds> <max size in bytes>", where negative values mean no limit.
+  * These print the number of removed bytes and inodes.
   */
 
 #include "src/trashcan.h"
@@ -38,6 +42,57 @@ int wmain(int argc, wchar_t **argv)
 {
 	int ret = trashcan_soft_delete_core(argv[1], true);
 
+#elif defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Permanently removes the entries of the home trash that were trashed from a path.
+ *
+ * @param path Original path of the entries.
+ * @param bytes Address to which the size of the removed regular files is added.
+ * @param inodes Address to which the number of removed files and directories is added.
+ * @return 0 when successful, negative otherwise.
+ */
+static int purge_path(const char *path, uint64_t *bytes, uint64_t *inodes)
+{
+	trashcan_iter *iter = NULL;
+	trashcan_entry entry;
+	int ret = trashcan_iter_open(NULL, 0, &iter);
+	if (ret != 0) { return ret; }
+
+	while ((ret = trashcan_iter_next(iter, &entry)) == 1)
+	{
+		if (strcmp(entry.original_path, path) == 0 && (ret = trashcan_purge(&entry, bytes, inodes)) != 0) { break; }
+	}
+
+	trashcan_iter_close(iter);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int cleanup = 1;
+	uint64_t bytes = 0;
+	uint64_t inodes = 0;
+
+	if (argc == 3 && strcmp(argv[1], "--purge") == 0) { ret = purge_path(argv[2], &bytes, &inodes); }
+	else if (argc == 2 && strcmp(argv[1], "--empty") == 0) { ret = trashcan_empty(NULL, &bytes, &inodes); }
+	else if (argc == 4 && strcmp(argv[1], "--expire") == 0)
+	{
+		long long max_size = strtoll(argv[3], NULL, 10);
+		ret = trashcan_expire(NULL, (time_t)strtoll(argv[2], NULL, 10), max_size < 0 ? UINT64_MAX : (uint64_t)max_size, &bytes, &inodes);
+	}
+	else
+	{
+		cleanup = 0;
+		ret = argc > 2 ? trashcan_soft_delete_many((const char **)argv + 1, (size_t)argc - 1, NULL) : trashcan_soft_delete(argv[1]);
+	}
+
+	if (cleanup && ret == 0) { printf("%" PRIu64 " %" PRIu64 "\n", bytes, inodes); }
+
 #else
 int main(int argc, char **argv)
 {
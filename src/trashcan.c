@@ -38,6 +38,10 @@
  * exist and it is not recommended to be used in production.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* Has to be defined before any system header is included, trashcan.h includes some. */
+#endif
+
 #include "trashcan.h"
 
 #ifdef WIN32
@@ -55,32 +59,61 @@
 
 #elif defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
 #ifdef __linux__
-#define _GNU_SOURCE
 #include <mntent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #else
 #include <sys/param.h>
 #include <sys/ucred.h>
 #include <sys/mount.h>
 #endif
 
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
-#include <libgen.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "trashcand_protocol.h"
+#ifdef TRASHCAN_IO_URING
+#include <liburing.h>
+#endif
+/* Vectorized escaping of paths, AVX2 is selected at runtime. SSE2 is part of every x86-64 CPU. */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define TRASHCAN_X86_SIMD
+#include <immintrin.h>
+#endif
 #else
 #error Platform not supported
 #endif
 
+/* Number of worker threads for asynchronous deletions if none is set. Deletions mostly wait for the filesystem. */
+#define TRASHCAN_DEFAULT_WORKERS 4
+
 /* Macro for generating enum entries */
 #define STATUS_ENUM(ID, NAME, STR) NAME = ID,
 
@@ -324,12 +357,307 @@ int trashcan_soft_delete(const char *path)
 	X(-11, LIBTRASHCAN_RENAME, "Failed to move files to trash.")\
 	X(-12, LIBTRASHCAN_COLLISION, "Failed to generate unique name.")\
 	X(-13, LIBTRASHCAN_DIRCACHE, "Failed to update directory size cache.")\
+	X(-14, LIBTRASHCAN_BATCH, "Failed to move at least one path of the batch to trash.")\
+	X(-15, LIBTRASHCAN_ALLOC, "Failed to allocate memory.")\
+	X(-16, LIBTRASHCAN_OPENTRASH, "Failed to open trash directory.")\
+	X(-17, LIBTRASHCAN_READTRASH, "Failed to read trash directory.")\
+	X(-18, LIBTRASHCAN_READINFO, "Failed to read trash info file.")\
+	X(-19, LIBTRASHCAN_RESTORE, "Failed to move file back from trash.")\
+	X(-20, LIBTRASHCAN_RESTOREEXISTS, "Failed to restore because the original path already exists.")\
+	X(-21, LIBTRASHCAN_RMINFO, "Failed to remove trash info file.")\
+	X(-22, LIBTRASHCAN_THREAD, "Failed to start worker thread.")\
+	X(-23, LIBTRASHCAN_COPY, "Failed to copy files to trash.")\
+	X(-24, LIBTRASHCAN_COPYREMOVE, "Copied files to trash, but failed to remove the originals.")\
+	X(-25, LIBTRASHCAN_PURGE, "Failed to remove files from trash.")\
+	X(-26, LIBTRASHCAN_SYNC, "Failed to flush trash to disk.")\
+	X(-27, LIBTRASHCAN_NOSTATS, "Library was built without TRASHCAN_STATS.")\
+	X(-28, LIBTRASHCAN_NOINDEX, "No index has been loaded into the context.")\
+	X(-29, LIBTRASHCAN_NOWATCH, "File system notifications are not supported on this platform.")\
+	X(-30, LIBTRASHCAN_WATCH, "Failed to watch trash directories for changes.")\
+	X(-31, LIBTRASHCAN_NODAEMON, "Trash daemon is not running.")\
+	X(-32, LIBTRASHCAN_DAEMON, "Lost connection to the trash daemon.")\
+	X(-33, LIBTRASHCAN_RESTOREREMOVE, "Restored a copy, but failed to remove the entry from the trash.")\
 
 enum
 {
 	STATUS_CODES(STATUS_ENUM)
 };
 
+/**
+ * @brief Returns the current time of the monotonic clock in nanoseconds.
+ */
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) { return 0; }
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+#ifdef TRASHCAN_STATS
+/* Per-phase counters and histograms, shared by all threads and contexts of the process. */
+static _Atomic uint64_t phase_count[TRASHCAN_NUM_PHASES];
+static _Atomic uint64_t phase_total_ns[TRASHCAN_NUM_PHASES];
+static _Atomic uint64_t phase_max_ns[TRASHCAN_NUM_PHASES];
+static _Atomic uint64_t phase_histogram[TRASHCAN_NUM_PHASES][TRASHCAN_STATS_BUCKETS];
+
+/**
+ * @brief Determines the histogram bucket of a duration.
+ *
+ * Durations below 4 ns have a bucket each, every larger power of two is split into 4 linear
+ * sub-buckets, so the relative error is at most 25 % over the whole range.
+ *
+ * @param ns Duration in nanoseconds.
+ * @return Index of the bucket.
+ */
+static size_t stats_bucket(uint64_t ns)
+{
+	if (ns < 4) { return (size_t)ns; }
+
+	unsigned int msb = 63u - (unsigned int)__builtin_clzll(ns);
+	return (size_t)(msb - 1) * 4 + (size_t)((ns >> (msb - 2)) & 3);
+}
+
+/**
+ * @brief Adds the duration of a phase to its counters and its histogram.
+ *
+ * @param phase Phase, one of the TRASHCAN_PHASE_* constants.
+ * @param start Time returned by monotonic_ns() when the phase started.
+ */
+static void stats_record(size_t phase, uint64_t start)
+{
+	uint64_t ns = monotonic_ns() - start;
+	uint64_t max = atomic_load_explicit(&phase_max_ns[phase], memory_order_relaxed);
+
+	atomic_fetch_add_explicit(&phase_count[phase], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&phase_total_ns[phase], ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&phase_histogram[phase][stats_bucket(ns)], 1, memory_order_relaxed);
+	while (ns > max && !atomic_compare_exchange_weak_explicit(&phase_max_ns[phase], &max, ns, memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+/* Macros for timing a phase. Without TRASHCAN_STATS they expand to nothing, not even a clock read. */
+#define STATS_START(VAR) uint64_t VAR = monotonic_ns();
+#define STATS_STOP(PHASE, VAR) stats_record(PHASE, VAR);
+#else
+#define STATS_START(VAR)
+#define STATS_STOP(PHASE, VAR)
+#endif
+
+/* Initial size of the arena of a deletion. The resolved path, the two paths in the trash and the
+ * content of the .trashinfo file, whose escaped path can be three times as long as the original,
+ * fit into one block even for paths of PATH_MAX bytes. */
+#define DELETE_ARENA_SIZE (8 * PATH_MAX)
+
+/**
+ * @brief Block of memory from which an arena hands out allocations.
+ */
+struct arena_block
+{
+	struct arena_block *prev; /**< Block that was filled before, NULL for the first block. */
+	size_t size; /**< Number of bytes in data. */
+	size_t used; /**< Number of bytes of data that have been handed out. */
+	max_align_t data[]; /**< Memory of the block. */
+};
+
+/**
+ * @brief Bump allocator whose allocations are freed together.
+ *
+ * Allocations advance an offset in the current block. If it is full, a new block is chained in
+ * front of it. The allocations are freed at once with arena_free(), or back to a mark with
+ * arena_release(), so a deletion costs a single malloc() in the common case.
+ */
+struct arena
+{
+	struct arena_block *block; /**< Current block, NULL before the first allocation. */
+	size_t block_size; /**< Minimum size of a new block. */
+};
+
+/**
+ * @brief Position in an arena to which it can be released.
+ */
+struct arena_mark
+{
+	struct arena_block *block; /**< Current block at the time of the mark. */
+	size_t used; /**< Bytes used in the block at the time of the mark. */
+};
+
+/**
+ * @brief Initializes an empty arena. Memory is only allocated with the first allocation.
+ *
+ * @param arena Arena that is initialized.
+ * @param block_size Minimum size of each block, should fit the expected allocations.
+ */
+static void arena_init(struct arena *arena, size_t block_size)
+{
+	arena->block = NULL;
+	arena->block_size = block_size;
+}
+
+/**
+ * @brief Allocates memory from an arena, aligned for any type.
+ *
+ * @param arena Arena from which the memory is taken.
+ * @param size Number of bytes.
+ * @return Pointer to the memory, NULL if a new block couldn't be allocated.
+ */
+static void *arena_alloc(struct arena *arena, size_t size)
+{
+	const size_t align = _Alignof(max_align_t);
+	struct arena_block *block = arena->block;
+
+	if (block == NULL || block->size - block->used < size)
+	{
+		size_t block_size = size > arena->block_size ? size : arena->block_size;
+		if (block_size > SIZE_MAX - sizeof(*block)) { return NULL; }
+		block = malloc(sizeof(*block) + block_size);
+		if (block == NULL) { return NULL; }
+		block->prev = arena->block;
+		block->size = block_size;
+		block->used = 0;
+		arena->block = block;
+	}
+
+	void *ptr = (char *)block->data + block->used;
+	size_t padded = (size + align - 1) & ~(align - 1);
+	block->used = padded < block->size - block->used ? block->used + padded : block->size;
+	return ptr;
+}
+
+/**
+ * @brief Shrinks the last allocation of an arena, returning the rest to the arena.
+ *
+ * @param arena Arena from which ptr has been allocated.
+ * @param ptr Last allocation of the arena.
+ * @param size New size in bytes, not larger than the allocated size.
+ */
+static void arena_shrink(struct arena *arena, void *ptr, size_t size)
+{
+	const size_t align = _Alignof(max_align_t);
+	size_t offset = (size_t)((char *)ptr - (char *)arena->block->data);
+	size_t padded = (size + align - 1) & ~(align - 1);
+	if (padded < arena->block->used - offset) { arena->block->used = offset + padded; }
+}
+
+/**
+ * @brief Determines the current position of an arena.
+ *
+ * @param arena Arena whose position is returned.
+ * @return Mark that can be passed to arena_release().
+ */
+static struct arena_mark arena_get_mark(const struct arena *arena)
+{
+	struct arena_mark mark = { arena->block, arena->block != NULL ? arena->block->used : 0 };
+	return mark;
+}
+
+/**
+ * @brief Frees all allocations of an arena that have been made after a mark.
+ *
+ * @param arena Arena whose allocations are freed.
+ * @param mark Mark returned by arena_get_mark().
+ */
+static void arena_release(struct arena *arena, struct arena_mark mark)
+{
+	while (arena->block != mark.block)
+	{
+		struct arena_block *prev = arena->block->prev;
+		free(arena->block);
+		arena->block = prev;
+	}
+	if (arena->block != NULL) { arena->block->used = mark.used; }
+}
+
+/**
+ * @brief Frees all allocations of an arena. The arena can be used again afterwards.
+ *
+ * @param arena Arena whose allocations are freed.
+ */
+static void arena_free(struct arena *arena)
+{
+	struct arena_mark start = { NULL, 0 };
+	arena_release(arena, start);
+}
+
+/**
+ * @brief Formats a string like asprintf() into an arena.
+ *
+ * @param arena Arena in which the string is allocated.
+ * @param format Format string of printf().
+ * @return Pointer to the string, NULL on failure.
+ */
+static char *arena_printf(struct arena *arena, const char *format, ...)
+{
+	va_list args;
+	char *str = NULL;
+
+	/* Try the free space of the current block first to format only once. */
+	if (arena->block != NULL && arena->block->used < arena->block->size)
+	{
+		size_t available = arena->block->size - arena->block->used;
+		str = (char *)arena->block->data + arena->block->used;
+		va_start(args, format);
+		int len = vsnprintf(str, available, format, args);
+		va_end(args);
+		if (len < 0) { return NULL; }
+		if ((size_t)len < available) { return arena_alloc(arena, (size_t)len + 1); }
+	}
+
+	va_start(args, format);
+	int len = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (len < 0) { return NULL; }
+
+	str = arena_alloc(arena, (size_t)len + 1);
+	if (str == NULL) { return NULL; }
+	va_start(args, format);
+	vsnprintf(str, (size_t)len + 1, format, args);
+	va_end(args);
+	return str;
+}
+
+/**
+ * @brief Copies the first bytes of a string into an arena.
+ *
+ * @param arena Arena in which the copy is allocated.
+ * @param str String to copy.
+ * @param len Number of bytes to copy.
+ * @return Pointer to the zero terminated copy, NULL on failure.
+ */
+static char *arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+	char *copy = arena_alloc(arena, len + 1);
+	if (copy == NULL) { return NULL; }
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+/**
+ * @brief Resolves a path like realpath() into an arena.
+ *
+ * A buffer of PATH_MAX bytes is taken from the arena and shrunk to the length of the result.
+ *
+ * @param arena Arena in which the resolved path is allocated.
+ * @param path Path to resolve.
+ * @return Pointer to the absolute path without symbolic links, NULL on failure.
+ */
+static char *arena_realpath(struct arena *arena, const char *path)
+{
+	struct arena_mark mark = arena_get_mark(arena);
+	char *resolved_path = arena_alloc(arena, PATH_MAX);
+	if (resolved_path == NULL) { return NULL; }
+
+	if (realpath(path, resolved_path) == NULL)
+	{
+		int saved_errno = errno;
+		arena_release(arena, mark);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	arena_shrink(arena, resolved_path, strlen(resolved_path) + 1);
+	return resolved_path;
+}
+
 /**
  * @brief Determines paths to the home trash directory.
  *
@@ -393,735 +721,8834 @@ error_m1:
 }
 
 /**
- * @brief Find the mountpoint of a device.
- *
- * @param device Device for which the mountpoint is determined.
- * @param mount_dir Address where pointer to the mount directory shall be stored.
- * @return 0 when successful, negative otherwise.
+ * @brief Mount point of a device.
  */
-static int get_mountpoint(dev_t device, char **mount_dir)
+struct mount_entry
 {
-	int status = -1;
-	struct stat mnt_stat;
-	*mount_dir = NULL;
+	dev_t device; /**< Device that is mounted. */
+	unsigned char is_root; /**< 1 if the root of the filesystem is mounted, 0 for bind mounts of a subdirectory. */
+	size_t order; /**< Position in the mount table, used to keep the sort stable. */
+	int mount_id; /**< Unique ID of the mount from mountinfo, negative if unknown. */
+	char *mount_dir; /**< Directory where the device is mounted. */
+};
 
-#ifdef __linux__
-	char *file = "/etc/mtab";
-	FILE *fptr = NULL;
-	struct mntent *mount_entry;
+/**
+ * @brief Cached mount table, sorted by device for binary search.
+ *
+ * On Linux the table is parsed from /proc/self/mountinfo, which contains the device numbers, so the
+ * mount points don't have to be stat'ed. This avoids blocking on stale NFS or FUSE mounts. The file
+ * stays open and is polled for POLLPRI, which the kernel signals when the mount table changes. Only
+ * then the table is parsed again.
+ */
+struct mount_table
+{
+	int fd; /**< Open /proc/self/mountinfo, negative if not opened (yet). */
+	struct mount_entry *entries; /**< Mount entries sorted by device. */
+	size_t num_entries; /**< Number of mount entries. */
+	unsigned char loaded; /**< 1 if entries reflect the current mount table. */
+};
 
-	fptr = setmntent(file, "r");
-	if (fptr == NULL) { goto error_0; }
+/**
+ * @brief Initializes an empty mount table.
+ *
+ * @param mounts Mount table that is initialized.
+ */
+static void mount_table_init(struct mount_table *mounts)
+{
+	memset(mounts, 0, sizeof(*mounts));
+	mounts->fd = -1;
+}
 
-	while ((mount_entry = getmntent(fptr)) != NULL)
+/**
+ * @brief Frees the entries of a mount table, but keeps it open.
+ *
+ * @param mounts Mount table whose entries are freed.
+ */
+static void mount_table_clear(struct mount_table *mounts)
+{
+	for (size_t i = 0; i < mounts->num_entries; i++)
 	{
-		if (lstat(mount_entry->mnt_dir, &mnt_stat)) { goto error_0; }
-		if (device == mnt_stat.st_dev)
-		{
-			break;
-		}
+		free(mounts->entries[i].mount_dir);
 	}
 
-	if (mount_entry == NULL) { goto error_0; }
-	if (asprintf(mount_dir, "%s", mount_entry->mnt_dir) < 0) { HANDLE_ERROR(*mount_dir, NULL, error_0) }
-#else
-	size_t i = 0;
-	unsigned char mnt_found = 0;
-	struct statfs* mounts;
-	int num_mounts = getmntinfo(&mounts, MNT_WAIT);
-	if (num_mounts < 0) { goto error_0; }
+	free(mounts->entries);
+	mounts->entries = NULL;
+	mounts->num_entries = 0;
+	mounts->loaded = 0;
+}
+
+/**
+ * @brief Frees a mount table.
+ *
+ * @param mounts Mount table that is freed.
+ */
+static void mount_table_free(struct mount_table *mounts)
+{
+	mount_table_clear(mounts);
 
-	for (i = 0; i < num_mounts; i++)
+	if (mounts->fd >= 0)
 	{
-		if (lstat(mounts[i].f_mntonname, &mnt_stat)) { goto error_0; }
-		if (device == mnt_stat.st_dev)
-		{
-			mnt_found = 1;
-			break;
-		}
+		close(mounts->fd);
+		mounts->fd = -1;
 	}
+}
 
-	if (!mnt_found) { goto error_0; }
-	if (asprintf(mount_dir, "%s", mounts[i].f_mntonname) < 0) { HANDLE_ERROR(*mount_dir, NULL, error_0) }
-#endif
-
-	status = 0;
+/**
+ * @brief Compares two mount entries by device. For the same device mounts of the filesystem root
+ * are sorted first, otherwise the order of the mount table is kept.
+ *
+ * @param a Pointer to the first mount entry.
+ * @param b Pointer to the second mount entry.
+ * @return Negative, zero or positive like strcmp().
+ */
+static int compare_mount_entries(const void *a, const void *b)
+{
+	const struct mount_entry *entry_a = a;
+	const struct mount_entry *entry_b = b;
 
-error_0:
-	return status;
+	if (entry_a->device != entry_b->device) { return entry_a->device < entry_b->device ? -1 : 1; }
+	if (entry_a->is_root != entry_b->is_root) { return entry_a->is_root ? -1 : 1; }
+	if (entry_a->order != entry_b->order) { return entry_a->order < entry_b->order ? -1 : 1; }
+	return 0;
 }
 
 /**
- * @brief Determines paths to the $topdir for case (1) and (2) of the specification.
- *
- * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ * @brief Adds an entry to the (unsorted) mount table.
  *
- * @param case_num Determines whether case (1) or (2) applies.
- * @param device Device for which the $topdir shall be determined.
- * @param trash_dir Base directory for $topdir.
- * @param trash_info_dir Directory where .trashinfo files are stored.
- * @param trash_files_dir Directory where trashed files are stored.
+ * @param mounts Mount table to which the entry is added.
+ * @param capacity Address of the number of allocated entries.
+ * @param device Device that is mounted.
+ * @param is_root 1 if the root of the filesystem is mounted.
+ * @param mount_id Unique ID of the mount, negative if unknown.
+ * @param mount_dir Directory where the device is mounted, is copied.
  * @return 0 when successful, negative otherwise.
  */
-static int get_top_trash_dir(unsigned char case_num, dev_t device, char **trash_dir, char **trash_info_dir, char **trash_files_dir)
+static int mount_table_add(struct mount_table *mounts, size_t *capacity, dev_t device, unsigned char is_root, int mount_id, const char *mount_dir)
 {
-	int status = -1;
-	char *mount_dir = NULL;
-	*trash_dir = NULL;
-	*trash_info_dir = NULL;
-	*trash_files_dir = NULL;
-
-	if (get_mountpoint(device, &mount_dir)) { goto error_0; }
-
-	uid_t uid = getuid();
-
-	switch (case_num)
+	if (mounts->num_entries == *capacity)
 	{
-		case 1:
-			if (asprintf(trash_dir, "%s%s%ju", mount_dir, "/.Trash/", (uintmax_t)uid) < 0) { HANDLE_ERROR(*trash_dir, NULL, error_m1) }
-			break;
-		case 2:
-			if (asprintf(trash_dir, "%s%s%ju", mount_dir, "/.Trash-", (uintmax_t)uid) < 0) { HANDLE_ERROR(*trash_dir, NULL, error_m1) }
-			break;
-		default:
-			goto error_m1;
+		size_t new_capacity = *capacity == 0 ? 64 : *capacity * 2;
+		struct mount_entry *entries = realloc(mounts->entries, new_capacity * sizeof(*entries));
+		if (entries == NULL) { return -1; }
+		mounts->entries = entries;
+		*capacity = new_capacity;
 	}
-	if (asprintf(trash_info_dir, "%s%s", *trash_dir, "/info") < 0) { HANDLE_ERROR(*trash_info_dir, NULL, error_m1) }
-	if (asprintf(trash_files_dir, "%s%s", *trash_dir, "/files") < 0) { HANDLE_ERROR(*trash_files_dir, NULL, error_m1) }
 
-	status = 0;
+	struct mount_entry *entry = &mounts->entries[mounts->num_entries];
+	entry->device = device;
+	entry->is_root = is_root;
+	entry->order = mounts->num_entries;
+	entry->mount_id = mount_id;
+	if (asprintf(&entry->mount_dir, "%s", mount_dir) < 0) { return -1; }
+	mounts->num_entries++;
 
-error_0:
-	return status;
-error_m1:
-	free(*trash_dir);
-	free(*trash_info_dir);
-	free(*trash_files_dir);
-	*trash_dir = NULL;
-	*trash_info_dir = NULL;
-	*trash_files_dir = NULL;
-	return status;
+	return 0;
 }
 
+#ifdef __linux__
 /**
- * @brief Create directories recursively.
+ * @brief Decodes the octal escapes (e.g. "\040" for a space) used for paths in /proc/self/mountinfo in place.
  *
- * @param path Path to create recursively.
- * @param mode File permission mode to use when creating the directories.
- * @return 0 when successful, negative otherwise.
+ * @param str String that is decoded.
  */
-static int mkdir_recursive(const char *path, mode_t mode)
+static void unescape_mountinfo(char *str)
 {
-	int status = -1;
-	char *current_path = NULL;
-	char *current_pos = NULL;
+	char *out = str;
 
-	if (path == NULL || *path == '\0')
+	for (char *in = str; *in != '\0'; in++)
 	{
-		goto error_0;
+		if (in[0] == '\\' && '0' <= in[1] && in[1] <= '3' && '0' <= in[2] && in[2] <= '7' && '0' <= in[3] && in[3] <= '7')
+		{
+			*out++ = (char)(((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0'));
+			in += 3;
+		}
+		else
+		{
+			*out++ = *in;
+		}
 	}
 
-	/* Copy string, since we don't want to modify the original */
-	if (asprintf(&current_path, "%s", path) < 0) { goto error_0; }
+	*out = '\0';
+}
 
-	current_pos = current_path + 1; /* Start after root dir */
+/**
+ * @brief Parses /proc/self/mountinfo into the mount table.
+ *
+ * Each line has the format "id parent_id major:minor root mount_point options ...".
+ * @see https://www.kernel.org/doc/Documentation/filesystems/proc.txt
+ *
+ * @param mounts Mount table whose file descriptor is open.
+ * @return 0 when successful, negative otherwise.
+ */
+static int mount_table_parse(struct mount_table *mounts)
+{
+	int status = -1;
+	char *buf = NULL;
+	size_t buf_size = 16384;
+	size_t len = 0;
+	size_t capacity = 0;
 
-	while (*current_pos != '\0')
+	/* The content is generated by the kernel when read, so read everything starting at offset 0 in one go. */
+	buf = malloc(buf_size);
+	if (buf == NULL) { goto error_0; }
+
+	for (;;)
 	{
-		if (*current_pos == '/')
+		ssize_t num_read = pread(mounts->fd, buf + len, buf_size - len - 1, (off_t)len);
+		if (num_read < 0)
 		{
-			*current_pos = '\0'; /* Temporary truncation */
-
-			if (mkdir(current_path, mode) != 0)
-			{
-				if (errno != EEXIST) { goto error_1; }
-			}
+			if (errno == EINTR) { continue; }
+			goto error_1;
+		}
+		if (num_read == 0) { break; }
+		len += (size_t)num_read;
 
-			*current_pos = '/';
+		if (len + 1 == buf_size)
+		{
+			char *new_buf = realloc(buf, buf_size * 2);
+			if (new_buf == NULL) { goto error_1; }
+			buf = new_buf;
+			buf_size *= 2;
 		}
-		current_pos++;
 	}
+	buf[len] = '\0';
 
-	/* Create last dir with name between slash and zero termination */
-	if (mkdir(current_path, mode) != 0)
+	char *save_line = NULL;
+	for (char *line = strtok_r(buf, "\n", &save_line); line != NULL; line = strtok_r(NULL, "\n", &save_line))
 	{
-		if (errno != EEXIST) { goto error_1; }
+		char *save_field = NULL;
+		unsigned int major_num = 0;
+		unsigned int minor_num = 0;
+
+		char *mount_id = strtok_r(line, " ", &save_field);
+		char *parent_id = strtok_r(NULL, " ", &save_field);
+		char *device = strtok_r(NULL, " ", &save_field);
+		char *root = strtok_r(NULL, " ", &save_field);
+		char *mount_point = strtok_r(NULL, " ", &save_field);
+		if (mount_id == NULL || parent_id == NULL || device == NULL || root == NULL || mount_point == NULL) { continue; }
+		if (sscanf(device, "%u:%u", &major_num, &minor_num) != 2) { continue; }
+
+		unescape_mountinfo(mount_point);
+		if (mount_table_add(mounts, &capacity, makedev(major_num, minor_num), strcmp(root, "/") == 0, atoi(mount_id), mount_point) < 0) { goto error_1; }
 	}
 
 	status = 0;
 
 error_1:
-	free(current_path);
+	free(buf);
 error_0:
 	return status;
 }
+#endif
 
 /**
- * @brief Create directories if the don't already exist.
+ * @brief Fallback that builds the mount table by stat'ing every mount point.
  *
- * @param trash_dir Base directory for trash.
- * @param trash_info_dir Directory where .trashinfo files are stored.
- * @param trash_files_dir Directory where trashed files are stored.
- * @param mode File permission mode to use when creating the directories.
+ * This is used on *BSD and on Linux when /proc isn't mounted.
+ *
+ * @param mounts Mount table to which the entries are added.
  * @return 0 when successful, negative otherwise.
  */
-static int create_trash_dir(const char *trash_info_dir, const char *trash_files_dir, mode_t mode)
+static int mount_table_stat(struct mount_table *mounts)
 {
 	int status = -1;
+	size_t capacity = 0;
+	struct stat mnt_stat;
 
-	if (mkdir_recursive(trash_info_dir, mode) < 0) { goto error_0; }
-	if (mkdir_recursive(trash_files_dir, mode) < 0) { goto error_0; }
+#ifdef __linux__
+	char *file = "/etc/mtab";
+	FILE *fptr = NULL;
+	struct mntent *mount_entry;
+
+	fptr = setmntent(file, "r");
+	if (fptr == NULL) { goto error_0; }
+
+	while ((mount_entry = getmntent(fptr)) != NULL)
+	{
+		if (lstat(mount_entry->mnt_dir, &mnt_stat)) { continue; }
+		if (mount_table_add(mounts, &capacity, mnt_stat.st_dev, 1, -1, mount_entry->mnt_dir) < 0) { goto error_1; }
+	}
 
 	status = 0;
 
-error_0:
-	return status;
-}
+error_1:
+	endmntent(fptr);
+#else
+	struct statfs* mounts_info;
+	int num_mounts = getmntinfo(&mounts_info, MNT_NOWAIT);
+	if (num_mounts < 0) { goto error_0; }
 
-/**
- * @brief Check whether a character is unreserved or not.
- *
- * This is meant to be used for URI escaping as defined in RFC 2396
- * @see https://www.ietf.org/rfc/rfc2396.txt
- *
- * @param c Character that is checked.
- * @return 1 when unreserved, 0 otherwise.
- */
-static int is_unreserved(char c)
-{
-	if (('a' <= c && c <= 'z') ||
-		('A' <= c && c <= 'Z') ||
-		('0' <= c && c <= '9') ||
-		c == '-' ||
-		c == '_' ||
-		c == '.' ||
-		c == '!' ||
-		c == '~' ||
-		c == '*' ||
-		c == '\'' ||
-		c == '(' ||
-		c == ')')
+	for (int i = 0; i < num_mounts; i++)
 	{
-		return 1;
+		if (lstat(mounts_info[i].f_mntonname, &mnt_stat)) { continue; }
+		if (mount_table_add(mounts, &capacity, mnt_stat.st_dev, 1, -1, mounts_info[i].f_mntonname) < 0) { goto error_0; }
 	}
 
-	return 0;
+	status = 0;
+#endif
+
+error_0:
+	return status;
 }
 
 /**
- * @brief Escape a string using URI escaping RFC 2396
- *
- * @see https://www.ietf.org/rfc/rfc2396.txt
+ * @brief Makes sure the mount table reflects the current mounts, parsing it again if it has changed.
  *
- * @param str String to be escaped
- * @param str_escaped Address where pointer to the escaped string is stored.
+ * @param mounts Mount table that is updated.
  * @return 0 when successful, negative otherwise.
  */
-static int escape_path(const char *str, char **str_escaped)
+static int mount_table_update(struct mount_table *mounts)
 {
-	/* Implements URI escaping as defined in RFC 2396 except for the reserved '/' which is a legal char in the path and therefore isn't escaped */
-	int status = -1;
-	size_t idx = 0;
-	size_t str_len = strlen(str);
-	*str_escaped = calloc(str_len * 3 + 1, sizeof(char)); /* Enough space if every char needs to be escaped. */
-	if (*str_escaped == NULL) { goto error_0; }
+#ifdef __linux__
+	if (mounts->fd < 0)
+	{
+		mounts->fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+	}
 
-	for (size_t i=0; i < str_len; i++)
+	if (mounts->fd >= 0)
 	{
-		if (is_unreserved(str[i]) || str[i] == '/')
+		/* The kernel signals POLLPRI (and POLLERR) once after each change of the mount table. */
+		struct pollfd pfd = { .fd = mounts->fd, .events = POLLPRI, .revents = 0 };
+		if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR)))
 		{
-			(*str_escaped)[idx] = str[i];
-			idx++;
+			mount_table_clear(mounts);
 		}
-		else
+
+		if (mounts->loaded) { return 0; }
+
+		mount_table_clear(mounts);
+		if (mount_table_parse(mounts) < 0)
 		{
-			snprintf(&((*str_escaped)[idx]), 4, "%%%02hhX", (unsigned char) str[i]); /* 3 chars + '\0' */
-			idx += 3;
+			mount_table_clear(mounts);
+			return -1;
+		}
+	}
+	else
+#endif
+	{
+		/* Without change notification the table can't be cached. */
+		mount_table_clear(mounts);
+		if (mount_table_stat(mounts) < 0)
+		{
+			mount_table_clear(mounts);
+			return -1;
 		}
 	}
 
-	status = 0;
+	qsort(mounts->entries, mounts->num_entries, sizeof(*mounts->entries), compare_mount_entries);
+	mounts->loaded = 1;
 
-error_0:
-	return status;
+	return 0;
 }
 
 /**
- * @brief Creates a .trashinfo file.
- *
- * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ * @brief Binary search for the first entry of a device, i.e. the first mount of its filesystem root.
  *
- * @param trashinfo_filepath Path to the trash info directory.
- * @param original_filepath Path where the file was stored before deletion.
- * @param timeinfo Time information about when the deletion occured.
- * @return 0 when successful, negative otherwise.
+ * @param entries Mount entries sorted by compare_mount_entries().
+ * @param num_entries Number of mount entries.
+ * @param device Device that is looked up.
+ * @return The entry or NULL if the device isn't mounted.
  */
-static int create_info_file(const char *trashinfo_filepath, const char *original_filepath, const struct tm *timeinfo)
+static const struct mount_entry *find_mount_entry(const struct mount_entry *entries, size_t num_entries, dev_t device)
 {
-	int status = -1;
-	char timestamp[20];
-	char *escaped_original_filepath = NULL;
-	char *trashinfo_file = NULL;
+	size_t low = 0;
+	size_t high = num_entries;
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		if (entries[mid].device < device) { low = mid + 1; } else { high = mid; }
+	}
 
-	strftime(timestamp, sizeof(timestamp), "%FT%T", timeinfo);
-	if (escape_path(original_filepath, &escaped_original_filepath) < 0) { goto error_0; }
+	return low < num_entries && entries[low].device == device ? &entries[low] : NULL;
+}
 
-	if (asprintf(&trashinfo_file, "[Trash Info]\nPath=%s\nDeletionDate=%s\n", escaped_original_filepath, timestamp) < 0) { HANDLE_ERROR(trashinfo_file, NULL, error_0) }
+#ifdef __linux__
+/**
+ * @brief Finds the mount that contains a path without stat'ing any mount point.
+ *
+ * The mount ID reported by statx() is matched against the IDs from mountinfo. Without STATX_MNT_ID
+ * the mount with the longest mount directory that is a prefix of the path is used, the last one
+ * in the mount table if mounts are stacked on the same directory.
+ *
+ * @param mounts Mount table in which the path is looked up.
+ * @param path Absolute path whose symbolic links are resolved, except for the last component.
+ * @return The entry or NULL if no mount contains the path.
+ */
+static const struct mount_entry *find_mount_entry_by_path(const struct mount_table *mounts, const char *path)
+{
+	const struct mount_entry *entry = NULL;
 
-	FILE *fptr = fopen(trashinfo_filepath, "wx");
-	if (fptr == NULL)
+#ifdef STATX_MNT_ID
+	struct statx path_statx;
+	if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_MNT_ID, &path_statx) == 0 && (path_statx.stx_mask & STATX_MNT_ID))
 	{
-		if (errno == EEXIST)
+		for (size_t i = 0; i < mounts->num_entries; i++)
 		{
-			status = 1;
+			if (mounts->entries[i].mount_id >= 0 && (uint64_t)mounts->entries[i].mount_id == path_statx.stx_mnt_id) { return &mounts->entries[i]; }
 		}
-		goto error_0;
 	}
+#endif
 
-	if (fwrite(trashinfo_file, sizeof(char), strlen(trashinfo_file), fptr) != strlen(trashinfo_file))
+	size_t best_len = 0;
+	for (size_t i = 0; i < mounts->num_entries; i++)
 	{
-		goto error_1;
+		const struct mount_entry *candidate = &mounts->entries[i];
+		size_t len = strlen(candidate->mount_dir);
+		if (strncmp(path, candidate->mount_dir, len) != 0) { continue; }
+		if (path[len] != '/' && path[len] != '\0' && strcmp(candidate->mount_dir, "/") != 0) { continue; }
+
+		if (entry == NULL || len > best_len || (len == best_len && candidate->order > entry->order))
+		{
+			entry = candidate;
+			best_len = len;
+		}
 	}
 
-	status = 0;
-error_1:
-	fclose(fptr);
-error_0:
-	free(trashinfo_file);
-	free(escaped_original_filepath);
-	return status;
+	return entry;
 }
+#endif
 
 /**
- * @brief Generates a random string of given length. The length has to be a multiple of two.
+ * @brief Find the mountpoint of a device.
  *
- * @param filename Address to pointer where filename shall be stored.
- * @param filename_length Length of the filename to be generated (without zero termination).
- * @param 0 when successful, negative otherwise.
+ * @param mounts Mount table in which the device is looked up.
+ * @param device Device for which the mountpoint is determined.
+ * @param path Path on the device used if the device isn't listed in the mount table, may be NULL.
+ * @param mount_dir Address where pointer to the mount directory shall be stored.
+ * @return 0 when successful, negative otherwise.
  */
-static int generate_random_filename(char **filename, size_t filename_length)
+static int get_mountpoint(struct mount_table *mounts, dev_t device, const char *path, char **mount_dir)
 {
 	int status = -1;
+	*mount_dir = NULL;
 
-	/* Length has to be multiple of two, because 1 byte => 2 hex chars */
-	if (filename_length % 2 != 0) { goto error_0; }
+	if (mount_table_update(mounts) < 0) { goto error_0; }
 
-	size_t num_bytes = filename_length / 2;
-	unsigned char *buf = malloc(filename_length);
-	if (buf == NULL) { goto error_0; }
+	const struct mount_entry *entry = find_mount_entry(mounts->entries, mounts->num_entries, device);
 
 #ifdef __linux__
-	if (getrandom(buf, num_bytes, GRND_RANDOM) < 0) { goto error_1; }
+	/* Some filesystems, e.g. btrfs subvolumes, report a device that differs from the one in mountinfo. */
+	if (entry == NULL && mounts->fd >= 0 && path != NULL)
+	{
+		entry = find_mount_entry_by_path(mounts, path);
+	}
 #else
-	arc4random_buf(buf, num_bytes);
+	(void)path;
 #endif
 
-	*filename = calloc(filename_length + 1, sizeof(char));
-	if (*filename == NULL) { goto error_1; }
-
-	for (size_t i = 0; i < num_bytes; i++)
-	{
-		snprintf(&((*filename)[i*2]), 3, "%02hhX", buf[i]); /* 2 chars + '\0' */
-	}
+	if (entry == NULL) { goto error_0; }
+	if (asprintf(mount_dir, "%s", entry->mount_dir) < 0) { HANDLE_ERROR(*mount_dir, NULL, error_0) }
 
 	status = 0;
-error_1:
-	free(buf);
+
 error_0:
 	return status;
 }
 
 /**
- * @brief Determines the path and filename of the deleted file and its .trashinfo file.
- *
- * The generated name is related to the original name. If the limits for the filename allow,
- * the new name is the original name, followed by the timestamp of deletion and a counter.
- *
- * Original path: /home/user/some/path/hello.txt
- * New path     : /home/user/.local/share/Trash/files/hello.txt201904241508300
- * Trashinfo    : /home/user/.local/share/Trash/files/hello.txt201904241508300.trashinfo
- *
- * The counter is intended to be used when name collision occur because two files with the same
- * name have been deleted. The timestamp is used to avoid unnecessary retries when many files
- * with the same name have been deleted. Instead of having to retry with many different counters,
- * incrementing until a unique name is reached, we use the deletion time in the name. This greatly
- * limits the chance of a name collision and results in fewer retries.
- *
- * If the approach above exceeds the limit for the filename, e.g. because the original filename
- * already has the maximum allowed number of character, a random name within limits is generated.
- * This approach is not described in the spec, since it does not allow to make a connection between
- * the original name and the new name. However we believe this is good solution for this edge case,
- * since otherwise filename truncation would be need, which may also make identifying the original
- * filename difficult.
+ * @brief Determines paths to the $topdir for case (1) and (2) of the specification.
  *
  * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
  *
- * @param original_name Original path before deletion.
- * @param trash_info_dir Path to the trash info directory.
- * @param trash_files_dir Path to the directory where deleted files shall be stored.
- * @param timeinfo Time when file was deleted.
- * @param counter Counter which should be incremented in case a name collision occurs.
- * @param enforce_random_name Force use of a random name.
- * @param trash_info_file Address to pointer where trash info file shall be stored.
- * @param trashed_file Address to pointer where deleted file shall be stored.
+ * @param mounts Mount table in which the mount point of the device is looked up.
+ * @param case_num Determines whether case (1) or (2) applies.
+ * @param device Device for which the $topdir shall be determined.
+ * @param path Path on the device, used by get_mountpoint(), may be NULL.
+ * @param trash_dir Base directory for $topdir.
+ * @param trash_info_dir Directory where .trashinfo files are stored.
+ * @param trash_files_dir Directory where trashed files are stored.
  * @return 0 when successful, negative otherwise.
  */
-static int generate_filenames(const char *original_name, const char *trash_info_dir, const char *trash_files_dir, const struct tm *timeinfo, 
-								unsigned int counter, unsigned char enforce_random_name, char **trash_info_file, char **trashed_file)
+static int get_top_trash_dir(struct mount_table *mounts, unsigned char case_num, dev_t device, const char *path, char **trash_dir, char **trash_info_dir, char **trash_files_dir)
 {
 	int status = -1;
-	long chars_left = 0;
-	char timestamp_name[15];
-	char *counter_str = NULL;
-	char *filename = NULL;
-	*trash_info_file = NULL;
-	*trashed_file = NULL;
-
-	strftime(timestamp_name, sizeof(timestamp_name), "%Y%m%d%H%M%S", timeinfo);
+	char *mount_dir = NULL;
+	*trash_dir = NULL;
+	*trash_info_dir = NULL;
+	*trash_files_dir = NULL;
 
-	if (asprintf(&counter_str, "%x", counter) < 0) { goto error_0; }
+	STATS_START(mountpoint_start)
+	int mountpoint_status = get_mountpoint(mounts, device, path, &mount_dir);
+	STATS_STOP(TRASHCAN_PHASE_MOUNTPOINT, mountpoint_start)
+	if (mountpoint_status) { goto error_0; }
 
-	/* Check the maximum allowed filename length to ensure that the deleted file can be renamed. */
-	errno = 0;
-	long name_max = pathconf(trash_files_dir, _PC_NAME_MAX);
-	if (name_max == -1)
-	{
-		if (errno != 0)
-		{
-			goto error_1;
-		}
-		/* If errno is zero, then there is no limit set for _PC_NAME_MAX */
-	}
-	else 
-	{
-		/* Check if intended filename would exceed the filename length limit of the filesystem. At least 14 bytes without terminating
-		 * null are guaranteed by POSIX (see _POSIX_NAME_MAX). */
-		chars_left = name_max - (long)(strlen(timestamp_name) + strlen(original_name) + strlen(counter_str) + strlen(".trashinfo"));
-	}
+	uid_t uid = getuid();
 
-	if (chars_left > 0 && !enforce_random_name)
-	{
-		/* Filenames for ".trashinfo" file and file or directory moved to the trash bin */
-		if (asprintf(trash_info_file, "%s/%s%s%s%s", trash_info_dir, original_name, timestamp_name, counter_str, ".trashinfo") < 0) { HANDLE_ERROR(*trash_info_file, NULL, error_m1) }
-		if (asprintf(trashed_file, "%s/%s%s%s", trash_files_dir, original_name, timestamp_name, counter_str) < 0) { HANDLE_ERROR(*trashed_file, NULL, error_m1) }
-	}
-	else
+	switch (case_num)
 	{
-		/* Generate a random filename within limits. This approach is used to handle small filename limits and name collisions during deletion gracefully. */
-		size_t filename_length = (size_t)name_max - strlen(".trashinfo"); /* Length without terminating '\0' */
-		if (generate_random_filename(&filename, filename_length) < 0) { HANDLE_ERROR(filename, NULL, error_1) }
-		if (asprintf(trash_info_file, "%s/%s%s", trash_info_dir, filename, ".trashinfo") < 0) { HANDLE_ERROR(*trash_info_file, NULL, error_m1) }
-		if (asprintf(trashed_file, "%s/%s", trash_files_dir, filename) < 0) { HANDLE_ERROR(*trashed_file, NULL, error_m1) }
+		case 1:
+			if (asprintf(trash_dir, "%s%s%ju", mount_dir, "/.Trash/", (uintmax_t)uid) < 0) { HANDLE_ERROR(*trash_dir, NULL, error_m1) }
+			break;
+		case 2:
+			if (asprintf(trash_dir, "%s%s%ju", mount_dir, "/.Trash-", (uintmax_t)uid) < 0) { HANDLE_ERROR(*trash_dir, NULL, error_m1) }
+			break;
+		default:
+			goto error_m1;
 	}
+	if (asprintf(trash_info_dir, "%s%s", *trash_dir, "/info") < 0) { HANDLE_ERROR(*trash_info_dir, NULL, error_m1) }
+	if (asprintf(trash_files_dir, "%s%s", *trash_dir, "/files") < 0) { HANDLE_ERROR(*trash_files_dir, NULL, error_m1) }
 
 	status = 0;
+	free(mount_dir);
 
-error_1:
-	free(filename);
-	free(counter_str);
 error_0:
 	return status;
 error_m1:
-	free(filename);
-	free(counter_str);
-	free(*trash_info_file);
-	free(*trashed_file);
-	*trash_info_file = NULL;
-	*trashed_file = NULL;
+	free(mount_dir);
+	free(*trash_dir);
+	free(*trash_info_dir);
+	free(*trash_files_dir);
+	*trash_dir = NULL;
+	*trash_info_dir = NULL;
+	*trash_files_dir = NULL;
 	return status;
 }
 
 /**
- * @brief Calculate the size of a directory and its contained files.
+ * @brief Create directories recursively.
  *
- * @param dir Directory for which the size shall be calculated.
- * @param dir_size Address where the result shall be stored.
+ * @param path Path to create recursively.
+ * @param mode File permission mode to use when creating the directories.
  * @return 0 when successful, negative otherwise.
  */
-static int get_dir_size(const char *base_dir, uint64_t *dir_size)
+static int mkdir_recursive(const char *path, mode_t mode)
 {
 	int status = -1;
-	struct dirent *directory_entry;
-	struct stat file_stat;
-	char *current_entry = NULL;
-
-	DIR *directory = opendir(base_dir);
-	if (directory == NULL) { goto error_0; }
+	char current_path[PATH_MAX];
+	char *current_pos = NULL;
 
-	while ((directory_entry = readdir(directory)) != NULL)
+	if (path == NULL || *path == '\0')
 	{
-		if ((strcmp(directory_entry->d_name, ".") == 0) || (strcmp(directory_entry->d_name, "..") == 0))
-		{
-			continue;
-		}
+		goto error_0;
+	}
 
-		if (asprintf(&current_entry, "%s/%s", base_dir, directory_entry->d_name) < 0) { HANDLE_ERROR(current_entry, NULL, error_1) }
+	/* Copy string, since we don't want to modify the original. Longer paths can't be created anyway. */
+	size_t path_len = strlen(path);
+	if (path_len >= sizeof(current_path))
+	{
+		errno = ENAMETOOLONG;
+		goto error_0;
+	}
+	memcpy(current_path, path, path_len + 1);
 
-		if (lstat(current_entry, &file_stat)) { goto error_1; }
+	current_pos = current_path + 1; /* Start after root dir */
 
-		if (S_ISDIR(file_stat.st_mode))
-		{
-			if (get_dir_size(current_entry, dir_size) < 0) { goto error_1; }
-		}
-		else if (S_ISREG(file_stat.st_mode))
+	while (*current_pos != '\0')
+	{
+		if (*current_pos == '/')
 		{
-			*dir_size += (uint64_t)file_stat.st_size;
+			*current_pos = '\0'; /* Temporary truncation */
+
+			if (mkdir(current_path, mode) != 0)
+			{
+				if (errno != EEXIST) { goto error_0; }
+			}
+
+			*current_pos = '/';
 		}
+		current_pos++;
+	}
 
-		free(current_entry);
-		current_entry = NULL;
+	/* Create last dir with name between slash and zero termination */
+	if (mkdir(current_path, mode) != 0)
+	{
+		if (errno != EEXIST) { goto error_0; }
 	}
 
 	status = 0;
 
-error_1:
-	closedir(directory);
 error_0:
-	free(current_entry);
 	return status;
 }
 
 /**
- * @brief Create or update the directory size cache.
- *
- * For each directory in $trash/files calculate the size recursively and write
- * a line to a temporary file. After completion replace the old $trash/directorysizes
- * file.
- *
- * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ * @brief Create directories if the don't already exist.
+ *
+ * @param trash_dir Base directory for trash.
+ * @param trash_info_dir Directory where .trashinfo files are stored.
+ * @param trash_files_dir Directory where trashed files are stored.
+ * @param mode File permission mode to use when creating the directories.
+ * @return 0 when successful, negative otherwise.
+ */
+static int create_trash_dir(const char *trash_info_dir, const char *trash_files_dir, mode_t mode)
+{
+	int status = -1;
+	STATS_START(mkdir_start)
+
+	if (mkdir_recursive(trash_info_dir, mode) < 0) { goto error_0; }
+	if (mkdir_recursive(trash_files_dir, mode) < 0) { goto error_0; }
+
+	status = 0;
+
+error_0:
+	STATS_STOP(TRASHCAN_PHASE_MKDIR, mkdir_start)
+	return status;
+}
+
+/* Bitmap of the characters that escape_into() copies verbatim: the unreserved characters of RFC 2396
+ * and the reserved '/', which is a legal char in the path and therefore isn't escaped. Bit c of word
+ * c / 64 is set for each of them, bytes outside of 7-bit ASCII are always escaped. */
+static const uint64_t escape_verbatim[2] = { 0x03FFE78200000000u, 0x47FFFFFE87FFFFFEu };
+
+/* Upper case hexadecimal representation of every byte, the pair of byte b starts at 2 * b. */
+static const char hex_pairs[] =
+	"000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+	"202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+	"404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+	"606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+	"808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+	"A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+	"C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+	"E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/**
+ * @brief Check whether a character is copied verbatim by escape_into().
+ *
+ * This is meant to be used for URI escaping as defined in RFC 2396
+ * @see https://www.ietf.org/rfc/rfc2396.txt
+ *
+ * @param c Character that is checked.
+ * @return 1 when unreserved or '/', 0 otherwise.
+ */
+static int is_verbatim(char c)
+{
+	unsigned char byte = (unsigned char)c;
+	return byte < 128 && (escape_verbatim[byte >> 6] >> (byte & 63) & 1) != 0;
+}
+
+/**
+ * @brief Writes the escape sequence of a single byte, e.g. "%20" for a space.
+ *
+ * @param c Character that is escaped.
+ * @param out Buffer of at least 3 bytes.
+ */
+static void escape_byte(char c, char *out)
+{
+	out[0] = '%';
+	memcpy(out + 1, hex_pairs + 2 * (unsigned char)c, 2);
+}
+
+/**
+ * @brief Escapes a string of known length one byte at a time. Used as fallback and for the tails
+ * that are shorter than a vector.
+ *
+ * @param str String to be escaped.
+ * @param len Length of str.
+ * @param out Buffer of at least 3 * len + 1 bytes where the escaped string is stored.
+ * @return Length of the escaped string.
+ */
+static size_t escape_scalar(const char *str, size_t len, char *out)
+{
+	size_t idx = 0;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		if (is_verbatim(str[i]))
+		{
+			out[idx] = str[i];
+			idx++;
+		}
+		else
+		{
+			escape_byte(str[i], out + idx);
+			idx += 3;
+		}
+	}
+
+	out[idx] = '\0';
+	return idx;
+}
+
+#ifdef TRASHCAN_X86_SIMD
+/**
+ * @brief Escapes a chunk of a vector's width that contains at least one byte which needs escaping.
+ *
+ * The caller has already stored the whole chunk to out, so the run of verbatim bytes at its start is
+ * kept as is. The remaining bytes are expanded from hex_pairs based on the mask of the classification.
+ *
+ * @param str Chunk that is escaped.
+ * @param width Length of the chunk, at most 32.
+ * @param verbatim Bit i is set when str[i] is copied verbatim.
+ * @param out Buffer of at least 3 * width bytes, which starts with a copy of the chunk.
+ * @return Number of bytes written to out.
+ */
+static size_t escape_chunk(const char *str, size_t width, uint32_t verbatim, char *out)
+{
+	size_t idx = (size_t)__builtin_ctz(~verbatim);
+
+	for (size_t pos = idx; pos < width; pos++)
+	{
+		if ((verbatim >> pos & 1) != 0)
+		{
+			out[idx] = str[pos];
+			idx++;
+		}
+		else
+		{
+			escape_byte(str[pos], out + idx);
+			idx += 3;
+		}
+	}
+
+	return idx;
+}
+
+/**
+ * @brief Classifies 16 bytes, the bytes that are copied verbatim are set to 0xFF, the others to 0.
+ *
+ * SSE2 only has signed comparisons, which is sufficient since the bytes outside of 7-bit ASCII are
+ * negative and therefore never within one of the ranges.
+ *
+ * @param v Bytes that are classified.
+ * @return Mask of the verbatim bytes.
+ */
+static inline __m128i classify_sse2(__m128i v)
+{
+	/* Setting the bit 0x20 maps 'A'-'Z' onto 'a'-'z' and nothing else onto them. */
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i mask = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+
+	mask = _mm_or_si128(mask, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('-' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)))); /* "-./0-9" */
+	mask = _mm_or_si128(mask, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\'' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('*' + 1)))); /* "'()*" */
+	mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('!')));
+	mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+	return _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('~')));
+}
+
+/**
+ * @brief Escapes a string of known length 16 bytes at a time with SSE2.
+ *
+ * Every chunk is stored before the bytes that need escaping are expanded, which stays within the
+ * buffer, because it has room for three times the remaining input.
+ *
+ * @param str String to be escaped.
+ * @param len Length of str.
+ * @param out Buffer of at least 3 * len + 1 bytes where the escaped string is stored.
+ * @return Length of the escaped string.
+ */
+static size_t escape_sse2(const char *str, size_t len, char *out)
+{
+	size_t idx = 0;
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+		uint32_t verbatim = (uint32_t)_mm_movemask_epi8(classify_sse2(v));
+
+		_mm_storeu_si128((__m128i *)(out + idx), v);
+		idx += verbatim == 0xFFFFu ? 16 : escape_chunk(str + i, 16, verbatim, out + idx);
+	}
+
+	return idx + escape_scalar(str + i, len - i, out + idx);
+}
+
+/**
+ * @brief Classifies 32 bytes, see classify_sse2().
+ *
+ * @param v Bytes that are classified.
+ * @return Mask of the verbatim bytes.
+ */
+__attribute__((target("avx2")))
+static inline __m256i classify_avx2(__m256i v)
+{
+	__m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+	__m256i mask = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+
+	mask = _mm256_or_si256(mask, _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('-' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v)));
+	mask = _mm256_or_si256(mask, _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\'' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('*' + 1), v)));
+	mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('!')));
+	mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+	return _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('~')));
+}
+
+/**
+ * @brief Escapes a string of known length 32 bytes at a time with AVX2.
+ *
+ * @param str String to be escaped.
+ * @param len Length of str.
+ * @param out Buffer of at least 3 * len + 1 bytes where the escaped string is stored.
+ * @return Length of the escaped string.
+ */
+__attribute__((target("avx2")))
+static size_t escape_avx2(const char *str, size_t len, char *out)
+{
+	size_t idx = 0;
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(str + i));
+		uint32_t verbatim = (uint32_t)_mm256_movemask_epi8(classify_avx2(v));
+
+		_mm256_storeu_si256((__m256i *)(out + idx), v);
+		idx += verbatim == 0xFFFFFFFFu ? 32 : escape_chunk(str + i, 32, verbatim, out + idx);
+	}
+
+	return idx + escape_sse2(str + i, len - i, out + idx);
+}
+#endif
+
+/**
+ * @brief Escape a string using URI escaping RFC 2396 into a buffer.
+ *
+ * Implements URI escaping as defined in RFC 2396 except for the reserved '/' which is a legal char in
+ * the path and therefore isn't escaped. On x86 the string is processed 16 or 32 bytes at a time,
+ * depending on whether the CPU supports AVX2.
+ *
+ * @see https://www.ietf.org/rfc/rfc2396.txt
+ *
+ * @param str String to be escaped
+ * @param out Buffer of at least 3 * strlen(str) + 1 bytes where the escaped string is stored.
+ * @return Length of the escaped string.
+ */
+static size_t escape_into(const char *str, char *out)
+{
+	size_t len = strlen(str);
+
+#ifdef TRASHCAN_X86_SIMD
+	if (__builtin_cpu_supports("avx2")) { return escape_avx2(str, len, out); }
+	return escape_sse2(str, len, out);
+#else
+	return escape_scalar(str, len, out);
+#endif
+}
+
+/**
+ * @brief Escape a string using URI escaping RFC 2396
+ *
+ * @see https://www.ietf.org/rfc/rfc2396.txt
+ *
+ * @param str String to be escaped
+ * @param str_escaped Address where pointer to the escaped string is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+static int escape_path(const char *str, char **str_escaped)
+{
+	*str_escaped = malloc(strlen(str) * 3 + 1); /* Enough space if every char needs to be escaped. */
+	if (*str_escaped == NULL) { return -1; }
+
+	escape_into(str, *str_escaped);
+	return 0;
+}
+
+/**
+ * @brief Converts a hexadecimal digit to its value.
+ *
+ * @param c Character that is converted.
+ * @return Value between 0 and 15 when successful, negative otherwise.
+ */
+static int hex_value(char c)
+{
+	if ('0' <= c && c <= '9') { return c - '0'; }
+	if ('a' <= c && c <= 'f') { return c - 'a' + 10; }
+	if ('A' <= c && c <= 'F') { return c - 'A' + 10; }
+	return -1;
+}
+
+/**
+ * @brief Decodes the escape sequence at the start of a string. Invalid escape sequences are copied
+ * verbatim.
+ *
+ * @param str Escaped string starting with '%'.
+ * @param out Address where the decoded byte is stored.
+ * @return Number of bytes of str that were consumed.
+ */
+static size_t unescape_byte(const char *str, char *out)
+{
+	if (hex_value(str[1]) >= 0 && hex_value(str[2]) >= 0) /* Short-circuits before reading past '\0' */
+	{
+		*out = (char)(hex_value(str[1]) * 16 + hex_value(str[2]));
+		return 3;
+	}
+
+	*out = str[0];
+	return 1;
+}
+
+/**
+ * @brief Unescapes a string of known length one byte at a time. Used as fallback and for the tails
+ * that are shorter than a vector.
+ *
+ * @param str String to be unescaped.
+ * @param len Length of str.
+ * @param out Buffer of at least len + 1 bytes where the unescaped string is stored.
+ * @return Length of the unescaped string.
+ */
+static size_t unescape_scalar(const char *str, size_t len, char *out)
+{
+	size_t idx = 0;
+
+	for (size_t i = 0; i < len; idx++)
+	{
+		if (str[i] == '%')
+		{
+			i += unescape_byte(str + i, out + idx);
+		}
+		else
+		{
+			out[idx] = str[i];
+			i++;
+		}
+	}
+
+	out[idx] = '\0';
+	return idx;
+}
+
+#ifdef TRASHCAN_X86_SIMD
+/**
+ * @brief Unescapes a chunk of a vector's width that contains at least one '%'.
+ *
+ * The caller has already stored the whole chunk to out, so the run before the first '%' is kept as is.
+ * The last escape sequence may extend up to two bytes past the chunk.
+ *
+ * @param str Chunk that is unescaped.
+ * @param width Length of the chunk, at most 32.
+ * @param percent Bit i is set when str[i] is '%'.
+ * @param out Buffer of at least width bytes, which starts with a copy of the chunk.
+ * @param consumed Address where the number of bytes of str that were consumed is stored.
+ * @return Number of bytes written to out.
+ */
+static size_t unescape_chunk(const char *str, size_t width, uint32_t percent, char *out, size_t *consumed)
+{
+	size_t pos = (size_t)__builtin_ctz(percent);
+	size_t idx = pos;
+
+	for (; pos < width; idx++)
+	{
+		if ((percent >> pos & 1) != 0)
+		{
+			pos += unescape_byte(str + pos, out + idx);
+		}
+		else
+		{
+			out[idx] = str[pos];
+			pos++;
+		}
+	}
+
+	*consumed = pos;
+	return idx;
+}
+
+/**
+ * @brief Unescapes a string of known length 16 bytes at a time with SSE2.
+ *
+ * Every chunk is stored before it is checked for '%', the bytes after the first '%' are overwritten
+ * afterwards. This stays within the buffer, because out never gets ahead of str.
+ *
+ * @param str String to be unescaped.
+ * @param len Length of str.
+ * @param out Buffer of at least len + 1 bytes where the unescaped string is stored.
+ * @return Length of the unescaped string.
+ */
+static size_t unescape_sse2(const char *str, size_t len, char *out)
+{
+	size_t idx = 0;
+	size_t i = 0;
+
+	while (i + 16 <= len)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+		uint32_t percent = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('%')));
+
+		_mm_storeu_si128((__m128i *)(out + idx), v);
+		if (percent == 0)
+		{
+			i += 16;
+			idx += 16;
+			continue;
+		}
+
+		size_t consumed;
+		idx += unescape_chunk(str + i, 16, percent, out + idx, &consumed);
+		i += consumed;
+	}
+
+	return idx + unescape_scalar(str + i, len - i, out + idx);
+}
+
+/**
+ * @brief Unescapes a string of known length 32 bytes at a time with AVX2, see unescape_sse2().
+ *
+ * @param str String to be unescaped.
+ * @param len Length of str.
+ * @param out Buffer of at least len + 1 bytes where the unescaped string is stored.
+ * @return Length of the unescaped string.
+ */
+__attribute__((target("avx2")))
+static size_t unescape_avx2(const char *str, size_t len, char *out)
+{
+	size_t idx = 0;
+	size_t i = 0;
+
+	while (i + 32 <= len)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(str + i));
+		uint32_t percent = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')));
+
+		_mm256_storeu_si256((__m256i *)(out + idx), v);
+		if (percent == 0)
+		{
+			i += 32;
+			idx += 32;
+			continue;
+		}
+
+		size_t consumed;
+		idx += unescape_chunk(str + i, 32, percent, out + idx, &consumed);
+		i += consumed;
+	}
+
+	return idx + unescape_sse2(str + i, len - i, out + idx);
+}
+#endif
+
+/**
+ * @brief Unescape a string that uses URI escaping RFC 2396 into a buffer.
+ *
+ * This is the inverse of escape_path(). Invalid escape sequences are copied verbatim. On x86 the
+ * runs without '%' are copied 16 or 32 bytes at a time, depending on whether the CPU supports AVX2.
+ *
+ * @see https://www.ietf.org/rfc/rfc2396.txt
+ *
+ * @param str String to be unescaped
+ * @param out Buffer of at least strlen(str) + 1 bytes where the unescaped string is stored.
+ * @return Length of the unescaped string.
+ */
+static size_t unescape_into(const char *str, char *out)
+{
+	size_t len = strlen(str);
+
+#ifdef TRASHCAN_X86_SIMD
+	if (__builtin_cpu_supports("avx2")) { return unescape_avx2(str, len, out); }
+	return unescape_sse2(str, len, out);
+#else
+	return unescape_scalar(str, len, out);
+#endif
+}
+
+/**
+ * @brief Unescape a string that uses URI escaping RFC 2396
+ *
+ * @see https://www.ietf.org/rfc/rfc2396.txt
+ *
+ * @param str String to be unescaped
+ * @param str_unescaped Address where pointer to the unescaped string is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+static int unescape_path(const char *str, char **str_unescaped)
+{
+	*str_unescaped = malloc(strlen(str) + 1); /* Unescaping never increases the length. */
+	if (*str_unescaped == NULL) { return -1; }
+
+	unescape_into(str, *str_unescaped);
+	return 0;
+}
+
+/**
+ * @brief Formats the content of a .trashinfo file.
+ *
+ * The path is escaped directly into the content, which is allocated once with enough space for
+ * the worst case of every character being escaped.
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param arena Arena in which the content is allocated.
+ * @param original_filepath Path where the file was stored before deletion.
+ * @param timeinfo Time information about when the deletion occured.
+ * @param content Address to pointer where the content shall be stored.
+ * @param content_len Address where the length of the content is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+static int format_info_file(struct arena *arena, const char *original_filepath, const struct tm *timeinfo, char **content, size_t *content_len)
+{
+	static const char header[] = "[Trash Info]\nPath=";
+	static const char date_key[] = "\nDeletionDate=";
+	char timestamp[20];
+
+	size_t timestamp_len = strftime(timestamp, sizeof(timestamp), "%FT%T", timeinfo);
+	*content = arena_alloc(arena, sizeof(header) - 1 + strlen(original_filepath) * 3 + sizeof(date_key) - 1 + timestamp_len + 2);
+	if (*content == NULL) { return -1; }
+
+	size_t len = sizeof(header) - 1;
+	memcpy(*content, header, len);
+	len += escape_into(original_filepath, *content + len);
+	memcpy(*content + len, date_key, sizeof(date_key) - 1);
+	len += sizeof(date_key) - 1;
+	memcpy(*content + len, timestamp, timestamp_len);
+	len += timestamp_len;
+	(*content)[len] = '\n';
+	len++;
+	(*content)[len] = '\0';
+
+	*content_len = len;
+	return 0;
+}
+
+/**
+ * @brief Creates a .trashinfo file.
+ *
+ * The content is written with a single write() instead of through a FILE stream, which would
+ * allocate a buffer for every file.
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param arena Arena used for the content, which is released before returning.
+ * @param trashinfo_filepath Path to the trash info directory.
+ * @param original_filepath Path where the file was stored before deletion.
+ * @param timeinfo Time information about when the deletion occured.
+ * @param sync_data Flush the content to disk with fsync() before the file is closed.
+ * @return 0 when successful, 1 if the file exists already, negative otherwise.
+ */
+static int create_info_file(struct arena *arena, const char *trashinfo_filepath, const char *original_filepath, const struct tm *timeinfo, unsigned char sync_data)
+{
+	int status = -1;
+	struct arena_mark mark = arena_get_mark(arena);
+	char *trashinfo_file = NULL;
+	size_t trashinfo_len = 0;
+	size_t written = 0;
+
+	if (format_info_file(arena, original_filepath, timeinfo, &trashinfo_file, &trashinfo_len) < 0) { goto error_0; }
+
+	int fd = open(trashinfo_filepath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd < 0)
+	{
+		if (errno == EEXIST)
+		{
+			status = 1;
+		}
+		goto error_0;
+	}
+
+	while (written < trashinfo_len)
+	{
+		ssize_t ret = write(fd, trashinfo_file + written, trashinfo_len - written);
+		if (ret < 0 && errno == EINTR) { continue; }
+		if (ret <= 0) { goto error_1; }
+		written += (size_t)ret;
+	}
+
+	if (sync_data && fsync(fd) != 0) { goto error_1; }
+
+	status = 0;
+error_1:
+	if (close(fd) != 0) { status = -1; }
+	if (status != 0) { remove(trashinfo_filepath); } /* Don't leave an incomplete file behind. */
+error_0:
+	arena_release(arena, mark);
+	return status;
+}
+
+/**
+ * @brief Generates a random string of given length. The length has to be a multiple of two.
+ *
+ * @param filename Buffer of at least filename_length + 1 bytes where the filename is stored.
+ * @param filename_length Length of the filename to be generated (without zero termination).
+ * @param 0 when successful, negative otherwise.
+ */
+static int generate_random_filename(char *filename, size_t filename_length)
+{
+	static const char hex_digits[] = "0123456789ABCDEF";
+
+	/* Length has to be multiple of two, because 1 byte => 2 hex chars */
+	if (filename_length % 2 != 0) { return -1; }
+
+	/* The random bytes are stored in the second half and expanded to hex digits from the front. Byte i
+	 * is read from position num_bytes + i before the digits of byte i overwrite positions 2i and 2i + 1. */
+	size_t num_bytes = filename_length / 2;
+	unsigned char *buf = (unsigned char *)filename + num_bytes;
+#ifdef __linux__
+	if (getrandom(buf, num_bytes, GRND_RANDOM) < 0) { return -1; }
+#else
+	arc4random_buf(buf, num_bytes);
+#endif
+
+	for (size_t i = 0; i < num_bytes; i++)
+	{
+		unsigned char byte = buf[i];
+		filename[i*2] = hex_digits[byte >> 4];
+		filename[i*2+1] = hex_digits[byte & 0xF];
+	}
+	filename[filename_length] = '\0';
+
+	return 0;
+}
+
+/**
+ * @brief Determines the maximum filename length of a directory.
+ *
+ * @param dir Directory for which the limit is determined.
+ * @param name_max Address where the limit is stored. Negative if there is no limit.
+ * @return 0 when successful, negative otherwise.
+ */
+static int get_name_max(const char *dir, long *name_max)
+{
+	errno = 0;
+	*name_max = pathconf(dir, _PC_NAME_MAX);
+	if (*name_max == -1 && errno != 0)
+	{
+		return -1;
+	}
+	/* If errno is zero, then there is no limit set for _PC_NAME_MAX */
+
+	return 0;
+}
+
+/**
+ * @brief Determines the path and filename of the deleted file and its .trashinfo file.
+ *
+ * The generated name is related to the original name. If the limits for the filename allow,
+ * the new name is the original name, followed by the timestamp of deletion and a counter.
+ *
+ * Original path: /home/user/some/path/hello.txt
+ * New path     : /home/user/.local/share/Trash/files/hello.txt201904241508300
+ * Trashinfo    : /home/user/.local/share/Trash/files/hello.txt201904241508300.trashinfo
+ *
+ * The counter is intended to be used when name collision occur because two files with the same
+ * name have been deleted. The timestamp is used to avoid unnecessary retries when many files
+ * with the same name have been deleted. Instead of having to retry with many different counters,
+ * incrementing until a unique name is reached, we use the deletion time in the name. This greatly
+ * limits the chance of a name collision and results in fewer retries.
+ *
+ * If the approach above exceeds the limit for the filename, e.g. because the original filename
+ * already has the maximum allowed number of character, a random name within limits is generated.
+ * This approach is not described in the spec, since it does not allow to make a connection between
+ * the original name and the new name. However we believe this is good solution for this edge case,
+ * since otherwise filename truncation would be need, which may also make identifying the original
+ * filename difficult.
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param arena Arena in which the paths are allocated.
+ * @param original_name Original path before deletion.
+ * @param trash_info_dir Path to the trash info directory.
+ * @param trash_files_dir Path to the directory where deleted files shall be stored.
+ * @param name_max Maximum filename length in trash_files_dir as returned by get_name_max().
+ * @param timeinfo Time when file was deleted.
+ * @param counter Counter which should be incremented in case a name collision occurs.
+ * @param enforce_random_name Force use of a random name.
+ * @param trash_info_file Address to pointer where trash info file shall be stored.
+ * @param trashed_file Address to pointer where deleted file shall be stored.
+ * @return 0 when successful, negative otherwise.
+ */
+static int generate_filenames(struct arena *arena, const char *original_name, const char *trash_info_dir, const char *trash_files_dir, long name_max, const struct tm *timeinfo,
+								unsigned int counter, unsigned char enforce_random_name, char **trash_info_file, char **trashed_file)
+{
+	int status = -1;
+	struct arena_mark mark = arena_get_mark(arena);
+	long chars_left = 0;
+	char timestamp_name[15];
+	char counter_str[sizeof(counter) * 2 + 1];
+	char *filename = NULL;
+	*trash_info_file = NULL;
+	*trashed_file = NULL;
+
+	strftime(timestamp_name, sizeof(timestamp_name), "%Y%m%d%H%M%S", timeinfo);
+	snprintf(counter_str, sizeof(counter_str), "%x", counter);
+
+	if (name_max < 0)
+	{
+		/* There is no limit set for _PC_NAME_MAX */
+		chars_left = 1;
+		name_max = _POSIX_NAME_MAX + (long)strlen(".trashinfo"); /* Length used for random names */
+	}
+	else
+	{
+		/* Check if intended filename would exceed the filename length limit of the filesystem. At least 14 bytes without terminating
+		 * null are guaranteed by POSIX (see _POSIX_NAME_MAX). */
+		chars_left = name_max - (long)(strlen(timestamp_name) + strlen(original_name) + strlen(counter_str) + strlen(".trashinfo"));
+	}
+
+	if (chars_left > 0 && !enforce_random_name)
+	{
+		/* Filenames for ".trashinfo" file and file or directory moved to the trash bin */
+		*trash_info_file = arena_printf(arena, "%s/%s%s%s%s", trash_info_dir, original_name, timestamp_name, counter_str, ".trashinfo");
+		if (*trash_info_file == NULL) { goto error_m1; }
+		*trashed_file = arena_printf(arena, "%s/%s%s%s", trash_files_dir, original_name, timestamp_name, counter_str);
+		if (*trashed_file == NULL) { goto error_m1; }
+	}
+	else
+	{
+		/* Generate a random filename within limits. This approach is used to handle small filename limits and name collisions during deletion gracefully. */
+		size_t filename_length = ((size_t)name_max - strlen(".trashinfo")) & ~(size_t)1; /* Length without terminating '\0', has to be even */
+		filename = arena_alloc(arena, filename_length + 1);
+		if (filename == NULL || generate_random_filename(filename, filename_length) < 0) { goto error_m1; }
+		*trash_info_file = arena_printf(arena, "%s/%s%s", trash_info_dir, filename, ".trashinfo");
+		if (*trash_info_file == NULL) { goto error_m1; }
+		*trashed_file = arena_printf(arena, "%s/%s", trash_files_dir, filename);
+		if (*trashed_file == NULL) { goto error_m1; }
+	}
+
+	status = 0;
+	return status;
+
+error_m1:
+	arena_release(arena, mark);
+	*trash_info_file = NULL;
+	*trashed_file = NULL;
+	return status;
+}
+
+/**
+ * @brief Double-ended queue of tasks owned by a worker of a work pool.
+ *
+ * The owner pushes and pops at the back, so it works depth first. Other workers steal from the
+ * front, which holds the oldest and therefore usually the largest subtrees.
+ */
+struct task_deque
+{
+	pthread_mutex_t lock; /**< Protects the other members. */
+	void **tasks; /**< Ring buffer of tasks. */
+	size_t head; /**< Index of the front element. */
+	size_t count; /**< Number of tasks in the deque. */
+	size_t capacity; /**< Number of elements allocated for tasks. */
+};
+
+struct work_pool;
+
+/**
+ * @brief Worker of a work pool with its own task queue and accumulators.
+ */
+struct pool_worker
+{
+	struct work_pool *pool; /**< Pool the worker belongs to. */
+	size_t idx; /**< Index of the worker, 0 is the thread that runs the pool. */
+	pthread_t thread; /**< Thread of the worker, unused for index 0. */
+	struct task_deque deque; /**< Tasks of the worker. */
+	uint64_t bytes; /**< Per-thread accumulator for sizes, summed up by run_work_pool(). */
+	uint64_t inodes; /**< Per-thread accumulator for the number of files and directories. */
+	char *buf; /**< Scratch buffer for reading directories. */
+	char *names; /**< Scratch buffer for the names of subdirectories, separated by '\0'. */
+	size_t names_len; /**< Number of used bytes in names. */
+	size_t names_size; /**< Number of allocated bytes for names. */
+	int aux_fd; /**< Descriptor that the enter callback of a walk associates with the processed directory, negative if none. */
+#ifdef TRASHCAN_IO_URING
+	struct io_uring ring; /**< Ring for batched statx requests, only valid if ring_state is 1. */
+	int ring_state; /**< 0 if the ring hasn't been set up yet, 1 if it's ready, negative if it's not available. */
+	struct statx *statx_bufs; /**< Results of the batched statx requests. */
+	const char **statx_names; /**< Names of the entries in the batch, they point into buf. */
+	unsigned char *statx_types; /**< Types of the entries in the batch as reported by the filesystem. */
+	size_t num_statx; /**< Number of entries in the batch. */
+#endif
+};
+
+/**
+ * @brief Work-stealing thread pool that processes tasks which may create new tasks.
+ *
+ * Worker threads are only spawned when tasks are queued that no running worker can take, so small
+ * directory trees are processed by the calling thread alone.
+ */
+struct work_pool
+{
+	pthread_mutex_t lock; /**< Protects num_workers and idle, used with cond. */
+	pthread_cond_t cond; /**< Signaled when tasks are queued or all work is done. */
+	struct pool_worker *workers; /**< Preallocated workers. */
+	size_t max_workers; /**< Maximum number of workers including the calling thread. */
+	size_t num_workers; /**< Number of workers that have been started. */
+	size_t idle; /**< Number of workers waiting for tasks. */
+	atomic_size_t queued; /**< Number of tasks in the deques. */
+	atomic_size_t pending; /**< Number of tasks that are queued or being processed. */
+	atomic_int failed; /**< Set when a task failed, remaining tasks are discarded. */
+	int (*process)(struct pool_worker *worker, void *task); /**< Processes a task, returns negative on failure. */
+	void (*discard)(void *task); /**< Frees a task that isn't processed because of a failure. */
+	void *arg; /**< Argument for the callbacks. */
+};
+
+/**
+ * @brief Determines the default number of threads for work pools.
+ *
+ * @return Number of online processors, but at least 1 and at most 16.
+ */
+static size_t default_thread_count(void)
+{
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_cpus < 1) { return 1; }
+	if (num_cpus > 16) { return 16; }
+	return (size_t)num_cpus;
+}
+
+/**
+ * @brief Pushes a task to the back of a deque.
+ *
+ * @param deque Deque to which the task is added.
+ * @param task Task that is added.
+ * @return 0 when successful, negative otherwise.
+ */
+static int task_deque_push(struct task_deque *deque, void *task)
+{
+	int status = -1;
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->count == deque->capacity)
+	{
+		size_t capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+		void **tasks = malloc(capacity * sizeof(*tasks));
+		if (tasks == NULL) { goto error_0; }
+
+		for (size_t i = 0; i < deque->count; i++)
+		{
+			tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+		}
+
+		free(deque->tasks);
+		deque->tasks = tasks;
+		deque->head = 0;
+		deque->capacity = capacity;
+	}
+
+	deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+	deque->count++;
+	status = 0;
+
+error_0:
+	pthread_mutex_unlock(&deque->lock);
+	return status;
+}
+
+/**
+ * @brief Pops a task from the back (owner) or the front (thief) of a deque.
+ *
+ * @param deque Deque from which the task is taken.
+ * @param steal 1 to take the task from the front, 0 to take it from the back.
+ * @return The task or NULL if the deque is empty.
+ */
+static void *task_deque_pop(struct task_deque *deque, unsigned char steal)
+{
+	void *task = NULL;
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->count > 0)
+	{
+		if (steal)
+		{
+			task = deque->tasks[deque->head];
+			deque->head = (deque->head + 1) % deque->capacity;
+		}
+		else
+		{
+			task = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+		}
+		deque->count--;
+	}
+
+	pthread_mutex_unlock(&deque->lock);
+	return task;
+}
+
+static void *pool_worker_thread(void *arg);
+
+/**
+ * @brief Adds a task to the queue of a worker and wakes up or spawns another worker to take it.
+ *
+ * @param worker Worker that created the task.
+ * @param task Task that is added. Ownership is passed to the pool, even on failure.
+ * @return 0 when successful, negative otherwise.
+ */
+static int work_pool_push(struct pool_worker *worker, void *task)
+{
+	struct work_pool *pool = worker->pool;
+
+	atomic_fetch_add(&pool->pending, 1);
+	if (task_deque_push(&worker->deque, task) < 0)
+	{
+		pool->discard(task);
+		atomic_fetch_sub(&pool->pending, 1);
+		return -1;
+	}
+	size_t queued = atomic_fetch_add(&pool->queued, 1) + 1;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->idle > 0)
+	{
+		pthread_cond_signal(&pool->cond);
+	}
+	else if (queued > 1 && pool->num_workers < pool->max_workers)
+	{
+		/* The pushing worker takes one of the queued tasks itself, spawn a thread for the others. */
+		struct pool_worker *new_worker = &pool->workers[pool->num_workers];
+		if (pthread_create(&new_worker->thread, NULL, pool_worker_thread, new_worker) == 0)
+		{
+			pool->num_workers++;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/**
+ * @brief Takes a task from the own deque or steals one from another worker.
+ *
+ * @param worker Worker looking for a task.
+ * @return The task or NULL if no task is queued.
+ */
+static void *work_pool_take(struct pool_worker *worker)
+{
+	struct work_pool *pool = worker->pool;
+	void *task = task_deque_pop(&worker->deque, 0);
+
+	for (size_t i = 1; task == NULL && i < pool->max_workers; i++)
+	{
+		task = task_deque_pop(&pool->workers[(worker->idx + i) % pool->max_workers].deque, 1);
+	}
+
+	if (task != NULL) { atomic_fetch_sub(&pool->queued, 1); }
+
+	return task;
+}
+
+/**
+ * @brief Processes tasks until all tasks of the pool are done.
+ *
+ * @param worker Worker that processes the tasks.
+ */
+static void work_pool_loop(struct pool_worker *worker)
+{
+	struct work_pool *pool = worker->pool;
+
+	for (;;)
+	{
+		void *task = work_pool_take(worker);
+
+		if (task != NULL)
+		{
+			if (atomic_load(&pool->failed))
+			{
+				pool->discard(task);
+			}
+			else if (pool->process(worker, task) < 0)
+			{
+				atomic_store(&pool->failed, 1);
+			}
+
+			if (atomic_fetch_sub(&pool->pending, 1) == 1)
+			{
+				/* Last task is done, wake up everybody to terminate. */
+				pthread_mutex_lock(&pool->lock);
+				pthread_cond_broadcast(&pool->cond);
+				pthread_mutex_unlock(&pool->lock);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		if (atomic_load(&pool->pending) == 0)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		/* Tasks are counted as queued before the pushing worker takes the lock, so a task can't be missed here. */
+		if (atomic_load(&pool->queued) == 0)
+		{
+			pool->idle++;
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			pool->idle--;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/**
+ * @brief Entry point of spawned worker threads.
+ *
+ * @param arg The worker.
+ * @return NULL
+ */
+static void *pool_worker_thread(void *arg)
+{
+	work_pool_loop(arg);
+	return NULL;
+}
+
+/**
+ * @brief Processes a task and all tasks created by it with a work-stealing thread pool.
+ *
+ * The calling thread is the first worker. Up to threads - 1 additional threads are spawned on demand.
+ *
+ * @param threads Maximum number of threads, 0 for the default.
+ * @param process Callback that processes a task and may push new tasks with work_pool_push().
+ * @param discard Callback that frees a task that isn't processed.
+ * @param arg Argument for the callbacks, available as worker->pool->arg.
+ * @param task Initial task, ownership is passed to the pool.
+ * @param bytes Address to which the sum of the bytes accumulated by all workers is added, may be NULL.
+ * @param inodes Address to which the sum of the inodes accumulated by all workers is added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+static int run_work_pool(size_t threads, int (*process)(struct pool_worker *worker, void *task), void (*discard)(void *task), void *arg,
+							void *task, uint64_t *bytes, uint64_t *inodes)
+{
+	int status = -1;
+	struct work_pool pool;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.max_workers = threads == 0 ? default_thread_count() : threads;
+	pool.process = process;
+	pool.discard = discard;
+	pool.arg = arg;
+	atomic_init(&pool.queued, 0);
+	atomic_init(&pool.pending, 0);
+	atomic_init(&pool.failed, 0);
+
+	pool.workers = calloc(pool.max_workers, sizeof(*pool.workers));
+	if (pool.workers == NULL)
+	{
+		discard(task);
+		goto error_0;
+	}
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	for (size_t i = 0; i < pool.max_workers; i++)
+	{
+		pool.workers[i].pool = &pool;
+		pool.workers[i].idx = i;
+		pool.workers[i].aux_fd = -1;
+		pthread_mutex_init(&pool.workers[i].deque.lock, NULL);
+	}
+	pool.num_workers = 1;
+
+	if (work_pool_push(&pool.workers[0], task) == 0)
+	{
+		work_pool_loop(&pool.workers[0]);
+	}
+	else
+	{
+		atomic_store(&pool.failed, 1);
+	}
+
+	/* The spawned workers terminate as soon as no task is pending anymore. */
+	pthread_mutex_lock(&pool.lock);
+	size_t num_workers = pool.num_workers;
+	pthread_mutex_unlock(&pool.lock);
+
+	for (size_t i = 1; i < num_workers; i++)
+	{
+		pthread_join(pool.workers[i].thread, NULL);
+	}
+
+	for (size_t i = 0; i < pool.max_workers; i++)
+	{
+		if (bytes != NULL) { *bytes += pool.workers[i].bytes; }
+		if (inodes != NULL) { *inodes += pool.workers[i].inodes; }
+		free(pool.workers[i].deque.tasks);
+		free(pool.workers[i].names);
+		free(pool.workers[i].buf);
+#ifdef TRASHCAN_IO_URING
+		if (pool.workers[i].ring_state == 1) { io_uring_queue_exit(&pool.workers[i].ring); }
+		free(pool.workers[i].statx_bufs);
+		free(pool.workers[i].statx_names);
+		free(pool.workers[i].statx_types);
+#endif
+		pthread_mutex_destroy(&pool.workers[i].deque.lock);
+	}
+
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.workers);
+
+	if (!atomic_load(&pool.failed)) { status = 0; }
+
+error_0:
+	return status;
+}
+
+/**
+ * @brief Directory of a tree walk.
+ *
+ * Directories are opened relative to the file descriptor of their parent, so the kernel never has
+ * to resolve a full path. A directory stays alive as long as it is processed or one of its
+ * subdirectories is queued or processed, which is tracked by a reference count. Its file descriptor
+ * is kept open for that time, unless the walk exceeds its budget of file descriptors. Then it's closed
+ * early and subdirectories reopen it through the chain of parents.
+ */
+struct walk_dir
+{
+	struct walk_dir *parent; /**< Parent directory, NULL for the root of the walk. */
+	atomic_size_t refs; /**< One reference for processing the directory and one per queued or running subdirectory. */
+	int fd; /**< Open directory, negative if not opened yet or closed because of the budget. Immutable once the subdirectories are queued. */
+	void *data; /**< Data of the enter and leave callbacks, freed with free() if the walk fails. */
+	char name[]; /**< Name of the directory within its parent. */
+};
+
+/**
+ * @brief Iterative, file descriptor relative walk of a directory tree on a work pool.
+ */
+struct tree_walk
+{
+	int (*visit)(struct pool_worker *worker, int dirfd, const char *name, unsigned char d_type, const struct stat *entry_stat); /**< Called for every entry that isn't a directory. entry_stat is NULL unless the walker had to stat the entry. */
+	int (*enter)(struct pool_worker *worker, struct walk_dir *dir, int fd); /**< Called before the entries of a directory are visited, may be NULL. */
+	int (*leave)(struct pool_worker *worker, struct walk_dir *dir); /**< Called once a directory and all its subdirectories have been processed, may be NULL. */
+	void *data; /**< Data of the callbacks. */
+	size_t fd_budget; /**< Number of directory file descriptors that may be kept open. */
+	atomic_size_t open_fds; /**< Number of directory file descriptors that are currently kept open. */
+	unsigned char stat_files; /**< Regular files are stat'ed before they are visited, which allows to batch the requests. */
+};
+
+#ifdef __linux__
+/**
+ * @brief Directory entry as returned by the getdents64 system call.
+ */
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* Size of the buffer for getdents64, large enough for several hundred entries per system call. */
+#define WALK_DENTS_BUFFER_SIZE 65536
+
+#ifdef TRASHCAN_IO_URING
+/* Number of statx requests that are submitted together by a worker of a walk. */
+#define WALK_STATX_BATCH 64
+#endif
+#endif
+
+/**
+ * @brief Determines the number of directory file descriptors a walk may keep open.
+ *
+ * @return A quarter of the soft limit for open files, at least 16 and at most 1024.
+ */
+static size_t walk_fd_budget(void)
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) { return 1024; }
+	if (limit.rlim_cur / 4 < 16) { return 16; }
+	if (limit.rlim_cur / 4 > 1024) { return 1024; }
+	return (size_t)(limit.rlim_cur / 4);
+}
+
+/**
+ * @brief Drops a reference to a directory of a walk and frees it and its parents when they are done.
+ *
+ * The leave callback is called for every directory that is done, while its parent is still alive.
+ *
+ * @param worker Worker that drops the reference.
+ * @param dir Directory whose reference is dropped.
+ */
+static void walk_dir_release(struct pool_worker *worker, struct walk_dir *dir)
+{
+	struct tree_walk *walk = worker->pool->arg;
+
+	while (dir != NULL && atomic_fetch_sub(&dir->refs, 1) == 1)
+	{
+		struct walk_dir *parent = dir->parent;
+
+		if (walk->leave != NULL && walk->leave(worker, dir) < 0) { atomic_store(&worker->pool->failed, 1); }
+
+		if (dir->fd >= 0)
+		{
+			close(dir->fd);
+			atomic_fetch_sub(&walk->open_fds, 1);
+		}
+
+		free(dir->data);
+		free(dir);
+		dir = parent;
+	}
+}
+
+/**
+ * @brief Opens a directory of a walk whose file descriptor has been closed because of the budget.
+ *
+ * The directory is opened relative to its nearest ancestor that is still open. The root of the walk
+ * is always open.
+ *
+ * @param dir Directory that is opened.
+ * @return File descriptor that has to be closed by the caller, negative on failure.
+ */
+static int walk_dir_reopen(const struct walk_dir *dir)
+{
+	size_t depth = 0;
+	const struct walk_dir *ancestor = dir;
+
+	while (ancestor->fd < 0)
+	{
+		ancestor = ancestor->parent;
+		depth++;
+	}
+
+	const struct walk_dir **chain = malloc(depth * sizeof(*chain));
+	if (chain == NULL) { return -1; }
+
+	const struct walk_dir *current = dir;
+	for (size_t i = depth; i > 0; i--)
+	{
+		chain[i - 1] = current;
+		current = current->parent;
+	}
+
+	int fd = ancestor->fd;
+	for (size_t i = 0; i < depth; i++)
+	{
+		int next_fd = openat(fd, chain[i]->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd != ancestor->fd) { close(fd); }
+		fd = next_fd;
+		if (fd < 0) { break; }
+	}
+
+	free(chain);
+	return fd;
+}
+
+/**
+ * @brief Frees a directory of a walk that isn't processed because the walk failed.
+ *
+ * @param task The directory.
+ */
+static void walk_dir_discard(void *task)
+{
+	struct walk_dir *dir = task;
+
+	/* The count of open descriptors doesn't matter anymore once the walk failed. */
+	while (dir != NULL && atomic_fetch_sub(&dir->refs, 1) == 1)
+	{
+		struct walk_dir *parent = dir->parent;
+		if (dir->fd >= 0) { close(dir->fd); }
+		free(dir->data);
+		free(dir);
+		dir = parent;
+	}
+}
+
+/**
+ * @brief Collects a subdirectory in the scratch buffer of the worker.
+ *
+ * @param worker Worker that processes the directory.
+ * @param name Name of the subdirectory.
+ * @return 0 when successful, negative otherwise.
+ */
+static int walk_add_subdir(struct pool_worker *worker, const char *name)
+{
+	size_t name_len = strlen(name) + 1;
+	if (worker->names_len + name_len > worker->names_size)
+	{
+		size_t names_size = worker->names_size == 0 ? 4096 : worker->names_size * 2;
+		while (names_size < worker->names_len + name_len) { names_size *= 2; }
+		char *names = realloc(worker->names, names_size);
+		if (names == NULL) { return -1; }
+		worker->names = names;
+		worker->names_size = names_size;
+	}
+
+	memcpy(worker->names + worker->names_len, name, name_len);
+	worker->names_len += name_len;
+
+	return 0;
+}
+
+#ifdef TRASHCAN_IO_URING
+/**
+ * @brief Converts the result of statx to a struct stat.
+ */
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = (ino_t)stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_size = (off_t)stx->stx_size;
+	st->st_blksize = (blksize_t)stx->stx_blksize;
+	st->st_blocks = (blkcnt_t)stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/**
+ * @brief Sets up the ring of a worker for batched statx requests.
+ *
+ * If io_uring isn't available, e.g. because the kernel is too old or it's disabled, the worker
+ * falls back to fstatat.
+ *
+ * @param worker Worker of a walk.
+ */
+static void walk_setup_ring(struct pool_worker *worker)
+{
+	worker->ring_state = -1;
+
+	worker->statx_bufs = malloc(WALK_STATX_BATCH * sizeof(*worker->statx_bufs));
+	worker->statx_names = malloc(WALK_STATX_BATCH * sizeof(*worker->statx_names));
+	worker->statx_types = malloc(WALK_STATX_BATCH * sizeof(*worker->statx_types));
+	if (worker->statx_bufs == NULL || worker->statx_names == NULL || worker->statx_types == NULL) { return; }
+
+	if (io_uring_queue_init(WALK_STATX_BATCH, &worker->ring, 0) < 0) { return; }
+
+	worker->ring_state = 1;
+}
+
+/**
+ * @brief Submits the batched statx requests of a worker and handles the entries.
+ *
+ * The names point into the buffer of getdents64, so the batch has to be flushed before the
+ * buffer is reused. Entries are handled in the order in which they were queued.
+ * If the ring fails, it is torn down and the batch is stat'ed with fstatat() like without io_uring.
+ *
+ * @param worker Worker that processes the directory.
+ * @param fd Directory that contains the entries.
+ * @return 0 when successful, negative otherwise.
+ */
+static int walk_flush_statx(struct pool_worker *worker, int fd)
+{
+	struct tree_walk *walk = worker->pool->arg;
+	int results[WALK_STATX_BATCH];
+	int status = 0;
+	size_t num = worker->num_statx;
+	worker->num_statx = 0;
+
+	if (num == 0) { return 0; }
+
+	for (size_t i = 0; i < num; i++)
+	{
+		/* The ring has as many entries as the batch, so there is always a free entry. */
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&worker->ring);
+		io_uring_prep_statx(sqe, fd, worker->statx_names[i], AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &worker->statx_bufs[i]);
+		io_uring_sqe_set_data64(sqe, i);
+		results[i] = -ECANCELED;
+	}
+
+	int ring_status = io_uring_submit_and_wait(&worker->ring, (unsigned)num) < 0 ? -1 : 0;
+
+	/* All completions are reaped, even after an error, so that the ring can be reused. */
+	for (size_t seen = 0; seen < num && ring_status == 0; seen++)
+	{
+		struct io_uring_cqe *cqe = NULL;
+		if (io_uring_wait_cqe(&worker->ring, &cqe) < 0)
+		{
+			ring_status = -1;
+			break;
+		}
+		results[io_uring_cqe_get_data64(cqe)] = cqe->res;
+		io_uring_cqe_seen(&worker->ring, cqe);
+	}
+
+	if (ring_status < 0)
+	{
+		/* The state of the ring is unknown, don't use it again and stat the batch with fstatat() instead. */
+		worker->ring_state = -1;
+		io_uring_queue_exit(&worker->ring);
+	}
+
+	for (size_t i = 0; i < num && status == 0; i++)
+	{
+		struct stat entry_stat;
+		if (ring_status < 0)
+		{
+			if (fstatat(fd, worker->statx_names[i], &entry_stat, AT_SYMLINK_NOFOLLOW) != 0)
+			{
+				status = -1;
+				break;
+			}
+		}
+		else if (results[i] < 0)
+		{
+			status = -1;
+			break;
+		}
+		else
+		{
+			statx_to_stat(&worker->statx_bufs[i], &entry_stat);
+		}
+
+		unsigned char d_type = worker->statx_types[i] == DT_UNKNOWN ? IFTODT(entry_stat.st_mode) : worker->statx_types[i];
+
+		if (d_type == DT_DIR) { status = walk_add_subdir(worker, worker->statx_names[i]); }
+		else { status = walk->visit(worker, fd, worker->statx_names[i], d_type, &entry_stat); }
+	}
+
+	return status;
+}
+
+/**
+ * @brief Queues a statx request for an entry, the entry is handled when the batch is flushed.
+ *
+ * @param worker Worker that processes the directory.
+ * @param fd Directory that contains the entry.
+ * @param name Name of the entry.
+ * @param d_type Type of the entry as reported by the filesystem.
+ * @return 0 when successful, negative otherwise.
+ */
+static int walk_queue_statx(struct pool_worker *worker, int fd, const char *name, unsigned char d_type)
+{
+	worker->statx_names[worker->num_statx] = name;
+	worker->statx_types[worker->num_statx] = d_type;
+	worker->num_statx++;
+
+	return worker->num_statx == WALK_STATX_BATCH ? walk_flush_statx(worker, fd) : 0;
+}
+#endif
+
+/**
+ * @brief Handles one entry of a directory that is walked.
+ *
+ * Subdirectories are collected in the scratch buffer of the worker, all other entries are passed to
+ * the visit callback. The entry is only stat'ed if the filesystem doesn't report its type or the walk
+ * requests it. With io_uring the stat requests are batched and the entry is handled later.
+ *
+ * @param worker Worker that processes the directory.
+ * @param fd Directory that contains the entry.
+ * @param name Name of the entry.
+ * @param d_type Type of the entry as reported by the filesystem.
+ * @return 0 when successful, negative otherwise.
+ */
+static int walk_entry(struct pool_worker *worker, int fd, const char *name, unsigned char d_type)
+{
+	struct tree_walk *walk = worker->pool->arg;
+	struct stat entry_stat;
+	const struct stat *entry_stat_ptr = NULL;
+
+	if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) { return 0; }
+
+#ifdef TRASHCAN_IO_URING
+	if (worker->ring_state == 1 && (d_type == DT_UNKNOWN || (d_type == DT_REG && walk->stat_files)))
+	{
+		return walk_queue_statx(worker, fd, name, d_type);
+	}
+#endif
+
+	if (d_type == DT_UNKNOWN || (d_type == DT_REG && walk->stat_files))
+	{
+		if (fstatat(fd, name, &entry_stat, AT_SYMLINK_NOFOLLOW) != 0) { return -1; }
+		entry_stat_ptr = &entry_stat;
+		d_type = IFTODT(entry_stat.st_mode);
+	}
+
+	if (d_type != DT_DIR)
+	{
+		return walk->visit(worker, fd, name, d_type, entry_stat_ptr);
+	}
+
+	return walk_add_subdir(worker, name);
+}
+
+/**
+ * @brief Processes one directory of a tree walk.
+ *
+ * The directory is opened relative to its parent and read with large buffers. Afterwards its
+ * subdirectories are queued as new tasks of the work pool.
+ *
+ * @param worker Worker that processes the directory.
+ * @param task The directory, its reference is dropped.
+ * @return 0 when successful, negative otherwise.
+ */
+static int walk_dir_task(struct pool_worker *worker, void *task)
+{
+	int status = -1;
+	struct tree_walk *walk = worker->pool->arg;
+	struct walk_dir *dir = task;
+	int fd = dir->fd;
+
+	if (fd < 0)
+	{
+		int parent_fd = dir->parent->fd >= 0 ? dir->parent->fd : walk_dir_reopen(dir->parent);
+		if (parent_fd < 0) { goto error_0; }
+		fd = openat(parent_fd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (parent_fd != dir->parent->fd) { close(parent_fd); }
+		if (fd < 0) { goto error_0; }
+	}
+
+	worker->names_len = 0;
+
+	if (walk->enter != NULL && walk->enter(worker, dir, fd) < 0) { goto error_1; }
+
+#ifdef __linux__
+	if (worker->buf == NULL)
+	{
+		worker->buf = malloc(WALK_DENTS_BUFFER_SIZE);
+		if (worker->buf == NULL) { goto error_1; }
+	}
+
+#ifdef TRASHCAN_IO_URING
+	if (worker->ring_state == 0 && walk->stat_files) { walk_setup_ring(worker); }
+#endif
+
+	for (;;)
+	{
+		long num_read = syscall(SYS_getdents64, fd, worker->buf, WALK_DENTS_BUFFER_SIZE);
+		if (num_read < 0) { goto error_1; }
+		if (num_read == 0) { break; }
+
+		for (long offset = 0; offset < num_read;)
+		{
+			struct linux_dirent64 *entry = (struct linux_dirent64 *)(worker->buf + offset);
+			if (walk_entry(worker, fd, entry->d_name, entry->d_type) < 0) { goto error_1; }
+			offset += entry->d_reclen;
+		}
+
+#ifdef TRASHCAN_IO_URING
+		/* The names of the batch point into the buffer, which is overwritten by the next read. */
+		if (walk_flush_statx(worker, fd) < 0) { goto error_1; }
+#endif
+	}
+#else
+	int dup_fd = dup(fd);
+	if (dup_fd < 0) { goto error_1; }
+	DIR *directory = fdopendir(dup_fd);
+	if (directory == NULL)
+	{
+		close(dup_fd);
+		goto error_1;
+	}
+
+	struct dirent *directory_entry;
+	while ((directory_entry = readdir(directory)) != NULL)
+	{
+		if (walk_entry(worker, fd, directory_entry->d_name, directory_entry->d_type) < 0)
+		{
+			closedir(directory);
+			goto error_1;
+		}
+	}
+	closedir(directory);
+#endif
+
+	/* Keep the directory open for its subdirectories, unless too many directories are open already. The
+	 * descriptor has to be settled before the first subdirectory is queued, since other workers use it.
+	 * The root always stays open, because closed directories are reopened relative to it. */
+	if (dir->parent != NULL)
+	{
+		if (worker->names_len > 0 && atomic_fetch_add(&walk->open_fds, 1) < walk->fd_budget)
+		{
+			dir->fd = fd;
+		}
+		else
+		{
+			if (worker->names_len > 0) { atomic_fetch_sub(&walk->open_fds, 1); }
+			close(fd);
+		}
+	}
+	fd = -1;
+
+	for (size_t offset = 0; offset < worker->names_len;)
+	{
+		const char *name = worker->names + offset;
+		size_t name_len = strlen(name) + 1;
+		offset += name_len;
+
+		struct walk_dir *subdir = malloc(sizeof(*subdir) + name_len);
+		if (subdir == NULL) { goto error_1; }
+		subdir->parent = dir;
+		subdir->fd = -1;
+		subdir->data = NULL;
+		atomic_init(&subdir->refs, 1);
+		memcpy(subdir->name, name, name_len);
+
+		atomic_fetch_add(&dir->refs, 1);
+		if (work_pool_push(worker, subdir) < 0) { goto error_1; }
+	}
+
+	status = 0;
+
+error_1:
+	if (fd >= 0 && fd != dir->fd) { close(fd); } /* Not settled yet */
+	if (worker->aux_fd >= 0)
+	{
+		close(worker->aux_fd);
+		worker->aux_fd = -1;
+	}
+error_0:
+	walk_dir_release(worker, dir);
+	return status;
+}
+
+/**
+ * @brief Runs a prepared tree walk in parallel.
+ *
+ * The callbacks, data and stat_files of walk have to be set, the remaining members are initialized here.
+ *
+ * @param walk The tree walk.
+ * @param dirfd Directory relative to which path is resolved, or AT_FDCWD.
+ * @param path Root directory of the walk.
+ * @param threads Maximum number of threads, 0 for the default.
+ * @param bytes Address to which the bytes accumulated by the workers are added, may be NULL.
+ * @param inodes Address to which the inodes accumulated by the workers are added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+static int run_tree_walk(struct tree_walk *walk, int dirfd, const char *path, size_t threads, uint64_t *bytes, uint64_t *inodes)
+{
+	walk->fd_budget = walk_fd_budget();
+	atomic_init(&walk->open_fds, 1); /* The root */
+
+	struct walk_dir *root = malloc(sizeof(*root) + 1);
+	if (root == NULL) { return -1; }
+	root->parent = NULL;
+	root->data = NULL;
+	root->name[0] = '\0';
+	atomic_init(&root->refs, 1);
+
+	root->fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (root->fd < 0)
+	{
+		free(root);
+		return -1;
+	}
+
+	return run_work_pool(threads, walk_dir_task, walk_dir_discard, walk, root, bytes, inodes);
+}
+
+/**
+ * @brief Walks a directory tree in parallel, calling visit for every entry that isn't a directory.
+ *
+ * @param dirfd Directory relative to which path is resolved, or AT_FDCWD.
+ * @param path Root directory of the walk.
+ * @param threads Maximum number of threads, 0 for the default.
+ * @param stat_files Stat regular files before they are visited, so that entry_stat is never NULL for them.
+ * @param visit Callback for every entry that isn't a directory.
+ * @param bytes Address to which the bytes accumulated by the workers are added, may be NULL.
+ * @param inodes Address to which the inodes accumulated by the workers are added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+static int walk_tree(int dirfd, const char *path, size_t threads, unsigned char stat_files,
+						int (*visit)(struct pool_worker *worker, int dirfd, const char *name, unsigned char d_type, const struct stat *entry_stat),
+						uint64_t *bytes, uint64_t *inodes)
+{
+	struct tree_walk walk;
+	walk.visit = visit;
+	walk.enter = NULL;
+	walk.leave = NULL;
+	walk.data = NULL;
+	walk.stat_files = stat_files;
+
+	return run_tree_walk(&walk, dirfd, path, threads, bytes, inodes);
+}
+
+/**
+ * @brief Adds the size of regular files to the accumulator of the worker.
+ *
+ * @param worker Worker that walks the directory.
+ * @param dirfd Directory that contains the entry.
+ * @param name Name of the entry.
+ * @param d_type Type of the entry.
+ * @param entry_stat Result of fstatat() for the entry if it's already known, otherwise NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+static int size_entry(struct pool_worker *worker, int dirfd, const char *name, unsigned char d_type, const struct stat *entry_stat)
+{
+	struct stat file_stat;
+
+	/* Symbolic links, devices, sockets, etc. don't count. */
+	if (d_type != DT_REG) { return 0; }
+
+	if (entry_stat == NULL)
+	{
+		if (fstatat(dirfd, name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) { return -1; }
+		entry_stat = &file_stat;
+	}
+
+	if (S_ISREG(entry_stat->st_mode))
+	{
+		worker->bytes += (uint64_t)entry_stat->st_size;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Calculate the size of a directory and its contained files.
+ *
+ * The directory tree is walked relative to directory file descriptors and subdirectories are sized
+ * in parallel by a work-stealing thread pool.
+ *
+ * @param base_dir Directory for which the size shall be calculated.
+ * @param threads Maximum number of threads, 0 for the default.
+ * @param dir_size Address where the result shall be stored.
+ * @return 0 when successful, negative otherwise.
+ */
+static int get_dir_size(const char *base_dir, size_t threads, uint64_t *dir_size)
+{
+	*dir_size = 0;
+	return walk_tree(AT_FDCWD, base_dir, threads, 1, size_entry, dir_size, NULL);
+}
+
+/**
+ * @brief Opens the counterpart of a directory of a walk below another root directory.
+ *
+ * The path of dir relative to the root of the walk is resolved relative to root_fd. Paths
+ * that don't fit into PATH_MAX are opened component by component.
+ *
+ * @param root_fd Directory that corresponds to the root of the walk.
+ * @param dir Directory of the walk.
+ * @return File descriptor that has to be closed by the caller, negative on failure.
+ */
+static int open_walk_path(int root_fd, const struct walk_dir *dir)
+{
+	char path[PATH_MAX];
+	size_t len = 0;
+	size_t depth = 0;
+
+	if (dir->parent == NULL) { return fcntl(root_fd, F_DUPFD_CLOEXEC, 0); }
+
+	for (const struct walk_dir *current = dir; current->parent != NULL; current = current->parent)
+	{
+		len += strlen(current->name) + 1;
+		depth++;
+	}
+
+	if (len > 0 && len <= sizeof(path))
+	{
+		size_t offset = len - 1;
+		path[offset] = '\0';
+
+		for (const struct walk_dir *current = dir; current->parent != NULL; current = current->parent)
+		{
+			size_t name_len = strlen(current->name);
+			offset -= name_len;
+			memcpy(path + offset, current->name, name_len);
+			if (offset > 0) { path[--offset] = '/'; }
+		}
+
+		return openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	}
+
+	const struct walk_dir **chain = malloc(depth * sizeof(*chain));
+	if (chain == NULL) { return -1; }
+
+	const struct walk_dir *current = dir;
+	for (size_t i = depth; i > 0; i--)
+	{
+		chain[i - 1] = current;
+		current = current->parent;
+	}
+
+	int fd = root_fd;
+	for (size_t i = 0; i < depth; i++)
+	{
+		int next_fd = openat(fd, chain[i]->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd != root_fd) { close(fd); }
+		fd = next_fd;
+		if (fd < 0) { break; }
+	}
+
+	free(chain);
+	return fd;
+}
+
+#ifdef __linux__
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
+/* Number of bytes copied per system call. Large chunks let the kernel copy without returning to user space. */
+#define COPY_CHUNK_SIZE ((size_t)1 << 30)
+
+/* Size of the buffer for copies with read() and write(). */
+#define COPY_BUFFER_SIZE 65536
+
+/**
+ * @brief Copies the content of a regular file.
+ *
+ * On Linux the data is shared with a reflink if the filesystem supports it. Otherwise it's copied
+ * within the kernel with copy_file_range() or sendfile(). Each method continues at the current file
+ * offsets where the previous one gave up, so read() and write() are only used for the remainder.
+ *
+ * @param src_fd File that is copied, positioned at its start.
+ * @param dst_fd Empty file that receives the data.
+ * @return 0 when successful, negative otherwise.
+ */
+static int copy_file_data(int src_fd, int dst_fd)
+{
+#ifdef __linux__
+	if (ioctl(dst_fd, FICLONE, src_fd) == 0) { return 0; }
+
+	ssize_t copied;
+	while ((copied = copy_file_range(src_fd, NULL, dst_fd, NULL, COPY_CHUNK_SIZE, 0)) != 0)
+	{
+		if (copied > 0) { continue; }
+		if (errno == EINTR) { continue; }
+		if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF && errno != EPERM) { return -1; }
+		break;
+	}
+	if (copied == 0) { return 0; }
+
+	while ((copied = sendfile(dst_fd, src_fd, NULL, COPY_CHUNK_SIZE)) != 0)
+	{
+		if (copied > 0) { continue; }
+		if (errno == EINTR) { continue; }
+		if (errno != EINVAL && errno != ENOSYS) { return -1; }
+		break;
+	}
+	if (copied == 0) { return 0; }
+#endif
+
+	char buf[COPY_BUFFER_SIZE];
+	ssize_t num_read;
+	while ((num_read = read(src_fd, buf, sizeof(buf))) != 0)
+	{
+		if (num_read < 0)
+		{
+			if (errno == EINTR) { continue; }
+			return -1;
+		}
+
+		for (ssize_t written = 0; written < num_read;)
+		{
+			ssize_t num_written = write(dst_fd, buf + written, (size_t)(num_read - written));
+			if (num_written < 0)
+			{
+				if (errno == EINTR) { continue; }
+				return -1;
+			}
+			written += num_written;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Copies an entry that isn't a directory, together with its permissions and timestamps.
+ *
+ * Regular files are copied with copy_file_data(), symbolic links are recreated with the same target
+ * and all other types are recreated with mknodat(). The owner isn't copied. Existing entries are
+ * never replaced.
+ *
+ * @param src_dirfd Directory that contains the entry, or AT_FDCWD.
+ * @param src_name Name of the entry.
+ * @param dst_dirfd Directory where the copy is created, or AT_FDCWD.
+ * @param dst_name Name of the copy.
+ * @param entry_stat Result of fstatat() for the entry.
+ * @return 0 when successful, negative otherwise.
+ */
+static int copy_entry(int src_dirfd, const char *src_name, int dst_dirfd, const char *dst_name, const struct stat *entry_stat)
+{
+	int status = -1;
+	const struct timespec times[2] = { entry_stat->st_atim, entry_stat->st_mtim };
+
+	if (S_ISREG(entry_stat->st_mode))
+	{
+		int src_fd = openat(src_dirfd, src_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (src_fd < 0) { goto error_0; }
+
+		int dst_fd = openat(dst_dirfd, dst_name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (dst_fd < 0)
+		{
+			close(src_fd);
+			goto error_0;
+		}
+
+		if (copy_file_data(src_fd, dst_fd) == 0 && fchmod(dst_fd, entry_stat->st_mode & 07777) == 0 && futimens(dst_fd, times) == 0)
+		{
+			status = 0;
+		}
+
+		close(src_fd);
+		if (close(dst_fd) != 0) { status = -1; }
+		return status;
+	}
+
+	if (S_ISLNK(entry_stat->st_mode))
+	{
+		/* Some filesystems report a size of 0 for symbolic links. */
+		size_t target_size = entry_stat->st_size > 0 ? (size_t)entry_stat->st_size + 1 : PATH_MAX;
+		char *target = malloc(target_size);
+		if (target == NULL) { goto error_0; }
+
+		ssize_t target_len = readlinkat(src_dirfd, src_name, target, target_size);
+		if (target_len < 0 || (size_t)target_len >= target_size)
+		{
+			free(target);
+			goto error_0;
+		}
+		target[target_len] = '\0';
+
+		int link_status = symlinkat(target, dst_dirfd, dst_name);
+		free(target);
+		if (link_status != 0) { goto error_0; }
+
+		/* Not all systems support timestamps of symbolic links, which isn't worth failing for. */
+		utimensat(dst_dirfd, dst_name, times, AT_SYMLINK_NOFOLLOW);
+		return 0;
+	}
+
+	if (mknodat(dst_dirfd, dst_name, entry_stat->st_mode, entry_stat->st_rdev) != 0) { goto error_0; }
+	if (fchmodat(dst_dirfd, dst_name, entry_stat->st_mode & 07777, 0) != 0) { goto error_0; }
+	if (utimensat(dst_dirfd, dst_name, times, AT_SYMLINK_NOFOLLOW) != 0) { goto error_0; }
+	status = 0;
+
+error_0:
+	return status;
+}
+
+/**
+ * @brief Creates the copy of a directory when a copy walk enters it.
+ *
+ * The copy is created with permissions for the owner only, so that it can be filled even if the
+ * original is read-only. The original permissions and timestamps are stored in dir->data and
+ * applied when the directory is left.
+ *
+ * @param worker Worker that processes the directory.
+ * @param dir Directory that is entered.
+ * @param fd Open source directory.
+ * @return 0 when successful, negative otherwise.
+ */
+static int copy_dir_enter(struct pool_worker *worker, struct walk_dir *dir, int fd)
+{
+	struct tree_walk *walk = worker->pool->arg;
+	int dst_root_fd = *(int *)walk->data;
+
+	struct stat *dir_stat = malloc(sizeof(*dir_stat));
+	if (dir_stat == NULL) { return -1; }
+	dir->data = dir_stat;
+	if (fstat(fd, dir_stat) != 0) { return -1; }
+
+	int parent_fd = open_walk_path(dst_root_fd, dir->parent != NULL ? dir->parent : dir);
+	if (parent_fd < 0) { return -1; }
+
+	if (dir->parent == NULL)
+	{
+		worker->aux_fd = parent_fd; /* The root has been created by the caller. */
+		return 0;
+	}
+
+	if (mkdirat(parent_fd, dir->name, S_IRWXU) == 0)
+	{
+		worker->aux_fd = openat(parent_fd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	}
+	close(parent_fd);
+
+	return worker->aux_fd < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Copies an entry that isn't a directory into the copy of its directory.
+ *
+ * @param worker Worker that processes the directory, its aux_fd is the copy of dirfd.
+ * @param dirfd Directory that contains the entry.
+ * @param name Name of the entry.
+ * @param d_type Type of the entry.
+ * @param entry_stat Result of fstatat() for the entry if it's already known, otherwise NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+static int copy_dir_visit(struct pool_worker *worker, int dirfd, const char *name, unsigned char d_type, const struct stat *entry_stat)
+{
+	struct stat file_stat;
+	(void)d_type;
+
+	if (entry_stat == NULL)
+	{
+		if (fstatat(dirfd, name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) { return -1; }
+		entry_stat = &file_stat;
+	}
+
+	return copy_entry(dirfd, name, worker->aux_fd, name, entry_stat);
+}
+
+/**
+ * @brief Applies the permissions and timestamps of the original to the copy of a directory.
+ *
+ * Called once the directory and all its subdirectories have been copied, since the timestamps
+ * change and the permissions may prevent modifications while it's filled.
+ *
+ * @param worker Worker that drops the last reference to the directory.
+ * @param dir Directory that is left.
+ * @return 0 when successful, negative otherwise.
+ */
+static int copy_dir_leave(struct pool_worker *worker, struct walk_dir *dir)
+{
+	struct tree_walk *walk = worker->pool->arg;
+	int dst_root_fd = *(int *)walk->data;
+	const struct stat *dir_stat = dir->data;
+
+	/* Keep partial copies writable, so that they can be removed. */
+	if (dir_stat == NULL || atomic_load(&worker->pool->failed)) { return 0; }
+
+	const struct timespec times[2] = { dir_stat->st_atim, dir_stat->st_mtim };
+
+	if (dir->parent == NULL)
+	{
+		if (fchmod(dst_root_fd, dir_stat->st_mode & 07777) != 0) { return -1; }
+		return futimens(dst_root_fd, times);
+	}
+
+	int parent_fd = open_walk_path(dst_root_fd, dir->parent);
+	if (parent_fd < 0) { return -1; }
+
+	int status = 0;
+	if (fchmodat(parent_fd, dir->name, dir_stat->st_mode & 07777, 0) != 0) { status = -1; }
+	else if (utimensat(parent_fd, dir->name, times, 0) != 0) { status = -1; }
+
+	close(parent_fd);
+	return status;
+}
+
+/**
+ * @brief Removes an entry that isn't a directory and counts what has been freed.
+ *
+ * @param worker Worker that processes the directory.
+ * @param dirfd Directory that contains the entry.
+ * @param name Name of the entry.
+ * @param d_type Type of the entry.
+ * @param entry_stat Result of fstatat() for the entry if it's already known, otherwise NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+static int remove_entry(struct pool_worker *worker, int dirfd, const char *name, unsigned char d_type, const struct stat *entry_stat)
+{
+	(void)d_type;
+
+	if (unlinkat(dirfd, name, 0) != 0) { return -1; }
+
+	if (entry_stat != NULL && S_ISREG(entry_stat->st_mode)) { worker->bytes += (uint64_t)entry_stat->st_size; }
+	worker->inodes++;
+
+	return 0;
+}
+
+/**
+ * @brief Removes a directory once its content has been removed.
+ *
+ * The root is left to the caller of the walk, since it's resolved relative to a directory that
+ * isn't part of the walk.
+ *
+ * @param worker Worker that drops the last reference to the directory.
+ * @param dir Directory that is left.
+ * @return 0 when successful, negative otherwise.
+ */
+static int remove_dir_leave(struct pool_worker *worker, struct walk_dir *dir)
+{
+	if (dir->parent == NULL || atomic_load(&worker->pool->failed)) { return 0; }
+
+	int parent_fd = dir->parent->fd >= 0 ? dir->parent->fd : walk_dir_reopen(dir->parent);
+	if (parent_fd < 0) { return -1; }
+
+	int status = unlinkat(parent_fd, dir->name, AT_REMOVEDIR);
+	if (parent_fd != dir->parent->fd) { close(parent_fd); }
+	if (status != 0) { return -1; }
+
+	worker->inodes++;
+	return 0;
+}
+
+/**
+ * @brief Removes the content of a directory in parallel, but not the directory itself.
+ *
+ * Files are unlinked by the workers that read their directories and each subdirectory is removed
+ * by the worker that finishes its last subdirectory.
+ *
+ * @param dirfd Directory relative to which path is resolved, or AT_FDCWD.
+ * @param path Directory whose content is removed.
+ * @param threads Maximum number of threads, 0 for the default.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed entries is added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+static int remove_dir_content(int dirfd, const char *path, size_t threads, uint64_t *bytes, uint64_t *inodes)
+{
+	struct tree_walk walk;
+	walk.visit = remove_entry;
+	walk.enter = NULL;
+	walk.leave = remove_dir_leave;
+	walk.data = NULL;
+	walk.stat_files = bytes != NULL;
+
+	return run_tree_walk(&walk, dirfd, path, threads, bytes, inodes);
+}
+
+/**
+ * @brief Removes a directory tree in parallel.
+ *
+ * @param dirfd Directory relative to which path is resolved, or AT_FDCWD.
+ * @param path Directory that is removed together with its content.
+ * @param threads Maximum number of threads, 0 for the default.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed entries is added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+static int remove_tree(int dirfd, const char *path, size_t threads, uint64_t *bytes, uint64_t *inodes)
+{
+	if (remove_dir_content(dirfd, path, threads, bytes, inodes) < 0) { return -1; }
+	if (unlinkat(dirfd, path, AT_REMOVEDIR) != 0) { return -1; }
+	if (inodes != NULL) { (*inodes)++; }
+
+	return 0;
+}
+
+/**
+ * @brief Copies a file or directory to another filesystem.
+ *
+ * Directory trees are copied in parallel by a tree walk. If copying fails, the partial copy is
+ * removed. The original is left to remove_original(), so that the copy can be flushed to disk first.
+ * An existing dst is never replaced, errno is EEXIST in this case. Also used to restore copies.
+ *
+ * @param src Absolute path of the file or directory.
+ * @param src_stat Result of lstat() for src.
+ * @param dst Path of the copy, must not exist.
+ * @param threads Maximum number of threads, 0 for the default.
+ * @return 0 when successful, negative otherwise.
+ */
+static int copy_into_trash(const char *src, const struct stat *src_stat, const char *dst, size_t threads)
+{
+	if (!S_ISDIR(src_stat->st_mode))
+	{
+		if (copy_entry(AT_FDCWD, src, AT_FDCWD, dst, src_stat) < 0)
+		{
+			/* An existing file at dst isn't the partial copy. */
+			int saved_errno = errno;
+			if (saved_errno != EEXIST) { unlink(dst); }
+			errno = saved_errno;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (mkdir(dst, S_IRWXU) != 0) { return -1; }
+
+	int dst_fd = open(dst, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dst_fd < 0)
+	{
+		rmdir(dst);
+		return -1;
+	}
+
+	struct tree_walk walk;
+	walk.visit = copy_dir_visit;
+	walk.enter = copy_dir_enter;
+	walk.leave = copy_dir_leave;
+	walk.data = &dst_fd;
+	walk.stat_files = 1;
+
+	int walk_status = run_tree_walk(&walk, AT_FDCWD, src, threads, NULL, NULL);
+	close(dst_fd);
+	if (walk_status < 0)
+	{
+		remove_tree(AT_FDCWD, dst, threads, NULL, NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Removes the original of a file or directory that has been copied to the trash.
+ *
+ * @param src Absolute path of the file or directory.
+ * @param src_stat Result of lstat() for src.
+ * @param threads Maximum number of threads, 0 for the default.
+ * @return 0 when successful, negative otherwise.
+ */
+static int remove_original(const char *src, const struct stat *src_stat, size_t threads)
+{
+	if (!S_ISDIR(src_stat->st_mode)) { return unlink(src); }
+	return remove_tree(AT_FDCWD, src, threads, NULL, NULL);
+}
+
+/**
+ * @brief Sizes a directory in $trash/files and writes its line to the directory size cache.
+ *
+ * The line has the format "size mtime name", where mtime is the modification time of the
+ * corresponding .trashinfo file and the name is percent-encoded as required by the specification.
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param fptr File to which the line is written.
+ * @param trash_info_dir Path to the trash info directory.
+ * @param trash_files_dir Path to the directory where deleted file are stored.
+ * @param name Name of the directory within trash_files_dir.
+ * @param threads Maximum number of threads used for sizing, 0 for the default.
+ * @param written_size Address to which the size is added if the line has been written, may be NULL.
+ * @return 0 when successful, 1 when there is no .trashinfo file for the directory, negative otherwise.
+ */
+static int write_dir_size_line(FILE *fptr, const char *trash_info_dir, const char *trash_files_dir, const char *name, size_t threads, uint64_t *written_size)
+{
+	int status = -1;
+	uint64_t dir_size = 0;
+	char *current_dir = NULL;
+	char *current_trashinfo = NULL;
+	char *escaped_name = NULL;
+	struct stat trashinfo_stat;
+
+	if (asprintf(&current_dir, "%s/%s", trash_files_dir, name) < 0) { HANDLE_ERROR(current_dir, NULL, error_0) }
+	if (asprintf(&current_trashinfo, "%s/%s%s", trash_info_dir, name, ".trashinfo") < 0) { HANDLE_ERROR(current_trashinfo, NULL, error_0) }
+	if (lstat(current_trashinfo, &trashinfo_stat)) { HANDLE_ERROR(status, 1, error_0) } /* lstat can fail if .trashinfo file doesn't exist. */
+	if (get_dir_size(current_dir, threads, &dir_size) < 0) { goto error_0; }
+	if (escape_path(name, &escaped_name) < 0) { goto error_0; }
+	if (fprintf(fptr, "%" PRIu64 " %jd %s\n", dir_size, (intmax_t)trashinfo_stat.st_mtime, escaped_name) < 0) { goto error_0; }
+	if (written_size != NULL) { *written_size += dir_size; }
+
+	status = 0;
+
+error_0:
+	free(escaped_name);
+	free(current_trashinfo);
+	free(current_dir);
+	return status;
+}
+
+/**
+ * @brief Locks the directory size cache of a trash directory against concurrent rewrites.
+ *
+ * The lock is held on the trash directory, since $trash/directorysizes is replaced on every
+ * rewrite. Deletions only append lines and take a shared lock, rewrites take an exclusive one, so
+ * that no appended line is lost by a rewrite of another thread or process. Applications that
+ * don't lock aren't excluded. If the filesystem doesn't support locks, nothing is locked.
+ *
+ * @param trash_dir Path to the trash base directory.
+ * @param operation LOCK_SH or LOCK_EX.
+ * @return File descriptor that holds the lock, negative if nothing is locked.
+ */
+static int lock_dir_size_cache(const char *trash_dir, int operation)
+{
+	int fd = open(trash_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) { return -1; }
+
+	while (flock(fd, operation) != 0)
+	{
+		if (errno != EINTR)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+/**
+ * @brief Releases a lock taken by lock_dir_size_cache().
+ *
+ * @param fd File descriptor that holds the lock, may be negative.
+ */
+static void unlock_dir_size_cache(int fd)
+{
+	if (fd >= 0) { close(fd); }
+}
+
+/**
+ * @brief Create or update the directory size cache.
+ *
+ * For each directory in $trash/files calculate the size recursively and write
+ * a line to a temporary file. After completion replace the old $trash/directorysizes
+ * file.
+ *
+ * The cost of this grows with the size of the trash, therefore it's only used for explicit
+ * maintenance through `trashcan_rebuild_dir_size_cache()`. Deletions use append_dir_size_lines().
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param trash_dir Path to the trash base directory.
+ * @param trash_info_dir Path to the trash info directory.
+ * @param trash_files_dir Path to the directory where deleted file are stored.
+ * @param threads Maximum number of threads used for sizing, 0 for the default.
+ * @return 0 when successful, negative otherwise.
+ */
+static int create_or_update_dir_size_cache(const char *trash_dir, const char *trash_info_dir, const char *trash_files_dir, size_t threads)
+{
+	int status = -1;
+	char temp_name[_POSIX_NAME_MAX + 1];
+	char *dir_size_cache = NULL;
+	char *dir_size_cache_temp = NULL;
+	int lock_fd = -1;
+
+	if (generate_random_filename(temp_name, _POSIX_NAME_MAX) < 0) { goto error_0; }
+	if (asprintf(&dir_size_cache, "%s/%s", trash_dir, "directorysizes") < 0) { HANDLE_ERROR(dir_size_cache, NULL, error_0) }
+	if (asprintf(&dir_size_cache_temp, "%s/%s", trash_dir, temp_name) < 0) { HANDLE_ERROR(dir_size_cache_temp, NULL, error_0) }
+
+	lock_fd = lock_dir_size_cache(trash_dir, LOCK_EX);
+
+	FILE *fptr = fopen(dir_size_cache_temp, "w");
+	if (fptr == NULL)
+	{
+		goto error_0;
+	}
+
+	struct dirent *directory_entry;
+	DIR *directory = opendir(trash_files_dir);
+	if (directory == NULL) { goto error_1; }
+
+	while ((directory_entry = readdir(directory)) != NULL)
+	{
+		if ((strcmp(directory_entry->d_name, ".") == 0) || (strcmp(directory_entry->d_name, "..") == 0))
+		{
+			continue;
+		}
+
+		if (directory_entry->d_type == DT_DIR)
+		{
+			if (write_dir_size_line(fptr, trash_info_dir, trash_files_dir, directory_entry->d_name, threads, NULL) < 0) { goto error_2; }
+		}
+	}
+
+	closedir(directory);
+	if (fclose(fptr) != 0) { goto error_m1; }
+
+	if (rename(dir_size_cache_temp, dir_size_cache) != 0) { goto error_m1; }
+
+	status = 0;
+
+	goto error_0;
+
+error_2:
+	closedir(directory);
+error_1:
+	fclose(fptr);
+error_m1:
+	remove(dir_size_cache_temp);
+error_0:
+	unlock_dir_size_cache(lock_fd);
+	free(dir_size_cache_temp);
+	free(dir_size_cache);
+	return status;
+}
+
+/**
+ * @brief Compares two strings, used for sorting and searching arrays of names.
+ *
+ * @param a Pointer to the first string pointer.
+ * @param b Pointer to the second string pointer.
+ * @return Result of strcmp() for the two strings.
+ */
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/**
+ * @brief Line of the directory size cache.
+ */
+struct dir_size_entry
+{
+	char *name; /**< Unescaped name of the directory in $trash/files. */
+	uint64_t size; /**< Size of the directory. */
+	intmax_t mtime; /**< Modification time of the .trashinfo file when the size was determined. */
+	size_t line; /**< Position in the file, later lines of a name replace earlier ones. */
+};
+
+/**
+ * @brief Compares two lines of the directory size cache by name.
+ *
+ * @param a Pointer to the first entry.
+ * @param b Pointer to the second entry.
+ * @return Result of strcmp() for the names.
+ */
+static int compare_dir_size_entries(const void *a, const void *b)
+{
+	return strcmp(((const struct dir_size_entry *)a)->name, ((const struct dir_size_entry *)b)->name);
+}
+
+/**
+ * @brief Compares two lines of the directory size cache by name and then by position in the file.
+ *
+ * @param a Pointer to the first entry.
+ * @param b Pointer to the second entry.
+ * @return Negative, zero or positive like strcmp().
+ */
+static int compare_dir_size_lines(const void *a, const void *b)
+{
+	const struct dir_size_entry *entry_a = a;
+	const struct dir_size_entry *entry_b = b;
+
+	int cmp = strcmp(entry_a->name, entry_b->name);
+	if (cmp != 0) { return cmp; }
+	return entry_a->line < entry_b->line ? -1 : entry_a->line > entry_b->line;
+}
+
+/**
+ * @brief Frees the lines of the directory size cache loaded by load_dir_size_cache().
+ *
+ * @param entries Lines of the cache.
+ * @param num_entries Number of lines.
+ */
+static void free_dir_size_cache(struct dir_size_entry *entries, size_t num_entries)
+{
+	for (size_t i = 0; i < num_entries; i++)
+	{
+		free(entries[i].name);
+	}
+
+	free(entries);
+}
+
+/**
+ * @brief Loads the directory size cache, sorted by name.
+ *
+ * Deletions append lines, so a name may be listed more than once, only its last line is kept.
+ * Lines without a terminating newline are skipped, since they may be cut short by a concurrent
+ * append.
+ * @param trash_dir Path to the trash base directory.
+ * @param entries Address where pointer to the lines is stored. NULL if there is no cache.
+ * @param num_entries Address where the number of lines is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+static int load_dir_size_cache(const char *trash_dir, struct dir_size_entry **entries, size_t *num_entries)
+{
+	int status = -1;
+	char *dir_size_cache = NULL;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	size_t capacity = 0;
+	*entries = NULL;
+	*num_entries = 0;
+
+	if (asprintf(&dir_size_cache, "%s/%s", trash_dir, "directorysizes") < 0) { HANDLE_ERROR(dir_size_cache, NULL, error_0) }
+
+	FILE *fptr = fopen(dir_size_cache, "r");
+	if (fptr == NULL)
+	{
+		if (errno == ENOENT) { status = 0; }
+		goto error_0;
+	}
+
+	while (getline(&line, &line_capacity, fptr) > 0)
+	{
+		uint64_t size = 0;
+		intmax_t mtime = 0;
+		int name_offset = 0;
+
+		size_t line_len = strcspn(line, "\n");
+		if (line[line_len] != '\n') { continue; } /* Incomplete line */
+		line[line_len] = '\0';
+		if (sscanf(line, "%" SCNu64 " %jd %n", &size, &mtime, &name_offset) != 2 || line[name_offset] == '\0') { continue; } /* Malformed line */
+
+		if (*num_entries == capacity)
+		{
+			capacity = capacity == 0 ? 64 : capacity * 2;
+			struct dir_size_entry *new_entries = realloc(*entries, capacity * sizeof(*new_entries));
+			if (new_entries == NULL) { goto error_1; }
+			*entries = new_entries;
+		}
+
+		if (unescape_path(line + name_offset, &(*entries)[*num_entries].name) < 0) { goto error_1; }
+		(*entries)[*num_entries].size = size;
+		(*entries)[*num_entries].mtime = mtime;
+		(*entries)[*num_entries].line = *num_entries;
+		(*num_entries)++;
+	}
+
+	if (ferror(fptr)) { goto error_1; }
+
+	if (*num_entries > 1)
+	{
+		qsort(*entries, *num_entries, sizeof(**entries), compare_dir_size_lines);
+
+		/* Keep the last line of each name. */
+		size_t num_kept = 0;
+		for (size_t i = 0; i < *num_entries; i++)
+		{
+			if (i + 1 < *num_entries && strcmp((*entries)[i].name, (*entries)[i + 1].name) == 0)
+			{
+				free((*entries)[i].name);
+				continue;
+			}
+			(*entries)[num_kept++] = (*entries)[i];
+		}
+		*num_entries = num_kept;
+	}
+	status = 0;
+
+	goto error_2;
+
+error_1:
+	free_dir_size_cache(*entries, *num_entries);
+	*entries = NULL;
+	*num_entries = 0;
+error_2:
+	fclose(fptr);
+error_0:
+	free(line);
+	free(dir_size_cache);
+	return status;
+}
+
+/**
+ * @brief Appends the lines of newly trashed directories to the directory size cache.
+ *
+ * Only the given entries of $trash/files are sized, the existing lines aren't read. All lines are
+ * appended with one write(), so the cost of a deletion doesn't depend on the size of the cache.
+ * A name may be listed more than once, readers use its last line, see load_dir_size_cache().
+ * Earlier lines are dropped when the cache is rewritten by update_dir_size_cache().
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param trash_dir Path to the trash base directory.
+ * @param trash_info_dir Path to the trash info directory.
+ * @param trash_files_dir Path to the directory where deleted file are stored.
+ * @param names Names of the directories within trash_files_dir that have been added.
+ * @param num_names Number of names.
+ * @param threads Maximum number of threads used for sizing, 0 for the default.
+ * @param added_size Address to which the sizes of the directories whose lines have been written are added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+static int append_dir_size_lines(const char *trash_dir, const char *trash_info_dir, const char *trash_files_dir, const char *const *names, size_t num_names, size_t threads, uint64_t *added_size)
+{
+	int status = -1;
+	int lock_fd = -1;
+	int fd = -1;
+	char *dir_size_cache = NULL;
+	char *buf = NULL;
+	size_t buf_len = 0;
+	uint64_t size = 0;
+
+	FILE *fptr = open_memstream(&buf, &buf_len);
+	if (fptr == NULL) { goto error_0; }
+
+	/* Directories are sized before the lock is taken, since that may take long. */
+	for (size_t i = 0; i < num_names; i++)
+	{
+		if (write_dir_size_line(fptr, trash_info_dir, trash_files_dir, names[i], threads, &size) < 0)
+		{
+			fclose(fptr);
+			goto error_0;
+		}
+	}
+	if (fclose(fptr) != 0) { goto error_0; }
+	if (buf_len == 0) { goto done; }
+
+	if (asprintf(&dir_size_cache, "%s/%s", trash_dir, "directorysizes") < 0) { HANDLE_ERROR(dir_size_cache, NULL, error_0) }
+
+	lock_fd = lock_dir_size_cache(trash_dir, LOCK_SH);
+	fd = open(dir_size_cache, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0) { goto error_1; }
+
+	/* A line that is cut short by a failed write isn't terminated, so readers skip it. */
+	ssize_t num_written;
+	while ((num_written = write(fd, buf, buf_len)) < 0 && errno == EINTR) { }
+	if (num_written != (ssize_t)buf_len) { goto error_2; }
+
+done:
+	if (added_size != NULL) { *added_size += size; }
+	status = 0;
+
+error_2:
+	if (fd >= 0) { close(fd); }
+error_1:
+	unlock_dir_size_cache(lock_fd);
+error_0:
+	free(dir_size_cache);
+	free(buf);
+	return status;
+}
+
+/**
+ * @brief Rewrites the directory size cache for entries that have been restored, purged or changed.
+ *
+ * The given entries of $trash/files are sized again, or their lines dropped if they are no longer
+ * directories, e.g. after they have been restored or purged. All other lines are kept, earlier
+ * lines of a name that has been appended more than once are dropped. With prune, stale lines whose
+ * directory has been removed by other means are dropped as well, which costs a fstatat() per line,
+ * so this is left to expiry and `trashcan_rebuild_dir_size_cache()`. Deletions use
+ * append_dir_size_lines() instead. As in create_or_update_dir_size_cache() the new cache is written
+ * to a temporary file which atomically replaces the old one, while the lock of
+ * lock_dir_size_cache() is held.
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param trash_dir Path to the trash base directory.
+ * @param trash_info_dir Path to the trash info directory.
+ * @param trash_files_dir Path to the directory where deleted file are stored.
+ * @param names Names of the entries within trash_files_dir that have been changed or removed.
+ * @param num_names Number of names.
+ * @param threads Maximum number of threads used for sizing, 0 for the default.
+ * @param prune 1 if stale lines of other entries are dropped, 0 if they are kept.
+ * @param added_size Address to which the sizes of the directories whose lines have been written are added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+static int update_dir_size_cache(const char *trash_dir, const char *trash_info_dir, const char *trash_files_dir, const char *const *names, size_t num_names, size_t threads, unsigned char prune, uint64_t *added_size)
+{
+	int status = -1;
+	int files_fd = -1;
+	int lock_fd = -1;
+	char temp_name[_POSIX_NAME_MAX + 1];
+	char *dir_size_cache = NULL;
+	char *dir_size_cache_temp = NULL;
+	char *escaped_name = NULL;
+	const char **sorted_names = NULL;
+	struct dir_size_entry *entries = NULL;
+	size_t num_entries = 0;
+	struct stat entry_stat;
+
+	if (num_names > 0)
+	{
+		sorted_names = malloc(num_names * sizeof(*sorted_names));
+		if (sorted_names == NULL) { goto error_0; }
+		memcpy(sorted_names, names, num_names * sizeof(*sorted_names));
+		qsort(sorted_names, num_names, sizeof(*sorted_names), compare_names);
+	}
+
+	files_fd = open(trash_files_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (files_fd < 0) { goto error_0; }
+
+	if (generate_random_filename(temp_name, _POSIX_NAME_MAX) < 0) { goto error_0; }
+	if (asprintf(&dir_size_cache, "%s/%s", trash_dir, "directorysizes") < 0) { HANDLE_ERROR(dir_size_cache, NULL, error_0) }
+	if (asprintf(&dir_size_cache_temp, "%s/%s", trash_dir, temp_name) < 0) { HANDLE_ERROR(dir_size_cache_temp, NULL, error_0) }
+
+	lock_fd = lock_dir_size_cache(trash_dir, LOCK_EX);
+
+	/* The cache doesn't exist before the first directory has been trashed. */
+	if (load_dir_size_cache(trash_dir, &entries, &num_entries) < 0) { goto error_0; }
+
+	FILE *fptr = fopen(dir_size_cache_temp, "w");
+	if (fptr == NULL)
+	{
+		goto error_0;
+	}
+
+	for (size_t i = 0; i < num_entries; i++)
+	{
+		const char *key = entries[i].name;
+		if (sorted_names != NULL && bsearch(&key, sorted_names, num_names, sizeof(*sorted_names), compare_names) != NULL) { continue; } /* Re-added below */
+		if (prune && (fstatat(files_fd, entries[i].name, &entry_stat, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(entry_stat.st_mode))) { continue; } /* Stale */
+
+		if (escape_path(entries[i].name, &escaped_name) < 0) { goto error_1; }
+		if (fprintf(fptr, "%" PRIu64 " %jd %s\n", entries[i].size, entries[i].mtime, escaped_name) < 0) { goto error_1; }
+		free(escaped_name);
+		escaped_name = NULL;
+	}
+
+	for (size_t i = 0; i < num_names; i++)
+	{
+		if (i > 0 && strcmp(sorted_names[i - 1], sorted_names[i]) == 0) { continue; } /* Duplicate */
+		if (fstatat(files_fd, sorted_names[i], &entry_stat, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(entry_stat.st_mode)) { continue; } /* Removed or not a directory */
+		if (write_dir_size_line(fptr, trash_info_dir, trash_files_dir, sorted_names[i], threads, added_size) < 0) { goto error_1; }
+	}
+
+	if (fclose(fptr) != 0) { goto error_m1; }
+
+	if (rename(dir_size_cache_temp, dir_size_cache) != 0) { goto error_m1; }
+
+	status = 0;
+
+	goto error_0;
+
+error_1:
+	fclose(fptr);
+error_m1:
+	remove(dir_size_cache_temp);
+error_0:
+	unlock_dir_size_cache(lock_fd);
+	if (files_fd >= 0) { close(files_fd); }
+	free_dir_size_cache(entries, num_entries);
+	free(escaped_name);
+	free(sorted_names);
+	free(dir_size_cache_temp);
+	free(dir_size_cache);
+	return status;
+}
+
+/**
+ * @brief Next free counter of generate_filenames() for a basename deleted at a certain time.
+ */
+struct name_counter
+{
+	char *name; /**< Basename of the deleted file, NULL for an empty slot. */
+	time_t time; /**< Deletion time in seconds, the counter is only valid within this second. */
+	unsigned int next; /**< Counter that is tried first for the next deletion. */
+};
+
+/**
+ * @brief Hash table of counters used to resolve name collisions in a trash directory.
+ *
+ * Counters of earlier seconds can't be used anymore, since the timestamp is part of the name.
+ * They are dropped whenever the table grows.
+ */
+struct name_counters
+{
+	struct name_counter *entries; /**< Open addressing table with linear probing. */
+	size_t capacity; /**< Number of slots, a power of two. */
+	size_t count; /**< Number of occupied slots. */
+};
+
+/**
+ * @brief Hashes a basename with FNV-1a.
+ */
+static size_t hash_name(const char *name)
+{
+	uint64_t hash = 14695981039346656037u;
+	for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++)
+	{
+		hash ^= *c;
+		hash *= 1099511628211u;
+	}
+
+	return (size_t)(hash ^ (hash >> 32));
+}
+
+/**
+ * @brief Frees the counters and their names.
+ */
+static void free_name_counters(struct name_counters *counters)
+{
+	if (counters == NULL) { return; }
+
+	for (size_t i = 0; i < counters->capacity; i++) { free(counters->entries[i].name); }
+	free(counters->entries);
+	free(counters);
+}
+
+/**
+ * @brief Finds the slot of a basename.
+ *
+ * @return Slot with the name or the empty slot where it would be inserted.
+ */
+static struct name_counter *find_name_counter(const struct name_counters *counters, const char *name)
+{
+	size_t mask = counters->capacity - 1;
+	size_t i = hash_name(name) & mask;
+
+	while (counters->entries[i].name != NULL && strcmp(counters->entries[i].name, name) != 0) { i = (i + 1) & mask; }
+
+	return &counters->entries[i];
+}
+
+/**
+ * @brief Returns the counter that is tried first for a basename deleted at a certain time.
+ */
+static unsigned int get_name_counter(const struct name_counters *counters, const char *name, time_t time)
+{
+	if (counters == NULL || counters->count == 0) { return 0; }
+
+	const struct name_counter *entry = find_name_counter(counters, name);
+	return entry->name != NULL && entry->time == time ? entry->next : 0;
+}
+
+/**
+ * @brief Rehashes the counters into a table of the given capacity, dropping counters of other seconds.
+ *
+ * @return 0 when successful, negative otherwise.
+ */
+static int rehash_name_counters(struct name_counters *counters, size_t capacity, time_t time)
+{
+	struct name_counter *old_entries = counters->entries;
+	size_t old_capacity = counters->capacity;
+
+	struct name_counter *entries = calloc(capacity, sizeof(*entries));
+	if (entries == NULL) { return -1; }
+
+	counters->entries = entries;
+	counters->capacity = capacity;
+	counters->count = 0;
+
+	for (size_t i = 0; i < old_capacity; i++)
+	{
+		if (old_entries[i].name == NULL) { continue; }
+
+		if (old_entries[i].time != time)
+		{
+			free(old_entries[i].name);
+			continue;
+		}
+
+		*find_name_counter(counters, old_entries[i].name) = old_entries[i];
+		counters->count++;
+	}
+
+	free(old_entries);
+	return 0;
+}
+
+/**
+ * @brief Remembers the counter that is tried first for the next deletion of a basename.
+ *
+ * Failing to remember the counter isn't an error, the next deletion only needs more attempts.
+ *
+ * @param counters Address of the pointer to the table, which is created if needed.
+ * @param name Basename of the deleted file.
+ * @param time Deletion time in seconds.
+ * @param next Counter following the one that has been used.
+ */
+static void set_name_counter(struct name_counters **counters, const char *name, time_t time, unsigned int next)
+{
+	if (*counters == NULL)
+	{
+		*counters = calloc(1, sizeof(**counters));
+		if (*counters == NULL) { return; }
+	}
+
+	struct name_counters *table = *counters;
+
+	if ((table->count + 1) * 2 > table->capacity)
+	{
+		/* Drop counters of earlier seconds first, the table only grows if that doesn't free enough slots. */
+		size_t live = 0;
+		for (size_t i = 0; i < table->capacity; i++) { live += table->entries[i].name != NULL && table->entries[i].time == time; }
+
+		size_t capacity = table->capacity == 0 ? 16 : table->capacity;
+		while ((live + 1) * 2 > capacity) { capacity *= 2; }
+
+		if (rehash_name_counters(table, capacity, time) < 0) { return; }
+	}
+
+	struct name_counter *entry = find_name_counter(table, name);
+	if (entry->name == NULL)
+	{
+		entry->name = strdup(name);
+		if (entry->name == NULL) { return; }
+		table->count++;
+	}
+
+	entry->time = time;
+	entry->next = next;
+}
+
+/**
+ * @brief Trash directory that has been resolved for a device.
+ */
+struct trash_location
+{
+	dev_t device; /**< Device whose files are moved to this trash directory. */
+	char *trash_dir; /**< Base directory for trash. */
+	char *trash_info_dir; /**< Directory where .trashinfo files are stored. */
+	char *trash_files_dir; /**< Directory where trashed files are stored. */
+	long name_max; /**< Maximum filename length in trash_files_dir, negative if there is no limit. */
+	struct name_counters *counters; /**< Counters of recent name collisions, NULL until the first deletion. */
+};
+
+/**
+ * @brief Frees the paths and collision counters of a trash location.
+ *
+ * @param location Trash location whose paths shall be freed.
+ */
+static void free_trash_location(struct trash_location *location)
+{
+	free(location->trash_files_dir);
+	free(location->trash_info_dir);
+	free(location->trash_dir);
+	free_name_counters(location->counters);
+	location->trash_files_dir = NULL;
+	location->trash_info_dir = NULL;
+	location->trash_dir = NULL;
+	location->counters = NULL;
+}
+
+/**
+ * @brief Determines the home trash and the device it is located on.
+ *
+ * $XDG_DATA_HOME is created if it doesn't exist. The trash directories themselves are only created
+ * by resolve_trash_location() when a file on the same device is trashed.
+ *
+ * @param home Address where the home trash location is stored.
+ * @param data_home Address where pointer to "$XDG_DATA_HOME" is stored.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int get_home_location(struct trash_location *home, char **data_home)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct stat home_stat;
+	memset(home, 0, sizeof(*home));
+
+	/* Get the paths for the home trash directory. */
+	if (get_home_trash_dir(data_home, &home->trash_dir, &home->trash_info_dir, &home->trash_files_dir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_HOMETRASH, error_0) }
+
+	/* Create $XDG_DATA_HOME if it doesn't exist */
+	STATS_START(mkdir_start)
+	int mkdir_status = mkdir_recursive(*data_home, S_IRWXU);
+	STATS_STOP(TRASHCAN_PHASE_MKDIR, mkdir_start)
+	if (mkdir_status < 0) { HANDLE_ERROR(status, LIBTRASHCAN_MKDIRHOME, error_m1) }
+
+	if (lstat(*data_home, &home_stat)) { HANDLE_ERROR(status, LIBTRASHCAN_HOMESTAT, error_m1) }
+	home->device = home_stat.st_dev;
+	home->name_max = -1;
+
+error_0:
+	return status;
+error_m1:
+	free_trash_location(home);
+	free(*data_home);
+	*data_home = NULL;
+	return status;
+}
+
+/**
+ * @brief Determines and creates the trash directory for files on a device.
+ *
+ * If the device is the same as the one of the home trash, the home trash is used. Otherwise
+ * case (1) or (2) of the specification is applied.
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param home Home trash location as determined by get_home_location().
+ * @param mounts Mount table used to determine $topdir.
+ * @param device Device of the file or directory that shall be trashed.
+ * @param path Resolved path of the file or directory, may be NULL.
+ * @param location Address where the trash location is stored.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int resolve_trash_location(const struct trash_location *home, struct mount_table *mounts, dev_t device, const char *path, struct trash_location *location)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct stat trash_stat;
+	memset(location, 0, sizeof(*location));
+	location->device = device;
+
+	if (device == home->device)
+	{
+		/* File or directory is on the same devices as the home directory. The trash directory is "$XDG_DATA_HOME/Trash".
+		 * Create the directories, if they don't exist. */
+		if (asprintf(&location->trash_dir, "%s", home->trash_dir) < 0) { location->trash_dir = NULL; HANDLE_ERROR(status, LIBTRASHCAN_HOMETRASH, error_m1) }
+		if (asprintf(&location->trash_info_dir, "%s", home->trash_info_dir) < 0) { location->trash_info_dir = NULL; HANDLE_ERROR(status, LIBTRASHCAN_HOMETRASH, error_m1) }
+		if (asprintf(&location->trash_files_dir, "%s", home->trash_files_dir) < 0) { location->trash_files_dir = NULL; HANDLE_ERROR(status, LIBTRASHCAN_HOMETRASH, error_m1) }
+		if (create_trash_dir(location->trash_info_dir, location->trash_files_dir, S_IRWXU) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_MKDIRHOME, error_m1) }
+	}
+	else
+	{
+		/* If possible apply case (1) or (2) of the specification */
+		unsigned char case_1_failed = 0;
+		unsigned char case_num = 1;
+
+		if (get_top_trash_dir(mounts, case_num, device, path, &location->trash_dir, &location->trash_info_dir, &location->trash_files_dir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_TOPDIRTRASH, error_m1) }
+		if (lstat(location->trash_dir, &trash_stat)) { case_1_failed = 1; } /* ENOENT if directory doesn't exist */
+		if (!case_1_failed && (trash_stat.st_mode & S_ISVTX) == 0) { case_1_failed = 1; } /* Make sure sticky bit is set */
+		if (!case_1_failed && S_ISLNK(trash_stat.st_mode)) { case_1_failed = 1; } /* Check if symlink */
+		if (!case_1_failed && create_trash_dir(location->trash_info_dir, location->trash_files_dir, S_IRWXU) < 0) { case_1_failed = 1; } /* Create (sub)directories */
+
+		if (case_1_failed)
+		{
+			case_num = 2;
+			free_trash_location(location);
+			if (get_top_trash_dir(mounts, case_num, device, path, &location->trash_dir, &location->trash_info_dir, &location->trash_files_dir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_TOPDIRTRASH, error_m1) }
+			if (create_trash_dir(location->trash_info_dir, location->trash_files_dir, S_IRWXU) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_MKDIRHOME, error_m1) }
+		}
+	}
+
+	/* Check the maximum allowed filename length once, to ensure that the deleted files can be renamed. */
+	if (get_name_max(location->trash_files_dir, &location->name_max) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_FILENAMES, error_m1) }
+
+	return status;
+error_m1:
+	free_trash_location(location);
+	return status;
+}
+
+/**
+ * @brief Checks whether the .trashinfo file for a counter already exists.
+ *
+ * @param arena Arena used for the paths, which are released before returning.
+ * @param location Trash location in which the file would be created.
+ * @param name Basename of the deleted file.
+ * @param timeinfo Time when file was deleted.
+ * @param counter Counter passed to generate_filenames().
+ * @return 1 if the file exists, 0 if it doesn't, negative otherwise.
+ */
+static int info_file_exists(struct arena *arena, const struct trash_location *location, const char *name, const struct tm *timeinfo, unsigned int counter)
+{
+	struct arena_mark mark = arena_get_mark(arena);
+	char *trash_info_file = NULL;
+	char *trashed_file = NULL;
+	struct stat info_stat;
+
+	if (generate_filenames(arena, name, location->trash_info_dir, location->trash_files_dir, location->name_max, timeinfo, counter, 0, &trash_info_file, &trashed_file) < 0) { return -1; }
+
+	int exists = lstat(trash_info_file, &info_stat) == 0 || errno != ENOENT;
+
+	arena_release(arena, mark);
+	return exists;
+}
+
+/**
+ * @brief Finds a counter whose .trashinfo file doesn't exist yet.
+ *
+ * Counters of a basename are taken in increasing order, so the used counters form a contiguous
+ * range in the common case. Starting at the first candidate, the step is doubled until a free
+ * counter is found, then the boundary is located by binary search. The n-th file with the same
+ * name in one second takes O(log n) checks instead of n attempts to create the .trashinfo file.
+ * The result is a candidate only, creating the .trashinfo file exclusively still decides.
+ *
+ * @param arena Arena used for the paths that are checked.
+ * @param location Trash location in which the file is created.
+ * @param name Basename of the deleted file.
+ * @param timeinfo Time when file was deleted.
+ * @param start First counter that is checked.
+ * @param counter Address where the candidate is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+static int find_free_counter(struct arena *arena, const struct trash_location *location, const char *name, const struct tm *timeinfo, unsigned int start, unsigned int *counter)
+{
+	int exists = info_file_exists(arena, location, name, timeinfo, start);
+	if (exists < 0) { return -1; }
+
+	*counter = start;
+	if (!exists) { return 0; }
+
+	unsigned int used = start;
+	unsigned int unused = start;
+	unsigned int step = 1;
+
+	for (;;)
+	{
+		/* The range of counters is exhausted, let the caller handle the collision. */
+		if (step > UINT_MAX - used) { return 0; }
+
+		unused = used + step;
+		exists = info_file_exists(arena, location, name, timeinfo, unused);
+		if (exists < 0) { return -1; }
+		if (!exists) { break; }
+
+		used = unused;
+		*counter = used;
+		if (step > UINT_MAX / 2) { return 0; }
+		step *= 2;
+	}
+
+	while (unused - used > 1)
+	{
+		unsigned int mid = used + (unused - used) / 2;
+		exists = info_file_exists(arena, location, name, timeinfo, mid);
+		if (exists < 0) { return -1; }
+
+		if (exists) { used = mid; }
+		else { unused = mid; }
+	}
+
+	*counter = unused;
+	return 0;
+}
+
+/**
+ * @brief Reserves a unique name in a trash location by creating the .trashinfo file.
+ *
+ * @param arena Arena in which the paths are allocated.
+ * @param location Trash location to which the file or directory is moved.
+ * @param counters_lock Mutex that protects the collision counters of the location.
+ * @param resolved_path Absolute path without symbolic links, as returned by realpath().
+ * @param sync_data Flush the content of the .trashinfo file to disk before returning.
+ * @param trash_info_file Address where pointer to the path of the .trashinfo file is stored.
+ * @param trashed_file Address where pointer to the new path of the file or directory is stored.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int create_trash_entry(struct arena *arena, struct trash_location *location, pthread_mutex_t *counters_lock, const char *resolved_path,
+							  unsigned char sync_data, char **trash_info_file, char **trashed_file)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct arena_mark mark = arena_get_mark(arena);
+	*trash_info_file = NULL;
+	*trashed_file = NULL;
+
+	/* Extract the original file or directory name */
+	const char *name = strrchr(resolved_path, '/');
+	if (name == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_NAME, error_0) }
+	name++; /* Start at char after the slash */
+
+	/* Get current time for trash info timestamp and unique filename creation in the trash dir */
+	time_t rawtime;
+	struct tm timeinfo;
+
+	time(&rawtime);
+	if (rawtime == (time_t)-1) { HANDLE_ERROR(status, LIBTRASHCAN_TIME, error_0) }
+	if (localtime_r(&rawtime, &timeinfo) == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_TIME, error_0) }
+
+	/* Counter for when collisions occur because at least two files with the same name get deleted at the same time.
+	 * Start after the counter that was used last for this name within the same second. */
+	pthread_mutex_lock(counters_lock);
+	unsigned int counter = get_name_counter(location->counters, name, rawtime);
+	pthread_mutex_unlock(counters_lock);
+
+	unsigned char enforce_random_name = 0;
+
+	for (;;)
+	{
+		if (generate_filenames(arena, name, location->trash_info_dir, location->trash_files_dir, location->name_max, &timeinfo, counter, enforce_random_name, trash_info_file, trashed_file) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_FILENAMES, error_0) }
+
+		STATS_START(info_start)
+		int status_info = create_info_file(arena, *trash_info_file, resolved_path, &timeinfo, sync_data);
+		STATS_STOP(TRASHCAN_PHASE_TRASHINFO, info_start)
+
+		if (status_info == 0) /* Successful .trashinfo creation */
+		{
+			if (!enforce_random_name)
+			{
+				pthread_mutex_lock(counters_lock);
+				set_name_counter(&location->counters, name, rawtime, counter + 1);
+				pthread_mutex_unlock(counters_lock);
+			}
+
+			break; /* Done. */
+		}
+		else if (status_info == 1) /* Name collision occured. Repeat with a different name. */
+		{
+			counter++;
+
+			/* When even a random filename doesn't allow to create a trash info file without conflict, abort. */
+			if (enforce_random_name) { HANDLE_ERROR(status, LIBTRASHCAN_COLLISION, error_0) }
+
+			/* Can't generate unique name because the counter has wrapped. This shouldn't happen unless more files with 
+			 * the name get deleted simultaneously than there are numbers in the range of uint. Use random name instead. */
+			if (counter == 0) { enforce_random_name = 1; }
+			else if (find_free_counter(arena, location, name, &timeinfo, counter, &counter) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_FILENAMES, error_0) }
+
+			arena_release(arena, mark);
+			*trashed_file = NULL;
+			*trash_info_file = NULL;
+		}
+		else /* Some other error */
+		{
+			HANDLE_ERROR(status, LIBTRASHCAN_TRASHINFO, error_0)
+		}
+	}
+
+	return status;
+
+error_0:
+	arena_release(arena, mark);
+	*trash_info_file = NULL;
+	*trashed_file = NULL;
+	return status;
+}
+
+static int sync_trash(trashcan_ctx *ctx, struct trash_location *const *locations, size_t num_locations, const char *const *dirs, size_t num_dirs);
+
+/**
+ * @brief Moves a file or directory into a resolved trash location.
+ *
+ * Creates the .trashinfo file with a unique name and renames the file or directory
+ * into $trash/files. The directory size cache isn't updated. If copy_stat is given and
+ * the trash is on another filesystem, the file or directory is copied instead.
+ *
+ * In durable mode the .trashinfo file is flushed to disk before the file or directory is moved,
+ * so that no entry can be left without its .trashinfo file after a crash, and the move is flushed
+ * before returning. A copy is flushed before the original is removed. Both flushes are shared with
+ * concurrent deletions through sync_trash().
+ *
+ * On failure errno is preserved from the failed operation, so that callers can tell
+ * whether rename() failed with EXDEV.
+ *
+ * @param arena Arena in which the new path is allocated.
+ * @param location Trash location to which the file or directory is moved.
+ * @param counters_lock Mutex that protects the collision counters of the location.
+ * @param resolved_path Absolute path without symbolic links, as returned by realpath().
+ * @param copy_stat Result of lstat() for resolved_path to allow copying, NULL to only rename.
+ * @param threads Maximum number of threads for copying directories, 0 for the default.
+ * @param durable_ctx Context whose group commit is used in durable mode, NULL otherwise.
+ * @param trashed_file Address where pointer to the new path of the file or directory is stored.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int move_to_trash(struct arena *arena, struct trash_location *location, pthread_mutex_t *counters_lock, const char *resolved_path,
+						 const struct stat *copy_stat, size_t threads, trashcan_ctx *durable_ctx, char **trashed_file)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	int saved_errno = 0;
+	struct arena_mark mark = arena_get_mark(arena);
+	char *trash_info_file = NULL;
+	char *parent_dir = NULL;
+	size_t num_dirs = 0;
+
+#ifdef __linux__
+	const unsigned char sync_data = 0; /* syncfs() flushes the content along with the directories. */
+#else
+	const unsigned char sync_data = durable_ctx != NULL;
+#endif
+
+	status = create_trash_entry(arena, location, counters_lock, resolved_path, sync_data, &trash_info_file, trashed_file);
+	if (status < 0) { goto error_0; }
+
+	if (durable_ctx != NULL)
+	{
+		/* The directory that loses the entry is flushed as well. */
+		size_t parent_len = (size_t)(strrchr(resolved_path, '/') - resolved_path);
+		parent_dir = arena_strndup(arena, resolved_path, parent_len > 0 ? parent_len : 1);
+		if (parent_dir == NULL)
+		{
+			remove(trash_info_file);
+			HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_m1)
+		}
+
+		if (sync_trash(durable_ctx, &location, 1, NULL, 0) < 0)
+		{
+			remove(trash_info_file);
+			HANDLE_ERROR(status, LIBTRASHCAN_SYNC, error_m1)
+		}
+	}
+
+	/* Move file to trash */
+	STATS_START(rename_start)
+	int rename_status = rename(resolved_path, *trashed_file);
+	STATS_STOP(TRASHCAN_PHASE_RENAME, rename_start) /* clock_gettime() only sets errno if it fails. */
+	if (rename_status != 0)
+	{
+		saved_errno = errno;
+		if (copy_stat == NULL || saved_errno != EXDEV)
+		{
+			remove(trash_info_file);
+			HANDLE_ERROR(status, LIBTRASHCAN_RENAME, error_m1)
+		}
+
+		if (copy_into_trash(resolved_path, copy_stat, *trashed_file, threads) < 0)
+		{
+			remove(trash_info_file);
+			HANDLE_ERROR(status, LIBTRASHCAN_COPY, error_m1)
+		}
+
+		/* The copy is complete, so it keeps its .trashinfo file even if the original can't be removed. */
+		if (durable_ctx != NULL && sync_trash(durable_ctx, &location, 1, NULL, 0) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_SYNC, error_m1) }
+		if (remove_original(resolved_path, copy_stat, threads) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_COPYREMOVE, error_m1) }
+	}
+	else
+	{
+		num_dirs = 1; /* The original was on the same filesystem. */
+	}
+
+	if (durable_ctx != NULL && sync_trash(durable_ctx, &location, 1, (const char *const *)&parent_dir, num_dirs) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_SYNC, error_m1) }
+
+error_0:
+	return status;
+error_m1:
+	arena_release(arena, mark);
+	*trashed_file = NULL;
+	if (saved_errno != 0) { errno = saved_errno; }
+	return status;
+}
+
+/**
+ * @brief Deletion that waits for a group commit to flush its changes to disk.
+ */
+struct sync_waiter
+{
+	struct trash_location *const *locations; /**< Trash locations whose directories have been modified. */
+	size_t num_locations; /**< Number of locations. */
+	const char *const *dirs; /**< Other directories that have been modified. */
+	size_t num_dirs; /**< Number of other directories. */
+	int status; /**< Result of the group commit, set before done. */
+	unsigned char done; /**< Set once a group commit that started after the waiter was queued has completed. */
+	struct sync_waiter *next; /**< Next waiter of the same group commit. */
+};
+
+/**
+ * @brief Cached total size of a trash directory.
+ *
+ * The total is valid as long as the modification time of $trash/info hasn't changed, since every
+ * entry that is added or removed adds or removes its .trashinfo file. While a watcher keeps the
+ * total up to date, the modification time isn't checked.
+ */
+struct size_account
+{
+	dev_t device; /**< Device of $trash/info. */
+	ino_t inode; /**< Inode of $trash/info. */
+	struct timespec info_mtime; /**< Modification time of $trash/info for which total is valid. */
+	uint64_t total; /**< Sum of the sizes of all entries. */
+	unsigned int watchers; /**< Number of watchers that keep total up to date, see trashcan_watcher_create(). */
+};
+
+/**
+ * @brief Context that caches the resolution of trash directories between calls.
+ */
+struct trashcan_ctx
+{
+	char *data_home; /**< "$XDG_DATA_HOME" at the time the context was created. */
+	struct trash_location home; /**< Home trash location, its directories might not exist yet. */
+	struct mount_table mounts; /**< Cached mount table used to determine $topdir. */
+	struct trash_location **locations; /**< Trash locations that have been resolved and whose directories exist. */
+	size_t num_locations; /**< Number of resolved trash locations. */
+	size_t locations_capacity; /**< Number of elements allocated for locations. */
+	struct trash_location **retired; /**< Invalidated locations, kept until destruction since other threads might still use them. */
+	size_t num_retired; /**< Number of invalidated locations. */
+	size_t threads; /**< Maximum number of threads for parallel directory walks, 0 for the default. */
+	int flags; /**< Combination of TRASHCAN_COPY_FALLBACK and TRASHCAN_DURABLE. */
+	pthread_mutex_t lock; /**< Protects the locations, the mount table and the collision counters. */
+	pthread_mutex_t cache_lock; /**< Serializes updates of the directory size caches and the size accounts. */
+	struct size_account *accounts; /**< Total sizes of trash directories that have been queried with trashcan_total_size(). */
+	size_t num_accounts; /**< Number of size accounts. */
+	pthread_mutex_t sync_lock; /**< Protects the group commit and its statistics. */
+	pthread_cond_t sync_done; /**< Signaled when a group commit has been completed. */
+	struct sync_waiter *sync_pending; /**< Deletions waiting for the next group commit. */
+	unsigned char sync_running; /**< Set while a group commit flushes the trash. */
+	trashcan_sync_stats sync_stats; /**< Statistics of the group commits. */
+	struct submit_queue *queue; /**< Queue of asynchronous deletions, NULL until the first submission. */
+	size_t workers; /**< Number of worker threads for asynchronous deletions, 0 for the default. */
+	pthread_mutex_t index_lock; /**< Protects the indexes and their content. */
+	pthread_mutex_t index_load_lock; /**< Serializes trashcan_index_load(). */
+	struct trash_index *index; /**< Index of the trash by original path, NULL until it has been loaded. */
+	struct trash_index *index_loading; /**< Index that is being loaded, changes are applied to both. */
+};
+
+/**
+ * @brief Creates a context for repeated calls of the API.
+ *
+ * @param ctx Address where pointer to the context is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_ctx_create(trashcan_ctx **ctx)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+
+	*ctx = calloc(1, sizeof(**ctx));
+	if (*ctx == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+	mount_table_init(&(*ctx)->mounts);
+
+	status = get_home_location(&(*ctx)->home, &(*ctx)->data_home);
+	if (status < 0) { goto error_m1; }
+
+	pthread_mutex_init(&(*ctx)->lock, NULL);
+	pthread_mutex_init(&(*ctx)->cache_lock, NULL);
+	pthread_mutex_init(&(*ctx)->sync_lock, NULL);
+	pthread_cond_init(&(*ctx)->sync_done, NULL);
+	pthread_mutex_init(&(*ctx)->index_lock, NULL);
+	pthread_mutex_init(&(*ctx)->index_load_lock, NULL);
+
+error_0:
+	return status;
+error_m1:
+	free(*ctx);
+	*ctx = NULL;
+	return status;
+}
+
+static void stop_submit_queue(trashcan_ctx *ctx);
+static void free_trash_index(struct trash_index *index);
+static void index_add_trashed(trashcan_ctx *ctx, const struct trash_location *location, const char *trashed_file);
+static int index_active(trashcan_ctx *ctx);
+static int read_index_entry(const char *trash_dir, const char *name, struct stat *dir_stat, char **original_path, char *deletion_date, size_t date_size);
+static void index_remove_trashed(trashcan_ctx *ctx, const char *trash_dir, const struct stat *dir_stat, const char *original_path, const char *name);
+
+/**
+ * @brief Destroys a context created by `trashcan_ctx_create()`.
+ *
+ * Pending asynchronous deletions are completed first.
+ *
+ * @param ctx Context to destroy, may be NULL.
+ */
+void trashcan_ctx_destroy(trashcan_ctx *ctx)
+{
+	if (ctx == NULL) { return; }
+
+	stop_submit_queue(ctx);
+
+	for (size_t i = 0; i < ctx->num_locations; i++)
+	{
+		free_trash_location(ctx->locations[i]);
+		free(ctx->locations[i]);
+	}
+
+	for (size_t i = 0; i < ctx->num_retired; i++)
+	{
+		free_trash_location(ctx->retired[i]);
+		free(ctx->retired[i]);
+	}
+
+	free_trash_index(ctx->index);
+	pthread_mutex_destroy(&ctx->index_load_lock);
+	pthread_mutex_destroy(&ctx->index_lock);
+	pthread_cond_destroy(&ctx->sync_done);
+	pthread_mutex_destroy(&ctx->sync_lock);
+	pthread_mutex_destroy(&ctx->cache_lock);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx->accounts);
+	free(ctx->retired);
+	free(ctx->locations);
+	mount_table_free(&ctx->mounts);
+	free_trash_location(&ctx->home);
+	free(ctx->data_home);
+	free(ctx);
+}
+
+/**
+ * @brief Sets the maximum number of threads used for parallel directory walks.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param threads Maximum number of threads, 0 for the number of online processors (at most 16).
+ */
+void trashcan_ctx_set_threads(trashcan_ctx *ctx, size_t threads)
+{
+	ctx->threads = threads;
+}
+
+/**
+ * @brief Sets flags that change how files are moved to the trash.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param flags 0 or a combination of TRASHCAN_COPY_FALLBACK and TRASHCAN_DURABLE.
+ */
+void trashcan_ctx_set_flags(trashcan_ctx *ctx, int flags)
+{
+	ctx->flags = flags;
+}
+
+/**
+ * @brief Flushes a directory, or on Linux the whole filesystem that contains it, to disk.
+ *
+ * @param path Path to the directory.
+ * @return 0 when successful, negative otherwise.
+ */
+static int sync_dir(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) { return -1; }
+
+#ifdef __linux__
+	int status = syncfs(fd);
+#else
+	int status = fsync(fd);
+#endif
+
+	close(fd);
+	return status;
+}
+
+/**
+ * @brief Flushes the changes of a group of deletions to disk.
+ *
+ * On Linux one syncfs() per filesystem flushes the .trashinfo files, the trash directories and
+ * the directories the files were moved from. Other systems fsync() every directory once, the
+ * .trashinfo files have been flushed when they were written.
+ *
+ * @param group Waiters of the group commit.
+ * @return 0 when successful, negative otherwise.
+ */
+static int run_group_sync(const struct sync_waiter *group)
+{
+	int status = 0;
+
+	for (const struct sync_waiter *waiter = group; waiter != NULL; waiter = waiter->next)
+	{
+		for (size_t i = 0; i < waiter->num_locations; i++)
+		{
+			const struct trash_location *location = waiter->locations[i];
+			unsigned char flushed = 0;
+
+			/* Locations of the same device have been flushed for an earlier waiter of the group. */
+			for (const struct sync_waiter *earlier = group; earlier != NULL && !flushed; earlier = earlier->next)
+			{
+				size_t num_earlier = earlier == waiter ? i : earlier->num_locations;
+				for (size_t k = 0; k < num_earlier && !flushed; k++) { flushed = earlier->locations[k]->device == location->device; }
+				if (earlier == waiter) { break; }
+			}
+			if (flushed) { continue; }
+
+			if (sync_dir(location->trash_info_dir) < 0) { status = -1; }
+#ifndef __linux__
+			if (sync_dir(location->trash_files_dir) < 0) { status = -1; }
+#endif
+		}
+
+#ifndef __linux__
+		for (size_t i = 0; i < waiter->num_dirs; i++)
+		{
+			if (sync_dir(waiter->dirs[i]) < 0) { status = -1; }
+		}
+#endif
+	}
+
+	return status;
+}
+
+/**
+ * @brief Waits until the changes of a deletion have been flushed to disk by a group commit.
+ *
+ * Deletions that arrive while a group commit is running are collected for the next one, which
+ * is run by the first of them once the running one has completed. A single flush thus covers
+ * every deletion that arrived in the meantime.
+ *
+ * @param ctx Context whose group commit is used.
+ * @param locations Trash locations whose directories have been modified.
+ * @param num_locations Number of locations.
+ * @param dirs Other directories that have been modified, e.g. those the files were moved from.
+ * @param num_dirs Number of other directories.
+ * @return 0 when successful, negative otherwise.
+ */
+static int sync_trash(trashcan_ctx *ctx, struct trash_location *const *locations, size_t num_locations, const char *const *dirs, size_t num_dirs)
+{
+	struct sync_waiter waiter;
+	waiter.locations = locations;
+	waiter.num_locations = num_locations;
+	waiter.dirs = dirs;
+	waiter.num_dirs = num_dirs;
+	waiter.status = 0;
+	waiter.done = 0;
+
+	uint64_t wait_start = monotonic_ns();
+
+	pthread_mutex_lock(&ctx->sync_lock);
+	waiter.next = ctx->sync_pending;
+	ctx->sync_pending = &waiter;
+
+	while (!waiter.done)
+	{
+		if (ctx->sync_running)
+		{
+			pthread_cond_wait(&ctx->sync_done, &ctx->sync_lock);
+			continue;
+		}
+
+		/* Lead the next group commit, which includes all waiters that are queued at this point. */
+		struct sync_waiter *group = ctx->sync_pending;
+		ctx->sync_pending = NULL;
+		ctx->sync_running = 1;
+		pthread_mutex_unlock(&ctx->sync_lock);
+
+		uint64_t sync_start = monotonic_ns();
+		int status = run_group_sync(group);
+		uint64_t sync_ns = monotonic_ns() - sync_start;
+
+		pthread_mutex_lock(&ctx->sync_lock);
+		ctx->sync_stats.syncs++;
+		ctx->sync_stats.sync_ns += sync_ns;
+		if (sync_ns > ctx->sync_stats.max_sync_ns) { ctx->sync_stats.max_sync_ns = sync_ns; }
+
+		while (group != NULL)
+		{
+			struct sync_waiter *next = group->next; /* The waiter may return as soon as done is set. */
+			group->status = status;
+			group->done = 1;
+			group = next;
+		}
+
+		ctx->sync_running = 0;
+		pthread_cond_broadcast(&ctx->sync_done);
+	}
+
+	uint64_t wait_ns = monotonic_ns() - wait_start;
+	ctx->sync_stats.waits++;
+	ctx->sync_stats.wait_ns += wait_ns;
+	if (wait_ns > ctx->sync_stats.max_wait_ns) { ctx->sync_stats.max_wait_ns = wait_ns; }
+	pthread_mutex_unlock(&ctx->sync_lock);
+
+	return waiter.status;
+}
+
+/**
+ * @brief Retrieves the statistics of the group commits of durable mode.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param stats Address where the statistics are stored.
+ */
+void trashcan_ctx_get_sync_stats(trashcan_ctx *ctx, trashcan_sync_stats *stats)
+{
+	pthread_mutex_lock(&ctx->sync_lock);
+	*stats = ctx->sync_stats;
+	pthread_mutex_unlock(&ctx->sync_lock);
+}
+
+/**
+ * @brief Returns the trash location for a device, resolving and caching it if necessary.
+ *
+ * Has to be called with ctx->lock held.
+ *
+ * @param ctx Context in which the location is cached.
+ * @param device Device of the file or directory that shall be trashed.
+ * @param path Resolved path of the file or directory, only used if the location isn't cached yet, may be NULL.
+ * @param location Address where pointer to the cached location is stored.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int get_trash_location(trashcan_ctx *ctx, dev_t device, const char *path, struct trash_location **location)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	*location = NULL;
+
+	for (size_t i = 0; i < ctx->num_locations; i++)
+	{
+		if (ctx->locations[i]->device == device)
+		{
+			*location = ctx->locations[i];
+			return status;
+		}
+	}
+
+	if (ctx->num_locations == ctx->locations_capacity)
+	{
+		size_t capacity = ctx->locations_capacity == 0 ? 4 : ctx->locations_capacity * 2;
+		struct trash_location **locations = realloc(ctx->locations, capacity * sizeof(*locations));
+		if (locations == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+		ctx->locations = locations;
+		ctx->locations_capacity = capacity;
+	}
+
+	struct trash_location *new_location = malloc(sizeof(*new_location));
+	if (new_location == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+	status = resolve_trash_location(&ctx->home, &ctx->mounts, device, path, new_location);
+	if (status < 0)
+	{
+		free(new_location);
+		goto error_0;
+	}
+
+	ctx->locations[ctx->num_locations] = new_location;
+	ctx->num_locations++;
+	*location = new_location;
+
+error_0:
+	return status;
+}
+
+/**
+ * @brief Removes a trash location from the cache, e.g. because its directories have been removed.
+ *
+ * The location is retired instead of freed, because other threads might still move files to it.
+ * Another thread might have invalidated the location already, in which case nothing happens.
+ * Has to be called with ctx->lock held.
+ *
+ * @param ctx Context in which the location is cached.
+ * @param location Location to remove.
+ */
+static void invalidate_trash_location(trashcan_ctx *ctx, struct trash_location *location)
+{
+	for (size_t i = 0; i < ctx->num_locations; i++)
+	{
+		if (ctx->locations[i] == location)
+		{
+			struct trash_location **retired = realloc(ctx->retired, (ctx->num_retired + 1) * sizeof(*retired));
+			if (retired == NULL) { return; } /* Keep using the outdated location, the retry fails again. */
+
+			ctx->retired = retired;
+			ctx->retired[ctx->num_retired] = location;
+			ctx->num_retired++;
+			ctx->locations[i] = ctx->locations[ctx->num_locations - 1];
+			ctx->num_locations--;
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Finds the size account of a trash directory. Has to be called with ctx->cache_lock held.
+ *
+ * @param ctx Context in which the accounts are cached.
+ * @param info_stat Result of stat() for $trash/info.
+ * @return The account, NULL if the trash directory has no account.
+ */
+static struct size_account *find_size_account(trashcan_ctx *ctx, const struct stat *info_stat)
+{
+	for (size_t i = 0; i < ctx->num_accounts; i++)
+	{
+		if (ctx->accounts[i].device == info_stat->st_dev && ctx->accounts[i].inode == info_stat->st_ino) { return &ctx->accounts[i]; }
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Applies a change of the entries of a trash directory to its size account.
+ *
+ * The account is only updated if $trash/info hasn't been modified between the last validation and
+ * the change, i.e. if before_stat still matches. Otherwise the trash has been modified by someone
+ * else in the meantime and the account is dropped, so that the next query walks the trash again.
+ * Accounts that are kept up to date by a watcher are left to it.
+ *
+ * @param ctx Context in which the accounts are cached.
+ * @param trash_info_dir Path to $trash/info.
+ * @param before_stat Result of stat() for trash_info_dir before the change, zeroed if unknown.
+ * @param added Size of the entries that have been added.
+ * @param removed Size of the entries that have been removed.
+ */
+static void update_size_account(trashcan_ctx *ctx, const char *trash_info_dir, const struct stat *before_stat, uint64_t added, uint64_t removed)
+{
+	struct stat after_stat;
+
+	pthread_mutex_lock(&ctx->cache_lock);
+
+	struct size_account *account = find_size_account(ctx, before_stat);
+	if (account != NULL && account->watchers == 0)
+	{
+		if (account->info_mtime.tv_sec == before_stat->st_mtim.tv_sec && account->info_mtime.tv_nsec == before_stat->st_mtim.tv_nsec &&
+			stat(trash_info_dir, &after_stat) == 0)
+		{
+			account->info_mtime = after_stat.st_mtim;
+			account->total += added;
+			account->total -= removed < account->total ? removed : account->total;
+		}
+		else
+		{
+			*account = ctx->accounts[ctx->num_accounts - 1];
+			ctx->num_accounts--;
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->cache_lock);
+}
+
+/**
+ * @brief Moves a file or a directory into the trash of its device.
+ *
+ * The trash location is taken from the context. If the .trashinfo file can't be created, the cached
+ * location might be outdated, e.g. because another application removed the trash directory. In that
+ * case the location is resolved again and the move is retried once.
+ *
+ * @param ctx Context in which the location is cached.
+ * @param arena Arena in which the resolved path and the new path are allocated.
+ * @param path Path to the file or directory that shall be moved to the trash.
+ * @param path_stat Address where the result of lstat() for the path is stored.
+ * @param location Address where pointer to the used trash location is stored.
+ * @param info_stat Address where the result of stat() for the info directory of the location before
+ * the move is stored, zeroed if it couldn't be determined. Used for update_size_account().
+ * @param trashed_file Address where pointer to the new path of the file or directory is stored.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int soft_delete_ctx(trashcan_ctx *ctx, struct arena *arena, const char *path, struct stat *path_stat, struct trash_location **location, struct stat *info_stat, char **trashed_file)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	char *resolved_path = NULL;
+	trashcan_ctx *durable_ctx = (ctx->flags & TRASHCAN_DURABLE) ? ctx : NULL;
+	*trashed_file = NULL;
+
+	STATS_START(realpath_start)
+	resolved_path = arena_realpath(arena, path);
+	STATS_STOP(TRASHCAN_PHASE_REALPATH, realpath_start)
+	if (resolved_path == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_REALPATH, error_0) }
+
+	if (lstat(resolved_path, path_stat)) { HANDLE_ERROR(status, LIBTRASHCAN_PATHSTAT, error_0) }
+
+	pthread_mutex_lock(&ctx->lock);
+	status = get_trash_location(ctx, path_stat->st_dev, resolved_path, location);
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (status == LIBTRASHCAN_SUCCESS)
+	{
+		if (stat((*location)->trash_info_dir, info_stat) != 0) { memset(info_stat, 0, sizeof(*info_stat)); }
+		status = move_to_trash(arena, *location, &ctx->lock, resolved_path, NULL, 0, durable_ctx, trashed_file);
+	}
+
+	if (status == LIBTRASHCAN_TRASHINFO)
+	{
+		pthread_mutex_lock(&ctx->lock);
+		invalidate_trash_location(ctx, *location);
+		status = get_trash_location(ctx, path_stat->st_dev, resolved_path, location);
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (status == LIBTRASHCAN_SUCCESS)
+		{
+			if (stat((*location)->trash_info_dir, info_stat) != 0) { memset(info_stat, 0, sizeof(*info_stat)); }
+			status = move_to_trash(arena, *location, &ctx->lock, resolved_path, NULL, 0, durable_ctx, trashed_file);
+		}
+	}
+
+	/* The topdir trash of the device can't be used, or the path is on a bind mount from which rename()
+	 * refuses to move files. Copy the file or directory into the home trash instead. */
+	if ((ctx->flags & TRASHCAN_COPY_FALLBACK) &&
+		(((status == LIBTRASHCAN_TOPDIRTRASH || status == LIBTRASHCAN_MKDIRHOME || status == LIBTRASHCAN_TRASHINFO) && path_stat->st_dev != ctx->home.device) ||
+		 (status == LIBTRASHCAN_RENAME && errno == EXDEV)))
+	{
+		/* Don't copy what can't be removed afterwards, e.g. from read-only filesystems. */
+		size_t parent_len = (size_t)(strrchr(resolved_path, '/') - resolved_path);
+		char *parent = arena_strndup(arena, resolved_path, parent_len > 0 ? parent_len : 1);
+		if (parent == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+		if (access(parent, W_OK | X_OK) != 0) { goto error_0; }
+
+		pthread_mutex_lock(&ctx->lock);
+		status = get_trash_location(ctx, ctx->home.device, NULL, location);
+		pthread_mutex_unlock(&ctx->lock);
+		if (status < 0) { goto error_0; }
+
+		if (stat((*location)->trash_info_dir, info_stat) != 0) { memset(info_stat, 0, sizeof(*info_stat)); }
+		status = move_to_trash(arena, *location, &ctx->lock, resolved_path, path_stat, ctx->threads, durable_ctx, trashed_file);
+	}
+
+error_0:
+	return status;
+}
+
+/**
+ * @brief Moves a file or a directory (and its content) to the trash using a context and reports the
+ * result as soon as it has been moved.
+ *
+ * The callback is called before a trashed directory is sized for the directory size cache, so that
+ * the caller doesn't wait for the walk. A failure to update the cache is only returned.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param path Path to the file or directory that shall be moved to the trash.
+ * @param callback Function called once with the result, may be NULL.
+ * @param userdata Argument passed to the callback.
+ * @return 0 when successful, negative otherwise.
+ */
+static int soft_delete_notify(trashcan_ctx *ctx, const char *path, trashcan_callback callback, void *userdata)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct arena arena;
+	char *trashed_file = NULL;
+	struct trash_location *location = NULL;
+	struct stat path_stat;
+	struct stat info_stat;
+	uint64_t added_size = 0;
+	STATS_START(total_start)
+
+	/* All strings of the deletion are taken from one arena, which is freed in one step. */
+	arena_init(&arena, DELETE_ARENA_SIZE);
+	status = soft_delete_ctx(ctx, &arena, path, &path_stat, &location, &info_stat, &trashed_file);
+	if (status < 0) { goto error_0; }
+
+	index_add_trashed(ctx, location, trashed_file);
+
+	if (callback != NULL)
+	{
+		callback(path, status, userdata);
+		callback = NULL;
+	}
+
+	if (S_ISREG(path_stat.st_mode)) { added_size = (uint64_t)path_stat.st_size; }
+
+	/* Only directories are listed in the cache, so there's nothing to do for other file types. */
+	if (S_ISDIR(path_stat.st_mode))
+	{
+		const char *trashed_name = trashed_file + strlen(location->trash_files_dir) + 1;
+		STATS_START(cache_start)
+		int cache_status = append_dir_size_lines(location->trash_dir, location->trash_info_dir, location->trash_files_dir, &trashed_name, 1, ctx->threads, &added_size);
+		STATS_STOP(TRASHCAN_PHASE_DIRCACHE, cache_start)
+		if (cache_status < 0) { HANDLE_ERROR(status, LIBTRASHCAN_DIRCACHE, error_0) }
+	}
+
+	update_size_account(ctx, location->trash_info_dir, &info_stat, added_size, 0);
+
+error_0:
+	if (callback != NULL) { callback(path, status, userdata); }
+	arena_free(&arena);
+	STATS_STOP(TRASHCAN_PHASE_TOTAL, total_start)
+	return status;
+}
+
+/**
+ * @brief Moves a file or a directory (and its content) to the trash using a context.
+ *
+ * @warning Do not change the current working directory when using this in a multithreaded application!
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param path Path to the file or directory that shall be moved to the trash.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_soft_delete_ctx(trashcan_ctx *ctx, const char *path)
+{
+	return soft_delete_notify(ctx, path, NULL, NULL);
+}
+
+/**
+ * @brief Determines the path of the socket of trashcand for the home trash.
+ *
+ * @param path Address where pointer to the path is stored, has to be freed.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_daemon_socket(char **path)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	char *data_home = NULL;
+	char *trash_dir = NULL;
+	char *trash_info_dir = NULL;
+	char *trash_files_dir = NULL;
+	*path = NULL;
+
+	const char *socket_path = getenv("TRASHCAND_SOCKET");
+	if (socket_path != NULL)
+	{
+		/* An empty value disables the daemon. */
+		if (socket_path[0] == '\0') { HANDLE_ERROR(status, LIBTRASHCAN_NODAEMON, error_0) }
+		*path = strdup(socket_path);
+		if (*path == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+		goto error_0;
+	}
+
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir == NULL || runtime_dir[0] == '\0') { HANDLE_ERROR(status, LIBTRASHCAN_NODAEMON, error_0) }
+	if (get_home_trash_dir(&data_home, &trash_dir, &trash_info_dir, &trash_files_dir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_HOMETRASH, error_0) }
+
+	/* One daemon per home trash, so that a client with another $XDG_DATA_HOME doesn't use it. */
+	if (asprintf(path, "%s/trashcand-%016" PRIx64 ".sock", runtime_dir, (uint64_t)hash_name(data_home)) < 0)
+	{
+		*path = NULL;
+		status = LIBTRASHCAN_ALLOC;
+	}
+
+	free(trash_files_dir);
+	free(trash_info_dir);
+	free(trash_dir);
+	free(data_home);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Sends a buffer completely over a socket, without raising SIGPIPE if the peer is gone.
+ *
+ * @return 0 when successful, negative otherwise.
+ */
+static int send_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+
+	while (len > 0)
+	{
+		ssize_t num_sent = send(fd, ptr, len, MSG_NOSIGNAL);
+		if (num_sent < 0)
+		{
+			if (errno == EINTR) { continue; }
+			return -1;
+		}
+		ptr += num_sent;
+		len -= (size_t)num_sent;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Receives exactly len bytes from a socket.
+ *
+ * @return 0 when successful, negative on failure or if the peer has closed the connection.
+ */
+static int recv_all(int fd, void *buf, size_t len)
+{
+	char *ptr = buf;
+
+	while (len > 0)
+	{
+		ssize_t num_received = recv(fd, ptr, len, 0);
+		if (num_received < 0 && errno == EINTR) { continue; }
+		if (num_received <= 0) { return -1; }
+		ptr += num_received;
+		len -= (size_t)num_received;
+	}
+
+	return 0;
+}
+
+/* Time after which a daemon that doesn't accept, read or answer a request is given up on. */
+#define DAEMON_TIMEOUT_MS 10000
+
+_Static_assert(TRASHCAND_REFUSED == LIBTRASHCAN_NODAEMON, "Refused deletions have to fall back to the in-process deletion");
+
+/**
+ * @brief Moves a file or directory to the trash through trashcand, if it's running for the home trash.
+ *
+ * The socket has to belong to the effective user, so that no other user can intercept the paths.
+ * The device and inode of the path are sent along, so that the daemon refuses paths that refer to
+ * another file in its mount namespace. If the daemon can't be reached, the request can't be sent
+ * or the daemon refuses it, nothing has been moved and the caller falls back to moving the path
+ * itself. Once the request has been sent, the result is up to the daemon. If it doesn't answer
+ * within DAEMON_TIMEOUT_MS, e.g. because it's busy with a large directory, the path may still be
+ * moved later.
+ *
+ * @param path Path to the file or directory that shall be moved to the trash.
+ * @return Status code of the daemon, LIBTRASHCAN_NODAEMON if it isn't running or refused the path,
+ * LIBTRASHCAN_DAEMON if the connection has been lost or timed out before the response arrived.
+ */
+static int daemon_soft_delete(const char *path)
+{
+	int status = LIBTRASHCAN_NODAEMON;
+	char *socket_path = NULL;
+	char *absolute_path = NULL;
+	struct sockaddr_un address;
+	struct trashcand_header header;
+	struct trashcand_delete request;
+	struct stat path_stat;
+	struct timeval timeout = { .tv_sec = DAEMON_TIMEOUT_MS / 1000, .tv_usec = (DAEMON_TIMEOUT_MS % 1000) * 1000 };
+	int32_t result;
+	int fd = -1;
+
+	if (trashcan_daemon_socket(&socket_path) < 0) { goto error_0; }
+	if (strlen(socket_path) >= sizeof(address.sun_path)) { goto error_1; }
+
+	/* The daemon has another working directory. */
+	if (path[0] != '/')
+	{
+		char *cwd = getcwd(NULL, 0);
+		if (cwd == NULL) { goto error_1; }
+		if (asprintf(&absolute_path, "%s/%s", cwd, path) < 0) { absolute_path = NULL; }
+		free(cwd);
+		if (absolute_path == NULL) { goto error_1; }
+		path = absolute_path;
+	}
+	if (strlen(path) > TRASHCAND_MAX_PAYLOAD - sizeof(request)) { goto error_1; }
+
+	/* Paths that don't exist are left to the in-process deletion, which reports the error. */
+	if (lstat(path, &path_stat) != 0) { goto error_1; }
+	request.device = (uint64_t)path_stat.st_dev;
+	request.inode = (uint64_t)path_stat.st_ino;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) { goto error_1; }
+
+	/* The send timeout also limits connect() if the backlog of the daemon is full. */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) { goto error_2; }
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, socket_path, strlen(socket_path) + 1);
+	if (connect(fd, (const struct sockaddr *)&address, sizeof(address)) != 0) { goto error_2; }
+
+#ifdef __linux__
+	struct ucred credentials;
+	socklen_t credentials_len = sizeof(credentials);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_len) != 0 || credentials.uid != geteuid()) { goto error_2; }
+#else
+	uid_t peer_uid;
+	gid_t peer_gid;
+	if (getpeereid(fd, &peer_uid, &peer_gid) != 0 || peer_uid != geteuid()) { goto error_2; }
+#endif
+
+	/* A request that hasn't been sent completely is discarded by the daemon. */
+	header.length = (uint32_t)(sizeof(request) + strlen(path));
+	header.id = 0;
+	header.op = TRASHCAND_DELETE;
+	header.flags = 0;
+	if (send_all(fd, &header, sizeof(header)) < 0 || send_all(fd, &request, sizeof(request)) < 0 || send_all(fd, path, strlen(path)) < 0) { goto error_2; }
+
+	/* The daemon may have moved the path already, so there's no fallback anymore. */
+	if (recv_all(fd, &header, sizeof(header)) < 0 || header.op != TRASHCAND_DELETE || header.length != sizeof(result) ||
+		recv_all(fd, &result, sizeof(result)) < 0)
+	{
+		HANDLE_ERROR(status, LIBTRASHCAN_DAEMON, error_2)
+	}
+	status = result;
+
+error_2:
+	close(fd);
+error_1:
+	free(absolute_path);
+	free(socket_path);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Moves a file or a directory (and its content) to the trash.
+ *
+ * @warning Do not change the current working directory when using this in a multithreaded application!
+ *
+ * If trashcand is running for the home trash, the path is moved by the daemon, whose context is
+ * already warm. Otherwise, or if the daemon refuses the path, a context is created for this call.
+ *
+ * @param path Path to the file or directory that shall be moved to the trash.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_soft_delete(const char *path)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	trashcan_ctx *ctx = NULL;
+
+	status = daemon_soft_delete(path);
+	if (status != LIBTRASHCAN_NODAEMON) { goto error_0; }
+
+	status = trashcan_ctx_create(&ctx);
+	if (status < 0) { goto error_0; }
+
+	status = trashcan_soft_delete_ctx(ctx, path);
+
+	trashcan_ctx_destroy(ctx);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Directory that has been moved to the trash during a batch and needs a directory size cache update.
+ */
+struct pending_dir
+{
+	size_t path_idx; /**< Index of the path in the batch. */
+	const struct trash_location *location; /**< Trash location the directory was moved to. */
+	char *trashed_file; /**< New path of the directory, allocated in the arena of the batch. */
+};
+
+/**
+ * @brief Path of a batch that is moved to the trash before the remaining paths are handled one by one.
+ *
+ * Used for the linked io_uring requests and for the two phases of durable batches. The strings are
+ * allocated in an arena and are never freed individually.
+ */
+struct batch_move
+{
+	unsigned char done; /**< Set if the path has been handled, otherwise it's left to soft_delete_ctx(). */
+	int status; /**< Status code of the path, only valid if done is set. */
+	struct stat path_stat; /**< Result of lstat() for the resolved path. */
+	struct trash_location *location; /**< Trash location the path is moved to. */
+	char *resolved_path; /**< Absolute path without symbolic links. */
+	char *trash_info_file; /**< Path of the .trashinfo file. */
+	char *trashed_file; /**< New path of the file or directory. */
+#ifdef TRASHCAN_IO_URING
+	char *info_content; /**< Content of the .trashinfo file. */
+	size_t info_len; /**< Length of the content. */
+	int results[4]; /**< Results of openat, write, close and renameat. */
+#endif
+};
+
+#ifdef TRASHCAN_IO_URING
+/* Number of paths whose requests are submitted together. Each path takes four submission queue entries. */
+#define URING_MOVE_GROUP 64
+
+/* Batches with fewer paths aren't worth setting up a ring. */
+#define URING_MOVE_MIN_PATHS 16
+
+/**
+ * @brief Determines the names of a path in the trash and the content of its .trashinfo file.
+ *
+ * The counter of the name is reserved in the location, so that other paths with the same name
+ * in the batch get a different one. Any failure leaves the path to soft_delete_ctx(), which
+ * reports the proper status code.
+ *
+ * @param ctx Context in which the locations are cached.
+ * @param arena Arena in which the strings of the move are allocated.
+ * @param path Path that shall be moved to the trash.
+ * @param move Address where the prepared move is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+static int prepare_uring_move(trashcan_ctx *ctx, struct arena *arena, const char *path, struct batch_move *move)
+{
+	time_t rawtime;
+	struct tm timeinfo;
+
+	move->resolved_path = arena_realpath(arena, path);
+	if (move->resolved_path == NULL) { return -1; }
+	if (lstat(move->resolved_path, &move->path_stat) != 0) { return -1; }
+
+	const char *name = strrchr(move->resolved_path, '/');
+	if (name == NULL) { return -1; }
+	name++;
+
+	time(&rawtime);
+	if (rawtime == (time_t)-1 || localtime_r(&rawtime, &timeinfo) == NULL) { return -1; }
+
+	pthread_mutex_lock(&ctx->lock);
+	int status = get_trash_location(ctx, move->path_stat.st_dev, move->resolved_path, &move->location);
+	unsigned int counter = 0;
+	if (status == LIBTRASHCAN_SUCCESS)
+	{
+		counter = get_name_counter(move->location->counters, name, rawtime);
+		set_name_counter(&move->location->counters, name, rawtime, counter + 1);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	if (status < 0) { return -1; }
+
+	if (generate_filenames(arena, name, move->location->trash_info_dir, move->location->trash_files_dir, move->location->name_max, &timeinfo, counter, 0, &move->trash_info_file, &move->trashed_file) < 0) { return -1; }
+	if (format_info_file(arena, move->resolved_path, &timeinfo, &move->info_content, &move->info_len) < 0) { return -1; }
+
+	return 0;
+}
+
+/**
+ * @brief Queues the linked requests that move a path to the trash.
+ *
+ * The .trashinfo file is created exclusively as a direct descriptor in the given slot, written,
+ * closed and then the path is renamed. If a request fails, the following ones are cancelled.
+ *
+ * @param ring The ring.
+ * @param move Prepared move.
+ * @param idx Index of the move within the group, used as slot and in the user data.
+ */
+static void queue_uring_move(struct io_uring *ring, struct batch_move *move, unsigned int idx)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	io_uring_prep_openat_direct(sqe, AT_FDCWD, move->trash_info_file, O_WRONLY | O_CREAT | O_EXCL, 0666, idx);
+	io_uring_sqe_set_data64(sqe, (uint64_t)idx * 4);
+	sqe->flags |= IOSQE_IO_LINK;
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_write(sqe, (int)idx, move->info_content, (unsigned)move->info_len, 0);
+	io_uring_sqe_set_data64(sqe, (uint64_t)idx * 4 + 1);
+	sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_close_direct(sqe, idx);
+	io_uring_sqe_set_data64(sqe, (uint64_t)idx * 4 + 2);
+	sqe->flags |= IOSQE_IO_LINK;
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_renameat(sqe, AT_FDCWD, move->resolved_path, AT_FDCWD, move->trashed_file, 0);
+	io_uring_sqe_set_data64(sqe, (uint64_t)idx * 4 + 3);
+
+	for (size_t i = 0; i < 4; i++) { move->results[i] = -ECANCELED; }
+}
+
+/**
+ * @brief Evaluates the results of the linked requests of a move.
+ *
+ * Paths whose .trashinfo file couldn't be created, e.g. because of a name collision with another
+ * application, or whose rename failed with EXDEV are left to soft_delete_ctx(). If the rename
+ * failed, the .trashinfo file is removed.
+ *
+ * @param move Move whose requests have been completed.
+ */
+static void complete_uring_move(struct batch_move *move)
+{
+	if (move->results[0] < 0) { return; } /* Not created, nothing to clean up */
+
+	if (move->results[1] != (int)move->info_len || move->results[2] < 0 || move->results[3] == -ECANCELED || move->results[3] == -EXDEV)
+	{
+		/* The rename hasn't been executed or refused to cross filesystems, e.g. from a bind mount.
+		 * The path is retried, so that it can be copied with TRASHCAN_COPY_FALLBACK. */
+		remove(move->trash_info_file);
+		return;
+	}
+
+	move->done = 1;
+	if (move->results[3] < 0)
+	{
+		remove(move->trash_info_file);
+		move->status = LIBTRASHCAN_RENAME;
+	}
+	else
+	{
+		move->status = LIBTRASHCAN_SUCCESS;
+	}
+}
+
+/**
+ * @brief Moves the paths of a batch to the trash with linked io_uring requests.
+ *
+ * Instead of one system call per step, each path is moved by a chain of openat, write, close and
+ * renameat requests, and the chains of a group of paths are submitted with one system call. Paths
+ * that can't be handled this way are left to soft_delete_ctx(). If io_uring isn't available, e.g.
+ * because the kernel is too old, all paths are left to it.
+ *
+ * The strings of a group are allocated in an arena that is freed after the group, only the new
+ * paths of successful moves are copied into the arena of the batch.
+ *
+ * @param ctx Context in which the locations are cached.
+ * @param arena Arena of the batch.
+ * @param paths Paths that shall be moved to the trash.
+ * @param num_paths Number of paths.
+ * @param moves Array of num_paths elements where the results are stored.
+ */
+static void uring_move_paths(trashcan_ctx *ctx, struct arena *arena, const char **paths, size_t num_paths, struct batch_move *moves)
+{
+	struct io_uring ring;
+	struct arena group_arena;
+	int slots[URING_MOVE_GROUP];
+	unsigned char ring_ok = 1;
+
+	if (num_paths < URING_MOVE_MIN_PATHS) { return; }
+	if (io_uring_queue_init(URING_MOVE_GROUP * 4, &ring, 0) < 0) { return; }
+
+	/* Sparse table of direct descriptors, one slot per path of a group. A slot that is still in use
+	 * because a chain failed after the openat is replaced by the next openat into it. */
+	for (size_t i = 0; i < URING_MOVE_GROUP; i++) { slots[i] = -1; }
+	if (io_uring_register_files(&ring, slots, URING_MOVE_GROUP) < 0) { ring_ok = 0; }
+	arena_init(&group_arena, DELETE_ARENA_SIZE);
+
+	for (size_t first = 0; first < num_paths && ring_ok;)
+	{
+		size_t group[URING_MOVE_GROUP];
+		unsigned int num_queued = 0;
+		size_t last = first;
+
+		for (; last < num_paths && num_queued < URING_MOVE_GROUP; last++)
+		{
+			if (prepare_uring_move(ctx, &group_arena, paths[last], &moves[last]) < 0) { continue; }
+
+			queue_uring_move(&ring, &moves[last], num_queued);
+			group[num_queued] = last;
+			num_queued++;
+		}
+
+		int submitted = num_queued > 0 ? io_uring_submit(&ring) : 0;
+		if (submitted < 0) { submitted = 0; }
+		if ((unsigned int)submitted < num_queued * 4) { ring_ok = 0; } /* Entries that weren't submitted remain in the ring */
+
+		/* Every submitted request completes exactly once, also when it's cancelled because an earlier link failed. */
+		for (int seen = 0; seen < submitted; seen++)
+		{
+			struct io_uring_cqe *cqe = NULL;
+			int ret;
+			while ((ret = io_uring_wait_cqe(&ring, &cqe)) == -EINTR) { }
+
+			/* Requests whose completion is lost count as not executed. At worst a .trashinfo file is left behind. */
+			if (ret < 0)
+			{
+				ring_ok = 0;
+				break;
+			}
+
+			uint64_t data = io_uring_cqe_get_data64(cqe);
+			moves[group[data / 4]].results[data % 4] = cqe->res;
+			io_uring_cqe_seen(&ring, cqe);
+		}
+
+		for (unsigned int i = 0; i < num_queued; i++)
+		{
+			struct batch_move *move = &moves[group[i]];
+			complete_uring_move(move);
+
+			if (move->done && move->status == LIBTRASHCAN_SUCCESS)
+			{
+				move->trashed_file = arena_strndup(arena, move->trashed_file, strlen(move->trashed_file));
+				if (move->trashed_file == NULL) { move->status = LIBTRASHCAN_ALLOC; }
+			}
+		}
+
+		/* Paths that haven't been moved are retried by soft_delete_ctx(), which doesn't use these strings. */
+		for (size_t i = first; i < last; i++)
+		{
+			if (!moves[i].done) { moves[i].trashed_file = NULL; }
+			moves[i].resolved_path = NULL;
+			moves[i].trash_info_file = NULL;
+			moves[i].info_content = NULL;
+		}
+		arena_free(&group_arena);
+
+		first = last;
+	}
+
+	arena_free(&group_arena);
+	io_uring_queue_exit(&ring);
+}
+#endif
+
+/**
+ * @brief Moves the paths of a batch to the trash in durable mode with two group commits.
+ *
+ * First the .trashinfo files of all paths are created and flushed together, then all paths are
+ * renamed and the moves are flushed together. Paths that need anything else, e.g. a retry after
+ * an outdated location or the copy fallback, are left to soft_delete_ctx() with their .trashinfo
+ * file removed.
+ *
+ * @param ctx Context in which the locations are cached.
+ * @param arena Arena of the batch in which the strings of the moves are allocated.
+ * @param paths Paths of the batch.
+ * @param num_paths Number of paths.
+ * @param moves Zeroed array with num_paths elements, where the handled paths are marked as done.
+ */
+static void durable_move_paths(trashcan_ctx *ctx, struct arena *arena, const char **paths, size_t num_paths, struct batch_move *moves)
+{
+	struct trash_location **locations = malloc(num_paths * sizeof(*locations));
+	char **dirs = malloc(num_paths * sizeof(*dirs));
+	size_t num_locations = 0;
+	size_t num_dirs = 0;
+
+#ifdef __linux__
+	const unsigned char sync_data = 0; /* syncfs() flushes the content along with the directories. */
+#else
+	const unsigned char sync_data = 1;
+#endif
+
+	if (locations == NULL || dirs == NULL) { goto error_0; }
+
+	for (size_t i = 0; i < num_paths; i++)
+	{
+		struct batch_move *move = &moves[i];
+
+		move->resolved_path = arena_realpath(arena, paths[i]);
+		if (move->resolved_path == NULL || lstat(move->resolved_path, &move->path_stat) != 0) { continue; }
+
+		pthread_mutex_lock(&ctx->lock);
+		int status = get_trash_location(ctx, move->path_stat.st_dev, move->resolved_path, &move->location);
+		pthread_mutex_unlock(&ctx->lock);
+		if (status < 0) { continue; }
+
+		if (create_trash_entry(arena, move->location, &ctx->lock, move->resolved_path, sync_data, &move->trash_info_file, &move->trashed_file) < 0) { continue; }
+
+		size_t known = 0;
+		while (known < num_locations && locations[known] != move->location) { known++; }
+		if (known == num_locations) { locations[num_locations++] = move->location; }
+	}
+
+	if (num_locations == 0) { goto error_0; }
+
+	if (sync_trash(ctx, locations, num_locations, NULL, 0) < 0)
+	{
+		for (size_t i = 0; i < num_paths; i++)
+		{
+			if (moves[i].trash_info_file != NULL) { remove(moves[i].trash_info_file); }
+		}
+		goto error_0;
+	}
+
+	for (size_t i = 0; i < num_paths; i++)
+	{
+		struct batch_move *move = &moves[i];
+		if (move->trash_info_file == NULL) { continue; }
+
+		if (rename(move->resolved_path, move->trashed_file) != 0)
+		{
+			remove(move->trash_info_file);
+			continue;
+		}
+
+		move->done = 1;
+		move->status = LIBTRASHCAN_SUCCESS;
+
+#ifndef __linux__
+		/* The directory that lost the entry, syncfs() covers it on Linux. */
+		size_t parent_len = (size_t)(strrchr(move->resolved_path, '/') - move->resolved_path);
+		dirs[num_dirs] = arena_strndup(arena, move->resolved_path, parent_len > 0 ? parent_len : 1);
+		if (dirs[num_dirs] == NULL) { move->status = LIBTRASHCAN_ALLOC; }
+		else { num_dirs++; }
+#endif
+	}
+
+	if (sync_trash(ctx, locations, num_locations, (const char *const *)dirs, num_dirs) < 0)
+	{
+		for (size_t i = 0; i < num_paths; i++)
+		{
+			if (moves[i].done) { moves[i].status = LIBTRASHCAN_SYNC; }
+		}
+	}
+
+error_0:
+	for (size_t i = 0; i < num_paths; i++)
+	{
+		if (!moves[i].done || moves[i].status != LIBTRASHCAN_SUCCESS) { moves[i].trashed_file = NULL; }
+	}
+	free(dirs);
+	free(locations);
+}
+
+/**
+ * @brief Moves multiple files or directories (and their content) to the trash using a context.
+ *
+ * @warning Do not change the current working directory when using this in a multithreaded application!
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param paths Paths to the files or directories that shall be moved to the trash.
+ * @param num_paths Number of paths.
+ * @param results Array of num_paths elements where the status code of each path is stored, may be NULL.
+ * @return 0 when all paths have been moved successfully, negative otherwise.
+ */
+int trashcan_soft_delete_many_ctx(trashcan_ctx *ctx, const char **paths, size_t num_paths, int *results)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct arena arena;
+	struct pending_dir *pending = NULL;
+	size_t num_pending = 0;
+	const char **names = NULL;
+	struct batch_move *moves = NULL;
+
+	/* Strings of the batch are taken from one arena. Those of paths that don't need a directory size
+	 * cache update are released right away. */
+	arena_init(&arena, DELETE_ARENA_SIZE);
+
+	/* Worst case every path is a directory. */
+	pending = calloc(num_paths + 1, sizeof(*pending));
+	names = calloc(num_paths + 1, sizeof(*names));
+	if (pending == NULL || names == NULL)
+	{
+		for (size_t i = 0; results != NULL && i < num_paths; i++) { results[i] = LIBTRASHCAN_ALLOC; }
+		HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0)
+	}
+
+	/* Without the array all paths take the synchronous path. */
+	if (ctx->flags & TRASHCAN_DURABLE)
+	{
+		moves = calloc(num_paths, sizeof(*moves));
+		if (moves != NULL) { durable_move_paths(ctx, &arena, paths, num_paths, moves); }
+	}
+#ifdef TRASHCAN_IO_URING
+	else
+	{
+		moves = calloc(num_paths, sizeof(*moves));
+		if (moves != NULL) { uring_move_paths(ctx, &arena, paths, num_paths, moves); }
+	}
+#endif
+
+	for (size_t i = 0; i < num_paths; i++)
+	{
+		struct arena_mark mark = arena_get_mark(&arena);
+		char *trashed_file = NULL;
+		struct trash_location *location = NULL;
+		struct stat path_stat;
+		struct stat info_stat; /* Batches leave the size accounts to the modification time check. */
+		int path_status;
+
+		if (moves != NULL && moves[i].done)
+		{
+			path_status = moves[i].status;
+			path_stat = moves[i].path_stat;
+			location = moves[i].location;
+			trashed_file = moves[i].trashed_file;
+		}
+		else
+		{
+			/* The trash location of each device is only resolved once and then taken from the context. */
+			path_status = soft_delete_ctx(ctx, &arena, paths[i], &path_stat, &location, &info_stat, &trashed_file);
+		}
+
+		if (path_status == LIBTRASHCAN_SUCCESS) { index_add_trashed(ctx, location, trashed_file); }
+
+		if (path_status == LIBTRASHCAN_SUCCESS && S_ISDIR(path_stat.st_mode))
+		{
+			pending[num_pending].path_idx = i;
+			pending[num_pending].location = location;
+			pending[num_pending].trashed_file = trashed_file;
+			num_pending++;
+		}
+		else if (moves == NULL || !moves[i].done)
+		{
+			arena_release(&arena, mark);
+		}
+
+		if (results != NULL) { results[i] = path_status; }
+		if (path_status < 0) { status = LIBTRASHCAN_BATCH; }
+	}
+
+	/* Update the directory size cache once per trash location. The locations are taken from the pending directories,
+	 * since another thread might invalidate a location of the context in the meantime. */
+	for (size_t first = 0; first < num_pending; first++)
+	{
+		const struct trash_location *location = pending[first].location;
+		size_t num_names = 0;
+
+		/* Skip locations that have been handled for an earlier directory. */
+		size_t earlier = 0;
+		while (earlier < first && pending[earlier].location != location) { earlier++; }
+		if (earlier < first) { continue; }
+
+		for (size_t i = first; i < num_pending; i++)
+		{
+			if (pending[i].location == location)
+			{
+				names[num_names] = pending[i].trashed_file + strlen(location->trash_files_dir) + 1;
+				num_names++;
+			}
+		}
+
+		int cache_status = append_dir_size_lines(location->trash_dir, location->trash_info_dir, location->trash_files_dir, names, num_names, ctx->threads, NULL);
+
+		if (cache_status < 0)
+		{
+			for (size_t i = 0; i < num_pending; i++)
+			{
+				if (pending[i].location == location && results != NULL) { results[pending[i].path_idx] = LIBTRASHCAN_DIRCACHE; }
+			}
+			status = LIBTRASHCAN_BATCH;
+		}
+	}
+
+error_0:
+	arena_free(&arena);
+	free(moves);
+	free(names);
+	free(pending);
+	return status;
+}
+
+/**
+ * @brief Moves multiple files or directories (and their content) to the trash.
+ *
+ * @warning Do not change the current working directory when using this in a multithreaded application!
+ *
+ * @param paths Paths to the files or directories that shall be moved to the trash.
+ * @param num_paths Number of paths.
+ * @param results Array of num_paths elements where the status code of each path is stored, may be NULL.
+ * @return 0 when all paths have been moved successfully, negative otherwise.
+ */
+int trashcan_soft_delete_many(const char **paths, size_t num_paths, int *results)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	trashcan_ctx *ctx = NULL;
+
+	status = trashcan_ctx_create(&ctx);
+	if (status < 0)
+	{
+		for (size_t i = 0; results != NULL && i < num_paths; i++) { results[i] = status; }
+		goto error_0;
+	}
+
+	status = trashcan_soft_delete_many_ctx(ctx, paths, num_paths, results);
+
+	trashcan_ctx_destroy(ctx);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Link of a node in the submission queue.
+ */
+struct submit_link
+{
+	_Atomic(struct submit_link *) next; /**< Next link towards the head of the queue. */
+};
+
+/**
+ * @brief Asynchronous deletion in the submission queue.
+ */
+struct submit_node
+{
+	struct submit_link link; /**< Has to be the first member, the queue only handles links. */
+	trashcan_callback callback; /**< Function called with the result, may be NULL. */
+	void *userdata; /**< Argument passed to the callback. */
+	char path[]; /**< Path that shall be moved to the trash. */
+};
+
+/**
+ * @brief Intrusive multi-producer single-consumer queue with a pool of worker threads.
+ *
+ * Producers only exchange the head pointer, so submitting never blocks. The queue is a
+ * Vyukov MPSC queue: a node is visible to the consumer once its predecessor links it, which
+ * happens right after the exchange. The workers take turns being the single consumer under
+ * consumer_lock and are woken by a semaphore that is posted once per submitted node.
+ */
+struct submit_queue
+{
+	_Atomic(struct submit_link *) head; /**< Most recently submitted link. */
+	struct submit_link *tail; /**< Oldest link, only accessed by the consumer. */
+	struct submit_link stub; /**< Placeholder that keeps the queue non-empty. */
+	pthread_mutex_t consumer_lock; /**< Held by the worker that takes a node. */
+	sem_t available; /**< Number of submitted nodes plus one per worker when stopping. */
+	atomic_int stopping; /**< Set when the context is destroyed. */
+	pthread_t *threads; /**< Worker threads. */
+	size_t num_threads; /**< Number of started worker threads. */
+	trashcan_ctx *ctx; /**< Context used by the workers. */
+};
+
+/**
+ * @brief Appends a node to the queue. Safe to call from any number of threads.
+ */
+static void submit_queue_push(struct submit_queue *queue, struct submit_link *link)
+{
+	atomic_store_explicit(&link->next, NULL, memory_order_relaxed);
+	struct submit_link *prev = atomic_exchange_explicit(&queue->head, link, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, link, memory_order_release);
+}
+
+/**
+ * @brief Takes the oldest node from the queue. Must only be called by one thread at a time.
+ *
+ * @return Oldest node or NULL if the queue is empty or a producer hasn't linked its node yet.
+ */
+static struct submit_node *submit_queue_pop(struct submit_queue *queue)
+{
+	struct submit_link *tail = queue->tail;
+	struct submit_link *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	if (tail == &queue->stub)
+	{
+		if (next == NULL) { return NULL; }
+		queue->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+
+	if (next != NULL)
+	{
+		queue->tail = next;
+		return (struct submit_node *)tail;
+	}
+
+	/* tail is the last linked node. Unless a producer is about to link a successor, re-insert the stub behind it. */
+	if (tail != atomic_load_explicit(&queue->head, memory_order_acquire)) { return NULL; }
+
+	submit_queue_push(queue, &queue->stub);
+
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next != NULL)
+	{
+		queue->tail = next;
+		return (struct submit_node *)tail;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Main function of a worker thread, moves submitted paths to the trash until the context is destroyed.
+ */
+static void *submit_worker(void *arg)
+{
+	struct submit_queue *queue = arg;
+
+	for (;;)
+	{
+		while (sem_wait(&queue->available) != 0) { } /* EINTR */
+
+		struct submit_node *node = NULL;
+		for (;;)
+		{
+			pthread_mutex_lock(&queue->consumer_lock);
+			node = submit_queue_pop(queue);
+			pthread_mutex_unlock(&queue->consumer_lock);
+
+			/* The semaphore is posted after the node has been pushed, so an empty queue either means that the
+			 * context is being destroyed or that a producer that came earlier is in the middle of linking its node. */
+			if (node != NULL || atomic_load(&queue->stopping)) { break; }
+			sched_yield();
+		}
+
+		if (node == NULL) { break; }
+
+		soft_delete_notify(queue->ctx, node->path, node->callback, node->userdata);
+		free(node);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Completes the pending deletions and joins the worker threads of a context.
+ */
+static void stop_submit_queue(trashcan_ctx *ctx)
+{
+	struct submit_queue *queue = ctx->queue;
+	if (queue == NULL) { return; }
+
+	/* Each worker exits after the queue has been drained. */
+	atomic_store(&queue->stopping, 1);
+	for (size_t i = 0; i < queue->num_threads; i++) { sem_post(&queue->available); }
+	for (size_t i = 0; i < queue->num_threads; i++) { pthread_join(queue->threads[i], NULL); }
+
+	sem_destroy(&queue->available);
+	pthread_mutex_destroy(&queue->consumer_lock);
+	free(queue->threads);
+	free(queue);
+	ctx->queue = NULL;
+}
+
+/**
+ * @brief Creates the queue of a context and starts its worker threads.
+ *
+ * Has to be called with ctx->lock held.
+ *
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int start_submit_queue(trashcan_ctx *ctx)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	size_t num_threads = ctx->workers == 0 ? TRASHCAN_DEFAULT_WORKERS : ctx->workers;
+
+	struct submit_queue *queue = calloc(1, sizeof(*queue));
+	if (queue == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+	queue->threads = calloc(num_threads, sizeof(*queue->threads));
+	if (queue->threads == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_1) }
+
+	atomic_init(&queue->stub.next, NULL);
+	atomic_init(&queue->head, &queue->stub);
+	atomic_init(&queue->stopping, 0);
+	queue->tail = &queue->stub;
+	queue->ctx = ctx;
+	if (sem_init(&queue->available, 0, 0) != 0) { HANDLE_ERROR(status, LIBTRASHCAN_THREAD, error_2) }
+	pthread_mutex_init(&queue->consumer_lock, NULL);
+
+	for (; queue->num_threads < num_threads; queue->num_threads++)
+	{
+		if (pthread_create(&queue->threads[queue->num_threads], NULL, submit_worker, queue) != 0) { break; }
+	}
+
+	/* Run with fewer workers if some couldn't be started. */
+	if (queue->num_threads == 0)
+	{
+		sem_destroy(&queue->available);
+		pthread_mutex_destroy(&queue->consumer_lock);
+		HANDLE_ERROR(status, LIBTRASHCAN_THREAD, error_2)
+	}
+
+	ctx->queue = queue;
+	return status;
+
+error_2:
+	free(queue->threads);
+error_1:
+	free(queue);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Sets the number of worker threads for asynchronous deletions.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param workers Number of worker threads, 0 for the default.
+ */
+void trashcan_ctx_set_workers(trashcan_ctx *ctx, size_t workers)
+{
+	pthread_mutex_lock(&ctx->lock);
+	ctx->workers = workers;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * @brief Queues a file or a directory to be moved to the trash by a worker thread.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param path Path to the file or directory that shall be moved to the trash.
+ * @param callback Function called by the worker thread with the result, may be NULL.
+ * @param userdata Argument passed to the callback.
+ * @return 0 when the path has been queued, negative otherwise.
+ */
+int trashcan_submit(trashcan_ctx *ctx, const char *path, trashcan_callback callback, void *userdata)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	char *cwd = NULL;
+	size_t cwd_len = 0;
+	size_t path_len = strlen(path);
+
+	/* Relative paths are resolved now, the workers might run after the working directory has been changed. */
+	if (path[0] != '/')
+	{
+		cwd = getcwd(NULL, 0);
+		if (cwd == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_REALPATH, error_0) }
+		cwd_len = strlen(cwd) + 1;
+	}
+
+	struct submit_node *node = malloc(sizeof(*node) + cwd_len + path_len + 1);
+	if (node == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_1) }
+
+	if (cwd != NULL)
+	{
+		memcpy(node->path, cwd, cwd_len - 1);
+		node->path[cwd_len - 1] = '/';
+	}
+	memcpy(node->path + cwd_len, path, path_len + 1);
+	node->callback = callback;
+	node->userdata = userdata;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->queue == NULL) { status = start_submit_queue(ctx); }
+	struct submit_queue *queue = ctx->queue;
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (status < 0)
+	{
+		free(node);
+		goto error_1;
+	}
+
+	submit_queue_push(queue, &node->link);
+	sem_post(&queue->available);
+
+error_1:
+	free(cwd);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Determines the paths of a trash directory given by the user.
+ *
+ * @param trash_dir Path to the trash directory or NULL for the home trash.
+ * @param location Address where the paths are stored. Only the paths are set.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int get_trash_paths(const char *trash_dir, struct trash_location *location)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	char *data_home = NULL;
+	memset(location, 0, sizeof(*location));
+	location->name_max = -1;
+
+	if (trash_dir == NULL)
+	{
+		if (get_home_trash_dir(&data_home, &location->trash_dir, &location->trash_info_dir, &location->trash_files_dir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_HOMETRASH, error_0) }
+		free(data_home);
+	}
+	else
+	{
+		if (asprintf(&location->trash_dir, "%s", trash_dir) < 0) { location->trash_dir = NULL; HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_m1) }
+		if (asprintf(&location->trash_info_dir, "%s%s", trash_dir, "/info") < 0) { location->trash_info_dir = NULL; HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_m1) }
+		if (asprintf(&location->trash_files_dir, "%s%s", trash_dir, "/files") < 0) { location->trash_files_dir = NULL; HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_m1) }
+	}
+
+error_0:
+	return status;
+error_m1:
+	free_trash_location(location);
+	return status;
+}
+
+/**
+ * @brief Rebuilds the directory size cache of a trash directory from scratch.
+ *
+ * @param trash_dir Path to the trash directory or NULL for the home trash.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_rebuild_dir_size_cache(const char *trash_dir)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct trash_location location;
+
+	status = get_trash_paths(trash_dir, &location);
+	if (status < 0) { goto error_0; }
+
+	if (create_or_update_dir_size_cache(location.trash_dir, location.trash_info_dir, location.trash_files_dir, 0) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_DIRCACHE, error_1) }
+
+error_1:
+	free_trash_location(&location);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Iterator over the entries of a trash directory.
+ *
+ * Only one .trashinfo file is held in memory at a time. All strings of an entry are stored in
+ * buffers that are reused for the next entry.
+ */
+struct trashcan_iter
+{
+	struct trash_location location; /**< Paths of the trash directory. */
+	char *topdir; /**< Directory relative to which paths are resolved, NULL for the home trash. */
+	DIR *info_dir; /**< Open $trash/info directory. */
+	int files_fd; /**< Open $trash/files directory, negative if it doesn't exist. */
+	int flags; /**< Flags passed to trashcan_iter_open(). */
+	size_t threads; /**< Maximum number of threads for sizing directories. */
+	char *info_buf; /**< Content of the current .trashinfo file. */
+	size_t info_buf_size; /**< Number of bytes allocated for info_buf. */
+	char *path_buf; /**< Unescaped original path of the current entry. */
+	size_t path_buf_size; /**< Number of bytes allocated for path_buf. */
+	char *name_buf; /**< Name of the current entry in $trash/files. */
+	size_t name_buf_size; /**< Number of bytes allocated for name_buf. */
+	char date_buf[32]; /**< DeletionDate of the current entry. */
+	struct dir_size_entry *dir_sizes; /**< Directory size cache, only loaded for TRASHCAN_ITER_SIZE. */
+	size_t num_dir_sizes; /**< Number of lines in dir_sizes. */
+};
+
+/**
+ * @brief Makes sure a reusable buffer has at least the given size.
+ *
+ * @param buf Address of the pointer to the buffer.
+ * @param buf_size Address of the allocated size of the buffer.
+ * @param size Required size.
+ * @return 0 when successful, negative otherwise.
+ */
+static int reserve_buffer(char **buf, size_t *buf_size, size_t size)
+{
+	if (*buf_size >= size) { return 0; }
+
+	size_t new_size = *buf_size == 0 ? 256 : *buf_size;
+	while (new_size < size) { new_size *= 2; }
+
+	char *new_buf = realloc(*buf, new_size);
+	if (new_buf == NULL) { return -1; }
+
+	*buf = new_buf;
+	*buf_size = new_size;
+	return 0;
+}
+
+/**
+ * @brief Determines $topdir for a trash directory, which relative paths in .trashinfo files refer to.
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param trash_dir Path to the trash directory.
+ * @param topdir Address where pointer to $topdir is stored. NULL for other trash directories.
+ * @return 0 when successful, negative otherwise.
+ */
+static int get_topdir(const char *trash_dir, char **topdir)
+{
+	*topdir = NULL;
+
+	const char *name = strrchr(trash_dir, '/');
+	if (name == NULL) { return 0; }
+
+	size_t parent_len = (size_t)(name - trash_dir);
+	name++;
+
+	if (strncmp(name, ".Trash-", strlen(".Trash-")) == 0)
+	{
+		/* Case (2): $topdir/.Trash-$uid */
+		if (asprintf(topdir, "%.*s", (int)parent_len, trash_dir) < 0) { *topdir = NULL; return -1; }
+	}
+	else if (parent_len >= strlen("/.Trash") && strncmp(trash_dir + parent_len - strlen("/.Trash"), "/.Trash", strlen("/.Trash")) == 0)
+	{
+		/* Case (1): $topdir/.Trash/$uid */
+		if (asprintf(topdir, "%.*s", (int)(parent_len - strlen("/.Trash")), trash_dir) < 0) { *topdir = NULL; return -1; }
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Opens an iterator over the entries of a trash directory.
+ *
+ * @param trash_dir Path to the trash directory or NULL for the home trash.
+ * @param flags TRASHCAN_ITER_SIZE to determine the size of each entry.
+ * @param iter Address where pointer to the iterator is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_iter_open(const char *trash_dir, int flags, trashcan_iter **iter)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+
+	*iter = calloc(1, sizeof(**iter));
+	if (*iter == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+	(*iter)->files_fd = -1;
+	(*iter)->flags = flags;
+
+	status = get_trash_paths(trash_dir, &(*iter)->location);
+	if (status < 0) { goto error_1; }
+
+	if (get_topdir((*iter)->location.trash_dir, &(*iter)->topdir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_2) }
+
+	(*iter)->info_dir = opendir((*iter)->location.trash_info_dir);
+	if ((*iter)->info_dir == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_OPENTRASH, error_2) }
+
+	if (flags & TRASHCAN_ITER_SIZE)
+	{
+		(*iter)->files_fd = open((*iter)->location.trash_files_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (load_dir_size_cache((*iter)->location.trash_dir, &(*iter)->dir_sizes, &(*iter)->num_dir_sizes) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_DIRCACHE, error_2) }
+	}
+
+error_0:
+	return status;
+error_2:
+	trashcan_iter_close(*iter);
+	*iter = NULL;
+	return status;
+error_1:
+	free(*iter);
+	*iter = NULL;
+	return status;
+}
+
+/**
+ * @brief Closes an iterator.
+ *
+ * @param iter Iterator created by `trashcan_iter_open()`, may be NULL.
+ */
+void trashcan_iter_close(trashcan_iter *iter)
+{
+	if (iter == NULL) { return; }
+
+	if (iter->info_dir != NULL) { closedir(iter->info_dir); }
+	if (iter->files_fd >= 0) { close(iter->files_fd); }
+	free_dir_size_cache(iter->dir_sizes, iter->num_dir_sizes);
+	free(iter->name_buf);
+	free(iter->path_buf);
+	free(iter->info_buf);
+	free(iter->topdir);
+	free_trash_location(&iter->location);
+	free(iter);
+}
+
+/**
+ * @brief Reads a .trashinfo file into a reusable buffer.
+ *
+ * @param dirfd Open $trash/info directory.
+ * @param name Name of the .trashinfo file.
+ * @param buf Address of the pointer to the buffer, which is enlarged if needed.
+ * @param buf_size Address of the allocated size of the buffer.
+ * @param info_stat Address where the result of fstat() for the file is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+static int read_info_file(int dirfd, const char *name, char **buf, size_t *buf_size, struct stat *info_stat)
+{
+	int status = -1;
+	size_t len = 0;
+
+	int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) { goto error_0; }
+	if (fstat(fd, info_stat) != 0 || !S_ISREG(info_stat->st_mode)) { goto error_1; }
+
+	for (;;)
+	{
+		if (reserve_buffer(buf, buf_size, len + 1024) < 0) { goto error_1; }
+
+		ssize_t num_read = read(fd, *buf + len, *buf_size - len - 1);
+		if (num_read < 0)
+		{
+			if (errno == EINTR) { continue; }
+			goto error_1;
+		}
+		if (num_read == 0) { break; }
+		len += (size_t)num_read;
+	}
+
+	(*buf)[len] = '\0';
+	status = 0;
+
+error_1:
+	close(fd);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Parses the content of a .trashinfo file.
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param content Content of the file, is modified.
+ * @param path Address where pointer to the (escaped) value of Path is stored.
+ * @param deletion_date Address where pointer to the value of DeletionDate is stored, NULL if missing.
+ * @return 0 when successful, negative if the file is malformed. A Path that contains "%00" is
+ * malformed, because the decoded NUL would truncate it, e.g. when it's restored.
+ */
+static int parse_info_file(char *content, char **path, char **deletion_date)
+{
+	unsigned char in_group = 0;
+	char *save_line = NULL;
+	*path = NULL;
+	*deletion_date = NULL;
+
+	for (char *line = strtok_r(content, "\n", &save_line); line != NULL; line = strtok_r(NULL, "\n", &save_line))
+	{
+		size_t len = strlen(line);
+		if (len > 0 && line[len - 1] == '\r') { line[len - 1] = '\0'; }
+
+		if (line[0] == '[')
+		{
+			in_group = strcmp(line, "[Trash Info]") == 0;
+		}
+		else if (in_group && strncmp(line, "Path=", strlen("Path=")) == 0)
+		{
+			*path = line + strlen("Path=");
+		}
+		else if (in_group && strncmp(line, "DeletionDate=", strlen("DeletionDate=")) == 0)
+		{
+			*deletion_date = line + strlen("DeletionDate=");
+		}
+	}
+
+	return *path == NULL || **path == '\0' || strstr(*path, "%00") != NULL ? -1 : 0;
+}
+
+/**
+ * @brief Decodes the value of Path in a .trashinfo file into a reusable buffer.
+ *
+ * @param topdir $topdir of the trash directory, relative paths are resolved against it. May be NULL.
+ * @param path Escaped value of Path.
+ * @param buf Address of the pointer to the buffer, which is enlarged if needed.
+ * @param buf_size Address of the allocated size of the buffer.
+ * @return 0 when successful, negative otherwise.
+ */
+static int decode_original_path(const char *topdir, const char *path, char **buf, size_t *buf_size)
+{
+	/* Relative paths are relative to $topdir. */
+	size_t topdir_len = path[0] != '/' && topdir != NULL ? strlen(topdir) + 1 : 0;
+	if (reserve_buffer(buf, buf_size, topdir_len + strlen(path) + 1) < 0) { return -1; }
+
+	if (topdir_len > 0)
+	{
+		memcpy(*buf, topdir, topdir_len - 1);
+		(*buf)[topdir_len - 1] = '/';
+	}
+
+	unescape_into(path, *buf + topdir_len);
+	return 0;
+}
+
+/**
+ * @brief Interprets the DeletionDate of a .trashinfo file as local time.
+ *
+ * @param deletion_date Value of DeletionDate, e.g. "2022-04-13T15:08:30". May be empty.
+ * @return Deletion time, -1 if the date is missing or invalid.
+ */
+static time_t parse_deletion_date(const char *deletion_date)
+{
+	struct tm timeinfo;
+	memset(&timeinfo, 0, sizeof(timeinfo));
+
+	if (strptime(deletion_date, "%Y-%m-%dT%H:%M:%S", &timeinfo) == NULL) { return (time_t)-1; }
+
+	timeinfo.tm_isdst = -1;
+	return mktime(&timeinfo);
+}
+
+/**
+ * @brief Determines the size of an entry of the trash.
+ *
+ * Directories are looked up in the directory size cache and only walked if they aren't cached or
+ * the cached line is outdated.
+ *
+ * @param iter The iterator.
+ * @param info_stat Result of fstat() for the .trashinfo file of the entry.
+ * @param size Address where the size is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+static int get_entry_size(trashcan_iter *iter, const struct stat *info_stat, uint64_t *size)
+{
+	struct stat entry_stat;
+	*size = 0;
+
+	if (iter->files_fd < 0) { return -1; }
+	if (fstatat(iter->files_fd, iter->name_buf, &entry_stat, AT_SYMLINK_NOFOLLOW) != 0) { return -1; }
+
+	if (!S_ISDIR(entry_stat.st_mode))
+	{
+		*size = S_ISREG(entry_stat.st_mode) ? (uint64_t)entry_stat.st_size : 0;
+		return 0;
+	}
+
+	struct dir_size_entry key = { .name = iter->name_buf, .size = 0, .mtime = 0 };
+	const struct dir_size_entry *cached = NULL;
+	if (iter->dir_sizes != NULL)
+	{
+		cached = bsearch(&key, iter->dir_sizes, iter->num_dir_sizes, sizeof(*iter->dir_sizes), compare_dir_size_entries);
+	}
+
+	if (cached != NULL && cached->mtime == (intmax_t)info_stat->st_mtime)
+	{
+		*size = cached->size;
+		return 0;
+	}
+
+	return walk_tree(iter->files_fd, iter->name_buf, iter->threads, 1, size_entry, size, NULL);
+}
+
+/**
+ * @brief Reads the next entry of the trash.
+ *
+ * @param iter Iterator created by `trashcan_iter_open()`.
+ * @param entry Address where the entry is stored. Its strings are valid until the next call.
+ * @return 1 when an entry has been read, 0 at the end of the trash, negative otherwise.
+ */
+int trashcan_iter_next(trashcan_iter *iter, trashcan_entry *entry)
+{
+	struct dirent *directory_entry;
+	struct stat info_stat;
+	const size_t suffix_len = strlen(".trashinfo");
+
+	for (;;)
+	{
+		errno = 0;
+		directory_entry = readdir(iter->info_dir);
+		if (directory_entry == NULL) { return errno == 0 ? 0 : LIBTRASHCAN_READTRASH; }
+
+		/* The name in $trash/files is the name of the .trashinfo file without the suffix, see generate_filenames(). */
+		size_t name_len = strlen(directory_entry->d_name);
+		if (name_len <= suffix_len || strcmp(directory_entry->d_name + name_len - suffix_len, ".trashinfo") != 0) { continue; }
+		if (read_info_file(dirfd(iter->info_dir), directory_entry->d_name, &iter->info_buf, &iter->info_buf_size, &info_stat) < 0) { continue; } /* Removed concurrently or not a file */
+
+		char *path = NULL;
+		char *deletion_date = NULL;
+		if (parse_info_file(iter->info_buf, &path, &deletion_date) < 0) { continue; } /* Malformed */
+
+		if (reserve_buffer(&iter->name_buf, &iter->name_buf_size, name_len - suffix_len + 1) < 0) { return LIBTRASHCAN_ALLOC; }
+		memcpy(iter->name_buf, directory_entry->d_name, name_len - suffix_len);
+		iter->name_buf[name_len - suffix_len] = '\0';
+
+		if (decode_original_path(iter->topdir, path, &iter->path_buf, &iter->path_buf_size) < 0) { return LIBTRASHCAN_ALLOC; }
+
+		iter->date_buf[0] = '\0';
+		if (deletion_date != NULL) { snprintf(iter->date_buf, sizeof(iter->date_buf), "%s", deletion_date); }
+
+		memset(entry, 0, sizeof(*entry));
+		entry->trash_dir = iter->location.trash_dir;
+		entry->name = iter->name_buf;
+		entry->original_path = iter->path_buf;
+		entry->deletion_date = iter->date_buf;
+		entry->deletion_time = parse_deletion_date(iter->date_buf);
+
+		if ((iter->flags & TRASHCAN_ITER_SIZE) && get_entry_size(iter, &info_stat, &entry->size) == 0)
+		{
+			entry->has_size = 1;
+		}
+
+		return 1;
+	}
+}
+
+/**
+ * @brief Renames a file without replacing an existing file at the target path.
+ *
+ * @param old_path Path of the file that is renamed.
+ * @param new_path Target path.
+ * @return 0 when successful, negative otherwise. errno is EEXIST if the target exists.
+ */
+static int rename_noreplace(const char *old_path, const char *new_path)
+{
+	struct stat target_stat;
+
+#if defined(__linux__) && defined(RENAME_NOREPLACE)
+	if (renameat2(AT_FDCWD, old_path, AT_FDCWD, new_path, RENAME_NOREPLACE) == 0) { return 0; }
+	if (errno != EINVAL && errno != ENOSYS) { return -1; } /* Otherwise not supported by the filesystem or kernel */
+#endif
+
+	/* Not atomic, but the best that's possible without RENAME_NOREPLACE. */
+	if (lstat(new_path, &target_stat) == 0)
+	{
+		errno = EEXIST;
+		return -1;
+	}
+
+	return rename(old_path, new_path);
+}
+
+/**
+ * @brief Checks that a name refers to an entry directly within $trash/files.
+ *
+ * @param name Name of the entry.
+ * @return 1 if the name is a single path component other than "." and "..", 0 otherwise.
+ */
+static int is_valid_entry_name(const char *name)
+{
+	return name[0] != '\0' && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/**
+ * @brief Moves an entry of the trash back to its original location.
+ *
+ * Entries that have been copied into the trash from another filesystem can't be renamed back. With
+ * copy they are copied to the original path and then removed from the trash.
+ *
+ * @param trash_dir Path to the trash directory or NULL for the home trash.
+ * @param name Name of the entry in $trash/files.
+ * @param copy 1 if the entry is copied when it can't be renamed across filesystems, 0 otherwise.
+ * @param threads Maximum number of threads for copying directories, 0 for the default.
+ * @param cache_lock Mutex held while the directory size cache is updated, may be NULL.
+ * @param restored_path Address where pointer to the decoded original path is stored once the entry
+ * has been moved back, even if removing the .trashinfo file or the cache line fails. NULL if the
+ * entry hasn't been moved. May be NULL if the path isn't needed.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int restore_entry(const char *trash_dir, const char *name, unsigned char copy, size_t threads, pthread_mutex_t *cache_lock, char **restored_path)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct trash_location location;
+	char *topdir = NULL;
+	char *info_name = NULL;
+	char *info_buf = NULL;
+	size_t info_buf_size = 0;
+	char *original_path = NULL;
+	size_t original_path_size = 0;
+	char *trashed_file = NULL;
+	struct stat info_stat;
+	struct stat trashed_stat;
+	int info_fd = -1;
+	if (restored_path != NULL) { *restored_path = NULL; }
+
+	if (!is_valid_entry_name(name)) { HANDLE_ERROR(status, LIBTRASHCAN_NAME, error_0) }
+
+	status = get_trash_paths(trash_dir, &location);
+	if (status < 0) { goto error_0; }
+
+	if (get_topdir(location.trash_dir, &topdir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_1) }
+	if (asprintf(&info_name, "%s%s", name, ".trashinfo") < 0) { info_name = NULL; HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_1) }
+	if (asprintf(&trashed_file, "%s/%s", location.trash_files_dir, name) < 0) { trashed_file = NULL; HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_1) }
+
+	info_fd = open(location.trash_info_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (info_fd < 0) { HANDLE_ERROR(status, LIBTRASHCAN_OPENTRASH, error_1) }
+
+	char *path = NULL;
+	char *deletion_date = NULL;
+	if (read_info_file(info_fd, info_name, &info_buf, &info_buf_size, &info_stat) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_READINFO, error_1) }
+	if (parse_info_file(info_buf, &path, &deletion_date) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_READINFO, error_1) }
+	if (decode_original_path(topdir, path, &original_path, &original_path_size) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_1) }
+
+	if (lstat(trashed_file, &trashed_stat) != 0) { HANDLE_ERROR(status, LIBTRASHCAN_RESTORE, error_1) }
+
+	if (rename_noreplace(trashed_file, original_path) != 0)
+	{
+		if (!copy || errno != EXDEV) { HANDLE_ERROR(status, errno == EEXIST ? LIBTRASHCAN_RESTOREEXISTS : LIBTRASHCAN_RESTORE, error_1) }
+
+		/* The entry has been copied into the trash from another filesystem. */
+		if (copy_into_trash(trashed_file, &trashed_stat, original_path, threads) < 0)
+		{
+			HANDLE_ERROR(status, errno == EEXIST ? LIBTRASHCAN_RESTOREEXISTS : LIBTRASHCAN_RESTORE, error_1)
+		}
+
+		/* The entry stays in the trash along with its .trashinfo file if it can't be removed. */
+		if (remove_original(trashed_file, &trashed_stat, threads) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_RESTOREREMOVE, error_1) }
+	}
+
+	if (restored_path != NULL)
+	{
+		*restored_path = original_path;
+		original_path = NULL;
+	}
+
+	/* The entry has been restored, a leftover .trashinfo file is reported but doesn't undo the restore. */
+	if (unlinkat(info_fd, info_name, 0) != 0) { status = LIBTRASHCAN_RMINFO; }
+
+	if (S_ISDIR(trashed_stat.st_mode))
+	{
+		/* The name no longer exists in $trash/files, so its line is dropped. */
+		if (cache_lock != NULL) { pthread_mutex_lock(cache_lock); }
+		int cache_status = update_dir_size_cache(location.trash_dir, location.trash_info_dir, location.trash_files_dir, &name, 1, 0, 0, NULL);
+		if (cache_lock != NULL) { pthread_mutex_unlock(cache_lock); }
+		if (cache_status < 0) { HANDLE_ERROR(status, LIBTRASHCAN_DIRCACHE, error_1) }
+	}
+
+error_1:
+	if (info_fd >= 0) { close(info_fd); }
+	free(trashed_file);
+	free(original_path);
+	free(info_buf);
+	free(info_name);
+	free(topdir);
+	free_trash_location(&location);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Moves an entry of the trash back to its original location.
+ *
+ * @param trash_dir Path to the trash directory or NULL for the home trash.
+ * @param name Name of the entry in $trash/files.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_restore(const char *trash_dir, const char *name)
+{
+	return restore_entry(trash_dir, name, 1, 0, NULL, NULL);
+}
+
+/**
+ * @brief Removes an entry from $trash/files and its .trashinfo file.
+ *
+ * The entry is removed before its .trashinfo file, so that an interrupted purge can be repeated.
+ * A .trashinfo file whose entry is already gone is removed as well. The directory size cache
+ * isn't updated.
+ *
+ * @param files_fd Open $trash/files directory.
+ * @param info_fd Open $trash/info directory.
+ * @param name Name of the entry in $trash/files.
+ * @param threads Maximum number of threads for removing directories, 0 for the default.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed files and directories is added, may be NULL.
+ * @param is_dir Address where 1 is stored if the entry was a directory, 0 otherwise.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int purge_entry(int files_fd, int info_fd, const char *name, size_t threads, uint64_t *bytes, uint64_t *inodes, unsigned char *is_dir)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	char *info_name = NULL;
+	struct stat trashed_stat;
+	*is_dir = 0;
+
+	if (asprintf(&info_name, "%s%s", name, ".trashinfo") < 0) { info_name = NULL; HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+	if (fstatat(files_fd, name, &trashed_stat, AT_SYMLINK_NOFOLLOW) == 0)
+	{
+		*is_dir = S_ISDIR(trashed_stat.st_mode);
+		if (*is_dir)
+		{
+			if (remove_tree(files_fd, name, threads, bytes, inodes) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_PURGE, error_0) }
+		}
+		else
+		{
+			if (unlinkat(files_fd, name, 0) != 0) { HANDLE_ERROR(status, LIBTRASHCAN_PURGE, error_0) }
+			if (bytes != NULL && S_ISREG(trashed_stat.st_mode)) { *bytes += (uint64_t)trashed_stat.st_size; }
+			if (inodes != NULL) { (*inodes)++; }
+		}
+	}
+	else if (errno != ENOENT) { HANDLE_ERROR(status, LIBTRASHCAN_PURGE, error_0) }
+
+	if (unlinkat(info_fd, info_name, 0) != 0 && errno != ENOENT) { HANDLE_ERROR(status, LIBTRASHCAN_RMINFO, error_0) }
+
+error_0:
+	free(info_name);
+	return status;
+}
+
+/**
+ * @brief Opens the info and files directories of a trash location.
+ *
+ * @param location Trash location.
+ * @param info_fd Address where the descriptor of $trash/info is stored.
+ * @param files_fd Address where the descriptor of $trash/files is stored.
+ * @return 0 when successful, negative status code otherwise. Nothing has to be closed on failure.
+ */
+static int open_trash_dirs(const struct trash_location *location, int *info_fd, int *files_fd)
+{
+	*info_fd = open(location->trash_info_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (*info_fd < 0) { return LIBTRASHCAN_OPENTRASH; }
+
+	*files_fd = open(location->trash_files_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (*files_fd < 0)
+	{
+		close(*info_fd);
+		*info_fd = -1;
+		return LIBTRASHCAN_OPENTRASH;
+	}
+
+	return LIBTRASHCAN_SUCCESS;
+}
+
+/**
+ * @brief Permanently removes an entry of the trash and drops its line from the directory size cache.
+ *
+ * @param entry Entry as returned by trashcan_iter_next(), only trash_dir and name are used.
+ * @param threads Maximum number of threads for removing directories, 0 for the default.
+ * @param cache_lock Mutex held while the directory size cache is updated, may be NULL.
+ * @param info_stat Address where the result of stat() for $trash/info before the removal is stored,
+ * zeroed if it couldn't be determined. May be NULL.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed files and directories is added, may be NULL.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int purge_trash_entry(const trashcan_entry *entry, size_t threads, pthread_mutex_t *cache_lock, struct stat *info_stat, uint64_t *bytes, uint64_t *inodes)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct trash_location location;
+	unsigned char is_dir = 0;
+	int info_fd = -1;
+	int files_fd = -1;
+	const char *name = entry->name;
+
+	if (!is_valid_entry_name(name)) { HANDLE_ERROR(status, LIBTRASHCAN_NAME, error_0) }
+
+	status = get_trash_paths(entry->trash_dir, &location);
+	if (status < 0) { goto error_0; }
+
+	status = open_trash_dirs(&location, &info_fd, &files_fd);
+	if (status < 0) { goto error_1; }
+
+	if (info_stat != NULL && fstat(info_fd, info_stat) != 0) { memset(info_stat, 0, sizeof(*info_stat)); }
+
+	status = purge_entry(files_fd, info_fd, name, threads, bytes, inodes, &is_dir);
+	if (status < 0) { goto error_2; }
+
+	if (is_dir)
+	{
+		/* The name no longer exists in $trash/files, so its line is dropped. */
+		if (cache_lock != NULL) { pthread_mutex_lock(cache_lock); }
+		int cache_status = update_dir_size_cache(location.trash_dir, location.trash_info_dir, location.trash_files_dir, &name, 1, 0, 0, NULL);
+		if (cache_lock != NULL) { pthread_mutex_unlock(cache_lock); }
+		if (cache_status < 0) { HANDLE_ERROR(status, LIBTRASHCAN_DIRCACHE, error_2) }
+	}
+
+error_2:
+	close(files_fd);
+	close(info_fd);
+error_1:
+	free_trash_location(&location);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Permanently removes an entry of the trash.
+ *
+ * @param entry Entry as returned by trashcan_iter_next(), only trash_dir and name are used.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed files and directories is added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_purge(const trashcan_entry *entry, uint64_t *bytes, uint64_t *inodes)
+{
+	return purge_trash_entry(entry, 0, NULL, NULL, bytes, inodes);
+}
+
+/**
+ * @brief Permanently removes all entries of a trash directory.
+ *
+ * @param trash_dir Path to the trash directory or NULL for the home trash.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed files and directories is added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_empty(const char *trash_dir, uint64_t *bytes, uint64_t *inodes)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct trash_location location;
+	char *dir_size_cache = NULL;
+
+	status = get_trash_paths(trash_dir, &location);
+	if (status < 0) { goto error_0; }
+
+	if (asprintf(&dir_size_cache, "%s/directorysizes", location.trash_dir) < 0) { dir_size_cache = NULL; HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_1) }
+
+	/* A trash that has never been used is empty. */
+	if (access(location.trash_files_dir, F_OK) != 0 && errno == ENOENT) { goto error_1; }
+
+	/* All entries are removed in one parallel walk, the entries at the top level are spread across the workers like any other subdirectories. */
+	if (remove_dir_content(AT_FDCWD, location.trash_files_dir, 0, bytes, inodes) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_PURGE, error_1) }
+	if (remove_dir_content(AT_FDCWD, location.trash_info_dir, 0, NULL, NULL) < 0 && errno != ENOENT) { HANDLE_ERROR(status, LIBTRASHCAN_RMINFO, error_1) }
+	if (unlink(dir_size_cache) != 0 && errno != ENOENT) { HANDLE_ERROR(status, LIBTRASHCAN_DIRCACHE, error_1) }
+
+error_1:
+	free(dir_size_cache);
+	free_trash_location(&location);
+error_0:
+	return status;
+}
+
+/* Maximum number of entries that are collected for eviction per pass over the trash. */
+#define EXPIRE_HEAP_CAPACITY 4096
+
+/**
+ * @brief Entry of the trash that is a candidate for eviction.
+ */
+struct expire_candidate
+{
+	time_t deletion_time; /**< Deletion time, -1 if unknown. */
+	uint64_t size; /**< Size of the entry, 0 if unknown. */
+	char *name; /**< Name of the entry in $trash/files. */
+};
+
+/**
+ * @brief Max-heap of the oldest entries of the trash, ordered by deletion time.
+ *
+ * The root is the most recently deleted candidate, which is the first to be replaced by an older entry.
+ */
+struct expire_heap
+{
+	struct expire_candidate *items; /**< Candidates, EXPIRE_HEAP_CAPACITY elements. */
+	size_t count; /**< Number of candidates. */
+	uint64_t size; /**< Sum of the sizes of the candidates. */
+};
+
+/**
+ * @brief Restores the heap order below a candidate.
+ *
+ * @param heap The heap.
+ * @param idx Index of the candidate that may be younger than its children.
+ */
+static void expire_heap_sift_down(struct expire_heap *heap, size_t idx)
+{
+	struct expire_candidate item = heap->items[idx];
+
+	for (;;)
+	{
+		size_t child = 2 * idx + 1;
+		if (child >= heap->count) { break; }
+		if (child + 1 < heap->count && heap->items[child + 1].deletion_time > heap->items[child].deletion_time) { child++; }
+		if (heap->items[child].deletion_time <= item.deletion_time) { break; }
+
+		heap->items[idx] = heap->items[child];
+		idx = child;
+	}
+
+	heap->items[idx] = item;
+}
+
+/**
+ * @brief Adds a candidate to the heap, which must not be full.
+ *
+ * @param heap The heap.
+ * @param item Candidate, the heap takes ownership of its name.
+ */
+static void expire_heap_push(struct expire_heap *heap, struct expire_candidate item)
+{
+	size_t idx = heap->count++;
+	heap->size += item.size;
+
+	while (idx > 0)
+	{
+		size_t parent = (idx - 1) / 2;
+		if (heap->items[parent].deletion_time >= item.deletion_time) { break; }
+
+		heap->items[idx] = heap->items[parent];
+		idx = parent;
+	}
+
+	heap->items[idx] = item;
+}
+
+/**
+ * @brief Removes the most recently deleted candidate from the heap.
+ *
+ * @param heap The heap, must not be empty.
+ */
+static void expire_heap_drop_root(struct expire_heap *heap)
+{
+	heap->size -= heap->items[0].size;
+	free(heap->items[0].name);
+
+	heap->count--;
+	if (heap->count > 0)
+	{
+		heap->items[0] = heap->items[heap->count];
+		expire_heap_sift_down(heap, 0);
+	}
+}
+
+/**
+ * @brief Collects the oldest entries of the trash whose removal frees at least excess bytes.
+ *
+ * Entries that are deleted more recently than all candidates are dropped as soon as the older
+ * candidates cover the excess, so the heap only grows beyond the entries that have to be evicted
+ * if their sizes are unknown. At most EXPIRE_HEAP_CAPACITY candidates are collected, in which case
+ * they cover less than the excess and another pass is needed.
+ *
+ * @param trash_dir Path to the trash directory or NULL for the home trash.
+ * @param excess Number of bytes that have to be freed.
+ * @param heap Empty heap where the candidates are stored.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int collect_expire_candidates(const char *trash_dir, uint64_t excess, struct expire_heap *heap)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	trashcan_iter *iter = NULL;
+	trashcan_entry entry;
+	int next;
+
+	status = trashcan_iter_open(trash_dir, TRASHCAN_ITER_SIZE, &iter);
+	if (status < 0) { goto error_0; }
+
+	while ((next = trashcan_iter_next(iter, &entry)) == 1)
+	{
+		struct expire_candidate item;
+		item.deletion_time = entry.deletion_time;
+		item.size = entry.has_size ? entry.size : 0;
+
+		if (heap->count == EXPIRE_HEAP_CAPACITY)
+		{
+			if (item.deletion_time >= heap->items[0].deletion_time) { continue; }
+			expire_heap_drop_root(heap);
+		}
+
+		item.name = strdup(entry.name);
+		if (item.name == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_1) }
+		expire_heap_push(heap, item);
+
+		/* The youngest candidate isn't needed if the others free enough. */
+		while (heap->count > 1 && heap->size - heap->items[0].size >= excess) { expire_heap_drop_root(heap); }
+	}
+	if (next < 0) { status = next; }
+
+error_1:
+	trashcan_iter_close(iter);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Permanently removes entries of a trash directory that are too old or exceed a size budget.
+ *
+ * @param trash_dir Path to the trash directory or NULL for the home trash.
+ * @param max_age Maximum age of entries in seconds, negative for no limit.
+ * @param max_size Maximum total size of the entries in bytes, UINT64_MAX for no limit.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed files and directories is added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_expire(const char *trash_dir, time_t max_age, uint64_t max_size, uint64_t *bytes, uint64_t *inodes)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct trash_location location;
+	trashcan_iter *iter = NULL;
+	trashcan_entry entry;
+	struct expire_heap heap = { NULL, 0, 0 };
+	unsigned char purged_dir = 0;
+	unsigned char is_dir;
+	uint64_t total_size = 0;
+	int info_fd = -1;
+	int files_fd = -1;
+	int next;
+
+	status = get_trash_paths(trash_dir, &location);
+	if (status < 0) { goto error_0; }
+
+	/* A trash that has never been used is empty. */
+	if (access(location.trash_info_dir, F_OK) != 0 && errno == ENOENT) { goto error_1; }
+
+	status = open_trash_dirs(&location, &info_fd, &files_fd);
+	if (status < 0) { goto error_1; }
+
+	time_t now = time(NULL);
+	if (now == (time_t)-1) { HANDLE_ERROR(status, LIBTRASHCAN_TIME, error_2) }
+
+	/* Expired entries are removed right away, the size of the others is summed up. Entries without
+	 * a valid deletion date never expire by age. A failed removal doesn't stop the pass. */
+	status = trashcan_iter_open(trash_dir, max_size == UINT64_MAX ? 0 : TRASHCAN_ITER_SIZE, &iter);
+	if (status < 0) { goto error_2; }
+
+	while ((next = trashcan_iter_next(iter, &entry)) == 1)
+	{
+		if (max_age >= 0 && entry.deletion_time != (time_t)-1 && entry.deletion_time < now && now - entry.deletion_time > max_age)
+		{
+			int purge_status = purge_entry(files_fd, info_fd, entry.name, 0, bytes, inodes, &is_dir);
+			if (purge_status < 0) { status = purge_status; }
+			else if (is_dir) { purged_dir = 1; }
+			continue;
+		}
+
+		if (entry.has_size) { total_size += entry.size; }
+	}
+	trashcan_iter_close(iter);
+	if (next < 0) { status = next; }
+	if (status < 0) { goto error_3; }
+
+	if (max_size == UINT64_MAX || total_size <= max_size) { goto error_3; }
+
+	heap.items = malloc(EXPIRE_HEAP_CAPACITY * sizeof(*heap.items));
+	if (heap.items == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_3) }
+
+	/* Each pass evicts the oldest entries that cover the excess, or the oldest EXPIRE_HEAP_CAPACITY
+	 * entries if that's not enough. Every pass removes at least one entry, so this terminates. */
+	while (total_size > max_size)
+	{
+		status = collect_expire_candidates(trash_dir, total_size - max_size, &heap);
+		if (status < 0) { goto error_4; }
+		if (heap.count == 0) { break; } /* The rest has been removed by someone else. */
+
+		while (heap.count > 0)
+		{
+			status = purge_entry(files_fd, info_fd, heap.items[0].name, 0, bytes, inodes, &is_dir);
+			if (status < 0) { goto error_4; }
+			if (is_dir) { purged_dir = 1; }
+
+			total_size -= heap.items[0].size < total_size ? heap.items[0].size : total_size;
+			expire_heap_drop_root(&heap);
+		}
+	}
+
+error_4:
+	while (heap.count > 0) { expire_heap_drop_root(&heap); }
+	free(heap.items);
+error_3:
+	/* Lines of removed directories are dropped as stale lines. */
+	if (purged_dir && update_dir_size_cache(location.trash_dir, location.trash_info_dir, location.trash_files_dir, NULL, 0, 0, 1, NULL) < 0 && status == LIBTRASHCAN_SUCCESS)
+	{
+		status = LIBTRASHCAN_DIRCACHE;
+	}
+error_2:
+	close(files_fd);
+	close(info_fd);
+error_1:
+	free_trash_location(&location);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Permanently removes an entry of the trash using a context.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param entry Entry as returned by trashcan_iter_next(), only trash_dir and name are used.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed files and directories is added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_purge_ctx(trashcan_ctx *ctx, const trashcan_entry *entry, uint64_t *bytes, uint64_t *inodes)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	char *trash_info_dir = NULL;
+	char *original_path = NULL;
+	char deletion_date[32];
+	struct stat info_stat;
+	struct stat dir_stat;
+	uint64_t freed = 0;
+
+	if (asprintf(&trash_info_dir, "%s/info", entry->trash_dir) < 0) { trash_info_dir = NULL; HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+	/* The original path is needed to find the entry in the index, the .trashinfo file is gone afterwards. */
+	if (index_active(ctx) && read_index_entry(entry->trash_dir, entry->name, &dir_stat, &original_path, deletion_date, sizeof(deletion_date)) < 0) { original_path = NULL; }
+
+	status = purge_trash_entry(entry, ctx->threads, &ctx->cache_lock, &info_stat, &freed, inodes);
+	if (status < 0) { goto error_1; }
+
+	update_size_account(ctx, trash_info_dir, &info_stat, 0, freed);
+	index_remove_trashed(ctx, entry->trash_dir, &dir_stat, original_path, entry->name);
+	if (bytes != NULL) { *bytes += freed; }
+
+error_1:
+	free(original_path);
+	free(trash_info_dir);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Determines the total size of the entries of a trash directory.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param trash_dir Path to the trash directory or NULL for the home trash of the context.
+ * @param size Address where the total size is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_total_size(trashcan_ctx *ctx, const char *trash_dir, uint64_t *size)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	char *trash_info_dir = NULL;
+	trashcan_iter *iter = NULL;
+	trashcan_entry entry;
+	struct stat info_stat;
+	uint64_t total = 0;
+	int next;
+	*size = 0;
+
+	if (trash_dir == NULL) { trash_dir = ctx->home.trash_dir; }
+	if (asprintf(&trash_info_dir, "%s/info", trash_dir) < 0) { trash_info_dir = NULL; HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+	if (stat(trash_info_dir, &info_stat) != 0)
+	{
+		/* A trash that has never been used is empty. */
+		if (errno != ENOENT) { HANDLE_ERROR(status, LIBTRASHCAN_OPENTRASH, error_1) }
+		goto error_1;
+	}
+
+	pthread_mutex_lock(&ctx->cache_lock);
+	struct size_account *account = find_size_account(ctx, &info_stat);
+	if (account != NULL && (account->watchers > 0 || (account->info_mtime.tv_sec == info_stat.st_mtim.tv_sec && account->info_mtime.tv_nsec == info_stat.st_mtim.tv_nsec)))
+	{
+		*size = account->total;
+		pthread_mutex_unlock(&ctx->cache_lock);
+		goto error_1;
+	}
+	pthread_mutex_unlock(&ctx->cache_lock);
+
+	/* The trash has been modified by someone else or has never been queried. The modification time
+	 * from before the walk is stored, so that changes during the walk cause another walk next time. */
+	status = trashcan_iter_open(trash_dir, TRASHCAN_ITER_SIZE, &iter);
+	if (status < 0) { goto error_1; }
+
+	while ((next = trashcan_iter_next(iter, &entry)) == 1)
+	{
+		if (entry.has_size) { total += entry.size; }
+	}
+	trashcan_iter_close(iter);
+	if (next < 0) { HANDLE_ERROR(status, next, error_1) }
+
+	*size = total;
+
+	pthread_mutex_lock(&ctx->cache_lock);
+	account = find_size_account(ctx, &info_stat);
+	if (account == NULL)
+	{
+		struct size_account *accounts = realloc(ctx->accounts, (ctx->num_accounts + 1) * sizeof(*accounts));
+		if (accounts != NULL)
+		{
+			ctx->accounts = accounts;
+			account = &ctx->accounts[ctx->num_accounts];
+			ctx->num_accounts++;
+			account->device = info_stat.st_dev;
+			account->inode = info_stat.st_ino;
+			account->watchers = 0;
+		}
+	}
+	if (account != NULL && account->watchers == 0) /* Without an account the next query walks again. A watcher has a more recent total. */
+	{
+		account->info_mtime = info_stat.st_mtim;
+		account->total = total;
+	}
+	pthread_mutex_unlock(&ctx->cache_lock);
+
+error_1:
+	free(trash_info_dir);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Trash directory found by trashcan_find_trash_dirs().
+ */
+struct found_trash_dir
+{
+	char *trash_dir; /**< Path to the trash directory. */
+	uint64_t num_entries; /**< Number of .trashinfo files. */
+	dev_t device; /**< Device of the trash directory, to detect a trash that is reachable through several mounts. */
+	ino_t inode; /**< Inode of the trash directory. */
+};
+
+/**
+ * @brief Probe of one device by trashcan_find_trash_dirs().
+ */
+struct discovery_job
+{
+	char *topdir; /**< Mount point of the device, NULL for the home trash. */
+	struct found_trash_dir found[2]; /**< Trash directories that have been found, owned by the job until they are taken. */
+	size_t num_found; /**< Number of trash directories that have been found. */
+	unsigned char done; /**< Set once the probe has been completed. */
+	struct trash_discovery *discovery; /**< Discovery the job belongs to. */
+};
+
+/**
+ * @brief State shared between trashcan_find_trash_dirs() and its workers.
+ *
+ * Workers that are still blocked by a slow mount when the caller stops waiting keep a reference
+ * and the last one frees the state.
+ */
+struct trash_discovery
+{
+	pthread_mutex_t lock; /**< Protects the jobs and the counters. */
+	pthread_cond_t done; /**< Signaled when a job has been completed. */
+	size_t refs; /**< References held by the caller and the running workers. */
+	size_t pending; /**< Number of started jobs that haven't been completed. */
+	struct discovery_job *jobs; /**< Jobs, the first one is the home trash. */
+	size_t num_jobs; /**< Number of jobs. */
+	char *home_trash_dir; /**< "$XDG_DATA_HOME/Trash" of the context. */
+};
+
+/**
+ * @brief Drops a reference to the shared discovery state and frees it with the last reference.
+ *
+ * @param discovery Discovery state, its lock must not be held.
+ */
+static void release_trash_discovery(struct trash_discovery *discovery)
+{
+	pthread_mutex_lock(&discovery->lock);
+	size_t refs = --discovery->refs;
+	pthread_mutex_unlock(&discovery->lock);
+	if (refs > 0) { return; }
+
+	for (size_t i = 0; i < discovery->num_jobs; i++)
+	{
+		free(discovery->jobs[i].topdir);
+		free(discovery->jobs[i].found[0].trash_dir);
+		free(discovery->jobs[i].found[1].trash_dir);
+	}
+	free(discovery->jobs);
+	free(discovery->home_trash_dir);
+	pthread_cond_destroy(&discovery->done);
+	pthread_mutex_destroy(&discovery->lock);
+	free(discovery);
+}
+
+/**
+ * @brief Checks whether a directory is a trash directory and counts its entries.
+ *
+ * Nothing is created. The trash directory must be a directory and not a symbolic link and it
+ * must contain an info directory.
+ *
+ * @param trash_dir Path to the potential trash directory.
+ * @param found Address where the number of .trashinfo files and the identity of the directory are
+ * stored, the path is not set.
+ * @return 0 if it is a trash directory, negative otherwise.
+ */
+static int probe_trash_dir(const char *trash_dir, struct found_trash_dir *found)
+{
+	struct stat trash_stat;
+	struct dirent *dir_entry;
+	found->num_entries = 0;
+
+	if (lstat(trash_dir, &trash_stat) != 0 || !S_ISDIR(trash_stat.st_mode)) { return -1; }
+	found->device = trash_stat.st_dev;
+	found->inode = trash_stat.st_ino;
+
+	int dirfd = open(trash_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dirfd < 0) { return -1; }
+	int info_fd = openat(dirfd, "info", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	close(dirfd);
+	if (info_fd < 0) { return -1; }
+
+	DIR *info_dir = fdopendir(info_fd);
+	if (info_dir == NULL)
+	{
+		close(info_fd);
+		return -1;
+	}
+
+	while ((dir_entry = readdir(info_dir)) != NULL)
+	{
+		size_t len = strlen(dir_entry->d_name);
+		if (len > 10 && strcmp(dir_entry->d_name + len - 10, ".trashinfo") == 0) { found->num_entries++; }
+	}
+	closedir(info_dir);
+
+	return 0;
+}
+
+/**
+ * @brief Looks for the trash directories of case (1) and (2) of the specification in a $topdir.
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param topdir Mount point of the device.
+ * @param found Array of two elements where the trash directories that have been found are stored.
+ * @return Number of trash directories that have been found.
+ */
+static size_t probe_topdir(const char *topdir, struct found_trash_dir *found)
+{
+	size_t num_found = 0;
+	char *shared_dir = NULL;
+	char *trash_dir = NULL;
+	struct stat shared_stat;
+	uid_t uid = getuid();
+
+	/* Case (1): $topdir/.Trash/$uid, only if .Trash is a sticky directory and not a symlink. */
+	if (asprintf(&shared_dir, "%s/.Trash", topdir) >= 0)
+	{
+		if (lstat(shared_dir, &shared_stat) == 0 && S_ISDIR(shared_stat.st_mode) && (shared_stat.st_mode & S_ISVTX) != 0
+			&& asprintf(&trash_dir, "%s/%ju", shared_dir, (uintmax_t)uid) >= 0)
+		{
+			if (probe_trash_dir(trash_dir, &found[num_found]) == 0) { found[num_found++].trash_dir = trash_dir; } else { free(trash_dir); }
+		}
+		free(shared_dir);
+	}
+
+	/* Case (2): $topdir/.Trash-$uid. Both may exist, e.g. if case (1) was set up by an administrator later on. */
+	if (asprintf(&trash_dir, "%s/.Trash-%ju", topdir, (uintmax_t)uid) >= 0)
+	{
+		if (probe_trash_dir(trash_dir, &found[num_found]) == 0) { found[num_found++].trash_dir = trash_dir; } else { free(trash_dir); }
+	}
+
+	return num_found;
+}
+
+/**
+ * @brief Worker of trashcan_find_trash_dirs() that probes one device.
+ *
+ * @param arg Job of the worker.
+ * @return NULL.
+ */
+static void *discovery_worker(void *arg)
+{
+	struct discovery_job *job = arg;
+	struct trash_discovery *discovery = job->discovery;
+	struct found_trash_dir found[2];
+	size_t num_found = 0;
+
+	/* The paths are only read, they are freed with the discovery state. */
+	if (job->topdir != NULL)
+	{
+		num_found = probe_topdir(job->topdir, found);
+	}
+	else if (probe_trash_dir(discovery->home_trash_dir, &found[0]) == 0 && asprintf(&found[0].trash_dir, "%s", discovery->home_trash_dir) >= 0)
+	{
+		num_found = 1;
+	}
+
+	pthread_mutex_lock(&discovery->lock);
+	for (size_t i = 0; i < num_found; i++)
+	{
+		job->found[i] = found[i];
+	}
+	job->num_found = num_found;
+	job->done = 1;
+	discovery->pending--;
+	pthread_cond_signal(&discovery->done);
+	pthread_mutex_unlock(&discovery->lock);
+
+	release_trash_discovery(discovery);
+	return NULL;
+}
+
+/**
+ * @brief Creates the jobs of a discovery, one for the home trash and one for each device.
+ *
+ * @param ctx Context whose home trash and mount table are used.
+ * @param discovery Discovery in which the jobs are stored.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int create_discovery_jobs(trashcan_ctx *ctx, struct trash_discovery *discovery)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+
+	if (asprintf(&discovery->home_trash_dir, "%s", ctx->home.trash_dir) < 0) { discovery->home_trash_dir = NULL; return LIBTRASHCAN_ALLOC; }
+
+	pthread_mutex_lock(&ctx->lock);
+	if (mount_table_update(&ctx->mounts) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_TOPDIRTRASH, error_0) }
+
+	discovery->jobs = calloc(ctx->mounts.num_entries + 1, sizeof(*discovery->jobs));
+	if (discovery->jobs == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+	discovery->num_jobs = 1; /* The first job is the home trash. */
+
+	/* Entries are sorted by device with the mounts of the filesystem root first, so the first
+	 * entry of each device is the one get_mountpoint() would use. */
+	for (size_t i = 0; i < ctx->mounts.num_entries; i++)
+	{
+		const struct mount_entry *entry = &ctx->mounts.entries[i];
+		if (i > 0 && ctx->mounts.entries[i - 1].device == entry->device) { continue; }
+
+		struct discovery_job *job = &discovery->jobs[discovery->num_jobs];
+		if (asprintf(&job->topdir, "%s", entry->mount_dir) < 0) { job->topdir = NULL; HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+		discovery->num_jobs++;
+	}
+
+error_0:
+	pthread_mutex_unlock(&ctx->lock);
+	return status;
+}
+
+/**
+ * @brief Discovers the trash directories of the home trash and of all mounted devices.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param timeout_ms Maximum time to wait for the devices in milliseconds, negative to wait for all.
+ * @param trash_dirs Address where pointer to the array of trash directories is stored.
+ * @param num_trash_dirs Address where the number of trash directories is stored.
+ * @return 0 when successful, 1 if some devices didn't respond in time, negative otherwise.
+ */
+int trashcan_find_trash_dirs(trashcan_ctx *ctx, int timeout_ms, trashcan_trash_dir **trash_dirs, size_t *num_trash_dirs)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	pthread_condattr_t cond_attr;
+	pthread_attr_t thread_attr;
+	struct timespec deadline;
+	*trash_dirs = NULL;
+	*num_trash_dirs = 0;
+
+	struct trash_discovery *discovery = calloc(1, sizeof(*discovery));
+	if (discovery == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+	pthread_mutex_init(&discovery->lock, NULL);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&discovery->done, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	discovery->refs = 1;
+
+	status = create_discovery_jobs(ctx, discovery);
+	if (status < 0) { goto error_1; }
+
+	if (timeout_ms >= 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	/* One detached worker per device, so that a hanging NFS or FUSE mount only blocks its own
+	 * worker. Workers that don't finish in time are abandoned and clean up after themselves. */
+	pthread_attr_init(&thread_attr);
+	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&discovery->lock);
+	for (size_t i = 0; i < discovery->num_jobs; i++)
+	{
+		pthread_t thread;
+		discovery->jobs[i].discovery = discovery;
+		discovery->refs++;
+		discovery->pending++;
+		if (pthread_create(&thread, &thread_attr, discovery_worker, &discovery->jobs[i]) != 0)
+		{
+			discovery->refs--;
+			discovery->pending--;
+			status = LIBTRASHCAN_THREAD;
+			break;
+		}
+	}
+	pthread_attr_destroy(&thread_attr);
+
+	while (discovery->pending > 0)
+	{
+		if (timeout_ms < 0) { pthread_cond_wait(&discovery->done, &discovery->lock); }
+		else if (pthread_cond_timedwait(&discovery->done, &discovery->lock, &deadline) == ETIMEDOUT) { break; }
+	}
+	if (status < 0)
+	{
+		pthread_mutex_unlock(&discovery->lock);
+		goto error_1;
+	}
+
+	size_t num_found = 0;
+	for (size_t i = 0; i < discovery->num_jobs; i++) { num_found += discovery->jobs[i].num_found; }
+
+	struct found_trash_dir *seen = NULL;
+	if (num_found > 0)
+	{
+		*trash_dirs = calloc(num_found, sizeof(**trash_dirs));
+		seen = malloc(num_found * sizeof(*seen));
+		if (*trash_dirs == NULL || seen == NULL)
+		{
+			free(*trash_dirs);
+			free(seen);
+			*trash_dirs = NULL;
+			pthread_mutex_unlock(&discovery->lock);
+			HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_1)
+		}
+	}
+
+	/* The results are taken in the order of the jobs, so the home trash is always first. A trash
+	 * that is reachable through several mounts, e.g. a filesystem mounted on top of another mount
+	 * of itself, is only returned once. */
+	for (size_t i = 0; i < discovery->num_jobs; i++)
+	{
+		struct discovery_job *job = &discovery->jobs[i];
+		for (size_t j = 0; j < job->num_found; j++)
+		{
+			struct found_trash_dir *found = &job->found[j];
+			unsigned char duplicate = 0;
+			for (size_t k = 0; k < *num_trash_dirs && !duplicate; k++)
+			{
+				duplicate = seen[k].device == found->device && seen[k].inode == found->inode;
+			}
+			if (duplicate) { continue; }
+
+			trashcan_trash_dir *trash_dir = &(*trash_dirs)[*num_trash_dirs];
+			trash_dir->trash_dir = found->trash_dir;
+			trash_dir->num_entries = found->num_entries;
+			trash_dir->is_home = job->topdir == NULL;
+			seen[*num_trash_dirs] = *found;
+			found->trash_dir = NULL; /* Ownership is passed to the caller. */
+			(*num_trash_dirs)++;
+		}
+		job->num_found = 0;
+	}
+	free(seen);
+	if (discovery->pending > 0) { status = 1; }
+	pthread_mutex_unlock(&discovery->lock);
+
+error_1:
+	release_trash_discovery(discovery);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Frees the trash directories returned by trashcan_find_trash_dirs().
+ *
+ * @param trash_dirs Array of trash directories, may be NULL.
+ * @param num_trash_dirs Number of trash directories.
+ */
+void trashcan_free_trash_dirs(trashcan_trash_dir *trash_dirs, size_t num_trash_dirs)
+{
+	for (size_t i = 0; i < num_trash_dirs; i++)
+	{
+		free(trash_dirs[i].trash_dir);
+	}
+	free(trash_dirs);
+}
+
+/**
+ * @brief Retrieves the timing statistics of the phases of soft deletions.
+ *
+ * @param stats Address where the statistics are stored.
+ * @return 0 when successful, negative if the library has been built without statistics.
+ */
+int trashcan_get_stats(trashcan_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+#ifdef TRASHCAN_STATS
+	for (size_t phase = 0; phase < TRASHCAN_NUM_PHASES; phase++)
+	{
+		trashcan_phase_stats *phase_stats = &stats->phases[phase];
+		phase_stats->count = atomic_load_explicit(&phase_count[phase], memory_order_relaxed);
+		phase_stats->total_ns = atomic_load_explicit(&phase_total_ns[phase], memory_order_relaxed);
+		phase_stats->max_ns = atomic_load_explicit(&phase_max_ns[phase], memory_order_relaxed);
+		for (size_t bucket = 0; bucket < TRASHCAN_STATS_BUCKETS; bucket++)
+		{
+			phase_stats->histogram[bucket] = atomic_load_explicit(&phase_histogram[phase][bucket], memory_order_relaxed);
+		}
+	}
+
+	return LIBTRASHCAN_SUCCESS;
+#else
+	return LIBTRASHCAN_NOSTATS;
+#endif
+}
+
+/**
+ * @brief Resets the timing statistics to zero.
+ */
+void trashcan_reset_stats(void)
+{
+#ifdef TRASHCAN_STATS
+	for (size_t phase = 0; phase < TRASHCAN_NUM_PHASES; phase++)
+	{
+		atomic_store_explicit(&phase_count[phase], 0, memory_order_relaxed);
+		atomic_store_explicit(&phase_total_ns[phase], 0, memory_order_relaxed);
+		atomic_store_explicit(&phase_max_ns[phase], 0, memory_order_relaxed);
+		for (size_t bucket = 0; bucket < TRASHCAN_STATS_BUCKETS; bucket++)
+		{
+			atomic_store_explicit(&phase_histogram[phase][bucket], 0, memory_order_relaxed);
+		}
+	}
+#endif
+}
+
+/* Minimum size of the blocks of the arena of an index. */
+#define INDEX_ARENA_SIZE (64 * 1024)
+
+/* Name of the persistent index in the trash directory, next to directorysizes. */
+#define INDEX_FILE_NAME "trashindex"
+#define INDEX_FILE_MAGIC "TRSHIDX1"
+#define INDEX_FILE_VERSION 1
+/* Written in native byte order, so that a file from a machine with another byte order is rebuilt. */
+#define INDEX_FILE_BYTE_ORDER 0x01020304u
+
+/**
+ * @brief Header of the persistent index of a trash directory.
+ *
+ * The header is followed by num_records records sorted by original path and name, followed by the
+ * string table. The index is valid as long as $trash/info has the stored device, inode, mtime and
+ * ctime, since every entry that is added or removed adds or removes its .trashinfo file.
+ */
+struct index_file_header
+{
+	char magic[8]; /**< INDEX_FILE_MAGIC without the terminating '\0'. */
+	uint32_t version; /**< INDEX_FILE_VERSION. */
+	uint32_t byte_order; /**< INDEX_FILE_BYTE_ORDER. */
+	uint64_t info_device; /**< Device of $trash/info. */
+	uint64_t info_inode; /**< Inode of $trash/info. */
+	int64_t info_mtime_sec; /**< Modification time of $trash/info before it was read. */
+	int64_t info_mtime_nsec;
+	int64_t info_ctime_sec; /**< Status change time of $trash/info before it was read. */
+	int64_t info_ctime_nsec;
+	uint64_t num_records; /**< Number of records. */
+	uint64_t strings_size; /**< Size of the string table in bytes. */
+};
+
+/**
+ * @brief Record of an entry in the persistent index. Offsets refer to the string table, whose
+ * strings are terminated by '\0'. Entries with the same original path share the string.
+ */
+struct index_file_record
+{
+	uint64_t path_offset; /**< Decoded original path. */
+	uint64_t name_offset; /**< Name of the entry in $trash/files. */
+	uint64_t date_offset; /**< DeletionDate, empty if it's missing. */
+	int64_t deletion_time; /**< DeletionDate interpreted as local time when the record was created, -1 if invalid. */
+};
+
+/**
+ * @brief Content of a persistent index, mapped from the file or built in memory if it couldn't be written.
+ */
+struct index_file
+{
+	void *data; /**< Header, records and string table. */
+	size_t size; /**< Size of data in bytes. */
+	unsigned char mapped; /**< Set if data has been mapped with mmap(), otherwise it's allocated with malloc(). */
+};
+
+/**
+ * @brief Entry of a persistent index while it's being rebuilt.
+ */
+struct index_build_record
+{
+	const char *original_path; /**< Decoded original path, taken from the old index or an arena. */
+	const char *name; /**< Name of the entry in $trash/files. */
+	const char *deletion_date; /**< DeletionDate, empty if it's missing. */
+	int64_t deletion_time; /**< DeletionDate interpreted as local time, -1 if it's missing or invalid. */
+};
+
+/**
+ * @brief Releases the content of a persistent index.
+ *
+ * @param file Content to release, data may be NULL.
+ */
+static void free_index_file(struct index_file *file)
+{
+	if (file->data == NULL) { return; }
+
+	if (file->mapped) { munmap(file->data, file->size); }
+	else { free(file->data); }
+	file->data = NULL;
+}
+
+/**
+ * @brief Returns the records of the content of a persistent index.
+ */
+static const struct index_file_record *index_file_records(const struct index_file *file)
+{
+	return (const struct index_file_record *)((const char *)file->data + sizeof(struct index_file_header));
+}
+
+/**
+ * @brief Returns a string of the string table of a persistent index.
+ */
+static const char *index_file_string(const struct index_file *file, uint64_t offset)
+{
+	const struct index_file_header *header = file->data;
+	return (const char *)(index_file_records(file) + header->num_records) + offset;
+}
+
+/**
+ * @brief Checks that the content of a persistent index is well-formed, so that every offset can be used without further checks.
+ *
+ * @param file Content of the index.
+ * @return 1 if the content is well-formed, 0 otherwise.
+ */
+static int check_index_file(const struct index_file *file)
+{
+	const struct index_file_header *header = file->data;
+
+	if (file->size < sizeof(*header)) { return 0; }
+	if (memcmp(header->magic, INDEX_FILE_MAGIC, sizeof(header->magic)) != 0 || header->version != INDEX_FILE_VERSION || header->byte_order != INDEX_FILE_BYTE_ORDER) { return 0; }
+	if (header->num_records > (file->size - sizeof(*header)) / sizeof(struct index_file_record)) { return 0; }
+	if (file->size - sizeof(*header) - header->num_records * sizeof(struct index_file_record) != header->strings_size) { return 0; }
+	if (header->num_records == 0) { return 1; }
+
+	/* Every offset then points to a terminated string, since the table ends with '\0'. */
+	if (header->strings_size == 0 || index_file_string(file, header->strings_size - 1)[0] != '\0') { return 0; }
+
+	const struct index_file_record *records = index_file_records(file);
+	for (uint64_t i = 0; i < header->num_records; i++)
+	{
+		if (records[i].path_offset >= header->strings_size || records[i].name_offset >= header->strings_size || records[i].date_offset >= header->strings_size) { return 0; }
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Maps the persistent index of a trash directory.
+ *
+ * @param path Path of the index.
+ * @param file Address where the content is stored, data is NULL if the file doesn't exist or is malformed.
+ */
+static void map_index_file(const char *path, struct index_file *file)
+{
+	struct stat file_stat;
+	memset(file, 0, sizeof(*file));
+
+	int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) { return; }
+
+	if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0)
+	{
+		void *data = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			file->data = data;
+			file->size = (size_t)file_stat.st_size;
+			file->mapped = 1;
+		}
+	}
+	close(fd);
+
+	if (file->data != NULL && !check_index_file(file)) { free_index_file(file); }
+}
+
+/**
+ * @brief Checks whether a persistent index describes the current content of $trash/info.
+ */
+static int index_file_is_current(const struct index_file *file, const struct stat *info_stat)
+{
+	const struct index_file_header *header = file->data;
+
+	return header->info_device == (uint64_t)info_stat->st_dev && header->info_inode == (uint64_t)info_stat->st_ino &&
+		   header->info_mtime_sec == (int64_t)info_stat->st_mtim.tv_sec && header->info_mtime_nsec == (int64_t)info_stat->st_mtim.tv_nsec &&
+		   header->info_ctime_sec == (int64_t)info_stat->st_ctim.tv_sec && header->info_ctime_nsec == (int64_t)info_stat->st_ctim.tv_nsec;
+}
+
+/**
+ * @brief Orders records of a rebuilt index by original path and name.
+ */
+static int compare_build_records(const void *a, const void *b)
+{
+	const struct index_build_record *record_a = a;
+	const struct index_build_record *record_b = b;
+
+	int result = strcmp(record_a->original_path, record_b->original_path);
+	return result != 0 ? result : strcmp(record_a->name, record_b->name);
+}
+
+/**
+ * @brief Orders records of a rebuilt index by name.
+ */
+static int compare_build_record_names(const void *a, const void *b)
+{
+	return strcmp(((const struct index_build_record *)a)->name, ((const struct index_build_record *)b)->name);
+}
+
+/**
+ * @brief Reads the names of the .trashinfo files of a trash directory without their suffix.
+ *
+ * @param info_fd Open $trash/info directory, which is consumed.
+ * @param arena Arena in which the names are allocated.
+ * @param names Address where pointer to the sorted names is stored, has to be freed.
+ * @param num_names Address where the number of names is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+static int read_info_names(int info_fd, struct arena *arena, char ***names, size_t *num_names)
+{
+	const size_t suffix_len = strlen(".trashinfo");
+	size_t capacity = 0;
+	struct dirent *directory_entry;
+	*names = NULL;
+	*num_names = 0;
+
+	DIR *info_dir = fdopendir(info_fd);
+	if (info_dir == NULL)
+	{
+		close(info_fd);
+		return -1;
+	}
+
+	for (;;)
+	{
+		errno = 0;
+		directory_entry = readdir(info_dir);
+		if (directory_entry == NULL) { break; }
+
+		size_t name_len = strlen(directory_entry->d_name);
+		if (name_len <= suffix_len || strcmp(directory_entry->d_name + name_len - suffix_len, ".trashinfo") != 0) { continue; }
+
+		if (*num_names == capacity)
+		{
+			capacity = capacity == 0 ? 256 : capacity * 2;
+			char **new_names = realloc(*names, capacity * sizeof(*new_names));
+			if (new_names == NULL)
+			{
+				errno = ENOMEM;
+				break;
+			}
+			*names = new_names;
+		}
+
+		(*names)[*num_names] = arena_strndup(arena, directory_entry->d_name, name_len - suffix_len);
+		if ((*names)[*num_names] == NULL)
+		{
+			errno = ENOMEM;
+			break;
+		}
+		(*num_names)++;
+	}
+
+	int failed = errno != 0;
+	closedir(info_dir);
+	if (failed) { return -1; }
+
+	if (*num_names > 0) { qsort(*names, *num_names, sizeof(**names), compare_names); }
+	return 0;
+}
+
+/**
+ * @brief Serializes the records of a rebuilt index.
+ *
+ * @param records Records sorted by original path and name.
+ * @param num_records Number of records.
+ * @param info_stat Result of stat() for $trash/info before it was read.
+ * @param file Address where the content is stored, allocated with malloc().
+ * @return 0 when successful, negative otherwise.
+ */
+static int serialize_index_file(const struct index_build_record *records, size_t num_records, const struct stat *info_stat, struct index_file *file)
+{
+	size_t strings_size = 0;
+
+	for (size_t i = 0; i < num_records; i++)
+	{
+		if (i == 0 || strcmp(records[i - 1].original_path, records[i].original_path) != 0) { strings_size += strlen(records[i].original_path) + 1; }
+		strings_size += strlen(records[i].name) + strlen(records[i].deletion_date) + 2;
+	}
+
+	memset(file, 0, sizeof(*file));
+	file->size = sizeof(struct index_file_header) + num_records * sizeof(struct index_file_record) + strings_size;
+	file->data = calloc(1, file->size);
+	if (file->data == NULL) { return -1; }
+
+	struct index_file_header *header = file->data;
+	memcpy(header->magic, INDEX_FILE_MAGIC, sizeof(header->magic));
+	header->version = INDEX_FILE_VERSION;
+	header->byte_order = INDEX_FILE_BYTE_ORDER;
+	header->info_device = (uint64_t)info_stat->st_dev;
+	header->info_inode = (uint64_t)info_stat->st_ino;
+	header->info_mtime_sec = (int64_t)info_stat->st_mtim.tv_sec;
+	header->info_mtime_nsec = (int64_t)info_stat->st_mtim.tv_nsec;
+	header->info_ctime_sec = (int64_t)info_stat->st_ctim.tv_sec;
+	header->info_ctime_nsec = (int64_t)info_stat->st_ctim.tv_nsec;
+	header->num_records = num_records;
+	header->strings_size = strings_size;
+
+	struct index_file_record *out = (struct index_file_record *)(header + 1);
+	char *strings = (char *)(out + num_records);
+	uint64_t offset = 0;
+
+	for (size_t i = 0; i < num_records; i++)
+	{
+		const char *values[3] = { records[i].original_path, records[i].name, records[i].deletion_date };
+		uint64_t offsets[3];
+
+		for (size_t j = 0; j < 3; j++)
+		{
+			/* Records with the same original path are adjacent and share its string. */
+			if (j == 0 && i > 0 && strcmp(records[i - 1].original_path, records[i].original_path) == 0)
+			{
+				offsets[j] = out[i - 1].path_offset;
+				continue;
+			}
+
+			size_t len = strlen(values[j]) + 1;
+			memcpy(strings + offset, values[j], len);
+			offsets[j] = offset;
+			offset += len;
+		}
+
+		out[i].path_offset = offsets[0];
+		out[i].name_offset = offsets[1];
+		out[i].date_offset = offsets[2];
+		out[i].deletion_time = records[i].deletion_time;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Writes the content of a persistent index to a temporary file that atomically replaces the old index.
+ *
+ * @param trash_dir Path to the trash directory.
+ * @param index_path Path of the index.
+ * @param file Content of the index.
+ * @return 0 when successful, negative otherwise.
+ */
+static int write_index_file(const char *trash_dir, const char *index_path, const struct index_file *file)
+{
+	int status = -1;
+	char temp_name[_POSIX_NAME_MAX + 1];
+	char *index_temp = NULL;
+	size_t written = 0;
+
+	if (generate_random_filename(temp_name, _POSIX_NAME_MAX) < 0) { goto error_0; }
+	if (asprintf(&index_temp, "%s/%s", trash_dir, temp_name) < 0) { HANDLE_ERROR(index_temp, NULL, error_0) }
+
+	int fd = open(index_temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0) { goto error_0; }
+
+	while (written < file->size)
+	{
+		ssize_t num_written = write(fd, (const char *)file->data + written, file->size - written);
+		if (num_written < 0)
+		{
+			if (errno == EINTR) { continue; }
+			close(fd);
+			goto error_m1;
+		}
+		written += (size_t)num_written;
+	}
+
+	if (close(fd) != 0) { goto error_m1; }
+	if (rename(index_temp, index_path) != 0) { goto error_m1; }
+
+	status = 0;
+	goto error_0;
+
+error_m1:
+	remove(index_temp);
+error_0:
+	free(index_temp);
+	return status;
+}
+
+/**
+ * @brief Opens the persistent index of a trash directory and brings it up to date.
+ *
+ * The index in $trash/trashindex is mapped with mmap(). If $trash/info has changed since it was
+ * written, the names in $trash/info are compared with the records: records of removed names are
+ * dropped and only the .trashinfo files of new names are read, since .trashinfo files aren't
+ * modified after they have been created. The new index is written to a temporary file which
+ * atomically replaces the old one and is mapped again. If it can't be written, e.g. because the
+ * trash directory is read-only, the content built in memory is used instead.
+ *
+ * @param trash_dir Path to the trash directory.
+ * @param file Address where the content is stored, has to be released with free_index_file().
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int open_index_file(const char *trash_dir, struct index_file *file)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct arena arena;
+	struct index_file old_file;
+	struct index_build_record *old_records = NULL;
+	size_t num_old_records = 0;
+	struct index_build_record *records = NULL;
+	size_t num_records = 0;
+	char **names = NULL;
+	size_t num_names = 0;
+	char *index_path = NULL;
+	char *topdir = NULL;
+	char *info_buf = NULL;
+	size_t info_buf_size = 0;
+	char *path_buf = NULL;
+	size_t path_buf_size = 0;
+	struct stat info_stat;
+	struct stat entry_stat;
+	int info_fd = -1;
+
+	memset(file, 0, sizeof(*file));
+	memset(&old_file, 0, sizeof(old_file));
+	arena_init(&arena, INDEX_ARENA_SIZE);
+
+	if (asprintf(&index_path, "%s/%s", trash_dir, INDEX_FILE_NAME) < 0) { index_path = NULL; HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+	if (get_topdir(trash_dir, &topdir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+	char *info_dir = arena_printf(&arena, "%s/info", trash_dir);
+	if (info_dir == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+	info_fd = open(info_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (info_fd < 0) { HANDLE_ERROR(status, LIBTRASHCAN_OPENTRASH, error_0) }
+	/* Taken before the directory is read, so that changes while it's read cause another update next time. */
+	if (fstat(info_fd, &info_stat) != 0) { HANDLE_ERROR(status, LIBTRASHCAN_OPENTRASH, error_0) }
+
+	map_index_file(index_path, &old_file);
+	if (old_file.data != NULL && index_file_is_current(&old_file, &info_stat))
+	{
+		*file = old_file;
+		goto error_0;
+	}
+
+	/* The records of the old index, sorted by name, to find those whose .trashinfo files still exist. */
+	if (old_file.data != NULL)
+	{
+		const struct index_file_header *header = old_file.data;
+		const struct index_file_record *file_records = index_file_records(&old_file);
+
+		num_old_records = (size_t)header->num_records;
+		old_records = malloc((num_old_records + 1) * sizeof(*old_records));
+		if (old_records == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+		for (size_t i = 0; i < num_old_records; i++)
+		{
+			old_records[i].original_path = index_file_string(&old_file, file_records[i].path_offset);
+			old_records[i].name = index_file_string(&old_file, file_records[i].name_offset);
+			old_records[i].deletion_date = index_file_string(&old_file, file_records[i].date_offset);
+			old_records[i].deletion_time = file_records[i].deletion_time;
+		}
+		qsort(old_records, num_old_records, sizeof(*old_records), compare_build_record_names);
+	}
+
+	int names_fd = dup(info_fd);
+	if (names_fd < 0 || read_info_names(names_fd, &arena, &names, &num_names) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_READTRASH, error_0) }
+
+	records = malloc((num_names + 1) * sizeof(*records));
+	if (records == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+	/* Both lists are sorted by name, so they are merged in one pass. */
+	size_t old_idx = 0;
+	for (size_t i = 0; i < num_names; i++)
+	{
+		while (old_idx < num_old_records && strcmp(old_records[old_idx].name, names[i]) < 0) { old_idx++; }
+
+		if (old_idx < num_old_records && strcmp(old_records[old_idx].name, names[i]) == 0)
+		{
+			records[num_records] = old_records[old_idx];
+			num_records++;
+			continue;
+		}
+
+		char *info_name = arena_printf(&arena, "%s.trashinfo", names[i]);
+		if (info_name == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+		if (read_info_file(info_fd, info_name, &info_buf, &info_buf_size, &entry_stat) < 0) { continue; } /* Removed concurrently or not a file */
+
+		char *path = NULL;
+		char *deletion_date = NULL;
+		if (parse_info_file(info_buf, &path, &deletion_date) < 0) { continue; } /* Malformed */
+		if (decode_original_path(topdir, path, &path_buf, &path_buf_size) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+		if (deletion_date == NULL) { deletion_date = ""; }
+
+		records[num_records].original_path = arena_strndup(&arena, path_buf, strlen(path_buf));
+		records[num_records].name = names[i];
+		records[num_records].deletion_date = arena_strndup(&arena, deletion_date, strlen(deletion_date));
+		records[num_records].deletion_time = (int64_t)parse_deletion_date(deletion_date);
+		if (records[num_records].original_path == NULL || records[num_records].deletion_date == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+		num_records++;
+	}
+
+	if (num_records > 0) { qsort(records, num_records, sizeof(*records), compare_build_records); }
+	if (serialize_index_file(records, num_records, &info_stat, file) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+
+	/* The records point into the old mapping and the arena, which are released below. */
+	if (write_index_file(trash_dir, index_path, file) == 0)
+	{
+		struct index_file written;
+		map_index_file(index_path, &written);
+		if (written.data != NULL)
+		{
+			free_index_file(file);
+			*file = written;
+		}
+	}
+
+error_0:
+	if (status < 0) { free_index_file(file); }
+	if (old_file.data != file->data) { free_index_file(&old_file); }
+	if (info_fd >= 0) { close(info_fd); }
+	free(path_buf);
+	free(info_buf);
+	free(records);
+	free(names);
+	free(old_records);
+	free(topdir);
+	free(index_path);
+	arena_free(&arena);
+	return status;
+}
+
+/**
+ * @brief Trash directory of an index, interned so that entries only refer to it.
+ */
+struct index_trash_dir
+{
+	char *trash_dir; /**< Path to the trash directory, allocated in the arena of the index. */
+	dev_t device; /**< Device of the trash directory, to recognize it under another path. */
+	ino_t inode; /**< Inode of the trash directory. */
+};
+
+/**
+ * @brief Entry of the trash in an index.
+ */
+struct index_entry
+{
+	const struct index_trash_dir *trash_dir; /**< Trash directory that contains the entry. */
+	const char *name; /**< Name of the entry in $trash/files, allocated in the arena of the index. */
+	const char *deletion_date; /**< DeletionDate as stored in the .trashinfo file, empty if it's missing. */
+	time_t deletion_time; /**< DeletionDate interpreted as local time, -1 if it's missing or invalid. */
+	struct index_entry *next; /**< Next entry with the same original path, or the next free entry. */
+};
+
+/**
+ * @brief Original path in the hash table of an index.
+ */
+struct index_slot
+{
+	const char *original_path; /**< Decoded original path, allocated in the arena of the index. NULL for an empty slot. */
+	size_t hash; /**< Hash of original_path, compared before the strings. */
+	struct index_entry *entries; /**< Entries deleted from the path, empty once all of them have been removed. */
+	struct index_entry *removed; /**< Entries removed while the index is loaded, which the loader must not add again. */
+};
+
+/**
+ * @brief Index of the trash by original path.
+ *
+ * All strings and entries are allocated from one arena, each original path and trash directory is
+ * stored once. The arena only grows, removed entries are kept in a free list for reuse and their
+ * strings are only reclaimed when the index is loaded again.
+ */
+struct trash_index
+{
+	struct arena arena; /**< Arena of the strings, the trash directories and the entries. */
+	struct index_slot *slots; /**< Open addressing table with linear probing. */
+	size_t capacity; /**< Number of slots, a power of two. */
+	size_t count; /**< Number of occupied slots. */
+	struct index_trash_dir **trash_dirs; /**< Interned trash directories. */
+	size_t num_trash_dirs; /**< Number of interned trash directories. */
+	struct index_entry *free_entries; /**< Entries that have been removed. */
+	struct index_file *files; /**< Persistent indexes whose strings are referenced by the entries. */
+	size_t num_files; /**< Number of persistent indexes. */
+};
+
+/**
+ * @brief Frees an index and all of its strings.
+ *
+ * @param index Index to free, may be NULL.
+ */
+static void free_trash_index(struct trash_index *index)
+{
+	if (index == NULL) { return; }
+
+	for (size_t i = 0; i < index->num_files; i++) { free_index_file(&index->files[i]); }
+	free(index->files);
+	arena_free(&index->arena);
+	free(index->trash_dirs);
+	free(index->slots);
+	free(index);
+}
+
+/**
+ * @brief Finds the slot of an original path.
+ *
+ * @return Slot with the path or the empty slot where it would be inserted.
+ */
+static struct index_slot *find_index_slot(const struct trash_index *index, const char *original_path, size_t hash)
+{
+	size_t mask = index->capacity - 1;
+	size_t i = hash & mask;
+
+	while (index->slots[i].original_path != NULL && (index->slots[i].hash != hash || strcmp(index->slots[i].original_path, original_path) != 0)) { i = (i + 1) & mask; }
+
+	return &index->slots[i];
+}
+
+/**
+ * @brief Rehashes the slots of an index into a table of the given capacity.
+ *
+ * @return 0 when successful, negative otherwise.
+ */
+static int rehash_index(struct trash_index *index, size_t capacity)
+{
+	struct index_slot *old_slots = index->slots;
+	size_t old_capacity = index->capacity;
+
+	struct index_slot *slots = calloc(capacity, sizeof(*slots));
+	if (slots == NULL) { return -1; }
+
+	index->slots = slots;
+	index->capacity = capacity;
+
+	for (size_t i = 0; i < old_capacity; i++)
+	{
+		if (old_slots[i].original_path != NULL) { *find_index_slot(index, old_slots[i].original_path, old_slots[i].hash) = old_slots[i]; }
+	}
+
+	free(old_slots);
+	return 0;
+}
+
+/**
+ * @brief Finds an interned trash directory by its device and inode.
+ *
+ * @return The trash directory, NULL if it isn't interned.
+ */
+static struct index_trash_dir *find_index_trash_dir(const struct trash_index *index, const struct stat *dir_stat)
+{
+	for (size_t i = 0; i < index->num_trash_dirs; i++)
+	{
+		if (index->trash_dirs[i]->device == dir_stat->st_dev && index->trash_dirs[i]->inode == dir_stat->st_ino) { return index->trash_dirs[i]; }
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Interns a trash directory, a directory that is reachable through several paths is only stored once.
+ *
+ * @return The trash directory, NULL if it couldn't be allocated.
+ */
+static struct index_trash_dir *intern_index_trash_dir(struct trash_index *index, const char *trash_dir, const struct stat *dir_stat)
+{
+	struct index_trash_dir *dir = find_index_trash_dir(index, dir_stat);
+	if (dir != NULL) { return dir; }
+
+	struct index_trash_dir **trash_dirs = realloc(index->trash_dirs, (index->num_trash_dirs + 1) * sizeof(*trash_dirs));
+	if (trash_dirs == NULL) { return NULL; }
+	index->trash_dirs = trash_dirs;
+
+	dir = arena_alloc(&index->arena, sizeof(*dir));
+	if (dir == NULL) { return NULL; }
+	dir->trash_dir = arena_strndup(&index->arena, trash_dir, strlen(trash_dir));
+	if (dir->trash_dir == NULL) { return NULL; }
+	dir->device = dir_stat->st_dev;
+	dir->inode = dir_stat->st_ino;
+
+	index->trash_dirs[index->num_trash_dirs] = dir;
+	index->num_trash_dirs++;
+	return dir;
+}
+
+/**
+ * @brief Finds the slot of an original path and occupies it if the path isn't in the index yet.
+ *
+ * @param index The index.
+ * @param original_path Decoded original path.
+ * @param borrow Set if the path outlives the index and isn't copied, see index_add().
+ * @return The slot, NULL if it couldn't be allocated.
+ */
+static struct index_slot *intern_index_slot(struct trash_index *index, const char *original_path, unsigned char borrow)
+{
+	if ((index->count + 1) * 2 > index->capacity && rehash_index(index, index->capacity == 0 ? 1024 : index->capacity * 2) < 0) { return NULL; }
+
+	size_t hash = hash_name(original_path);
+	struct index_slot *slot = find_index_slot(index, original_path, hash);
+
+	if (slot->original_path == NULL)
+	{
+		const char *path = borrow ? original_path : arena_strndup(&index->arena, original_path, strlen(original_path));
+		if (path == NULL) { return NULL; }
+
+		slot->original_path = path;
+		slot->hash = hash;
+		slot->entries = NULL;
+		slot->removed = NULL;
+		index->count++;
+	}
+
+	return slot;
+}
+
+/**
+ * @brief Unlinks the entry of a trash directory with the given name from a list of entries.
+ *
+ * @param list Address of the first entry of the list.
+ * @param dir Trash directory that contains the entry.
+ * @param name Name of the entry in $trash/files.
+ * @return The unlinked entry, NULL if it isn't in the list.
+ */
+static struct index_entry *unlink_index_entry(struct index_entry **list, const struct index_trash_dir *dir, const char *name)
+{
+	for (struct index_entry **entry = list; *entry != NULL; entry = &(*entry)->next)
+	{
+		if ((*entry)->trash_dir == dir && strcmp((*entry)->name, name) == 0)
+		{
+			struct index_entry *unlinked = *entry;
+			*entry = unlinked->next;
+			return unlinked;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Checks whether a list of entries contains the entry of a trash directory with the given name.
+ */
+static int has_index_entry(const struct index_entry *list, const struct index_trash_dir *dir, const char *name)
+{
+	for (const struct index_entry *entry = list; entry != NULL; entry = entry->next)
+	{
+		if (entry->trash_dir == dir && strcmp(entry->name, name) == 0) { return 1; }
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Adds an entry of the trash to an index. An entry that is already in the index, or that has
+ * been removed while the index is loaded, isn't added again.
+ *
+ * @param index The index.
+ * @param trash_dir Path to the trash directory that contains the entry.
+ * @param dir_stat Result of stat() for trash_dir.
+ * @param original_path Decoded original path of the entry.
+ * @param name Name of the entry in $trash/files.
+ * @param deletion_date DeletionDate of the .trashinfo file, empty if it's missing.
+ * @param deletion_time DeletionDate interpreted as local time, -1 if it's missing or invalid.
+ * @param borrow Set if the strings outlive the index, e.g. because they are in one of its persistent indexes, and aren't copied.
+ * @return 0 when successful, negative otherwise.
+ */
+static int index_add(struct trash_index *index, const char *trash_dir, const struct stat *dir_stat, const char *original_path, const char *name, const char *deletion_date, time_t deletion_time, unsigned char borrow)
+{
+	const struct index_trash_dir *dir = intern_index_trash_dir(index, trash_dir, dir_stat);
+	if (dir == NULL) { return -1; }
+
+	struct index_slot *slot = intern_index_slot(index, original_path, borrow);
+	if (slot == NULL) { return -1; }
+
+	/* A deletion during trashcan_index_load() may have added the entry before the loader reads it,
+	 * and a restore or purge may have removed it while the persistent index still contains it. */
+	if (has_index_entry(slot->entries, dir, name) || has_index_entry(slot->removed, dir, name)) { return 0; }
+
+	const char *entry_name = borrow ? name : arena_strndup(&index->arena, name, strlen(name));
+	const char *entry_date = borrow ? deletion_date : arena_strndup(&index->arena, deletion_date, strlen(deletion_date));
+	if (entry_name == NULL || entry_date == NULL) { return -1; }
+
+	struct index_entry *entry = index->free_entries;
+	if (entry != NULL) { index->free_entries = entry->next; }
+	else if ((entry = arena_alloc(&index->arena, sizeof(*entry))) == NULL) { return -1; }
+
+	entry->trash_dir = dir;
+	entry->name = entry_name;
+	entry->deletion_date = entry_date;
+	entry->deletion_time = deletion_time;
+	entry->next = slot->entries;
+	slot->entries = entry;
+	return 0;
+}
+
+/**
+ * @brief Removes an entry of the trash from an index.
+ *
+ * @param index The index.
+ * @param dir_stat Result of stat() for the trash directory that contained the entry.
+ * @param original_path Decoded original path of the entry.
+ * @param name Name of the entry in $trash/files.
+ */
+static void index_remove(struct trash_index *index, const struct stat *dir_stat, const char *original_path, const char *name)
+{
+	const struct index_trash_dir *dir = find_index_trash_dir(index, dir_stat);
+	if (dir == NULL || index->count == 0) { return; }
+
+	struct index_slot *slot = find_index_slot(index, original_path, hash_name(original_path));
+
+	struct index_entry *removed = unlink_index_entry(&slot->entries, dir, name);
+	if (removed != NULL)
+	{
+		removed->next = index->free_entries;
+		index->free_entries = removed;
+	}
+}
+
+/**
+ * @brief Removes an entry of the trash from an index that is being loaded and records the removal
+ * as a tombstone, so that the loader skips the entry if it reads it afterwards.
+ *
+ * @param index The index that is being loaded.
+ * @param trash_dir Path to the trash directory that contained the entry.
+ * @param dir_stat Result of stat() for trash_dir.
+ * @param original_path Decoded original path of the entry.
+ * @param name Name of the entry in $trash/files.
+ * @return 0 when successful, negative otherwise.
+ */
+static int index_remove_loading(struct trash_index *index, const char *trash_dir, const struct stat *dir_stat, const char *original_path, const char *name)
+{
+	index_remove(index, dir_stat, original_path, name);
+
+	const struct index_trash_dir *dir = intern_index_trash_dir(index, trash_dir, dir_stat);
+	if (dir == NULL) { return -1; }
+
+	struct index_slot *slot = intern_index_slot(index, original_path, 0);
+	if (slot == NULL) { return -1; }
+	if (has_index_entry(slot->removed, dir, name)) { return 0; }
+
+	const char *entry_name = arena_strndup(&index->arena, name, strlen(name));
+	if (entry_name == NULL) { return -1; }
+
+	struct index_entry *entry = index->free_entries;
+	if (entry != NULL) { index->free_entries = entry->next; }
+	else if ((entry = arena_alloc(&index->arena, sizeof(*entry))) == NULL) { return -1; }
+
+	entry->trash_dir = dir;
+	entry->name = entry_name;
+	entry->deletion_date = "";
+	entry->deletion_time = (time_t)-1;
+	entry->next = slot->removed;
+	slot->removed = entry;
+	return 0;
+}
+
+/**
+ * @brief Drops the tombstone of an entry that is added to the trash again, e.g. under a reused name.
+ *
+ * @param index The index that is being loaded.
+ * @param dir_stat Result of stat() for the trash directory that contains the entry.
+ * @param original_path Decoded original path of the entry.
+ * @param name Name of the entry in $trash/files.
+ */
+static void index_revive(struct trash_index *index, const struct stat *dir_stat, const char *original_path, const char *name)
+{
+	const struct index_trash_dir *dir = find_index_trash_dir(index, dir_stat);
+	if (dir == NULL || index->count == 0) { return; }
+
+	struct index_slot *slot = find_index_slot(index, original_path, hash_name(original_path));
+
+	struct index_entry *revived = unlink_index_entry(&slot->removed, dir, name);
+	if (revived != NULL)
+	{
+		revived->next = index->free_entries;
+		index->free_entries = revived;
+	}
+}
+
+/**
+ * @brief Drops all tombstones of an index once it has been loaded.
+ *
+ * @param index The index.
+ */
+static void index_drop_tombstones(struct trash_index *index)
+{
+	for (size_t i = 0; i < index->capacity; i++)
+	{
+		while (index->slots[i].removed != NULL)
+		{
+			struct index_entry *removed = index->slots[i].removed;
+			index->slots[i].removed = removed->next;
+			removed->next = index->free_entries;
+			index->free_entries = removed;
+		}
+	}
+}
+
+/**
+ * @brief Checks whether changes of the trash have to be applied to an index of the context.
+ */
+static int index_active(trashcan_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->index_lock);
+	int active = ctx->index != NULL || ctx->index_loading != NULL;
+	pthread_mutex_unlock(&ctx->index_lock);
+	return active;
+}
+
+/**
+ * @brief Reads the original path and the deletion date of an entry of the trash from its .trashinfo file.
+ *
+ * @param trash_dir Path to the trash directory.
+ * @param name Name of the entry in $trash/files.
+ * @param dir_stat Address where the result of stat() for trash_dir is stored.
+ * @param original_path Address where pointer to the decoded original path is stored, has to be freed.
+ * @param deletion_date Buffer where the DeletionDate is stored, empty if it's missing.
+ * @param date_size Size of the buffer.
+ * @return 0 when successful, negative otherwise.
+ */
+static int read_index_entry(const char *trash_dir, const char *name, struct stat *dir_stat, char **original_path, char *deletion_date, size_t date_size)
+{
+	int status = -1;
+	char *topdir = NULL;
+	char *info_file = NULL;
+	char *info_buf = NULL;
+	size_t info_buf_size = 0;
+	size_t original_path_size = 0;
+	struct stat info_stat;
+	*original_path = NULL;
+
+	if (stat(trash_dir, dir_stat) != 0) { goto error_0; }
+	if (get_topdir(trash_dir, &topdir) < 0) { goto error_0; }
+	if (asprintf(&info_file, "%s/info/%s.trashinfo", trash_dir, name) < 0) { info_file = NULL; goto error_1; }
+	if (read_info_file(AT_FDCWD, info_file, &info_buf, &info_buf_size, &info_stat) < 0) { goto error_1; }
+
+	char *path = NULL;
+	char *date = NULL;
+	if (parse_info_file(info_buf, &path, &date) < 0) { goto error_1; }
+	if (decode_original_path(topdir, path, original_path, &original_path_size) < 0) { goto error_1; }
+	snprintf(deletion_date, date_size, "%s", date != NULL ? date : "");
+	status = 0;
+
+error_1:
+	free(info_buf);
+	free(info_file);
+	free(topdir);
+error_0:
+	return status;
+}
+
+/**
+ * @brief Adds an entry of the trash to the indexes of the context.
+ *
+ * @param ctx The context.
+ * @param trash_dir Path to the trash directory that contains the entry.
+ * @param dir_stat Result of stat() for trash_dir.
+ * @param original_path Decoded original path of the entry.
+ * @param name Name of the entry in $trash/files.
+ * @param deletion_date DeletionDate of the .trashinfo file, empty if it's missing.
+ */
+static void index_add_entry(trashcan_ctx *ctx, const char *trash_dir, const struct stat *dir_stat, const char *original_path, const char *name, const char *deletion_date)
+{
+	time_t deletion_time = parse_deletion_date(deletion_date);
+
+	pthread_mutex_lock(&ctx->index_lock);
+	if (ctx->index != NULL) { index_add(ctx->index, trash_dir, dir_stat, original_path, name, deletion_date, deletion_time, 0); }
+	if (ctx->index_loading != NULL)
+	{
+		index_revive(ctx->index_loading, dir_stat, original_path, name);
+		index_add(ctx->index_loading, trash_dir, dir_stat, original_path, name, deletion_date, deletion_time, 0);
+	}
+	pthread_mutex_unlock(&ctx->index_lock);
+}
+
+/**
+ * @brief Adds a file or directory that has just been moved to the trash to the indexes of the context.
+ *
+ * The original path and the deletion date are read back from the .trashinfo file, which is still
+ * in the page cache, so that every way of moving files to the trash is covered. An entry that can't
+ * be added is missing from the index until it's loaded again.
+ *
+ * @param ctx The context.
+ * @param location Trash location the file or directory has been moved to.
+ * @param trashed_file New path of the file or directory.
+ */
+static void index_add_trashed(trashcan_ctx *ctx, const struct trash_location *location, const char *trashed_file)
+{
+	const char *name = trashed_file + strlen(location->trash_files_dir) + 1;
+	char *original_path = NULL;
+	char deletion_date[32];
+	struct stat dir_stat;
+
+	if (!index_active(ctx)) { return; }
+	if (read_index_entry(location->trash_dir, name, &dir_stat, &original_path, deletion_date, sizeof(deletion_date)) < 0) { return; }
+
+	index_add_entry(ctx, location->trash_dir, &dir_stat, original_path, name, deletion_date);
+	free(original_path);
+}
+
+/**
+ * @brief Removes an entry that has left the trash from the indexes of the context.
+ *
+ * While an index is loaded, the removal is recorded in it, so that the entry isn't added again from
+ * a persistent index that was read before the removal. If that fails, the entry may show up in the
+ * loaded index until the next load.
+ *
+ * @param ctx The context.
+ * @param trash_dir Path to the trash directory that contained the entry.
+ * @param dir_stat Result of stat() for the trash directory that contained the entry.
+ * @param original_path Decoded original path of the entry, NULL if it's unknown.
+ * @param name Name of the entry in $trash/files.
+ */
+static void index_remove_trashed(trashcan_ctx *ctx, const char *trash_dir, const struct stat *dir_stat, const char *original_path, const char *name)
+{
+	if (original_path == NULL) { return; }
+
+	pthread_mutex_lock(&ctx->index_lock);
+	if (ctx->index != NULL) { index_remove(ctx->index, dir_stat, original_path, name); }
+	if (ctx->index_loading != NULL) { index_remove_loading(ctx->index_loading, trash_dir, dir_stat, original_path, name); }
+	pthread_mutex_unlock(&ctx->index_lock);
+}
+
+/**
+ * @brief Moves an entry of the trash back to its original location using a context.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param trash_dir Path to the trash directory or NULL for the home trash of the context.
+ * @param name Name of the entry in $trash/files.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_restore_ctx(trashcan_ctx *ctx, const char *trash_dir, const char *name)
+{
+	char *original_path = NULL;
+	struct stat dir_stat;
+
+	if (trash_dir == NULL) { trash_dir = ctx->home.trash_dir; }
+
+	int status = restore_entry(trash_dir, name, (ctx->flags & TRASHCAN_COPY_FALLBACK) != 0, ctx->threads, &ctx->cache_lock, &original_path);
+	if (original_path != NULL && index_active(ctx) && stat(trash_dir, &dir_stat) == 0) { index_remove_trashed(ctx, trash_dir, &dir_stat, original_path, name); }
+
+	free(original_path);
+	return status;
+}
+
+/**
+ * @brief Reads the entries of a trash directory into an index that is being loaded.
+ *
+ * The entries are read from the persistent index of the trash directory, which is brought up to
+ * date first. Its content is kept by the index, so that the entries refer to its strings.
+ *
+ * @param ctx Context that the index belongs to.
+ * @param index Index that is being loaded.
+ * @param trash_dir Path to the trash directory.
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int load_index_trash_dir(trashcan_ctx *ctx, struct trash_index *index, const char *trash_dir)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	struct index_file file;
+	struct stat dir_stat;
+
+	/* A trash directory that has disappeared since the discovery has no entries. */
+	if (stat(trash_dir, &dir_stat) != 0) { goto error_0; }
+
+	status = open_index_file(trash_dir, &file);
+	if (status == LIBTRASHCAN_OPENTRASH)
+	{
+		status = LIBTRASHCAN_SUCCESS;
+		goto error_0;
+	}
+	if (status < 0) { goto error_0; }
+
+	struct index_file *files = realloc(index->files, (index->num_files + 1) * sizeof(*files));
+	if (files == NULL)
+	{
+		free_index_file(&file);
+		HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0)
+	}
+	index->files = files;
+	index->files[index->num_files] = file;
+	index->num_files++;
+
+	const struct index_file_header *header = file.data;
+	const struct index_file_record *records = index_file_records(&file);
+	for (uint64_t i = 0; i < header->num_records; i++)
+	{
+		pthread_mutex_lock(&ctx->index_lock);
+		int add_status = index_add(index, trash_dir, &dir_stat, index_file_string(&file, records[i].path_offset), index_file_string(&file, records[i].name_offset),
+								   index_file_string(&file, records[i].date_offset), (time_t)records[i].deletion_time, 1);
+		pthread_mutex_unlock(&ctx->index_lock);
+		if (add_status < 0) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+	}
+
+error_0:
+	return status;
+}
+
+/**
+ * @brief Loads the entries of all trash directories into an index of the context.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param timeout_ms Maximum time to wait for the discovery in milliseconds, negative to wait for all devices.
+ * @return 0 when successful, 1 if some devices are missing because of the timeout, negative otherwise.
+ */
+int trashcan_index_load(trashcan_ctx *ctx, int timeout_ms)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	trashcan_trash_dir *trash_dirs = NULL;
+	size_t num_trash_dirs = 0;
+	struct trash_index *index = NULL;
+
+	pthread_mutex_lock(&ctx->index_load_lock);
+
+	index = calloc(1, sizeof(*index));
+	if (index == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+	arena_init(&index->arena, INDEX_ARENA_SIZE);
+
+	int found = trashcan_find_trash_dirs(ctx, timeout_ms, &trash_dirs, &num_trash_dirs);
+	if (found < 0) { HANDLE_ERROR(status, found, error_1) }
+
+	/* Deletions, restores and purges from now on are applied to the new index as well. */
+	pthread_mutex_lock(&ctx->index_lock);
+	ctx->index_loading = index;
+	pthread_mutex_unlock(&ctx->index_lock);
+
+	for (size_t i = 0; i < num_trash_dirs; i++)
+	{
+		status = load_index_trash_dir(ctx, index, trash_dirs[i].trash_dir);
+		if (status < 0) { break; }
+	}
+
+	pthread_mutex_lock(&ctx->index_lock);
+	ctx->index_loading = NULL;
+	if (status == LIBTRASHCAN_SUCCESS)
+	{
+		index_drop_tombstones(index);
+		struct trash_index *old_index = ctx->index;
+		ctx->index = index;
+		index = old_index;
+		status = found;
+	}
+	pthread_mutex_unlock(&ctx->index_lock);
+
+error_1:
+	trashcan_free_trash_dirs(trash_dirs, num_trash_dirs);
+	free_trash_index(index);
+error_0:
+	pthread_mutex_unlock(&ctx->index_load_lock);
+	return status;
+}
+
+/**
+ * @brief Orders entries of the index by their deletion time, the most recent first.
+ */
+static int compare_index_entries(const void *a, const void *b)
+{
+	time_t time_a = ((const trashcan_index_entry *)a)->deletion_time;
+	time_t time_b = ((const trashcan_index_entry *)b)->deletion_time;
+	return (time_a < time_b) - (time_a > time_b);
+}
+
+/**
+ * @brief Looks up the entries of the trash that have been deleted from a path.
+ *
+ * @param ctx Context whose index has been loaded.
+ * @param original_path Original path of the entries.
+ * @param entries Address where pointer to the entries is stored, NULL if there are none.
+ * @param num_entries Address where the number of entries is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_index_lookup(trashcan_ctx *ctx, const char *original_path, trashcan_index_entry **entries, size_t *num_entries)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	const struct index_slot *slot = NULL;
+	size_t strings_size = 0;
+	*entries = NULL;
+	*num_entries = 0;
+
+	pthread_mutex_lock(&ctx->index_lock);
+
+	if (ctx->index == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_NOINDEX, error_0) }
+	if (ctx->index->count == 0) { goto error_0; }
+
+	slot = find_index_slot(ctx->index, original_path, hash_name(original_path));
+	for (const struct index_entry *entry = slot->entries; entry != NULL; entry = entry->next)
+	{
+		strings_size += strlen(entry->trash_dir->trash_dir) + strlen(entry->name) + strlen(entry->deletion_date) + 3;
+		(*num_entries)++;
+	}
+	if (*num_entries == 0) { goto error_0; }
+
+	/* The entries and their strings are copied into one allocation, since the index may change as soon as the lock is released. */
+	*entries = malloc(*num_entries * sizeof(**entries) + strings_size);
+	if (*entries == NULL)
+	{
+		*num_entries = 0;
+		HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0)
+	}
+
+	char *strings = (char *)(*entries + *num_entries);
+	size_t i = 0;
+	for (const struct index_entry *entry = slot->entries; entry != NULL; entry = entry->next, i++)
+	{
+		const char *values[3] = { entry->trash_dir->trash_dir, entry->name, entry->deletion_date };
+		const char *copies[3];
+
+		for (size_t j = 0; j < 3; j++)
+		{
+			size_t len = strlen(values[j]) + 1;
+			memcpy(strings, values[j], len);
+			copies[j] = strings;
+			strings += len;
+		}
+
+		(*entries)[i].trash_dir = copies[0];
+		(*entries)[i].name = copies[1];
+		(*entries)[i].deletion_date = copies[2];
+		(*entries)[i].deletion_time = entry->deletion_time;
+	}
+
+error_0:
+	pthread_mutex_unlock(&ctx->index_lock);
+	if (*entries != NULL) { qsort(*entries, *num_entries, sizeof(**entries), compare_index_entries); }
+	return status;
+}
+
+/**
+ * @brief Frees the entries returned by `trashcan_index_lookup()`.
+ *
+ * @param entries Array of entries, may be NULL.
+ */
+void trashcan_free_index_entries(trashcan_index_entry *entries)
+{
+	free(entries);
+}
+
+#ifdef __linux__
+/* Time that the thread of a watcher waits for further events before it applies a batch, in milliseconds. */
+#define WATCH_BATCH_MS 20
+
+/**
+ * @brief Entry of a watched trash directory, as it has been applied to the caches of the context.
+ */
+struct watch_record
+{
+	char *name; /**< Name of the entry in $trash/files, followed by the original path in the same allocation. NULL for an empty slot. */
+	const char *original_path; /**< Decoded original path of the entry. */
+	size_t hash; /**< Hash of name. */
+	uint64_t size; /**< Size of the entry that has been added to the total. */
+};
+
+/**
+ * @brief Entry of a watched trash directory that has changed since the last batch.
+ */
+struct watch_change
+{
+	const char *name; /**< Name of the entry in $trash/files, allocated in the arena of the watcher. */
+	unsigned char files; /**< Set if $trash/files has changed, i.e. the directory size cache might be outdated. */
+};
+
+/**
+ * @brief Trash directory that is watched for changes.
+ */
+struct watch_dir
+{
+	char *trash_dir; /**< Path to the trash directory. */
+	char *trash_info_dir; /**< Path to $trash/info. */
+	char *trash_files_dir; /**< Path to $trash/files. */
+	int info_wd; /**< Watch descriptor of $trash/info, negative once it isn't watched anymore. */
+	int files_wd; /**< Watch descriptor of $trash/files, negative once it isn't watched anymore. */
+	struct stat dir_stat; /**< Result of stat() for trash_dir, identifies it in the index. */
+	struct stat info_stat; /**< Result of stat() for $trash/info before the events of the current batch have been read. */
+	struct watch_record *records; /**< Open addressing table of the entries with linear probing. */
+	size_t capacity; /**< Number of slots, a power of two. */
+	size_t count; /**< Number of entries. */
+	uint64_t total; /**< Sum of the sizes of all entries. */
+	struct watch_change *changes; /**< Changes of the current batch. */
+	size_t num_changes; /**< Number of changes. */
+	size_t changes_capacity; /**< Number of elements allocated for changes. */
+	unsigned char rescan; /**< Set if events have been lost and all entries have to be compared. */
+	unsigned char accounted; /**< Set once the size account of the trash directory counts this watcher. */
+};
+
+/**
+ * @brief Watcher that applies changes of the trash by other applications to the caches of a context.
+ */
+struct trashcan_watcher
+{
+	trashcan_ctx *ctx; /**< Context whose caches are kept up to date. */
+	int fd; /**< inotify instance. */
+	struct watch_dir *dirs; /**< Watched trash directories. */
+	size_t num_dirs; /**< Number of watched trash directories. */
+	struct arena arena; /**< Names of the changes of the current batch. */
+	pthread_mutex_t lock; /**< Serializes the processing of events. */
+	int stop_pipe[2]; /**< Wakes the thread up when the watcher is destroyed. */
+	pthread_t thread; /**< Thread that processes the events if TRASHCAN_WATCH_THREAD has been passed. */
+	unsigned char threaded; /**< Set if thread has been started. */
+};
+
+/**
+ * @brief Finds the slot of an entry of a watched trash directory.
+ *
+ * @return Slot with the entry or the empty slot where it would be inserted.
+ */
+static struct watch_record *find_watch_record(const struct watch_dir *dir, const char *name, size_t hash)
+{
+	size_t mask = dir->capacity - 1;
+	size_t i = hash & mask;
+
+	while (dir->records[i].name != NULL && (dir->records[i].hash != hash || strcmp(dir->records[i].name, name) != 0)) { i = (i + 1) & mask; }
+
+	return &dir->records[i];
+}
+
+/**
+ * @brief Adds an entry to a watched trash directory. The entry must not exist yet.
+ *
+ * @return 0 when successful, negative otherwise.
+ */
+static int add_watch_record(struct watch_dir *dir, const char *name, const char *original_path, uint64_t size)
+{
+	if ((dir->count + 1) * 2 > dir->capacity)
+	{
+		size_t old_capacity = dir->capacity;
+		struct watch_record *old_records = dir->records;
+		size_t capacity = old_capacity == 0 ? 256 : old_capacity * 2;
+
+		struct watch_record *records = calloc(capacity, sizeof(*records));
+		if (records == NULL) { return -1; }
+		dir->records = records;
+		dir->capacity = capacity;
+
+		for (size_t i = 0; i < old_capacity; i++)
+		{
+			if (old_records[i].name != NULL) { *find_watch_record(dir, old_records[i].name, old_records[i].hash) = old_records[i]; }
+		}
+		free(old_records);
+	}
+
+	size_t name_len = strlen(name) + 1;
+	size_t path_len = strlen(original_path) + 1;
+	char *strings = malloc(name_len + path_len);
+	if (strings == NULL) { return -1; }
+	memcpy(strings, name, name_len);
+	memcpy(strings + name_len, original_path, path_len);
+
+	size_t hash = hash_name(name);
+	struct watch_record *record = find_watch_record(dir, name, hash);
+	record->name = strings;
+	record->original_path = strings + name_len;
+	record->hash = hash;
+	record->size = size;
+	dir->count++;
+	dir->total += size;
+	return 0;
+}
+
+/**
+ * @brief Removes an entry from a watched trash directory.
+ *
+ * The following entries of the same cluster are shifted back, so that no lookup stops early at the freed slot.
+ *
+ * @param dir The trash directory.
+ * @param record Slot of the entry.
+ */
+static void remove_watch_record(struct watch_dir *dir, struct watch_record *record)
+{
+	size_t mask = dir->capacity - 1;
+	size_t i = (size_t)(record - dir->records);
+
+	dir->total -= record->size < dir->total ? record->size : dir->total;
+	free(record->name);
+	dir->count--;
+
+	for (size_t j = (i + 1) & mask; dir->records[j].name != NULL; j = (j + 1) & mask)
+	{
+		/* An entry can be moved into the gap if its home slot isn't in the cyclic range (i, j]. */
+		size_t home = dir->records[j].hash & mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) { continue; }
+
+		dir->records[i] = dir->records[j];
+		i = j;
+	}
+
+	dir->records[i].name = NULL;
+}
+
+/**
+ * @brief Frees a watched trash directory. Its watches are removed together with the inotify instance.
+ */
+static void free_watch_dir(struct watch_dir *dir)
+{
+	for (size_t i = 0; i < dir->capacity; i++) { free(dir->records[i].name); }
+	free(dir->records);
+	free(dir->changes);
+	free(dir->trash_files_dir);
+	free(dir->trash_info_dir);
+	free(dir->trash_dir);
+}
+
+/**
+ * @brief Queues a changed entry of a watched trash directory for the current batch.
  *
- * @param trash_dir Path to the trash base directory.
- * @param trash_info_dir Path to the trash info directory.
- * @param trash_files_dir Path to the directory where deleted file are stored.
  * @return 0 when successful, negative otherwise.
  */
-static int create_or_update_dir_size_cache(const char *trash_dir, const char *trash_info_dir, const char *trash_files_dir)
+static int queue_watch_change(trashcan_watcher *watcher, struct watch_dir *dir, const char *name, size_t name_len, unsigned char files)
 {
-	int status = -1;
-	char *temp_name = NULL;
-	char *dir_size_cache = NULL;
-	char *dir_size_cache_temp = NULL;
-	char *current_dir = NULL;
-	char *current_trashinfo = NULL;
-	char *current_line = NULL;
+	if (dir->num_changes == dir->changes_capacity)
+	{
+		size_t capacity = dir->changes_capacity == 0 ? 64 : dir->changes_capacity * 2;
+		struct watch_change *changes = realloc(dir->changes, capacity * sizeof(*changes));
+		if (changes == NULL) { return -1; }
+		dir->changes = changes;
+		dir->changes_capacity = capacity;
+	}
 
-	if (generate_random_filename(&temp_name, _POSIX_NAME_MAX) < 0) { goto error_0; }
-	if (asprintf(&dir_size_cache, "%s/%s", trash_dir, "directorysizes") < 0) { HANDLE_ERROR(dir_size_cache, NULL, error_0) }
-	if (asprintf(&dir_size_cache_temp, "%s/%s", trash_dir, temp_name) < 0) { HANDLE_ERROR(dir_size_cache_temp, NULL, error_0) }
+	const char *copy = arena_strndup(&watcher->arena, name, name_len);
+	if (copy == NULL) { return -1; }
 
-	FILE *fptr = fopen(dir_size_cache_temp, "w");
-	if (fptr == NULL)
+	dir->changes[dir->num_changes].name = copy;
+	dir->changes[dir->num_changes].files = files;
+	dir->num_changes++;
+	return 0;
+}
+
+/**
+ * @brief Queues all known entries and all .trashinfo files of a watched trash directory, e.g. after events have been lost.
+ *
+ * @return 0 when successful, negative otherwise.
+ */
+static int queue_watch_rescan(trashcan_watcher *watcher, struct watch_dir *dir)
+{
+	const size_t suffix_len = strlen(".trashinfo");
+	struct dirent *directory_entry;
+
+	for (size_t i = 0; i < dir->capacity; i++)
 	{
-		goto error_0;
+		if (dir->records[i].name != NULL && queue_watch_change(watcher, dir, dir->records[i].name, strlen(dir->records[i].name), 1) < 0) { return -1; }
 	}
 
-	struct dirent *directory_entry;
-	struct stat trashinfo_stat;
-	DIR *directory = opendir(trash_files_dir);
-	if (directory == NULL) { goto error_1; }
+	DIR *info_dir = opendir(dir->trash_info_dir);
+	if (info_dir == NULL) { return 0; } /* Removed, so all entries are gone */
 
-	while ((directory_entry = readdir(directory)) != NULL)
+	while ((directory_entry = readdir(info_dir)) != NULL)
 	{
-		if ((strcmp(directory_entry->d_name, ".") == 0) || (strcmp(directory_entry->d_name, "..") == 0))
+		size_t name_len = strlen(directory_entry->d_name);
+		if (name_len <= suffix_len || strcmp(directory_entry->d_name + name_len - suffix_len, ".trashinfo") != 0) { continue; }
+		if (queue_watch_change(watcher, dir, directory_entry->d_name, name_len - suffix_len, 1) < 0)
 		{
-			continue;
+			closedir(info_dir);
+			return -1;
 		}
-		
-		if (directory_entry->d_type == DT_DIR)
+	}
+
+	closedir(info_dir);
+	return 0;
+}
+
+/**
+ * @brief Orders changes by name, so that duplicates are adjacent.
+ */
+static int compare_watch_changes(const void *a, const void *b)
+{
+	return strcmp(((const struct watch_change *)a)->name, ((const struct watch_change *)b)->name);
+}
+
+/**
+ * @brief Reads all pending events of a watcher and queues them as changes of their trash directories.
+ *
+ * @return 0 when successful, negative status code otherwise.
+ */
+static int read_watch_events(trashcan_watcher *watcher)
+{
+	const size_t suffix_len = strlen(".trashinfo");
+	char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;)
+	{
+		ssize_t num_read = read(watcher->fd, buf, sizeof(buf));
+		if (num_read < 0)
+		{
+			if (errno == EINTR) { continue; }
+			if (errno == EAGAIN) { return 0; }
+			return LIBTRASHCAN_WATCH;
+		}
+
+		for (char *ptr = buf; ptr < buf + num_read;)
 		{
-			uint64_t dir_size = 0;
-			if (asprintf(&current_dir, "%s/%s", trash_files_dir, directory_entry->d_name) < 0) { HANDLE_ERROR(current_dir, NULL, error_2) }
-			if (get_dir_size(current_dir, &dir_size) < 0) { goto error_2; }
-			if (asprintf(&current_trashinfo, "%s/%s%s", trash_info_dir, directory_entry->d_name, ".trashinfo") < 0) { HANDLE_ERROR(current_trashinfo, NULL, error_2) }
-			if (lstat(current_trashinfo, &trashinfo_stat)) { goto skip; } /* lstat can fail if .trashinfo file doesn't exist. */
-			if (asprintf(&current_line, "%" PRIu64 " %jd %s\n", dir_size, (intmax_t)trashinfo_stat.st_mtime, directory_entry->d_name) < 0) { HANDLE_ERROR(current_line, NULL, error_2) }
+			const struct inotify_event *event = (const struct inotify_event *)ptr;
+			ptr += sizeof(*event) + event->len;
 
-			if (fwrite(current_line, sizeof(char), strlen(current_line), fptr) != strlen(current_line))
+			if (event->mask & IN_Q_OVERFLOW)
 			{
-				goto error_2;
+				for (size_t i = 0; i < watcher->num_dirs; i++) { watcher->dirs[i].rescan = 1; }
+				continue;
 			}
 
-skip:
-			free(current_dir);
-			free(current_line);
-			free(current_trashinfo);
-			current_dir = NULL;
-			current_line = NULL;
-			current_trashinfo = NULL;
+			for (size_t i = 0; i < watcher->num_dirs; i++)
+			{
+				struct watch_dir *dir = &watcher->dirs[i];
+				if (event->wd != dir->info_wd && event->wd != dir->files_wd) { continue; }
+
+				if (event->mask & IN_IGNORED)
+				{
+					/* The directory has been removed, which removes all of its entries. */
+					if (event->wd == dir->info_wd) { dir->info_wd = -1; }
+					else { dir->files_wd = -1; }
+					dir->rescan = 1;
+				}
+				else if (event->len > 0 && event->wd == dir->info_wd)
+				{
+					size_t name_len = strlen(event->name);
+					if (name_len <= suffix_len || strcmp(event->name + name_len - suffix_len, ".trashinfo") != 0) { break; }
+					if (queue_watch_change(watcher, dir, event->name, name_len - suffix_len, 0) < 0) { return LIBTRASHCAN_ALLOC; }
+				}
+				else if (event->len > 0)
+				{
+					if (queue_watch_change(watcher, dir, event->name, strlen(event->name), 1) < 0) { return LIBTRASHCAN_ALLOC; }
+				}
+				break;
+			}
 		}
 	}
+}
 
-	closedir(directory);
-	fclose(fptr);
+/**
+ * @brief Brings the directory size cache of a watched trash directory up to date for the changed entries.
+ *
+ * Only entries whose line is missing, outdated or no longer needed are passed to
+ * update_dir_size_cache(), so that directories that have already been sized by a deletion of the
+ * context aren't walked again.
+ *
+ * @param ctx Context whose cache lock is held while the cache is updated.
+ * @param dir The trash directory whose changes have been sorted by name.
+ * @param info_fd Open $trash/info directory.
+ * @param files_fd Open $trash/files directory.
+ * @param dir_sizes Address where pointer to the lines of the updated cache is stored.
+ * @param num_dir_sizes Address where the number of lines is stored.
+ */
+static void update_watch_dir_sizes(trashcan_ctx *ctx, const struct watch_dir *dir, int info_fd, int files_fd, struct dir_size_entry **dir_sizes, size_t *num_dir_sizes)
+{
+	const char **names = NULL;
+	size_t num_names = 0;
+	struct stat entry_stat;
+	struct stat info_stat;
+	char info_name[NAME_MAX + 1];
+
+	pthread_mutex_lock(&ctx->cache_lock);
+
+	if (load_dir_size_cache(dir->trash_dir, dir_sizes, num_dir_sizes) < 0) { goto error_0; }
 
-	if (rename(dir_size_cache_temp, dir_size_cache) != 0)
+	for (size_t i = 0; i < dir->num_changes; i++)
 	{
-		remove(dir_size_cache_temp);
-		goto error_0;
-	}
+		if (!dir->changes[i].files) { continue; }
 
-	status = 0;
+		struct dir_size_entry key = { .name = (char *)dir->changes[i].name, .size = 0, .mtime = 0 };
+		const struct dir_size_entry *cached = NULL;
+		if (*dir_sizes != NULL) { cached = bsearch(&key, *dir_sizes, *num_dir_sizes, sizeof(**dir_sizes), compare_dir_size_entries); }
 
-	goto error_0;
+		unsigned char is_dir = fstatat(files_fd, dir->changes[i].name, &entry_stat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(entry_stat.st_mode);
+		unsigned char current = 0;
+		if (is_dir && cached != NULL && snprintf(info_name, sizeof(info_name), "%s.trashinfo", dir->changes[i].name) < (int)sizeof(info_name) &&
+			fstatat(info_fd, info_name, &info_stat, 0) == 0)
+		{
+			current = cached->mtime == (intmax_t)info_stat.st_mtime;
+		}
+
+		if ((is_dir && !current) || (!is_dir && cached != NULL))
+		{
+			const char **new_names = realloc(names, (num_names + 1) * sizeof(*new_names));
+			if (new_names == NULL) { goto error_1; }
+			names = new_names;
+			names[num_names] = dir->changes[i].name;
+			num_names++;
+		}
+	}
+
+	if (num_names > 0 && update_dir_size_cache(dir->trash_dir, dir->trash_info_dir, dir->trash_files_dir, names, num_names, ctx->threads, 0, NULL) == 0)
+	{
+		free_dir_size_cache(*dir_sizes, *num_dir_sizes);
+		load_dir_size_cache(dir->trash_dir, dir_sizes, num_dir_sizes);
+	}
 
-error_2:
-	closedir(directory);
 error_1:
-	fclose(fptr);
+	free(names);
 error_0:
-	free(current_line);
-	free(current_trashinfo);
-	free(dir_size_cache_temp);
-	free(dir_size_cache);
-	free(temp_name);
-	return status;
+	pthread_mutex_unlock(&ctx->cache_lock);
 }
 
 /**
- * @brief Moves a file or a directory (and its content) to the trash.
- *
- * @warning Do not change the current working directory when using this in a multithreaded application!
+ * @brief Determines the size of an entry of a watched trash directory like get_entry_size().
  *
- * @param path Path to the file or directory that shall be moved to the trash.
- * @return 0 when successful, -1 otherwise.
+ * @return Size of the entry, 0 if it doesn't exist in $trash/files.
  */
-int trashcan_soft_delete(const char *path)
+static uint64_t get_watch_entry_size(trashcan_ctx *ctx, int info_fd, int files_fd, const char *name, const struct dir_size_entry *dir_sizes, size_t num_dir_sizes)
 {
-	int status = LIBTRASHCAN_SUCCESS;
-	char *resolved_path = NULL;
-	char *data_home = NULL;
-	char *trash_dir = NULL;
-	char *trash_info_dir = NULL;
-	char *trash_files_dir = NULL;
-	char *trash_info_file = NULL;
-	char *trashed_file = NULL;
+	struct stat entry_stat;
+	struct stat info_stat;
+	char info_name[NAME_MAX + 1];
+	uint64_t size = 0;
 
-	resolved_path = realpath(path, NULL);
-	if (resolved_path == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_REALPATH, error_0) }
+	if (fstatat(files_fd, name, &entry_stat, AT_SYMLINK_NOFOLLOW) != 0) { return 0; }
+	if (!S_ISDIR(entry_stat.st_mode)) { return S_ISREG(entry_stat.st_mode) ? (uint64_t)entry_stat.st_size : 0; }
 
-	/* Get the paths for the home trash directory. */
-	if (get_home_trash_dir(&data_home, &trash_dir, &trash_info_dir, &trash_files_dir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_HOMETRASH, error_0) }
+	struct dir_size_entry key = { .name = (char *)name, .size = 0, .mtime = 0 };
+	const struct dir_size_entry *cached = NULL;
+	if (dir_sizes != NULL) { cached = bsearch(&key, dir_sizes, num_dir_sizes, sizeof(*dir_sizes), compare_dir_size_entries); }
 
-	/* Create $XDG_DATA_HOME if it doesn't exist */
-	if (mkdir_recursive(data_home, S_IRWXU) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_MKDIRHOME, error_1) }
+	if (cached != NULL && snprintf(info_name, sizeof(info_name), "%s.trashinfo", name) < (int)sizeof(info_name) && fstatat(info_fd, info_name, &info_stat, 0) == 0 &&
+		cached->mtime == (intmax_t)info_stat.st_mtime)
+	{
+		return cached->size;
+	}
 
-	struct stat trash_stat;
-	struct stat path_stat;
-	if (lstat(data_home, &trash_stat)) { HANDLE_ERROR(status, LIBTRASHCAN_HOMESTAT, error_1) }
-	if (lstat(resolved_path, &path_stat)) { HANDLE_ERROR(status, LIBTRASHCAN_PATHSTAT, error_1) }
+	/* The cache couldn't be written, e.g. because the trash directory is read-only. */
+	if (walk_tree(files_fd, name, ctx->threads, 1, size_entry, &size, NULL) < 0) { return 0; }
+	return size;
+}
 
-	if (trash_stat.st_dev == path_stat.st_dev)
+/**
+ * @brief Applies the changes of the current batch of a watched trash directory to the caches of the context.
+ *
+ * Every changed entry is compared with its .trashinfo file and $trash/files, so that the result
+ * doesn't depend on the order of the events, or on whether the context has already applied the
+ * change itself. The index is updated through its deduplication, the size account is set to the
+ * total of the watcher.
+ *
+ * @param watcher The watcher.
+ * @param dir The trash directory.
+ * @return Number of changed entries, negative status code on failure.
+ */
+static int apply_watch_dir(trashcan_watcher *watcher, struct watch_dir *dir)
+{
+	int status = 0;
+	trashcan_ctx *ctx = watcher->ctx;
+	struct dir_size_entry *dir_sizes = NULL;
+	size_t num_dir_sizes = 0;
+	char *original_path = NULL;
+	char deletion_date[32];
+	struct stat dir_stat;
+	int info_fd = -1;
+	int files_fd = -1;
+
+	if (dir->rescan && queue_watch_rescan(watcher, dir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+	dir->rescan = 0;
+	if (dir->num_changes == 0) { goto error_0; }
+
+	qsort(dir->changes, dir->num_changes, sizeof(*dir->changes), compare_watch_changes);
+
+	/* Merge duplicates, a change of $trash/files is kept. */
+	size_t num_changes = 0;
+	for (size_t i = 0; i < dir->num_changes; i++)
 	{
-		/* File or directory is on the same devices as the home directory. The trash directory is "$XDG_DATA_HOME/Trash".
-		 * Create the directories, if they don't exist. */
-		if (create_trash_dir(trash_info_dir, trash_files_dir, S_IRWXU) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_MKDIRHOME, error_1) }
+		if (num_changes > 0 && strcmp(dir->changes[num_changes - 1].name, dir->changes[i].name) == 0)
+		{
+			dir->changes[num_changes - 1].files |= dir->changes[i].files;
+			continue;
+		}
+		dir->changes[num_changes] = dir->changes[i];
+		num_changes++;
 	}
-	else
+	dir->num_changes = num_changes;
+
+	/* Both are missing if the trash directory has been removed, in which case all entries are gone. */
+	info_fd = open(dir->trash_info_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	files_fd = open(dir->trash_files_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (info_fd >= 0 && files_fd >= 0) { update_watch_dir_sizes(ctx, dir, info_fd, files_fd, &dir_sizes, &num_dir_sizes); }
+
+	for (size_t i = 0; i < dir->num_changes; i++)
 	{
-		/* If possible apply case (1) or (2) of the specification */
-		unsigned char case_1_failed = 0;
-		unsigned char case_num = 1;
+		const char *name = dir->changes[i].name;
+		struct watch_record *record = dir->capacity > 0 ? find_watch_record(dir, name, hash_name(name)) : NULL;
+		if (record != NULL && record->name == NULL) { record = NULL; }
 
-		free(trash_dir);
-		free(trash_info_dir);
-		free(trash_files_dir);
-		trash_dir = NULL;
-		trash_info_dir = NULL;
-		trash_files_dir = NULL;
+		unsigned char exists = info_fd >= 0 && read_index_entry(dir->trash_dir, name, &dir_stat, &original_path, deletion_date, sizeof(deletion_date)) == 0;
 
-		if (get_top_trash_dir(case_num, path_stat.st_dev, &trash_dir, &trash_info_dir, &trash_files_dir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_TOPDIRTRASH, error_1) }
-		if (lstat(trash_dir, &trash_stat)) { case_1_failed = 1; } /* ENOENT if directory doesn't exist */
-		if (!case_1_failed && (trash_stat.st_mode & S_ISVTX) == 0) { case_1_failed = 1; } /* Make sure sticky bit is set */
-		if (!case_1_failed && S_ISLNK(trash_stat.st_mode)) { case_1_failed = 1; } /* Check if symlink */
-		if (!case_1_failed && create_trash_dir(trash_info_dir, trash_files_dir, S_IRWXU) < 0) { case_1_failed = 1; } /* Create (sub)directories */
+		if (record != NULL && (!exists || strcmp(record->original_path, original_path) != 0))
+		{
+			index_remove_trashed(ctx, dir->trash_dir, &dir->dir_stat, record->original_path, name);
+			remove_watch_record(dir, record);
+			record = NULL;
+		}
 
-		if (case_1_failed)
+		if (exists)
 		{
-			case_num = 2;
-			free(trash_dir);
-			free(trash_info_dir);
-			free(trash_files_dir);
-			trash_dir = NULL;
-			trash_info_dir = NULL;
-			trash_files_dir = NULL;
-			if (get_top_trash_dir(case_num, path_stat.st_dev, &trash_dir, &trash_info_dir, &trash_files_dir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_TOPDIRTRASH, error_1) }
-			if (create_trash_dir(trash_info_dir, trash_files_dir, S_IRWXU) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_MKDIRHOME, error_1) }
+			uint64_t size = files_fd >= 0 ? get_watch_entry_size(ctx, info_fd, files_fd, name, dir_sizes, num_dir_sizes) : 0;
+
+			if (record != NULL)
+			{
+				dir->total -= record->size < dir->total ? record->size : dir->total;
+				dir->total += size;
+				record->size = size;
+			}
+			else if (add_watch_record(dir, name, original_path, size) < 0)
+			{
+				HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_1)
+			}
+
+			/* Entries that the context has added itself are already in the index. */
+			if (index_active(ctx)) { index_add_entry(ctx, dir->trash_dir, &dir->dir_stat, original_path, name, deletion_date); }
 		}
 
+		free(original_path);
+		original_path = NULL;
 	}
 
-	/* Extract the original file or directory name */
-	char *name = strrchr(resolved_path, '/');
-	if (name == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_NAME, error_1) }
-	name++; /* Start at char after the slash */
+	status = (int)(dir->num_changes < INT_MAX ? dir->num_changes : INT_MAX);
 
-	/* Get current time for trash info timestamp and unique filename creation in the trash dir */
-	time_t rawtime;
-	struct tm *timeinfo;
+	/* The modification time from before the events were read, so that later changes invalidate the total once the watcher is gone. */
+	pthread_mutex_lock(&ctx->cache_lock);
+	struct size_account *account = find_size_account(ctx, &dir->info_stat);
+	if (account == NULL)
+	{
+		struct size_account *accounts = realloc(ctx->accounts, (ctx->num_accounts + 1) * sizeof(*accounts));
+		if (accounts != NULL)
+		{
+			ctx->accounts = accounts;
+			account = &ctx->accounts[ctx->num_accounts];
+			ctx->num_accounts++;
+			memset(account, 0, sizeof(*account));
+			account->device = dir->info_stat.st_dev;
+			account->inode = dir->info_stat.st_ino;
+		}
+	}
+	if (account != NULL)
+	{
+		if (!dir->accounted) { account->watchers++; }
+		dir->accounted = 1;
+		account->info_mtime = dir->info_stat.st_mtim;
+		account->total = dir->total;
+	}
+	pthread_mutex_unlock(&ctx->cache_lock);
 
-	time(&rawtime);
-	if (rawtime == (time_t)-1) { HANDLE_ERROR(status, LIBTRASHCAN_TIME, error_1) }
-	timeinfo = localtime(&rawtime);
+error_1:
+	free(original_path);
+	free_dir_size_cache(dir_sizes, num_dir_sizes);
+	if (files_fd >= 0) { close(files_fd); }
+	if (info_fd >= 0) { close(info_fd); }
+error_0:
+	dir->num_changes = 0;
+	return status;
+}
 
-	/* Counter for when collisions occur because at least two files with the same name get deleted at the same time. */
-	unsigned int counter = 0;
+/**
+ * @brief Processes the events of a watcher.
+ *
+ * @param watcher Watcher created by `trashcan_watcher_create()`.
+ * @param timeout_ms Maximum time to wait for an event in milliseconds, 0 to return immediately, negative to wait indefinitely.
+ * @return Number of changed entries that have been applied, negative on failure.
+ */
+int trashcan_watcher_process(trashcan_watcher *watcher, int timeout_ms)
+{
+	int status = 0;
+	struct pollfd poll_fd = { .fd = watcher->fd, .events = POLLIN, .revents = 0 };
 
-	unsigned char delete_in_progress = 1;
-	unsigned char enforce_random_name = 0;
+	if (timeout_ms != 0 && poll(&poll_fd, 1, timeout_ms) < 0 && errno != EINTR) { return LIBTRASHCAN_WATCH; }
 
-	while (delete_in_progress)
+	pthread_mutex_lock(&watcher->lock);
+
+	/* Taken before the events are read, see apply_watch_dir(). */
+	for (size_t i = 0; i < watcher->num_dirs; i++)
 	{
-		if (generate_filenames(name, trash_info_dir, trash_files_dir, timeinfo, counter, enforce_random_name, &trash_info_file, &trashed_file) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_FILENAMES, error_1) }
+		struct stat info_stat;
+		if (stat(watcher->dirs[i].trash_info_dir, &info_stat) == 0 && info_stat.st_dev == watcher->dirs[i].info_stat.st_dev && info_stat.st_ino == watcher->dirs[i].info_stat.st_ino)
+		{
+			watcher->dirs[i].info_stat = info_stat;
+		}
+	}
 
-		int status_info = create_info_file(trash_info_file, resolved_path, timeinfo);
+	int read_status = read_watch_events(watcher);
+	if (read_status == LIBTRASHCAN_ALLOC)
+	{
+		/* The queued changes are incomplete, all entries are compared instead. */
+		for (size_t i = 0; i < watcher->num_dirs; i++) { watcher->dirs[i].rescan = 1; }
+	}
+	else if (read_status < 0) { HANDLE_ERROR(status, read_status, error_0) }
 
-		if (status_info == 0) /* Successful .trashinfo creation */
+	for (size_t i = 0; i < watcher->num_dirs; i++)
+	{
+		int applied = apply_watch_dir(watcher, &watcher->dirs[i]);
+		if (applied < 0)
 		{
-			/* Move file to trash */
-			if (rename(resolved_path, trashed_file) != 0)
-			{
-				remove(trash_info_file);
-				HANDLE_ERROR(status, LIBTRASHCAN_RENAME, error_2)
-			}
+			watcher->dirs[i].rescan = 1;
+			if (status >= 0) { status = applied; }
+		}
+		else if (status >= 0) { status = applied > INT_MAX - status ? INT_MAX : status + applied; }
+	}
 
-			if (create_or_update_dir_size_cache(trash_dir, trash_info_dir, trash_files_dir) < 0) { HANDLE_ERROR(status, LIBTRASHCAN_DIRCACHE, error_2) }
+error_0:
+	arena_free(&watcher->arena);
+	pthread_mutex_unlock(&watcher->lock);
+	return status;
+}
 
-			delete_in_progress = 0; /* Done. */
-		}
-		else if (status_info == 1) /* Name collision occured. Repeat with a different name. */
-		{
-			counter++;
+/**
+ * @brief Thread that processes the events of a watcher in batches.
+ *
+ * @param arg The watcher.
+ * @return NULL.
+ */
+static void *watcher_thread(void *arg)
+{
+	trashcan_watcher *watcher = arg;
+	struct pollfd poll_fds[2] = { { .fd = watcher->stop_pipe[0], .events = POLLIN, .revents = 0 }, { .fd = watcher->fd, .events = POLLIN, .revents = 0 } };
 
-			/* When even a random filename doesn't allow to create a trash info file without conflict, abort. */
-			if (enforce_random_name) { HANDLE_ERROR(status, LIBTRASHCAN_COLLISION, error_2) }
+	for (;;)
+	{
+		if (poll(poll_fds, 2, -1) < 0 && errno != EINTR) { break; }
+		if (poll_fds[0].revents != 0) { break; }
+		if (poll_fds[1].revents == 0) { continue; }
 
-			/* Can't generate unique name because the counter has wrapped. This shouldn't happen unless more files with 
-			 * the name get deleted simultaneously than there are numbers in the range of uint. Use random name instead. */
-			if (counter == 0) { enforce_random_name = 1; }
+		/* Events usually come in bursts, e.g. a .trashinfo file and the move into $trash/files, which are applied together. */
+		if (poll(poll_fds, 1, WATCH_BATCH_MS) > 0) { break; }
+		trashcan_watcher_process(watcher, 0);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Watches the trash directories of all mounted devices for changes by other applications.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param flags 0 or TRASHCAN_WATCH_THREAD.
+ * @param timeout_ms Maximum time to wait for the discovery in milliseconds, negative to wait for all devices.
+ * @param watcher Address where pointer to the watcher is stored.
+ * @return 0 when successful, 1 if some devices are missing because of the timeout, negative otherwise.
+ */
+int trashcan_watcher_create(trashcan_ctx *ctx, int flags, int timeout_ms, trashcan_watcher **watcher)
+{
+	int status = LIBTRASHCAN_SUCCESS;
+	trashcan_trash_dir *trash_dirs = NULL;
+	size_t num_trash_dirs = 0;
+
+	*watcher = calloc(1, sizeof(**watcher));
+	if (*watcher == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_0) }
+	(*watcher)->ctx = ctx;
+	(*watcher)->stop_pipe[0] = -1;
+	(*watcher)->stop_pipe[1] = -1;
+	arena_init(&(*watcher)->arena, INDEX_ARENA_SIZE);
+	pthread_mutex_init(&(*watcher)->lock, NULL);
+
+	(*watcher)->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if ((*watcher)->fd < 0) { HANDLE_ERROR(status, LIBTRASHCAN_WATCH, error_1) }
+
+	int found = trashcan_find_trash_dirs(ctx, timeout_ms, &trash_dirs, &num_trash_dirs);
+	if (found < 0) { HANDLE_ERROR(status, found, error_1) }
 
-			free(trashed_file);
-			free(trash_info_file);
-			trashed_file = NULL;
-			trash_info_file = NULL;
+	(*watcher)->dirs = calloc(num_trash_dirs > 0 ? num_trash_dirs : 1, sizeof(*(*watcher)->dirs));
+	if ((*watcher)->dirs == NULL) { HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_2) }
+
+	for (size_t i = 0; i < num_trash_dirs; i++)
+	{
+		struct watch_dir *dir = &(*watcher)->dirs[(*watcher)->num_dirs];
+
+		dir->trash_dir = strdup(trash_dirs[i].trash_dir);
+		if (dir->trash_dir == NULL || asprintf(&dir->trash_info_dir, "%s/info", dir->trash_dir) < 0) { dir->trash_info_dir = NULL; }
+		if (dir->trash_info_dir == NULL || asprintf(&dir->trash_files_dir, "%s/files", dir->trash_dir) < 0) { dir->trash_files_dir = NULL; }
+		if (dir->trash_files_dir == NULL)
+		{
+			free_watch_dir(dir);
+			HANDLE_ERROR(status, LIBTRASHCAN_ALLOC, error_2)
 		}
-		else /* Some other error */
+
+		dir->info_wd = inotify_add_watch((*watcher)->fd, dir->trash_info_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR);
+		dir->files_wd = inotify_add_watch((*watcher)->fd, dir->trash_files_dir, IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR);
+
+		/* A trash directory that has disappeared since the discovery isn't watched. */
+		if (dir->info_wd < 0 || stat(dir->trash_dir, &dir->dir_stat) != 0 || stat(dir->trash_info_dir, &dir->info_stat) != 0)
 		{
-			HANDLE_ERROR(status, LIBTRASHCAN_TRASHINFO, error_2)
+			if (dir->info_wd >= 0) { inotify_rm_watch((*watcher)->fd, dir->info_wd); }
+			if (dir->files_wd >= 0) { inotify_rm_watch((*watcher)->fd, dir->files_wd); }
+			free_watch_dir(dir);
+			memset(dir, 0, sizeof(*dir));
+			continue;
 		}
+
+		/* The first batch reads all entries. */
+		dir->rescan = 1;
+		(*watcher)->num_dirs++;
+	}
+
+	int processed = trashcan_watcher_process(*watcher, 0);
+	if (processed < 0) { HANDLE_ERROR(status, processed, error_2) }
+
+	if (flags & TRASHCAN_WATCH_THREAD)
+	{
+		if (pipe2((*watcher)->stop_pipe, O_CLOEXEC) != 0) { HANDLE_ERROR(status, LIBTRASHCAN_THREAD, error_2) }
+		if (pthread_create(&(*watcher)->thread, NULL, watcher_thread, *watcher) != 0) { HANDLE_ERROR(status, LIBTRASHCAN_THREAD, error_2) }
+		(*watcher)->threaded = 1;
 	}
 
+	status = found;
+	trashcan_free_trash_dirs(trash_dirs, num_trash_dirs);
+
+error_0:
+	return status;
 error_2:
-	free(trashed_file);
-	free(trash_info_file);
+	trashcan_free_trash_dirs(trash_dirs, num_trash_dirs);
 error_1:
-	free(trash_files_dir);
-	free(trash_info_dir);
-	free(trash_dir);
-	free(resolved_path);
-error_0:
+	trashcan_watcher_destroy(*watcher);
+	*watcher = NULL;
 	return status;
 }
 
+/**
+ * @brief Returns the file descriptor of a watcher for an event loop.
+ *
+ * @param watcher Watcher created by `trashcan_watcher_create()`.
+ * @return File descriptor that becomes readable when `trashcan_watcher_process()` has events to process.
+ */
+int trashcan_watcher_fd(const trashcan_watcher *watcher)
+{
+	return watcher->fd;
+}
+
+/**
+ * @brief Stops watching the trash directories.
+ *
+ * @param watcher Watcher created by `trashcan_watcher_create()`, may be NULL.
+ */
+void trashcan_watcher_destroy(trashcan_watcher *watcher)
+{
+	if (watcher == NULL) { return; }
+
+	if (watcher->threaded)
+	{
+		while (write(watcher->stop_pipe[1], "", 1) < 0 && errno == EINTR) {}
+		pthread_join(watcher->thread, NULL);
+	}
+	if (watcher->stop_pipe[0] >= 0) { close(watcher->stop_pipe[0]); }
+	if (watcher->stop_pipe[1] >= 0) { close(watcher->stop_pipe[1]); }
+
+	/* The totals are validated by the modification time of $trash/info again. */
+	pthread_mutex_lock(&watcher->ctx->cache_lock);
+	for (size_t i = 0; i < watcher->num_dirs; i++)
+	{
+		struct size_account *account = watcher->dirs[i].accounted ? find_size_account(watcher->ctx, &watcher->dirs[i].info_stat) : NULL;
+		if (account != NULL && account->watchers > 0) { account->watchers--; }
+	}
+	pthread_mutex_unlock(&watcher->ctx->cache_lock);
+
+	for (size_t i = 0; i < watcher->num_dirs; i++) { free_watch_dir(&watcher->dirs[i]); }
+	free(watcher->dirs);
+	if (watcher->fd >= 0) { close(watcher->fd); }
+	arena_free(&watcher->arena);
+	pthread_mutex_destroy(&watcher->lock);
+	free(watcher);
+}
+#else
+int trashcan_watcher_create(trashcan_ctx *ctx, int flags, int timeout_ms, trashcan_watcher **watcher)
+{
+	(void)ctx;
+	(void)flags;
+	(void)timeout_ms;
+	*watcher = NULL;
+	return LIBTRASHCAN_NOWATCH;
+}
+
+int trashcan_watcher_fd(const trashcan_watcher *watcher)
+{
+	(void)watcher;
+	return -1;
+}
+
+int trashcan_watcher_process(trashcan_watcher *watcher, int timeout_ms)
+{
+	(void)watcher;
+	(void)timeout_ms;
+	return LIBTRASHCAN_NOWATCH;
+}
+
+void trashcan_watcher_destroy(trashcan_watcher *watcher)
+{
+	(void)watcher;
+}
+#endif
+
 #else
 #error Platform not supported
 #endif
@@ -80,6 +80,648 @@ int trashcan_soft_delete_com(const char *path, unsigned int code_page, bool init
 
 #elif defined(__APPLE__)
 #elif defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Opaque context that caches the resolution of trash directories between calls.
+ *
+ * The context caches the paths of the home trash determined from `XDG_DATA_HOME` or `HOME`,
+ * the device of the home trash and, for each device that has been seen, the trash directory
+ * whose `info` and `files` directories are known to exist together with their `_PC_NAME_MAX`.
+ * Changes of the environment variables after the context has been created are not taken into
+ * account.
+ *
+ * The soft delete functions may be called by multiple threads with the same context. Creating,
+ * destroying and configuring the context must not happen concurrently with other calls.
+ */
+typedef struct trashcan_ctx trashcan_ctx;
+
+/**
+ * @brief Creates a context for repeated calls of the API.
+ *
+ * `$XDG_DATA_HOME` is created if it doesn't exist.
+ *
+ * @param ctx Address where pointer to the context is stored. Has to be freed with `trashcan_ctx_destroy()`.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_ctx_create(trashcan_ctx **ctx);
+
+/**
+ * @brief Destroys a context created by `trashcan_ctx_create()`.
+ *
+ * Asynchronous deletions that have been submitted with `trashcan_submit()` are completed first.
+ *
+ * @param ctx Context to destroy, may be NULL.
+ */
+void trashcan_ctx_destroy(trashcan_ctx *ctx);
+
+/**
+ * @brief Sets the maximum number of threads used for parallel directory walks.
+ *
+ * Directories are sized by a work-stealing thread pool when the directory size cache is updated.
+ * Threads are only spawned when a directory tree has enough subdirectories to keep them busy.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param threads Maximum number of threads including the calling thread. 0 selects the number of
+ * online processors, but at most 16. This is the default.
+ */
+void trashcan_ctx_set_threads(trashcan_ctx *ctx, size_t threads);
+
+/**
+ * @brief Flag for `trashcan_ctx_set_flags()` to copy files into the home trash if they can't be moved.
+ *
+ * Without this flag a file fails to be deleted if the trash directory of its filesystem can't be
+ * created, e.g. on read-only topdirs, or if rename() refuses to move it because it's on a bind
+ * mount. With this flag it's copied into the home trash instead. On Linux file data is shared with
+ * a reflink if the filesystem supports it and otherwise copied within the kernel. Directories are
+ * copied in parallel, see `trashcan_ctx_set_threads()`. The original is only removed after the copy
+ * is complete. If it can't be removed afterwards, LIBTRASHCAN_COPYREMOVE (-24) is returned and the
+ * copy stays in the trash.
+ */
+#define TRASHCAN_COPY_FALLBACK 1
+
+/**
+ * @brief Flag for `trashcan_ctx_set_flags()` to flush deletions to disk before returning.
+ *
+ * Without this flag a crash shortly after a deletion can leave a trashed file without its
+ * .trashinfo file. With this flag the .trashinfo file is flushed before the file is moved and the
+ * move is flushed before the function returns. Flushes are shared as group commits: concurrent
+ * deletions of the context, e.g. by the workers of `trashcan_submit()`, wait for one common flush,
+ * and `trashcan_soft_delete_many_ctx()` flushes all .trashinfo files of the batch once and all
+ * moves once. On Linux a flush is one syncfs() per filesystem, other systems fsync() the
+ * .trashinfo files and the modified directories. If a flush fails, LIBTRASHCAN_SYNC (-26) is
+ * returned. The latency of the flushes is reported by `trashcan_ctx_get_sync_stats()`.
+ */
+#define TRASHCAN_DURABLE 2
+
+/**
+ * @brief Sets flags that change how files are moved to the trash.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param flags 0 or a combination of TRASHCAN_COPY_FALLBACK and TRASHCAN_DURABLE. The default is 0.
+ */
+void trashcan_ctx_set_flags(trashcan_ctx *ctx, int flags);
+
+/**
+ * @brief Statistics of the group commits of durable mode.
+ */
+typedef struct trashcan_sync_stats
+{
+	uint64_t syncs; /**< Number of group commits, each flushes every filesystem of its group once. */
+	uint64_t waits; /**< Number of times a deletion waited for a group commit. */
+	uint64_t sync_ns; /**< Total duration of the group commits in nanoseconds. */
+	uint64_t max_sync_ns; /**< Longest group commit in nanoseconds. */
+	uint64_t wait_ns; /**< Total time deletions waited for group commits in nanoseconds. */
+	uint64_t max_wait_ns; /**< Longest wait for a group commit in nanoseconds. */
+} trashcan_sync_stats;
+
+/**
+ * @brief Retrieves the statistics of the group commits of durable mode.
+ *
+ * The ratio of waits to syncs shows how many deletions share a flush on average.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param stats Address where the statistics are stored.
+ */
+void trashcan_ctx_get_sync_stats(trashcan_ctx *ctx, trashcan_sync_stats *stats);
+
+/**
+ * @brief Moves a file or a directory (and its content) to the trash using a context.
+ *
+ * Same as `trashcan_soft_delete()`, but the trash directories are taken from the context instead
+ * of being determined and created on every call.
+ *
+ * @warning Do not change the current working directory when using this in a multithreaded application!
+ *
+ * @warning This function expects an UTF-8 encoded string!
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param path Path to the file or directory that shall be moved to the trash.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_soft_delete_ctx(trashcan_ctx *ctx, const char *path);
+
+/**
+ * @brief Moves multiple files or directories (and their content) to the trash using a context.
+ *
+ * Same as `trashcan_soft_delete_many()`, but the trash directories are taken from the context.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param paths Paths to the files or directories that shall be moved to the trash.
+ * @param num_paths Number of paths.
+ * @param results Array with num_paths elements where the status code of each path is stored. May be NULL.
+ * @return 0 when all paths have been moved successfully, negative otherwise.
+ */
+int trashcan_soft_delete_many_ctx(trashcan_ctx *ctx, const char **paths, size_t num_paths, int *results);
+
+/**
+ * @brief Function called when an asynchronous deletion has been completed.
+ *
+ * It's called as soon as the path has been moved to the trash. A trashed directory is sized for
+ * `$trash/directorysizes` afterwards, so LIBTRASHCAN_DIRCACHE isn't reported to the callback.
+ *
+ * @param path Absolute path that was passed to `trashcan_submit()`.
+ * @param status Status code as `trashcan_soft_delete()` would return it.
+ * @param userdata Argument that was passed to `trashcan_submit()`.
+ */
+typedef void (*trashcan_callback)(const char *path, int status, void *userdata);
+
+/**
+ * @brief Sets the number of worker threads for asynchronous deletions.
+ *
+ * Only has an effect before the first call of `trashcan_submit()`, which starts the workers.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param workers Number of worker threads. 0 selects the default of 4 threads.
+ */
+void trashcan_ctx_set_workers(trashcan_ctx *ctx, size_t workers);
+
+/**
+ * @brief Queues a file or a directory to be moved to the trash by a worker thread.
+ *
+ * Returns without waiting for the filesystem. The queue is lock-free for submitting threads, so
+ * the function can be called from any number of threads. Worker threads of the context move the
+ * paths to the trash in the order of submission, but deletions may complete out of order. Relative
+ * paths are resolved against the current working directory at the time of submission.
+ *
+ * The callback is called from a worker thread and must be thread-safe. It may call
+ * `trashcan_submit()` but not `trashcan_ctx_destroy()`. All other functions taking the context
+ * may be called concurrently with the workers. `trashcan_ctx_destroy()` completes all pending
+ * deletions and joins the workers, it must not be called while other threads still submit.
+ *
+ * @warning This function expects an UTF-8 encoded string!
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param path Path to the file or directory that shall be moved to the trash.
+ * @param callback Function called with the result, may be NULL.
+ * @param userdata Argument passed to the callback.
+ * @return 0 when the path has been queued, negative otherwise. The callback is only called if
+ * the path has been queued.
+ */
+int trashcan_submit(trashcan_ctx *ctx, const char *path, trashcan_callback callback, void *userdata);
+
+/**
+ * @brief Moves multiple files or directories (and their content) to the trash.
+ *
+ * @warning Do not change the current working directory when using this in a multithreaded application!
+ *
+ * @warning This function expects UTF-8 encoded strings!
+ *
+ * Behaves like calling `trashcan_soft_delete()` for each path, but the paths are grouped by device
+ * and the trash directory of each device is only determined and created once. The directory size
+ * cache of each trash directory is updated once at the end of the batch.
+ *
+ * @param paths Paths to the files or directories that shall be moved to the trash.
+ * @param num_paths Number of paths.
+ * @param results Array with num_paths elements where the status code of each path is stored, as
+ * `trashcan_soft_delete()` would return it. May be NULL if the individual results aren't needed.
+ * @return 0 when all paths have been moved successfully, negative otherwise.
+ */
+int trashcan_soft_delete_many(const char **paths, size_t num_paths, int *results);
+
+
+/**
+ * @brief Rebuilds the directory size cache of a trash directory from scratch.
+ *
+ * `trashcan_soft_delete()` only sizes the directory that was trashed and patches its line in
+ * `$trash/directorysizes`. Lines of directories that were removed by other applications are
+ * dropped lazily. A full rebuild walks every directory in `$trash/files` and is only needed
+ * for maintenance, e.g. when other applications modified the trash without updating the cache.
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param trash_dir Path to the trash directory, e.g. "/mnt/.Trash-1000". If NULL the home trash
+ * "$XDG_DATA_HOME/Trash" is used.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_rebuild_dir_size_cache(const char *trash_dir);
+
+/**
+ * @brief Opaque iterator over the entries of a trash directory.
+ */
+typedef struct trashcan_iter trashcan_iter;
+
+/**
+ * @brief Flag for `trashcan_iter_open()` to determine the size of each entry.
+ *
+ * Files are stat'ed, the size of directories is taken from `$trash/directorysizes` if the cached
+ * line is up to date and determined by walking the directory otherwise.
+ */
+#define TRASHCAN_ITER_SIZE 1
+
+/**
+ * @brief Entry of a trash directory as returned by `trashcan_iter_next()`.
+ *
+ * The strings are owned by the iterator and are only valid until the next call of
+ * `trashcan_iter_next()` or `trashcan_iter_close()`.
+ */
+typedef struct trashcan_entry
+{
+	const char *trash_dir; /**< Trash directory that contains the entry. */
+	const char *name; /**< Name of the entry in `$trash/files`, the .trashinfo file is `$trash/info/<name>.trashinfo`. */
+	const char *original_path; /**< Decoded path where the entry was located before it was trashed. */
+	const char *deletion_date; /**< DeletionDate as stored in the .trashinfo file, e.g. "2022-04-13T15:08:30". */
+	time_t deletion_time; /**< DeletionDate interpreted as local time, -1 if it's missing or invalid. */
+	uint64_t size; /**< Size in bytes, only valid if has_size is set. */
+	int has_size; /**< 1 if TRASHCAN_ITER_SIZE was given and the size could be determined. */
+} trashcan_entry;
+
+/**
+ * @brief Opens an iterator over the entries of a trash directory.
+ *
+ * The `$trash/info` directory is read incrementally and only one .trashinfo file is parsed at a
+ * time into buffers that are reused, so the memory consumption doesn't depend on the number of
+ * entries. Malformed .trashinfo files are skipped.
+ *
+ * @param trash_dir Path to the trash directory, e.g. "/mnt/.Trash-1000". If NULL the home trash
+ * "$XDG_DATA_HOME/Trash" is used.
+ * @param flags 0 or TRASHCAN_ITER_SIZE.
+ * @param iter Address where pointer to the iterator is stored. Has to be closed with `trashcan_iter_close()`.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_iter_open(const char *trash_dir, int flags, trashcan_iter **iter);
+
+/**
+ * @brief Reads the next entry of the trash.
+ *
+ * @param iter Iterator created by `trashcan_iter_open()`.
+ * @param entry Address where the entry is stored.
+ * @return 1 when an entry has been read, 0 at the end of the trash, negative otherwise.
+ */
+int trashcan_iter_next(trashcan_iter *iter, trashcan_entry *entry);
+
+/**
+ * @brief Closes an iterator.
+ *
+ * @param iter Iterator created by `trashcan_iter_open()`, may be NULL.
+ */
+void trashcan_iter_close(trashcan_iter *iter);
+
+/**
+ * @brief Moves an entry of the trash back to its original location.
+ *
+ * This is the inverse of `trashcan_soft_delete()`. The original path is read from the .trashinfo
+ * file, the entry is renamed back, the .trashinfo file is removed and the line of the entry is
+ * removed from `$trash/directorysizes`. An existing file at the original path is never replaced.
+ * Missing parent directories of the original path aren't created. Entries that can't be renamed
+ * back because they have been copied into the trash from another filesystem, see
+ * `TRASHCAN_COPY_FALLBACK`, are copied back and then removed from the trash. If they can't be
+ * removed, LIBTRASHCAN_RESTOREREMOVE (-33) is returned and the entry stays in the trash.
+ *
+ * @param trash_dir Path to the trash directory, e.g. "/mnt/.Trash-1000". If NULL the home trash
+ * "$XDG_DATA_HOME/Trash" is used.
+ * @param name Name of the entry in `$trash/files`, as returned in `trashcan_entry::name`.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_restore(const char *trash_dir, const char *name);
+
+/**
+ * @brief Permanently removes an entry of the trash.
+ *
+ * The entry is removed from `$trash/files` first, then its .trashinfo file and its line in
+ * `$trash/directorysizes` are removed. Directories are removed by a work-stealing thread pool that
+ * unlinks relative to directory file descriptors and spreads subdirectories across the workers.
+ * A .trashinfo file whose entry doesn't exist anymore is removed as well.
+ *
+ * @param entry Entry as returned by `trashcan_iter_next()`. Only `trash_dir` and `name` are used.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed files and directories is added, may be
+ * NULL. The .trashinfo file isn't counted.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_purge(const trashcan_entry *entry, uint64_t *bytes, uint64_t *inodes);
+
+/**
+ * @brief Permanently removes all entries of a trash directory.
+ *
+ * The content of `$trash/files` is removed in one parallel walk, as in `trashcan_purge()`, then the
+ * content of `$trash/info` and `$trash/directorysizes` are removed. The directories `files` and
+ * `info` are kept.
+ *
+ * @param trash_dir Path to the trash directory, e.g. "/mnt/.Trash-1000". If NULL the home trash
+ * "$XDG_DATA_HOME/Trash" is used.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed files and directories is added, may be
+ * NULL. The .trashinfo files aren't counted.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_empty(const char *trash_dir, uint64_t *bytes, uint64_t *inodes);
+
+/**
+ * @brief Permanently removes entries of a trash directory that are too old or exceed a size budget.
+ *
+ * First every entry whose DeletionDate is more than max_age seconds ago is removed. Then, while
+ * the total size of the remaining entries exceeds max_size, the oldest entries are removed. They
+ * are found with a bounded heap while the trash is read, so the trash is never sorted and the
+ * memory consumption doesn't depend on the number of entries. Entries without a valid DeletionDate
+ * never expire by age but are the first to be removed for the size budget. Sizes are determined
+ * as with `TRASHCAN_ITER_SIZE`, using `$trash/directorysizes` for directories.
+ *
+ * @param trash_dir Path to the trash directory, e.g. "/mnt/.Trash-1000". If NULL the home trash
+ * "$XDG_DATA_HOME/Trash" is used.
+ * @param max_age Maximum age of entries in seconds, negative for no limit.
+ * @param max_size Maximum total size of the entries in bytes, UINT64_MAX for no limit.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed files and directories is added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_expire(const char *trash_dir, time_t max_age, uint64_t max_size, uint64_t *bytes, uint64_t *inodes);
+
+/**
+ * @brief Permanently removes an entry of the trash using a context.
+ *
+ * Same as `trashcan_purge()`, but directories are removed with the threads of the context and the
+ * size account of the trash directory is updated, see `trashcan_total_size()`.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param entry Entry as returned by `trashcan_iter_next()`. Only `trash_dir` and `name` are used.
+ * @param bytes Address to which the size of the removed regular files is added, may be NULL.
+ * @param inodes Address to which the number of removed files and directories is added, may be NULL.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_purge_ctx(trashcan_ctx *ctx, const trashcan_entry *entry, uint64_t *bytes, uint64_t *inodes);
+
+/**
+ * @brief Determines the total size of the entries of a trash directory.
+ *
+ * The total is the sum of the sizes that `TRASHCAN_ITER_SIZE` reports. The first query of a trash
+ * directory reads all entries, using `$trash/directorysizes` for directories. The total is cached in
+ * the context together with the modification time of `$trash/info`, so following queries only
+ * cost a stat() as long as the trash hasn't changed. `trashcan_soft_delete_ctx()`,
+ * `trashcan_submit()` and `trashcan_purge_ctx()` update the cached total incrementally. Changes by
+ * other applications or other functions modify `$trash/info`, so the next query reads the trash
+ * again. Changes by other applications within the timestamp granularity of the filesystem may
+ * remain unnoticed until the next change.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param trash_dir Path to the trash directory, e.g. "/mnt/.Trash-1000". If NULL the home trash
+ * of the context is used.
+ * @param size Address where the total size in bytes is stored.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_total_size(trashcan_ctx *ctx, const char *trash_dir, uint64_t *size);
+
+/**
+ * @brief Trash directory as returned by `trashcan_find_trash_dirs()`.
+ */
+typedef struct trashcan_trash_dir
+{
+	char *trash_dir; /**< Path to the trash directory, can be passed to `trashcan_iter_open()`. */
+	uint64_t num_entries; /**< Number of .trashinfo files in `$trash/info` at the time of the discovery. */
+	int is_home; /**< 1 for the home trash "$XDG_DATA_HOME/Trash", 0 for trash directories in a $topdir. */
+} trashcan_trash_dir;
+
+/**
+ * @brief Discovers every trash directory visible to the user.
+ *
+ * Besides the home trash, the $topdir of every mounted device is checked for `$topdir/.Trash/$uid`,
+ * if `$topdir/.Trash` is a sticky directory and not a symbolic link, and for `$topdir/.Trash-$uid`.
+ * Nothing is created. Devices are taken from the mount table of the context, every device is probed
+ * once by its own thread, so a slow or hanging mount, e.g. a stale NFS share, doesn't delay the
+ * others. Threads that haven't finished when the timeout expires are abandoned and exit on their
+ * own once their filesystem responds.
+ *
+ * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param timeout_ms Maximum time to wait for the devices in milliseconds, negative to wait for
+ * all of them.
+ * @param trash_dirs Address where pointer to the trash directories is stored, the home trash
+ * first if it exists. Has to be freed with `trashcan_free_trash_dirs()`.
+ * @param num_trash_dirs Address where the number of trash directories is stored.
+ * @return 0 when successful, 1 if some devices didn't respond within the timeout and are missing
+ * from the result, negative otherwise.
+ */
+int trashcan_find_trash_dirs(trashcan_ctx *ctx, int timeout_ms, trashcan_trash_dir **trash_dirs, size_t *num_trash_dirs);
+
+/**
+ * @brief Frees the trash directories returned by `trashcan_find_trash_dirs()`.
+ *
+ * @param trash_dirs Array of trash directories, may be NULL.
+ * @param num_trash_dirs Number of trash directories.
+ */
+void trashcan_free_trash_dirs(trashcan_trash_dir *trash_dirs, size_t num_trash_dirs);
+
+/**
+ * @name Phases of a soft deletion for `trashcan_get_stats()`
+ * @{
+ */
+#define TRASHCAN_PHASE_REALPATH 0 /**< Resolving the path with realpath(). */
+#define TRASHCAN_PHASE_MOUNTPOINT 1 /**< Looking up the mount point of a device to determine $topdir. */
+#define TRASHCAN_PHASE_MKDIR 2 /**< Creating `$XDG_DATA_HOME` and the trash directories. */
+#define TRASHCAN_PHASE_TRASHINFO 3 /**< Creating and writing a .trashinfo file, once per attempted name. */
+#define TRASHCAN_PHASE_RENAME 4 /**< Moving the file or directory into `$trash/files`. */
+#define TRASHCAN_PHASE_DIRCACHE 5 /**< Updating `$trash/directorysizes` after a directory has been trashed. */
+#define TRASHCAN_PHASE_TOTAL 6 /**< Whole deletion by `trashcan_soft_delete_ctx()`, which `trashcan_soft_delete()` uses. */
+#define TRASHCAN_NUM_PHASES 7 /**< Number of phases. */
+/** @} */
+
+/**
+ * @brief Number of buckets of the latency histograms.
+ *
+ * Bucket b < 4 counts durations of b nanoseconds. Above, every power of two is split into four
+ * linear sub-buckets: bucket b counts durations from `(4 + b % 4) << (b / 4 - 1)` nanoseconds up to
+ * the lower bound of bucket b + 1, so each bucket spans at most 25 % of its lower bound.
+ */
+#define TRASHCAN_STATS_BUCKETS 252
+
+/**
+ * @brief Timing statistics of one phase.
+ */
+typedef struct trashcan_phase_stats
+{
+	uint64_t count; /**< Number of times the phase has been run. */
+	uint64_t total_ns; /**< Total duration in nanoseconds. */
+	uint64_t max_ns; /**< Longest duration in nanoseconds. */
+	uint64_t histogram[TRASHCAN_STATS_BUCKETS]; /**< Log-linear latency histogram, see TRASHCAN_STATS_BUCKETS. */
+} trashcan_phase_stats;
+
+/**
+ * @brief Timing statistics of the phases of soft deletions.
+ */
+typedef struct trashcan_stats
+{
+	trashcan_phase_stats phases[TRASHCAN_NUM_PHASES]; /**< Statistics indexed by the TRASHCAN_PHASE_* constants. */
+} trashcan_stats;
+
+/**
+ * @brief Retrieves the timing statistics of the phases of soft deletions.
+ *
+ * Only available if the library has been built with the CMake option `TRASHCAN_STATS`. Otherwise
+ * the timers aren't compiled in at all. Each phase is timed with the monotonic clock and added to
+ * counters that are shared by all threads and contexts of the process. Phases that are shared with
+ * `trashcan_soft_delete_many()` and `trashcan_submit()` are counted for them as well. The counters
+ * are updated without a lock, so a snapshot taken during deletions may be slightly inconsistent.
+ *
+ * @param stats Address where the statistics are stored.
+ * @return 0 when successful, LIBTRASHCAN_NOSTATS (-27) if the library has been built without
+ * statistics, in which case stats is zeroed.
+ */
+int trashcan_get_stats(trashcan_stats *stats);
+
+/**
+ * @brief Resets the timing statistics of `trashcan_get_stats()` to zero.
+ */
+void trashcan_reset_stats(void);
+
+/**
+ * @brief Moves an entry of the trash back to its original location using a context.
+ *
+ * Same as `trashcan_restore()`, but the entry is removed from the index of the context, see
+ * `trashcan_index_load()`. Entries on another filesystem are only copied back if
+ * `TRASHCAN_COPY_FALLBACK` is set, using the threads of the context.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param trash_dir Path to the trash directory, e.g. "/mnt/.Trash-1000". If NULL the home trash
+ * of the context is used.
+ * @param name Name of the entry in `$trash/files`, as returned in `trashcan_entry::name`.
+ * @return 0 when successful, negative otherwise.
+ */
+int trashcan_restore_ctx(trashcan_ctx *ctx, const char *trash_dir, const char *name);
+
+/**
+ * @brief Entry of the trash as returned by `trashcan_index_lookup()`.
+ */
+typedef struct trashcan_index_entry
+{
+	const char *trash_dir; /**< Trash directory that contains the entry. */
+	const char *name; /**< Name of the entry in `$trash/files`. */
+	const char *deletion_date; /**< DeletionDate as stored in the .trashinfo file, e.g. "2022-04-13T15:08:30". */
+	time_t deletion_time; /**< DeletionDate interpreted as local time, -1 if it's missing or invalid. */
+} trashcan_index_entry;
+
+/**
+ * @brief Loads the entries of all trash directories into an index of the context.
+ *
+ * The trash directories are discovered with `trashcan_find_trash_dirs()`. Each trash directory has
+ * a persistent index in `$trash/trashindex`, which is mapped with `mmap()` and only brought up to
+ * date if `$trash/info` has changed since it was written: only the .trashinfo files of new entries
+ * are read, and the new index atomically replaces the old one. The index maps each decoded
+ * original path to the entries that have been deleted from it, referring to the strings of the
+ * mapped files. Afterwards `trashcan_soft_delete_ctx()`,
+ * `trashcan_soft_delete_many_ctx()`, `trashcan_submit()`, `trashcan_restore_ctx()` and
+ * `trashcan_purge_ctx()` keep the index up to date, also while it's being loaded. Changes by other
+ * applications or other functions aren't noticed until the index is loaded again, which replaces
+ * the previous index and frees the memory of removed entries.
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param timeout_ms Maximum time to wait for the discovery of the trash directories in
+ * milliseconds, negative to wait for all of them.
+ * @return 0 when successful, 1 if some devices didn't respond within the timeout and their trash
+ * directories are missing from the index, negative otherwise.
+ */
+int trashcan_index_load(trashcan_ctx *ctx, int timeout_ms);
+
+/**
+ * @brief Looks up the entries of the trash that have been deleted from a path.
+ *
+ * The lookup costs a hash table probe and a copy of the matching entries, independent of the
+ * number of entries in the trash.
+ *
+ * @param ctx Context whose index has been loaded with `trashcan_index_load()`.
+ * @param original_path Absolute path as it was before the deletion, compared byte by byte with
+ * the decoded Path of the .trashinfo files.
+ * @param entries Address where pointer to the entries is stored, the most recently added first.
+ * NULL if there are none. Has to be freed with `trashcan_free_index_entries()`.
+ * @param num_entries Address where the number of entries is stored.
+ * @return 0 when successful, LIBTRASHCAN_NOINDEX (-28) if no index has been loaded, negative
+ * otherwise.
+ */
+int trashcan_index_lookup(trashcan_ctx *ctx, const char *original_path, trashcan_index_entry **entries, size_t *num_entries);
+
+/**
+ * @brief Frees the entries returned by `trashcan_index_lookup()`.
+ *
+ * @param entries Array of entries, may be NULL.
+ */
+void trashcan_free_index_entries(trashcan_index_entry *entries);
+
+/**
+ * @brief Opaque watcher that keeps the caches of a context in sync with other applications.
+ */
+typedef struct trashcan_watcher trashcan_watcher;
+
+/**
+ * @brief Flag for `trashcan_watcher_create()` to process the events in a background thread.
+ *
+ * The thread waits 20 ms after the first event of a burst and applies all events that have
+ * arrived until then as one batch.
+ */
+#define TRASHCAN_WATCH_THREAD 1
+
+/**
+ * @brief Watches the trash directories of all mounted devices for changes by other applications.
+ *
+ * File managers and `gio trash` modify the trash directories as well. The watcher watches
+ * `$trash/info` and `$trash/files` of every trash directory found by `trashcan_find_trash_dirs()`
+ * with inotify and applies the changed entries incrementally to the caches of the context: the
+ * index of `trashcan_index_load()`, `$trash/directorysizes` and the totals of
+ * `trashcan_total_size()`. While a watcher is active, `trashcan_total_size()` returns its total
+ * without checking `$trash/info`, which lags behind changes by at most one batch. Trash
+ * directories that are created after the watcher aren't watched.
+ *
+ * Without TRASHCAN_WATCH_THREAD the events are applied by `trashcan_watcher_process()`, e.g. when
+ * `trashcan_watcher_fd()` becomes readable in the event loop of the application. The watcher has
+ * to be destroyed before its context.
+ *
+ * Only available on Linux, other platforms return LIBTRASHCAN_NOWATCH (-29).
+ *
+ * @param ctx Context created by `trashcan_ctx_create()`.
+ * @param flags 0 or TRASHCAN_WATCH_THREAD.
+ * @param timeout_ms Maximum time to wait for the discovery in milliseconds, negative to wait for all devices.
+ * @param watcher Address where pointer to the watcher is stored.
+ * @return 0 when successful, 1 if some devices are missing because of the timeout, negative otherwise.
+ */
+int trashcan_watcher_create(trashcan_ctx *ctx, int flags, int timeout_ms, trashcan_watcher **watcher);
+
+/**
+ * @brief Returns the file descriptor of a watcher for an event loop.
+ *
+ * @param watcher Watcher created by `trashcan_watcher_create()`.
+ * @return File descriptor that becomes readable when there are events, -1 if not supported.
+ */
+int trashcan_watcher_fd(const trashcan_watcher *watcher);
+
+/**
+ * @brief Applies the pending events of a watcher to the caches of its context as one batch.
+ *
+ * If events have been lost because the queue of the kernel overflowed, all entries of the trash
+ * directories are compared once.
+ *
+ * @param watcher Watcher created by `trashcan_watcher_create()`.
+ * @param timeout_ms Maximum time to wait for an event in milliseconds, 0 to return immediately, negative to wait indefinitely.
+ * @return Number of changed entries that have been applied, negative otherwise.
+ */
+int trashcan_watcher_process(trashcan_watcher *watcher, int timeout_ms);
+
+/**
+ * @brief Stops watching and frees a watcher. Totals of `trashcan_total_size()` are validated by
+ * the modification time of `$trash/info` again.
+ *
+ * @param watcher Watcher created by `trashcan_watcher_create()`, may be NULL.
+ */
+void trashcan_watcher_destroy(trashcan_watcher *watcher);
+
+/**
+ * @brief Determines the path of the socket of the trash daemon `trashcand` for the home trash.
+ *
+ * The daemon keeps one context warm and serves many short-lived processes. `trashcan_soft_delete()`
+ * uses it if it's running and the socket belongs to the same user, otherwise the path is moved
+ * in-process. The daemon refuses paths that refer to another file in its view of the filesystem,
+ * e.g. from clients in containers or chroots that share "$XDG_RUNTIME_DIR", which then move the
+ * path in-process as well. The path is "$TRASHCAND_SOCKET" if set, an empty value disables the daemon.
+ * Otherwise it's "$XDG_RUNTIME_DIR/trashcand-<hash>.sock", where the hash identifies
+ * "$XDG_DATA_HOME", so that clients only reach a daemon of their own home trash. The framing of
+ * the requests is described in trashcand_protocol.h.
+ *
+ * @param path Address where pointer to the path is stored, has to be freed.
+ * @return 0 when successful, LIBTRASHCAN_NODAEMON (-31) if the daemon is disabled or
+ * "$XDG_RUNTIME_DIR" isn't set, negative otherwise.
+ */
+int trashcan_daemon_socket(char **path);
+
 #else
 #error Platform not supported
 #endif
@@ -93,6 +735,11 @@ int trashcan_soft_delete_com(const char *path, unsigned int code_page, bool init
  *
  * On Linux and *BSD this function implements the FreeDesktop.org trash specification v1.0.
  * @see https://specifications.freedesktop.org/trash-spec/trashspec-1.0.html
+ * If the trash daemon `trashcand` is running, the path is sent to it over a Unix domain socket and
+ * moved by the daemon, see `trashcan_daemon_socket()`. Set the environment variable
+ * TRASHCAND_SOCKET to an empty string to always move the path in-process. If the daemon doesn't
+ * answer within 10 seconds, LIBTRASHCAN_DAEMON (-32) is returned and the daemon may still move
+ * the path later.
  *
  * On Windows the `IFileOperation` interfaces is used. 
  * @note The COM library is initialized and uninitialized during this function call. If your
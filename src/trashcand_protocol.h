@@ -0,0 +1,104 @@
+/* MIT License
+ *
+ * Copyright (c) 2019 Robert Guetzkow
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file trashcand_protocol.h
+ * @author Robert Guetzkow
+ * @date 2026-10-16
+ * @brief Framing of the requests and responses of trashcand, shared by the daemon and the client
+ * in `trashcan_soft_delete()`.
+ *
+ * Every message is a header followed by length bytes of payload. Clients may send further
+ * requests before the responses have arrived, the responses of a connection are sent in the
+ * order of the requests and carry the id of their request. Integers are in the native byte order,
+ * since both ends run on the same machine. Strings aren't terminated, their length follows from
+ * the payload or a preceding length field.
+ *
+ * Requests:
+ * - TRASHCAND_DELETE: a trashcand_delete followed by the absolute path. The response is sent once
+ *   the path has been moved to the trash, before the size of a directory is added to
+ *   `$trash/directorysizes`. If the path doesn't refer to the same file for the daemon, e.g. because the client runs in another mount namespace or chroot, nothing is
+ *   moved and the status is TRASHCAND_REFUSED, so that the client moves the path itself.
+ * - TRASHCAND_LIST: the path to the trash directory, empty for the home trash of the daemon.
+ * - TRASHCAND_RESTORE: uint32_t length of the path to the trash directory (0 for the home trash),
+ *   the path and the name of the entry in `$trash/files`.
+ *
+ * The payload of a response starts with an int32_t status code of libtrashcan. The entries of
+ * TRASHCAND_LIST follow in responses with the status 1 and TRASHCAND_MORE set, each entry as a
+ * trashcand_list_entry followed by the name, the original path and the deletion date. The last
+ * response has no entries and the status of the listing. The daemon reads further entries only
+ * while the client keeps up with the previous responses.
+ */
+
+#ifndef TRASHCAND_PROTOCOL_H
+#define TRASHCAND_PROTOCOL_H
+
+#include <stdint.h>
+
+/* Operations of the requests. */
+#define TRASHCAND_DELETE 1
+#define TRASHCAND_LIST 2
+#define TRASHCAND_RESTORE 3
+
+/* Flag of a response that is followed by further responses to the same request. */
+#define TRASHCAND_MORE 1
+
+/* Status of a refused deletion, the value of LIBTRASHCAN_NODAEMON. */
+#define TRASHCAND_REFUSED (-31)
+
+/* Maximum length of the payload of a message, larger requests close the connection. */
+#define TRASHCAND_MAX_PAYLOAD (64 * 1024)
+
+/**
+ * @brief Header of a request or a response.
+ */
+struct trashcand_header
+{
+	uint32_t length; /**< Length of the payload in bytes. */
+	uint32_t id; /**< Chosen by the client, copied into the responses. */
+	uint16_t op; /**< Operation of the request, copied into the responses. */
+	uint16_t flags; /**< TRASHCAND_MORE or 0. */
+};
+
+/**
+ * @brief Identity of the file that the client wants to delete, followed by its path.
+ */
+struct trashcand_delete
+{
+	uint64_t device; /**< st_dev of lstat() of the path by the client. */
+	uint64_t inode; /**< st_ino of lstat() of the path by the client. */
+};
+
+/**
+ * @brief Entry of the trash in a response to TRASHCAND_LIST, followed by its strings.
+ */
+struct trashcand_list_entry
+{
+	int64_t deletion_time; /**< DeletionDate interpreted as local time, -1 if it's missing or invalid. */
+	uint32_t name_len; /**< Length of the name in `$trash/files`. */
+	uint32_t path_len; /**< Length of the decoded original path. */
+	uint32_t date_len; /**< Length of the DeletionDate. */
+	uint32_t reserved; /**< Zero. */
+};
+
+#endif
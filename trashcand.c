@@ -0,0 +1,871 @@
+/* MIT License
+ *
+ * Copyright (c) 2019 Robert Guetzkow
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+ /**
+  * @file trashcand.c
+  * @author Robert Guetzkow
+  * @date 2026-10-16
+  * @brief Trash daemon for Linux and *BSD. It keeps one context warm, so that short-lived
+  * processes don't pay for parsing the mount table and resolving the trash directories on every
+  * deletion. Requests are read from a Unix domain socket with the framing of trashcand_protocol.h.
+  * The poll loop only parses requests and sends responses. Deletions are moved to the trash by the
+  * worker threads of the context with trashcan_submit() and answered as soon as they have been
+  * moved, restores run on threads of their own and listings are streamed one chunk per round, so
+  * that a slow request doesn't hold up the other clients. trashcan_soft_delete() uses the daemon
+  * when it's running.
+  *
+  * Usage: trashcand [-s socket]
+  */
+
+#define _GNU_SOURCE
+#include "src/trashcan.h"
+#include "src/trashcand_protocol.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Size of the entries of a TRASHCAND_LIST response before it's sent and the next one is started. */
+#define TRASHCAND_LIST_CHUNK (32 * 1024)
+/* Clients whose responses pile up beyond this size aren't read until they have caught up. */
+#define TRASHCAND_MAX_OUTPUT (4 * 1024 * 1024)
+
+struct buffer
+{
+	char *data;
+	size_t len;
+	size_t capacity;
+};
+
+/**
+ * @brief Request of a client whose response hasn't been queued yet.
+ *
+ * Responses are queued in the order of the requests, so a request that completes early waits for
+ * the ones before it.
+ */
+struct pending_request
+{
+	uint64_t seq; /**< Sequence number of the request on its connection. */
+	uint32_t id; /**< Id of the request. */
+	uint16_t op; /**< Operation of the request. */
+	unsigned char done; /**< Set once status is valid. */
+	int32_t status; /**< Status of the response. */
+};
+
+struct client
+{
+	int fd;
+	uint64_t serial; /**< Identifies the connection for requests that are completed by other threads. */
+	struct buffer in; /**< Received bytes that haven't been parsed yet. */
+	struct buffer out; /**< Responses that haven't been sent yet, starting at out_offset. */
+	size_t out_offset;
+	struct pending_request *pending; /**< Requests that are running or wait for an earlier one, oldest first. */
+	size_t num_pending;
+	size_t pending_capacity;
+	uint64_t next_seq; /**< Sequence number of the next request. */
+	trashcan_iter *list_iter; /**< Listing that is being streamed, NULL if there is none. */
+	uint32_t list_id; /**< Id of the TRASHCAND_LIST request of list_iter. */
+	unsigned char eof; /**< Set once the client has shut down its side of the connection. */
+	unsigned char closed; /**< Set if the connection has to be closed at the end of the round. */
+};
+
+struct daemon_state;
+
+/**
+ * @brief Request that is executed by another thread, handed over to the poll loop once it's done.
+ */
+struct completion
+{
+	struct completion *next;
+	struct daemon_state *state;
+	uint64_t client; /**< Serial of the client. */
+	uint64_t seq; /**< Sequence number of the request. */
+	int32_t status; /**< Status of the response. */
+	char *trash_dir; /**< Trash directory of a restore, NULL for the home trash. */
+	char *name; /**< Name of the entry of a restore. */
+};
+
+struct daemon_state
+{
+	trashcan_ctx *ctx;
+	int listen_fd;
+	int wake_fds[2]; /**< Pipe that wakes up poll() when other threads have completed requests. */
+	struct client *clients;
+	size_t num_clients;
+	uint64_t next_serial;
+	pthread_mutex_t completed_lock;
+	pthread_cond_t restores_done; /**< Signaled when running_restores drops. */
+	struct completion *completed; /**< Requests completed by other threads, protected by completed_lock. */
+	size_t running_restores; /**< Restore threads that haven't finished, protected by completed_lock. */
+	uint64_t requests;
+	uint64_t deletes; /**< Deletions that have been submitted to the workers. */
+	uint64_t refused; /**< Deletions whose path refers to another file for the daemon. */
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_signal(int signal_number)
+{
+	(void)signal_number;
+	stop_requested = 1;
+}
+
+static int buffer_append(struct buffer *buffer, const void *data, size_t len)
+{
+	if (buffer->len + len > buffer->capacity)
+	{
+		size_t capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+		while (capacity < buffer->len + len) { capacity *= 2; }
+
+		char *new_data = realloc(buffer->data, capacity);
+		if (new_data == NULL) { return -1; }
+		buffer->data = new_data;
+		buffer->capacity = capacity;
+	}
+
+	memcpy(buffer->data + buffer->len, data, len);
+	buffer->len += len;
+	return 0;
+}
+
+/**
+ * @brief Queues a response of a client, which is closed if the response can't be allocated.
+ */
+static void queue_response(struct client *client, uint32_t id, uint16_t op, uint16_t flags, int32_t status, const void *data, size_t len)
+{
+	struct trashcand_header header = { .length = (uint32_t)(sizeof(status) + len), .id = id, .op = op, .flags = flags };
+
+	if (client->closed) { return; }
+	if (buffer_append(&client->out, &header, sizeof(header)) < 0 || buffer_append(&client->out, &status, sizeof(status)) < 0 ||
+		(len > 0 && buffer_append(&client->out, data, len) < 0))
+	{
+		client->closed = 1;
+	}
+}
+
+/**
+ * @brief Checks that the peer of a connection is the user of the daemon.
+ */
+static int peer_is_owner(int fd)
+{
+#ifdef __linux__
+	struct ucred credentials;
+	socklen_t credentials_len = sizeof(credentials);
+	return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_len) == 0 && credentials.uid == geteuid();
+#else
+	uid_t peer_uid;
+	gid_t peer_gid;
+	return getpeereid(fd, &peer_uid, &peer_gid) == 0 && peer_uid == geteuid();
+#endif
+}
+
+static void free_completion(struct completion *completion)
+{
+	free(completion->trash_dir);
+	free(completion->name);
+	free(completion);
+}
+
+/**
+ * @brief Hands a request that has been completed by another thread over to the poll loop.
+ */
+static void complete_request(struct completion *completion, int status)
+{
+	struct daemon_state *state = completion->state;
+	char byte = 0;
+
+	completion->status = status;
+	pthread_mutex_lock(&state->completed_lock);
+	completion->next = state->completed;
+	state->completed = completion;
+	pthread_mutex_unlock(&state->completed_lock);
+
+	/* If the pipe is full, a wakeup is pending anyway. */
+	while (write(state->wake_fds[1], &byte, 1) < 0 && errno == EINTR) { }
+}
+
+/**
+ * @brief Callback of trashcan_submit(), called by a worker once the path has been moved.
+ */
+static void delete_done(const char *path, int status, void *userdata)
+{
+	(void)path;
+	complete_request(userdata, status);
+}
+
+static void *restore_thread(void *arg)
+{
+	struct completion *completion = arg;
+	struct daemon_state *state = completion->state;
+
+	complete_request(completion, trashcan_restore_ctx(state->ctx, completion->trash_dir, completion->name));
+
+	pthread_mutex_lock(&state->completed_lock);
+	state->running_restores--;
+	pthread_cond_signal(&state->restores_done);
+	pthread_mutex_unlock(&state->completed_lock);
+	return NULL;
+}
+
+/**
+ * @brief Adds a request to the requests of a client whose responses are pending.
+ *
+ * @return The request, NULL if it couldn't be allocated.
+ */
+static struct pending_request *add_pending(struct client *client, uint32_t id, uint16_t op)
+{
+	if (client->num_pending == client->pending_capacity)
+	{
+		size_t capacity = client->pending_capacity == 0 ? 16 : client->pending_capacity * 2;
+		struct pending_request *pending = realloc(client->pending, capacity * sizeof(*pending));
+		if (pending == NULL) { return NULL; }
+		client->pending = pending;
+		client->pending_capacity = capacity;
+	}
+
+	struct pending_request *request = &client->pending[client->num_pending];
+	client->num_pending++;
+	request->seq = client->next_seq++;
+	request->id = id;
+	request->op = op;
+	request->done = 0;
+	request->status = 0;
+	return request;
+}
+
+/**
+ * @brief Marks the requests that other threads have completed since the last round as done.
+ * Completions of clients that have been closed in the meantime are dropped.
+ */
+static void apply_completions(struct daemon_state *state)
+{
+	char buf[256];
+	while (read(state->wake_fds[0], buf, sizeof(buf)) > 0) { }
+
+	pthread_mutex_lock(&state->completed_lock);
+	struct completion *completion = state->completed;
+	state->completed = NULL;
+	pthread_mutex_unlock(&state->completed_lock);
+
+	while (completion != NULL)
+	{
+		struct completion *next = completion->next;
+
+		for (size_t i = 0; i < state->num_clients; i++)
+		{
+			struct client *client = &state->clients[i];
+			if (client->serial != completion->client) { continue; }
+
+			/* The pending requests have consecutive sequence numbers. */
+			uint64_t idx = client->num_pending > 0 ? completion->seq - client->pending[0].seq : 0;
+			if (idx < client->num_pending)
+			{
+				client->pending[idx].done = 1;
+				client->pending[idx].status = completion->status;
+			}
+			break;
+		}
+
+		free_completion(completion);
+		completion = next;
+	}
+}
+
+/**
+ * @brief Queues the responses of the oldest requests of a client as far as they have been completed.
+ */
+static void queue_completed(struct client *client)
+{
+	size_t num_done = 0;
+
+	while (num_done < client->num_pending && client->pending[num_done].done)
+	{
+		const struct pending_request *request = &client->pending[num_done];
+		queue_response(client, request->id, request->op, 0, request->status, NULL, 0);
+		num_done++;
+	}
+
+	if (num_done > 0)
+	{
+		memmove(client->pending, client->pending + num_done, (client->num_pending - num_done) * sizeof(*client->pending));
+		client->num_pending -= num_done;
+	}
+}
+
+/**
+ * @brief Submits a deletion to the workers of the context, it's answered once the path has been moved.
+ */
+static void start_delete(struct daemon_state *state, struct client *client, uint32_t id, const char *payload, size_t len)
+{
+	struct trashcand_delete request;
+	struct stat path_stat;
+
+	if (len < sizeof(request))
+	{
+		client->closed = 1;
+		return;
+	}
+	memcpy(&request, payload, sizeof(request));
+
+	char *path = strndup(payload + sizeof(request), len - sizeof(request));
+	struct completion *completion = calloc(1, sizeof(*completion));
+	struct pending_request *pending = path != NULL && completion != NULL ? add_pending(client, id, TRASHCAND_DELETE) : NULL;
+	if (pending == NULL)
+	{
+		client->closed = 1;
+		free(completion);
+		free(path);
+		return;
+	}
+
+	/* A client in another mount namespace or chroot may mean another file with the same path. */
+	if (path[0] != '/' || lstat(path, &path_stat) != 0 || (uint64_t)path_stat.st_dev != request.device || (uint64_t)path_stat.st_ino != request.inode)
+	{
+		pending->done = 1;
+		pending->status = TRASHCAND_REFUSED;
+		state->refused++;
+		free(completion);
+	}
+	else
+	{
+		completion->state = state;
+		completion->client = client->serial;
+		completion->seq = pending->seq;
+
+		int status = trashcan_submit(state->ctx, path, delete_done, completion);
+		if (status < 0)
+		{
+			pending->done = 1;
+			pending->status = status;
+			free(completion);
+		}
+		else
+		{
+			state->deletes++;
+		}
+	}
+
+	free(path);
+}
+
+/**
+ * @brief Starts streaming the entries of a trash directory to a client.
+ */
+static void start_list(struct client *client, uint32_t id, const char *payload, size_t len)
+{
+	char *trash_dir = NULL;
+
+	if (len > 0 && (trash_dir = strndup(payload, len)) == NULL)
+	{
+		client->closed = 1;
+		return;
+	}
+
+	int status = trashcan_iter_open(trash_dir, 0, &client->list_iter);
+	if (status < 0)
+	{
+		client->list_iter = NULL;
+		queue_response(client, id, TRASHCAND_LIST, 0, status, NULL, 0);
+	}
+	client->list_id = id;
+
+	free(trash_dir);
+}
+
+/**
+ * @brief Queues the next chunk of the listing of a client, or the last response at its end.
+ *
+ * One chunk is read per round and only while less than a chunk of output is waiting for the client,
+ * so a large trash neither holds up the other clients nor piles up in memory.
+ */
+static void continue_list(struct client *client)
+{
+	struct buffer chunk = { NULL, 0, 0 };
+	trashcan_entry entry;
+	int next = 0;
+
+	if (client->list_iter == NULL || client->closed || client->out.len - client->out_offset >= TRASHCAND_LIST_CHUNK) { return; }
+
+	while (chunk.len < TRASHCAND_LIST_CHUNK && (next = trashcan_iter_next(client->list_iter, &entry)) == 1)
+	{
+		struct trashcand_list_entry header = { .deletion_time = (int64_t)entry.deletion_time, .name_len = (uint32_t)strlen(entry.name),
+											   .path_len = (uint32_t)strlen(entry.original_path), .date_len = (uint32_t)strlen(entry.deletion_date), .reserved = 0 };
+
+		if (buffer_append(&chunk, &header, sizeof(header)) < 0 || buffer_append(&chunk, entry.name, header.name_len) < 0 ||
+			buffer_append(&chunk, entry.original_path, header.path_len) < 0 || buffer_append(&chunk, entry.deletion_date, header.date_len) < 0)
+		{
+			client->closed = 1;
+			break;
+		}
+	}
+
+	if (chunk.len > 0) { queue_response(client, client->list_id, TRASHCAND_LIST, TRASHCAND_MORE, 1, chunk.data, chunk.len); }
+
+	/* The end of the trash or an error. */
+	if (next != 1)
+	{
+		queue_response(client, client->list_id, TRASHCAND_LIST, 0, next, NULL, 0);
+		trashcan_iter_close(client->list_iter);
+		client->list_iter = NULL;
+	}
+
+	free(chunk.data);
+}
+
+/**
+ * @brief Starts a thread that restores an entry of the trash for a client.
+ */
+static void start_restore(struct daemon_state *state, struct client *client, uint32_t id, const char *payload, size_t len)
+{
+	uint32_t trash_dir_len;
+	pthread_t thread;
+
+	if (len < sizeof(trash_dir_len))
+	{
+		client->closed = 1;
+		return;
+	}
+	memcpy(&trash_dir_len, payload, sizeof(trash_dir_len));
+	if (trash_dir_len > len - sizeof(trash_dir_len))
+	{
+		client->closed = 1;
+		return;
+	}
+
+	struct completion *completion = calloc(1, sizeof(*completion));
+	if (completion == NULL)
+	{
+		client->closed = 1;
+		return;
+	}
+
+	const char *name_start = payload + sizeof(trash_dir_len) + trash_dir_len;
+	completion->name = strndup(name_start, len - sizeof(trash_dir_len) - trash_dir_len);
+	if (trash_dir_len > 0) { completion->trash_dir = strndup(payload + sizeof(trash_dir_len), trash_dir_len); }
+
+	struct pending_request *pending = NULL;
+	if (completion->name != NULL && (trash_dir_len == 0 || completion->trash_dir != NULL)) { pending = add_pending(client, id, TRASHCAND_RESTORE); }
+	if (pending == NULL)
+	{
+		client->closed = 1;
+		free_completion(completion);
+		return;
+	}
+
+	completion->state = state;
+	completion->client = client->serial;
+	completion->seq = pending->seq;
+
+	pthread_mutex_lock(&state->completed_lock);
+	state->running_restores++;
+	pthread_mutex_unlock(&state->completed_lock);
+
+	if (pthread_create(&thread, NULL, restore_thread, completion) == 0)
+	{
+		pthread_detach(thread);
+		return;
+	}
+
+	/* Without a thread the restore blocks the other clients, but it isn't lost. */
+	pthread_mutex_lock(&state->completed_lock);
+	state->running_restores--;
+	pthread_mutex_unlock(&state->completed_lock);
+
+	pending->done = 1;
+	pending->status = trashcan_restore_ctx(state->ctx, completion->trash_dir, completion->name);
+	free_completion(completion);
+}
+
+/**
+ * @brief Handles the complete requests that a client has sent.
+ *
+ * Deletions of a client run concurrently. Other requests wait until the requests before them have
+ * been answered, and no further request is started before they have been answered themselves, so
+ * that the requests of a client are executed in order.
+ */
+static void handle_requests(struct daemon_state *state, size_t client_idx)
+{
+	size_t offset = 0;
+
+	for (;;)
+	{
+		struct client *client = &state->clients[client_idx];
+		struct trashcand_header header;
+
+		queue_completed(client);
+		if (client->closed || client->list_iter != NULL || client->out.len - client->out_offset > TRASHCAND_MAX_OUTPUT) { break; }
+		if (client->in.len - offset < sizeof(header)) { break; }
+
+		memcpy(&header, client->in.data + offset, sizeof(header));
+		if (header.length > TRASHCAND_MAX_PAYLOAD)
+		{
+			client->closed = 1;
+			break;
+		}
+		if (client->in.len - offset - sizeof(header) < header.length) { break; }
+		if (client->num_pending > 0 && (header.op != TRASHCAND_DELETE || client->pending[client->num_pending - 1].op != TRASHCAND_DELETE)) { break; }
+
+		const char *payload = client->in.data + offset + sizeof(header);
+		offset += sizeof(header) + header.length;
+		state->requests++;
+
+		if (header.op == TRASHCAND_DELETE) { start_delete(state, client, header.id, payload, header.length); }
+		else if (header.op == TRASHCAND_LIST) { start_list(client, header.id, payload, header.length); }
+		else if (header.op == TRASHCAND_RESTORE) { start_restore(state, client, header.id, payload, header.length); }
+		else
+		{
+			client->closed = 1;
+			break;
+		}
+	}
+
+	struct client *client = &state->clients[client_idx];
+	queue_completed(client);
+	if (offset > 0)
+	{
+		memmove(client->in.data, client->in.data + offset, client->in.len - offset);
+		client->in.len -= offset;
+	}
+}
+
+static void read_client(struct client *client)
+{
+	char buf[16 * 1024];
+
+	for (;;)
+	{
+		ssize_t num_received = recv(client->fd, buf, sizeof(buf), 0);
+		if (num_received < 0)
+		{
+			if (errno == EINTR) { continue; }
+			if (errno != EAGAIN && errno != EWOULDBLOCK) { client->closed = 1; }
+			return;
+		}
+		if (num_received == 0)
+		{
+			client->eof = 1;
+			return;
+		}
+		if (buffer_append(&client->in, buf, (size_t)num_received) < 0)
+		{
+			client->closed = 1;
+			return;
+		}
+		/* A client that keeps sending must not starve the others. */
+		if (client->in.len > 2 * TRASHCAND_MAX_PAYLOAD) { return; }
+	}
+}
+
+static void write_client(struct client *client)
+{
+	while (!client->closed && client->out_offset < client->out.len)
+	{
+		ssize_t num_sent = send(client->fd, client->out.data + client->out_offset, client->out.len - client->out_offset, MSG_NOSIGNAL);
+		if (num_sent < 0)
+		{
+			if (errno == EINTR) { continue; }
+			if (errno != EAGAIN && errno != EWOULDBLOCK) { client->closed = 1; }
+			break;
+		}
+		client->out_offset += (size_t)num_sent;
+	}
+
+	if (client->out_offset == client->out.len)
+	{
+		client->out.len = 0;
+		client->out_offset = 0;
+	}
+}
+
+static void accept_clients(struct daemon_state *state)
+{
+	for (;;)
+	{
+		int fd = accept4(state->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) { return; }
+
+		if (!peer_is_owner(fd))
+		{
+			close(fd);
+			continue;
+		}
+
+		struct client *clients = realloc(state->clients, (state->num_clients + 1) * sizeof(*clients));
+		if (clients == NULL)
+		{
+			close(fd);
+			return;
+		}
+		state->clients = clients;
+		memset(&state->clients[state->num_clients], 0, sizeof(*state->clients));
+		state->clients[state->num_clients].fd = fd;
+		state->clients[state->num_clients].serial = state->next_serial++;
+		state->num_clients++;
+	}
+}
+
+/**
+ * @brief Closes the connections that are done and compacts the array of clients.
+ *
+ * Requests of a closed connection that are still running are completed, but their responses are dropped.
+ */
+static void remove_clients(struct daemon_state *state)
+{
+	size_t num_clients = 0;
+
+	for (size_t i = 0; i < state->num_clients; i++)
+	{
+		struct client *client = &state->clients[i];
+		unsigned char done = client->closed || (client->eof && client->out.len == 0 && client->num_pending == 0 && client->list_iter == NULL &&
+												client->in.len < sizeof(struct trashcand_header));
+
+		if (done)
+		{
+			close(client->fd);
+			trashcan_iter_close(client->list_iter);
+			free(client->in.data);
+			free(client->out.data);
+			free(client->pending);
+			continue;
+		}
+		state->clients[num_clients] = *client;
+		num_clients++;
+	}
+
+	state->num_clients = num_clients;
+}
+
+/**
+ * @brief Creates the listening socket, replacing the socket of a daemon that is no longer running.
+ *
+ * @return File descriptor of the socket, negative on failure.
+ */
+static int open_socket(const char *socket_path)
+{
+	struct sockaddr_un address;
+
+	if (strlen(socket_path) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+		return -1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, socket_path, strlen(socket_path) + 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) { return -1; }
+
+	/* A socket that refuses connections has been left behind by a daemon that has exited. */
+	int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe_fd >= 0 && connect(probe_fd, (const struct sockaddr *)&address, sizeof(address)) == 0)
+	{
+		fprintf(stderr, "trashcand is already running on %s\n", socket_path);
+		close(probe_fd);
+		close(fd);
+		return -1;
+	}
+	if (probe_fd >= 0) { close(probe_fd); }
+	unlink(socket_path);
+
+	mode_t old_umask = umask(S_IRWXG | S_IRWXO);
+	int bound = bind(fd, (const struct sockaddr *)&address, sizeof(address));
+	umask(old_umask);
+
+	if (bound != 0 || listen(fd, SOMAXCONN) != 0)
+	{
+		perror("Failed to listen on socket");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void print_usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-s socket]\n", program);
+	fprintf(stderr, "  -s  Path of the socket, default is the path of trashcan_daemon_socket()\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct daemon_state state;
+	char *socket_path = NULL;
+	struct pollfd *poll_fds = NULL;
+	int status = 1;
+	int opt;
+
+	memset(&state, 0, sizeof(state));
+	state.listen_fd = -1;
+	state.wake_fds[0] = -1;
+	state.wake_fds[1] = -1;
+	pthread_mutex_init(&state.completed_lock, NULL);
+	pthread_cond_init(&state.restores_done, NULL);
+
+	while ((opt = getopt(argc, argv, "s:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			free(socket_path);
+			socket_path = strdup(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+			free(socket_path);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (socket_path == NULL)
+	{
+		int socket_status = trashcan_daemon_socket(&socket_path);
+		if (socket_status < 0)
+		{
+			fprintf(stderr, "No socket path: %s\n", trashcan_status_msg(socket_status));
+			return 1;
+		}
+	}
+
+	if (pipe2(state.wake_fds, O_NONBLOCK | O_CLOEXEC) != 0)
+	{
+		perror("Failed to create pipe");
+		goto error_0;
+	}
+
+	int ctx_status = trashcan_ctx_create(&state.ctx);
+	if (ctx_status < 0)
+	{
+		fprintf(stderr, "Failed to create context: %s\n", trashcan_status_msg(ctx_status));
+		goto error_0;
+	}
+
+	state.listen_fd = open_socket(socket_path);
+	if (state.listen_fd < 0) { goto error_1; }
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_signal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "trashcand listening on %s\n", socket_path);
+
+	int timeout = -1;
+	while (!stop_requested)
+	{
+		struct pollfd *new_poll_fds = realloc(poll_fds, (state.num_clients + 2) * sizeof(*new_poll_fds));
+		if (new_poll_fds == NULL) { break; }
+		poll_fds = new_poll_fds;
+
+		poll_fds[0].fd = state.listen_fd;
+		poll_fds[0].events = POLLIN;
+		poll_fds[1].fd = state.wake_fds[0];
+		poll_fds[1].events = POLLIN;
+		for (size_t i = 0; i < state.num_clients; i++)
+		{
+			const struct client *client = &state.clients[i];
+			poll_fds[i + 2].fd = client->fd;
+			poll_fds[i + 2].events = 0;
+			if (!client->eof && client->out.len - client->out_offset <= TRASHCAND_MAX_OUTPUT) { poll_fds[i + 2].events |= POLLIN; }
+			if (client->out_offset < client->out.len) { poll_fds[i + 2].events |= POLLOUT; }
+		}
+
+		if (poll(poll_fds, state.num_clients + 2, timeout) < 0)
+		{
+			if (errno == EINTR) { continue; }
+			perror("poll");
+			break;
+		}
+
+		if (poll_fds[1].revents & POLLIN) { apply_completions(&state); }
+
+		size_t num_polled = state.num_clients;
+		for (size_t i = 0; i < num_polled; i++)
+		{
+			if (poll_fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) { read_client(&state.clients[i]); }
+		}
+
+		/* A listing that has ended lets the requests behind it start in the same round. */
+		for (size_t i = 0; i < state.num_clients; i++)
+		{
+			continue_list(&state.clients[i]);
+			handle_requests(&state, i);
+		}
+
+		/* Listings that can take another chunk continue without waiting for an event. */
+		timeout = -1;
+		for (size_t i = 0; i < state.num_clients; i++)
+		{
+			struct client *client = &state.clients[i];
+			write_client(client);
+			if (client->list_iter != NULL && !client->closed && client->out.len - client->out_offset < TRASHCAND_LIST_CHUNK) { timeout = 0; }
+		}
+		remove_clients(&state);
+
+		if (poll_fds[0].revents & POLLIN) { accept_clients(&state); }
+	}
+
+	fprintf(stderr, "trashcand: %" PRIu64 " requests, %" PRIu64 " deletions, %" PRIu64 " refused\n", state.requests, state.deletes, state.refused);
+	status = 0;
+
+	for (size_t i = 0; i < state.num_clients; i++) { state.clients[i].closed = 1; }
+	remove_clients(&state);
+	close(state.listen_fd);
+	unlink(socket_path);
+
+	/* Restores that are still running use the context. */
+	pthread_mutex_lock(&state.completed_lock);
+	while (state.running_restores > 0) { pthread_cond_wait(&state.restores_done, &state.completed_lock); }
+	pthread_mutex_unlock(&state.completed_lock);
+error_1:
+	/* Completes the submitted deletions, whose completions are dropped afterwards. */
+	trashcan_ctx_destroy(state.ctx);
+	apply_completions(&state);
+error_0:
+	if (state.wake_fds[0] >= 0)
+	{
+		close(state.wake_fds[0]);
+		close(state.wake_fds[1]);
+	}
+	pthread_cond_destroy(&state.restores_done);
+	pthread_mutex_destroy(&state.completed_lock);
+	free(state.clients);
+	free(poll_fds);
+	free(socket_path);
+	return status;
+}